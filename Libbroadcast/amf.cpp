@@ -16,10 +16,15 @@
 //*****************************************************************************
 
 #include "include/amf.h"
+#include "byteorder.h"
 
 //=============================================================================
 // Helpers
 
+// The exported helpers below are thin wrappers around the inline codec in
+// "byteorder.h" and only exist for ABI compatibility. Internal code should use
+// the inline versions directly.
+
 /// <summary>
 /// Decodes a big-endian 8-bit unsigned integer.
 /// </summary>
@@ -34,9 +39,7 @@ uint amfDecodeUInt8(const char *data)
 /// </summary>
 uint amfDecodeUInt16(const char *data)
 {
-	unsigned char *uc = (unsigned char *)data;
-	return ((uint)uc[0] << 8) |
-		(uint)uc[1];
+	return decodeBEUInt16(data);
 }
 
 /// <summary>
@@ -44,10 +47,7 @@ uint amfDecodeUInt16(const char *data)
 /// </summary>
 uint amfDecodeUInt24(const char *data)
 {
-	unsigned char *uc = (unsigned char *)data;
-	return ((uint)uc[0] << 16) |
-		((uint)uc[1] << 8) |
-		(uint)uc[2];
+	return decodeBEUInt24(data);
 }
 
 /// <summary>
@@ -55,11 +55,7 @@ uint amfDecodeUInt24(const char *data)
 /// </summary>
 uint amfDecodeUInt32(const char *data)
 {
-	unsigned char *uc = (unsigned char *)data;
-	return ((uint)uc[0] << 24) |
-		((uint)uc[1] << 16) |
-		((uint)uc[2] << 8) |
-		(uint)uc[3];
+	return decodeBEUInt32(data);
 }
 
 /// <summary>
@@ -67,22 +63,7 @@ uint amfDecodeUInt32(const char *data)
 /// </summary>
 double amfDecodeDouble(const char *data)
 {
-	// WARNING: Do we need to worry about platforms that store floats in a
-	// different byte order than integers?
-#if Q_BYTE_ORDER != Q_LITTLE_ENDIAN
-#error Unsupported byte order
-#endif
-	unsigned char ucVal[8];
-	unsigned char *uc = (unsigned char *)data;
-	ucVal[0] = uc[7];
-	ucVal[1] = uc[6];
-	ucVal[2] = uc[5];
-	ucVal[3] = uc[4];
-	ucVal[4] = uc[3];
-	ucVal[5] = uc[2];
-	ucVal[6] = uc[1];
-	ucVal[7] = uc[0];
-	return *((double *)ucVal);
+	return decodeBEDouble(data);
 }
 
 /// <summary>
@@ -102,10 +83,7 @@ char *amfEncodeUInt8(char *data, uint val)
 /// <returns>A pointer to the next byte to write</returns>
 char *amfEncodeUInt16(char *data, uint val)
 {
-	unsigned char *uc = (unsigned char *)data;
-	uc[0] = (val >> 8) & 0xff;
-	uc[1] = val & 0xff;
-	return data + 2;
+	return encodeBEUInt16(data, val);
 }
 
 /// <summary>
@@ -114,11 +92,7 @@ char *amfEncodeUInt16(char *data, uint val)
 /// <returns>A pointer to the next byte to write</returns>
 char *amfEncodeUInt24(char *data, uint val)
 {
-	unsigned char *uc = (unsigned char *)data;
-	uc[0] = (val >> 16) & 0xff;
-	uc[1] = (val >> 8) & 0xff;
-	uc[2] = val & 0xff;
-	return data + 3;
+	return encodeBEUInt24(data, val);
 }
 
 /// <summary>
@@ -127,12 +101,7 @@ char *amfEncodeUInt24(char *data, uint val)
 /// <returns>A pointer to the next byte to write</returns>
 char *amfEncodeUInt32(char *data, uint val)
 {
-	unsigned char *uc = (unsigned char *)data;
-	uc[0] = (val >> 24) & 0xff;
-	uc[1] = (val >> 16) & 0xff;
-	uc[2] = (val >> 8) & 0xff;
-	uc[3] = val & 0xff;
-	return data + 4;
+	return encodeBEUInt32(data, val);
 }
 
 /// <summary>
@@ -141,22 +110,7 @@ char *amfEncodeUInt32(char *data, uint val)
 /// <returns>A pointer to the next byte to write</returns>
 char *amfEncodeDouble(char *data, double val)
 {
-	// WARNING: Do we need to worry about platforms that store floats in a
-	// different byte order than integers?
-#if Q_BYTE_ORDER != Q_LITTLE_ENDIAN
-#error Unsupported byte order
-#endif
-	unsigned char *ucVal = (unsigned char *)&val;
-	unsigned char *uc = (unsigned char *)data;
-	uc[0] = ucVal[7];
-	uc[1] = ucVal[6];
-	uc[2] = ucVal[5];
-	uc[3] = ucVal[4];
-	uc[4] = ucVal[3];
-	uc[5] = ucVal[2];
-	uc[6] = ucVal[1];
-	uc[7] = ucVal[0];
-	return data + 8;
+	return encodeBEDouble(data, val);
 }
 
 /// <summary>
@@ -168,13 +122,145 @@ char *amfEncodeUtf8String(char *data, const QByteArray &str)
 {
 	int lenSize = (str.size() > 0xFFFF) ? 4 : 2;
 	if(lenSize == 4)
-		data = amfEncodeUInt32(data, str.size());
+		data = encodeBEUInt32(data, str.size());
 	else
-		data = amfEncodeUInt16(data, str.size());
+		data = encodeBEUInt16(data, str.size());
 	memcpy(data, str.constData(), str.size());
 	return data + str.size();
 }
 
+/// <summary>
+/// Decodes an AMF 3 variable length 29-bit unsigned integer ("U29").
+/// </summary>
+/// <returns>The amount of bytes read from the input (1-4)</returns>
+uint amfDecodeU29(const char *data, uint *valOut)
+{
+	unsigned char *uc = (unsigned char *)data;
+	uint val = 0;
+	for(int i = 0; i < 3; i++) {
+		if(!(uc[i] & 0x80)) {
+			*valOut = (val << 7) | uc[i];
+			return i + 1;
+		}
+		val = (val << 7) | (uc[i] & 0x7F);
+	}
+
+	// The fourth byte uses all 8 bits
+	*valOut = (val << 8) | uc[3];
+	return 4;
+}
+
+/// <summary>
+/// Encodes an AMF 3 variable length 29-bit unsigned integer ("U29"). Values
+/// larger than 29 bits are truncated.
+/// </summary>
+/// <returns>A pointer to the next byte to write</returns>
+char *amfEncodeU29(char *data, uint val)
+{
+	unsigned char *uc = (unsigned char *)data;
+	val &= 0x1FFFFFFF;
+	if(val < 0x80) {
+		uc[0] = val;
+		return data + 1;
+	} else if(val < 0x4000) {
+		uc[0] = (val >> 7) | 0x80;
+		uc[1] = val & 0x7F;
+		return data + 2;
+	} else if(val < 0x200000) {
+		uc[0] = (val >> 14) | 0x80;
+		uc[1] = ((val >> 7) & 0x7F) | 0x80;
+		uc[2] = val & 0x7F;
+		return data + 3;
+	}
+	uc[0] = (val >> 22) | 0x80;
+	uc[1] = ((val >> 15) & 0x7F) | 0x80;
+	uc[2] = ((val >> 8) & 0x7F) | 0x80;
+	uc[3] = val & 0xFF;
+	return data + 4;
+}
+
+/// <summary>
+/// Appends an AMF 3 "U29" to the end of the specified byte array.
+/// </summary>
+static void amf3AppendU29(QByteArray &data, uint val)
+{
+	char buf[4];
+	char *end = amfEncodeU29(buf, val);
+	data.append(buf, end - buf);
+}
+
+/// <summary>
+/// Appends an AMF 3 "UTF-8-vr" string to the end of the specified byte array
+/// using the string reference table if the string was previously sent. Empty
+/// strings are never sent by reference.
+/// </summary>
+static void amf3AppendString(
+	QByteArray &data, const QString &str, AMF3Context *ctx)
+{
+	if(str.isEmpty()) {
+		amf3AppendU29(data, 0x01); // Inline empty string
+		return;
+	}
+	if(ctx->stringRefs.contains(str)) {
+		amf3AppendU29(data, ctx->stringRefs.value(str) << 1);
+		return;
+	}
+	ctx->stringRefs.insert(str, ctx->stringRefs.count());
+	QByteArray utf8 = str.toUtf8();
+	amf3AppendU29(data, (utf8.size() << 1) | 0x01);
+	data.append(utf8);
+}
+
+/// <summary>
+/// Decodes an AMF 3 "UTF-8-vr" string taking into account the string
+/// reference table.
+/// </summary>
+/// <returns>The amount of bytes read from the input or 0 on error</returns>
+static uint amf3DecodeString(const char *data, QString *strOut, AMF3Context *ctx)
+{
+	uint ref;
+	uint size = amfDecodeU29(data, &ref);
+	if(!(ref & 0x01)) {
+		// String reference
+		uint index = ref >> 1;
+		if(index >= (uint)ctx->strings.count())
+			return 0; // Invalid reference
+		*strOut = ctx->strings.at(index);
+		return size;
+	}
+	uint len = ref >> 1;
+	*strOut = QString::fromUtf8(&data[size], len);
+	if(len > 0)
+		ctx->strings.append(*strOut);
+	return size + len;
+}
+
+//=============================================================================
+// AMF3Context class
+
+AMF3Context::AMF3Context()
+	: stringRefs()
+	, objectRefs()
+	, traitRefs()
+	, strings()
+	, objects()
+	, traits()
+{
+}
+
+/// <summary>
+/// Clears all reference tables.
+/// </summary>
+void AMF3Context::reset()
+{
+	stringRefs.clear();
+	objectRefs.clear();
+	traitRefs.clear();
+	strings.clear();
+	objects.clear();
+	traits.clear();
+}
+
 //=============================================================================
 // AMFType class
 
@@ -197,13 +283,13 @@ uint AMFType::decode(const char *data, AMFType **resultOut)
 	default:
 		return 0; // Unknown type
 	case 0x00: // NumberType
-		*resultOut = new AMFNumber(amfDecodeDouble(&data[1]));
+		*resultOut = new AMFNumber(decodeBEDouble(&data[1]));
 		return 1 + 8;
 	case 0x01: // BooleanType
 		*resultOut = new AMFBoolean(amfDecodeUInt8(&data[1]) != 0);
 		return 1 + 1;
 	case 0x02: { // StringType
-		uint len = amfDecodeUInt16(&data[1]);
+		uint len = decodeBEUInt16(&data[1]);
 		*resultOut = new AMFString(QString::fromUtf8(&data[3], len));
 		return 1 + 2 + len; }
 	case 0x03: // ObjectType
@@ -214,14 +300,14 @@ uint AMFType::decode(const char *data, AMFType **resultOut)
 			obj = new AMFObject();
 		else {
 			AMFEcmaArray *ecma = new AMFEcmaArray();
-			ecma->setAssociativeCount(amfDecodeUInt32(&data[objSize]));
+			ecma->setAssociativeCount(decodeBEUInt32(&data[objSize]));
 			objSize += 4;
 			obj = ecma;
 		}
 		*resultOut = obj;
 		for(;;) {
 			// Decode key
-			uint len = amfDecodeUInt16(&data[objSize]);
+			uint len = decodeBEUInt16(&data[objSize]);
 			QString key = QString::fromUtf8(&data[objSize+2], len);
 			objSize += 2 + len;
 
@@ -253,9 +339,193 @@ uint AMFType::decode(const char *data, AMFType **resultOut)
 		*resultOut = new AMFUndefined();
 		return 1;
 	case 0x0C: { // LongStringType
-		uint len = amfDecodeUInt32(&data[1]);
+		uint len = decodeBEUInt32(&data[1]);
 		*resultOut = new AMFString(QString::fromUtf8(&data[5], len));
 		return 1 + 4 + len; }
+	case 0x11: { // "avmplus-object-marker", switch to AMF 3
+		AMF3Context ctx;
+		uint len = decodeAmf3(&data[1], resultOut, &ctx);
+		if(len == 0)
+			return 0; // Failed to decode value
+		return 1 + len; }
+	}
+
+	// Should never reach here
+	Q_ASSERT(false);
+	return 0;
+}
+
+/// <summary>
+/// Decodes the provided byte data as an AMF 3 encoded value using the
+/// reference tables in `ctx`. Behaves identically to `decode()` otherwise.
+/// Decoded values are marked as AMF 3 so that they are serialized in the same
+/// format that they were received in. Object references are resolved by
+/// deep copying the referenced object as every value in our tree must have
+/// exactly one owner. Dates, XML, byte arrays, vectors and dictionaries have
+/// no `AMFType` equivalent and fail to decode.
+/// </summary>
+/// <returns>The amount of bytes read from the input.</returns>
+uint AMFType::decodeAmf3(
+	const char *data, AMFType **resultOut, AMF3Context *ctx)
+{
+	if(resultOut == NULL || ctx == NULL)
+		return 0; // Invalid input
+	*resultOut = NULL;
+
+	// The first byte is always a marker type
+	uint marker = amfDecodeUInt8(data);
+	switch(marker) {
+	default:
+		return 0; // Unknown or unsupported type
+	case 0x00: // UndefinedType
+		*resultOut = new AMFUndefined();
+		(*resultOut)->setAmfVer(3);
+		return 1;
+	case 0x01: // NullType
+		*resultOut = new AMFNull();
+		(*resultOut)->setAmfVer(3);
+		return 1;
+	case 0x02: // BooleanType (False)
+	case 0x03: // BooleanType (True)
+		*resultOut = new AMFBoolean(marker == 0x03);
+		(*resultOut)->setAmfVer(3);
+		return 1;
+	case 0x04: { // NumberType (Signed 29-bit integer)
+		uint val;
+		uint size = amfDecodeU29(&data[1], &val);
+		int sval = (int)val;
+		if(val & 0x10000000)
+			sval -= 0x20000000; // Sign extend
+		*resultOut = new AMFNumber((double)sval);
+		(*resultOut)->setAmfVer(3);
+		return 1 + size; }
+	case 0x05: // NumberType (Double)
+		*resultOut = new AMFNumber(decodeBEDouble(&data[1]));
+		(*resultOut)->setAmfVer(3);
+		return 1 + 8;
+	case 0x06: { // StringType
+		QString str;
+		uint size = amf3DecodeString(&data[1], &str, ctx);
+		if(size == 0)
+			return 0; // Invalid string reference
+		*resultOut = new AMFString(str);
+		(*resultOut)->setAmfVer(3);
+		return 1 + size; }
+	case 0x09: // EcmaArrayType
+	case 0x0A: { // ObjectType
+		uint objSize = 1; // Number of bytes read
+		uint ref;
+		objSize += amfDecodeU29(&data[objSize], &ref);
+		if(!(ref & 0x01)) {
+			// Object reference
+			uint index = ref >> 1;
+			if(index >= (uint)ctx->objects.count())
+				return 0; // Invalid reference
+			*resultOut = ctx->objects.at(index)->clone();
+			return objSize;
+		}
+
+		// Determine the object's traits. Arrays are always dynamic.
+		AMF3Context::Traits traits;
+		traits.isDynamic = true;
+		uint denseCount = 0;
+		if(marker == 0x09)
+			denseCount = ref >> 1;
+		else if(!(ref & 0x02)) {
+			// Traits reference
+			uint index = ref >> 2;
+			if(index >= (uint)ctx->traits.count())
+				return 0; // Invalid reference
+			traits = ctx->traits.at(index);
+		} else if(ref & 0x04) {
+			// Externalizable objects require knowledge of the class
+			return 0;
+		} else {
+			// Inline traits
+			traits.isDynamic = (ref & 0x08) != 0;
+			uint sealedCount = ref >> 4;
+			uint size = amf3DecodeString(&data[objSize], &traits.className, ctx);
+			if(size == 0)
+				return 0; // Invalid string reference
+			objSize += size;
+			for(uint i = 0; i < sealedCount; i++) {
+				QString name;
+				size = amf3DecodeString(&data[objSize], &name, ctx);
+				if(size == 0)
+					return 0; // Invalid string reference
+				objSize += size;
+				traits.sealedNames.append(name);
+			}
+			ctx->traits.append(traits);
+		}
+
+		// The object must be added to the reference table before its members
+		// are decoded as they are allowed to reference it
+		AMFObject *obj;
+		if(marker == 0x09)
+			obj = new AMFEcmaArray();
+		else
+			obj = new AMFObject();
+		obj->setAmfVer(3);
+		ctx->objects.append(obj);
+		*resultOut = obj;
+
+		// Sealed members followed by dynamic members which are terminated by
+		// an empty key. The associative portion of arrays is identical to
+		// dynamic members.
+		int sealedLeft = traits.sealedNames.count();
+		for(;;) {
+			QString key;
+			if(sealedLeft > 0) {
+				key = traits.sealedNames.at(
+					traits.sealedNames.count() - sealedLeft);
+				sealedLeft--;
+			} else {
+				if(!traits.isDynamic)
+					break;
+				uint size = amf3DecodeString(&data[objSize], &key, ctx);
+				if(size == 0) {
+					// Invalid string reference, abort decode
+					delete obj;
+					*resultOut = NULL;
+					return 0;
+				}
+				objSize += size;
+				if(key.isEmpty())
+					break; // End of dynamic members
+			}
+
+			// Decode value
+			AMFType *value = NULL;
+			objSize += decodeAmf3(&data[objSize], &value, ctx);
+			if(value == NULL) {
+				// Failed to decode value, abort decode
+				delete obj;
+				*resultOut = NULL;
+				return 0;
+			}
+
+			// Append key/value pair to the object
+			obj->insert(key, value);
+		}
+
+		// The dense portion of arrays is stored using the element index as the
+		// key which is identical to how ActionScript treats ECMA arrays
+		for(uint i = 0; i < denseCount; i++) {
+			AMFType *value = NULL;
+			objSize += decodeAmf3(&data[objSize], &value, ctx);
+			if(value == NULL) {
+				// Failed to decode value, abort decode
+				delete obj;
+				*resultOut = NULL;
+				return 0;
+			}
+			obj->insert(QString::number(i), value);
+		}
+		if(marker == 0x09)
+			obj->asEcmaArray()->setAssociativeCount(obj->count());
+
+		return objSize; }
 	}
 
 	// Should never reach here
@@ -269,6 +539,31 @@ AMFType::AMFType(ValueType type)
 {
 }
 
+AMFType::~AMFType()
+{
+}
+
+/// <summary>
+/// Serializes the value in the format specified by `setAmfVer()`. As RTMP
+/// messages are always AMF 0 streams AMF 3 values are prefixed with the AMF 0
+/// "avmplus-object-marker" and use a brand new set of reference tables. Use
+/// `serializedAmf3()` directly to share reference tables between values.
+/// </summary>
+QByteArray AMFType::serialized() const
+{
+	if(m_amfVer == 0)
+		return serializedAmf0();
+	else if(m_amfVer == 3) {
+		AMF3Context ctx;
+		QByteArray data(1, 0x11); // "avmplus-object-marker"
+		data += serializedAmf3(&ctx);
+		return data;
+	}
+
+	// Unknown AMF version
+	return QByteArray();
+}
+
 AMFNumber *AMFType::asNumber()
 {
 	if(m_type != NumberType)
@@ -400,21 +695,43 @@ AMFNumber &AMFNumber::operator=(const AMFNumber &other)
 	return *this;
 }
 
-QByteArray AMFNumber::serialized() const
+QByteArray AMFNumber::serializedAmf0() const
 {
-	if(m_amfVer == 0) {
-		QByteArray data(9, 0);
+	QByteArray data(9, 0);
+	char *ptr = data.data();
+	ptr = amfEncodeUInt8(ptr, 0x00); // Marker
+	ptr = encodeBEDouble(ptr, m_value);
+	return data;
+}
+
+/// <summary>
+/// Whole numbers that fit in a signed 29-bit integer are sent as an AMF 3
+/// "integer" while everything else is sent as a "double".
+/// </summary>
+QByteArray AMFNumber::serializedAmf3(AMF3Context *ctx) const
+{
+	if(m_value >= -268435456.0 && m_value <= 268435455.0 &&
+		m_value == (double)(int)m_value)
+	{
+		QByteArray data(5, 0);
 		char *ptr = data.data();
-		ptr = amfEncodeUInt8(ptr, 0x00); // Marker
-		ptr = amfEncodeDouble(ptr, m_value);
+		ptr = amfEncodeUInt8(ptr, 0x04); // Marker
+		ptr = amfEncodeU29(ptr, (uint)(int)m_value);
+		data.resize(ptr - data.constData());
 		return data;
-	} else if(m_amfVer == 3) {
-		// TODO: AMF 3 support
-		return QByteArray();
 	}
+	QByteArray data(9, 0);
+	char *ptr = data.data();
+	ptr = amfEncodeUInt8(ptr, 0x05); // Marker
+	ptr = encodeBEDouble(ptr, m_value);
+	return data;
+}
 
-	// Unknown AMF version
-	return QByteArray();
+AMFType *AMFNumber::clone() const
+{
+	AMFNumber *ret = new AMFNumber(m_value);
+	ret->setAmfVer(m_amfVer);
+	return ret;
 }
 
 QString AMFNumber::debugString(int indent) const
@@ -443,21 +760,26 @@ AMFBoolean &AMFBoolean::operator=(const AMFBoolean &other)
 	return *this;
 }
 
-QByteArray AMFBoolean::serialized() const
+QByteArray AMFBoolean::serializedAmf0() const
 {
-	if(m_amfVer == 0) {
-		QByteArray data(2, 0);
-		char *ptr = data.data();
-		ptr = amfEncodeUInt8(ptr, 0x01); // Marker
-		ptr = amfEncodeUInt8(ptr, m_value ? 1 : 0);
-		return data;
-	} else if(m_amfVer == 3) {
-		// TODO: AMF 3 support
-		return QByteArray();
-	}
+	QByteArray data(2, 0);
+	char *ptr = data.data();
+	ptr = amfEncodeUInt8(ptr, 0x01); // Marker
+	ptr = amfEncodeUInt8(ptr, m_value ? 1 : 0);
+	return data;
+}
 
-	// Unknown AMF version
-	return QByteArray();
+QByteArray AMFBoolean::serializedAmf3(AMF3Context *ctx) const
+{
+	// AMF 3 has separate markers for true and false
+	return QByteArray(1, m_value ? 0x03 : 0x02);
+}
+
+AMFType *AMFBoolean::clone() const
+{
+	AMFBoolean *ret = new AMFBoolean(m_value);
+	ret->setAmfVer(m_amfVer);
+	return ret;
 }
 
 QString AMFBoolean::debugString(int indent) const
@@ -486,32 +808,53 @@ AMFString::AMFString(const AMFString &other)
 {
 }
 
+AMFString::AMFString(AMFString &&other)
+	: QString()
+	, AMFType(StringType)
+{
+	QString::swap(other);
+	m_amfVer = other.m_amfVer;
+}
+
 AMFString &AMFString::operator=(const AMFString &other)
 {
 	QString::operator=(other);
 	return *this;
 }
 
-QByteArray AMFString::serialized() const
+AMFString &AMFString::operator=(AMFString &&other)
 {
-	if(m_amfVer == 0) {
-		QByteArray str = toUtf8();
-		int lenSize = (str.size() > 0xFFFF) ? 4 : 2;
-		QByteArray data(str.size() + lenSize + 1, 0);
-		char *ptr = data.data();
-		if(lenSize == 2)
-			ptr = amfEncodeUInt8(ptr, 0x02); // Marker
-		else
-			ptr = amfEncodeUInt8(ptr, 0x0C); // Marker
-		ptr = amfEncodeUtf8String(ptr, str);
-		return data;
-	} else if(m_amfVer == 3) {
-		// TODO: AMF 3 support
-		return QByteArray();
-	}
+	QString::swap(other);
+	m_amfVer = other.m_amfVer;
+	return *this;
+}
 
-	// Unknown AMF version
-	return QByteArray();
+QByteArray AMFString::serializedAmf0() const
+{
+	QByteArray str = toUtf8();
+	int lenSize = (str.size() > 0xFFFF) ? 4 : 2;
+	QByteArray data(str.size() + lenSize + 1, 0);
+	char *ptr = data.data();
+	if(lenSize == 2)
+		ptr = amfEncodeUInt8(ptr, 0x02); // Marker
+	else
+		ptr = amfEncodeUInt8(ptr, 0x0C); // Marker
+	ptr = amfEncodeUtf8String(ptr, str);
+	return data;
+}
+
+QByteArray AMFString::serializedAmf3(AMF3Context *ctx) const
+{
+	QByteArray data(1, 0x06); // Marker
+	amf3AppendString(data, *this, ctx);
+	return data;
+}
+
+AMFType *AMFString::clone() const
+{
+	AMFString *ret = new AMFString(*this);
+	ret->setAmfVer(m_amfVer);
+	return ret;
 }
 
 QString AMFString::debugString(int indent) const
@@ -528,15 +871,28 @@ AMFObject::AMFObject()
 {
 }
 
-AMFObject::AMFObject(const AMFObject &other)
-	: QMap<QString, AMFType *>(other)
+/// <summary>
+/// Takes ownership of all of the children of `other` leaving it empty.
+/// </summary>
+AMFObject::AMFObject(AMFObject &&other)
+	: QMap<QString, AMFType *>()
 	, AMFType(ObjectType)
 {
+	QMap<QString, AMFType *>::swap(other);
+	m_amfVer = other.m_amfVer;
 }
 
-AMFObject &AMFObject::operator=(const AMFObject &other)
+/// <summary>
+/// Deletes all of our existing children and takes ownership of all of the
+/// children of `other` leaving it empty.
+/// </summary>
+AMFObject &AMFObject::operator=(AMFObject &&other)
 {
-	QMap<QString, AMFType *>::operator=(other);
+	if(&other == this)
+		return *this;
+	deepClear();
+	QMap<QString, AMFType *>::swap(other);
+	m_amfVer = other.m_amfVer;
 	return *this;
 }
 
@@ -559,42 +915,94 @@ void AMFObject::deepClear()
 	clear();
 }
 
-QByteArray AMFObject::serialized() const
+QByteArray AMFObject::serializedAmf0() const
 {
-	if(m_amfVer == 0) {
-		QByteArray data;
-		if(m_type == EcmaArrayType) {
-			const AMFEcmaArray *ecma = asEcmaArray();
-			data = QByteArray(5, 0x08); // Marker
-			amfEncodeUInt32(&data.data()[1], ecma->getAssociativeCount());
-		} else
-			data = QByteArray(1, 0x03); // Marker
+	QByteArray data;
+	if(m_type == EcmaArrayType) {
+		const AMFEcmaArray *ecma = asEcmaArray();
+		data = QByteArray(5, 0x08); // Marker
+		encodeBEUInt32(&data.data()[1], ecma->getAssociativeCount());
+	} else
+		data = QByteArray(1, 0x03); // Marker
 
-		QMapIterator<QString, AMFType *> it(*this);
-		while(it.hasNext()) {
-			it.next();
+	QMapIterator<QString, AMFType *> it(*this);
+	while(it.hasNext()) {
+		it.next();
 
-			// Append encoded key
-			QByteArray str = it.key().toUtf8();
-			int lenSize = (str.size() > 0xFFFF) ? 4 : 2;
-			QByteArray keyData(str.size() + lenSize, 0);
-			amfEncodeUtf8String(keyData.data(), str);
-			data += keyData;
+		// Append encoded key
+		QByteArray str = it.key().toUtf8();
+		int lenSize = (str.size() > 0xFFFF) ? 4 : 2;
+		QByteArray keyData(str.size() + lenSize, 0);
+		amfEncodeUtf8String(keyData.data(), str);
+		data += keyData;
 
-			// Append value
-			data += it.value()->serialized();
-		}
+		// Append value. Children that are marked as AMF 3 are automatically
+		// prefixed with the "avmplus-object-marker".
+		data += it.value()->serialized();
+	}
+
+	data += QByteArray(2, 0x00); // "UTF-8-empty"
+	data += QByteArray(1, 0x09); // End marker
+	return data;
+}
+
+/// <summary>
+/// Objects are sent as anonymous dynamic objects and ECMA arrays as arrays
+/// with only an associative portion. All children are serialized as AMF 3
+/// regardless of their own AMF version so that they share our reference
+/// tables.
+/// </summary>
+QByteArray AMFObject::serializedAmf3(AMF3Context *ctx) const
+{
+	QByteArray data(1, m_type == EcmaArrayType ? 0x09 : 0x0A); // Marker
 
-		data += QByteArray(2, 0x00); // "UTF-8-empty"
-		data += QByteArray(1, 0x09); // End marker
+	// Send the object by reference if it has already been sent
+	if(ctx->objectRefs.contains(this)) {
+		amf3AppendU29(data, ctx->objectRefs.value(this) << 1);
 		return data;
-	} else if(m_amfVer == 3) {
-		// TODO: AMF 3 support
-		return QByteArray();
 	}
+	ctx->objectRefs.insert(this, ctx->objectRefs.count());
 
-	// Unknown AMF version
-	return QByteArray();
+	if(m_type == EcmaArrayType) {
+		// Dense portion is always empty
+		amf3AppendU29(data, (0 << 1) | 0x01);
+	} else {
+		// All anonymous objects share the same traits so only the first object
+		// needs to send them
+		const QString className;
+		if(ctx->traitRefs.contains(className))
+			amf3AppendU29(data, (ctx->traitRefs.value(className) << 2) | 0x01);
+		else {
+			ctx->traitRefs.insert(className, ctx->traitRefs.count());
+			amf3AppendU29(data, 0x0B); // Inline, dynamic, no sealed members
+			amf3AppendString(data, className, ctx);
+		}
+	}
+
+	QMapIterator<QString, AMFType *> it(*this);
+	while(it.hasNext()) {
+		it.next();
+		amf3AppendString(data, it.key(), ctx);
+		data += it.value()->serializedAmf3(ctx);
+	}
+	amf3AppendString(data, QString(), ctx); // End of dynamic members
+
+	return data;
+}
+
+/// <summary>
+/// Creates a deep copy of the object and all of its children.
+/// </summary>
+AMFType *AMFObject::clone() const
+{
+	AMFObject *ret = new AMFObject();
+	ret->setAmfVer(m_amfVer);
+	QMapIterator<QString, AMFType *> it(*this);
+	while(it.hasNext()) {
+		it.next();
+		ret->insert(it.key(), it.value()->clone());
+	}
+	return ret;
 }
 
 QString AMFObject::debugString(int indent) const
@@ -628,21 +1036,36 @@ AMFEcmaArray::AMFEcmaArray()
 	m_type = EcmaArrayType;
 }
 
-AMFEcmaArray::AMFEcmaArray(const AMFEcmaArray &other)
-	: AMFObject(other)
+AMFEcmaArray::AMFEcmaArray(AMFEcmaArray &&other)
+	: AMFObject(static_cast<AMFObject &&>(other))
 	, m_associativeCount(other.getAssociativeCount())
 {
 	m_type = EcmaArrayType;
 }
 
-AMFEcmaArray &AMFEcmaArray::operator=(const AMFEcmaArray &other)
+AMFEcmaArray &AMFEcmaArray::operator=(AMFEcmaArray &&other)
 {
-	AMFObject::operator=(other);
-	m_type = EcmaArrayType;
+	AMFObject::operator=(static_cast<AMFObject &&>(other));
 	m_associativeCount = other.getAssociativeCount();
 	return *this;
 }
 
+/// <summary>
+/// Creates a deep copy of the array and all of its children.
+/// </summary>
+AMFType *AMFEcmaArray::clone() const
+{
+	AMFEcmaArray *ret = new AMFEcmaArray();
+	ret->setAmfVer(m_amfVer);
+	ret->setAssociativeCount(m_associativeCount);
+	QMapIterator<QString, AMFType *> it(*this);
+	while(it.hasNext()) {
+		it.next();
+		ret->insert(it.key(), it.value()->clone());
+	}
+	return ret;
+}
+
 //=============================================================================
 // AMFNull class
 
@@ -661,20 +1084,24 @@ AMFNull &AMFNull::operator=(const AMFNull &other)
 	return *this;
 }
 
-QByteArray AMFNull::serialized() const
+QByteArray AMFNull::serializedAmf0() const
 {
-	if(m_amfVer == 0) {
-		QByteArray data(1, 0);
-		char *ptr = data.data();
-		ptr = amfEncodeUInt8(ptr, 0x05); // Marker
-		return data;
-	} else if(m_amfVer == 3) {
-		// TODO: AMF 3 support
-		return QByteArray();
-	}
+	QByteArray data(1, 0);
+	char *ptr = data.data();
+	ptr = amfEncodeUInt8(ptr, 0x05); // Marker
+	return data;
+}
 
-	// Unknown AMF version
-	return QByteArray();
+QByteArray AMFNull::serializedAmf3(AMF3Context *ctx) const
+{
+	return QByteArray(1, 0x01); // Marker
+}
+
+AMFType *AMFNull::clone() const
+{
+	AMFNull *ret = new AMFNull();
+	ret->setAmfVer(m_amfVer);
+	return ret;
 }
 
 QString AMFNull::debugString(int indent) const
@@ -700,23 +1127,99 @@ AMFUndefined &AMFUndefined::operator=(const AMFUndefined &other)
 	return *this;
 }
 
-QByteArray AMFUndefined::serialized() const
+QByteArray AMFUndefined::serializedAmf0() const
 {
-	if(m_amfVer == 0) {
-		QByteArray data(1, 0);
-		char *ptr = data.data();
-		ptr = amfEncodeUInt8(ptr, 0x06); // Marker
-		return data;
-	} else if(m_amfVer == 3) {
-		// TODO: AMF 3 support
-		return QByteArray();
-	}
+	QByteArray data(1, 0);
+	char *ptr = data.data();
+	ptr = amfEncodeUInt8(ptr, 0x06); // Marker
+	return data;
+}
 
-	// Unknown AMF version
-	return QByteArray();
+QByteArray AMFUndefined::serializedAmf3(AMF3Context *ctx) const
+{
+	return QByteArray(1, 0x00); // Marker
+}
+
+AMFType *AMFUndefined::clone() const
+{
+	AMFUndefined *ret = new AMFUndefined();
+	ret->setAmfVer(m_amfVer);
+	return ret;
 }
 
 QString AMFUndefined::debugString(int indent) const
 {
 	return QStringLiteral("Undefined");
 }
+
+//=============================================================================
+// AMFTypeList class
+
+AMFTypeList::AMFTypeList()
+	: QVector<AMFType *>()
+{
+}
+
+/// <summary>
+/// Deep copies all of the values of `other`.
+/// </summary>
+AMFTypeList::AMFTypeList(const AMFTypeList &other)
+	: QVector<AMFType *>()
+{
+	reserve(other.count());
+	for(int i = 0; i < other.count(); i++)
+		append(other.at(i) != NULL ? other.at(i)->clone() : NULL);
+}
+
+/// <summary>
+/// Takes ownership of all of the values of `other` leaving it empty.
+/// </summary>
+AMFTypeList::AMFTypeList(AMFTypeList &&other)
+	: QVector<AMFType *>()
+{
+	QVector<AMFType *>::swap(other);
+}
+
+/// <summary>
+/// Deletes all of our existing values and deep copies all of the values of
+/// `other`.
+/// </summary>
+AMFTypeList &AMFTypeList::operator=(const AMFTypeList &other)
+{
+	if(&other == this)
+		return *this;
+	deepClear();
+	reserve(other.count());
+	for(int i = 0; i < other.count(); i++)
+		append(other.at(i) != NULL ? other.at(i)->clone() : NULL);
+	return *this;
+}
+
+/// <summary>
+/// Deletes all of our existing values and takes ownership of all of the
+/// values of `other` leaving it empty.
+/// </summary>
+AMFTypeList &AMFTypeList::operator=(AMFTypeList &&other)
+{
+	if(&other == this)
+		return *this;
+	deepClear();
+	QVector<AMFType *>::swap(other);
+	return *this;
+}
+
+AMFTypeList::~AMFTypeList()
+{
+	// We have memory ownership of all our values, clean up
+	deepClear();
+}
+
+/// <summary>
+/// Delete all values and clear the list.
+/// </summary>
+void AMFTypeList::deepClear()
+{
+	for(int i = 0; i < count(); i++)
+		delete at(i);
+	clear();
+}
@@ -0,0 +1,175 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "include/annexb.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define USE_SSE2_SCANNER 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define USE_SSE2_SCANNER 0
+#endif
+
+//=============================================================================
+// Helpers
+
+#if USE_SSE2_SCANNER
+static inline int lowestSetBit(uint mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+#endif // USE_SSE2_SCANNER
+
+/// <summary>
+/// Finds the first 0x01 byte at or after `from` that is preceded by two zero
+/// bytes. `from` must be at least 2.
+/// </summary>
+/// <returns>The offset of the 0x01 byte or `size` if there is none</returns>
+static int findStartCodeEnd(const char *data, int size, int from)
+{
+	int i = from;
+
+#if USE_SSE2_SCANNER
+	// Test 16 positions at once by comparing the buffer against itself
+	// shifted by one and two bytes. Nearly all H.264 data contains no zero
+	// bytes at all thanks to emulation prevention so we test for the cheap
+	// "no zero bytes in the previous two positions" case first.
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	for(; i + 16 <= size; i += 16) {
+		__m128i prev1 = _mm_loadu_si128((const __m128i *)&data[i - 1]);
+		__m128i prev2 = _mm_loadu_si128((const __m128i *)&data[i - 2]);
+		__m128i zeros = _mm_and_si128(
+			_mm_cmpeq_epi8(prev1, zero), _mm_cmpeq_epi8(prev2, zero));
+		if(_mm_movemask_epi8(zeros) == 0)
+			continue;
+		__m128i cur = _mm_loadu_si128((const __m128i *)&data[i]);
+		uint mask = (uint)_mm_movemask_epi8(
+			_mm_and_si128(zeros, _mm_cmpeq_epi8(cur, one)));
+		if(mask != 0)
+			return i + lowestSetBit(mask);
+	}
+#endif // USE_SSE2_SCANNER
+
+	// Scalar tail (Or the entire buffer on platforms without SSE2)
+	const unsigned char *uc = (const unsigned char *)data;
+	for(; i < size; i++) {
+		if(uc[i] == 0x01 && uc[i - 1] == 0 && uc[i - 2] == 0)
+			return i;
+	}
+	return size;
+}
+
+/// <summary>
+/// Finds the first start code that begins at or after `from`.
+/// </summary>
+/// <returns>The offset of the first byte of the start code or `size` if there
+/// is none</returns>
+static int findStartCode(const char *data, int size, int from, int *codeSize)
+{
+	int end = findStartCodeEnd(data, size, qMax(2, from + 2));
+	if(end >= size) {
+		*codeSize = 0;
+		return size;
+	}
+	int off = end - 2;
+	*codeSize = 3;
+	if(off > from && data[off - 1] == 0) {
+		off--;
+		*codeSize = 4;
+	}
+	return off;
+}
+
+//=============================================================================
+// Exported functions
+
+/// <summary>
+/// Finds the first 3-byte or 4-byte Annex B start code in the specified
+/// buffer. If `codeSizeOut` is not NULL then the size of the start code is
+/// returned in it.
+/// </summary>
+/// <returns>The offset of the first byte of the start code or `size` if the
+/// buffer contains no start codes</returns>
+int annexBFindStartCode(const char *data, int size, int *codeSizeOut)
+{
+	int codeSize;
+	int off = findStartCode(data, size, 0, &codeSize);
+	if(codeSizeOut != NULL)
+		*codeSizeOut = codeSize;
+	return off;
+}
+
+/// <summary>
+/// Skips the leading zero bytes and start code of a single NAL unit if it has
+/// one. Data that doesn't begin with a start code is assumed to already be a
+/// raw NAL unit.
+/// </summary>
+/// <returns>The offset of the NAL unit header byte</returns>
+int annexBSkipStartCode(const char *data, int size)
+{
+	int off = 0;
+	while(off < size - 1 && data[off] == 0)
+		off++;
+	if(off >= 2 && data[off] == 0x01)
+		return off + 1;
+	return 0;
+}
+
+/// <summary>
+/// Splits an entire Annex B access unit into its NAL units in a single pass.
+/// The found NAL units are appended to `nalsOut` and reference `data` by
+/// offset so nothing is copied. Any data before the first start code is
+/// treated as a NAL unit as well so that buffers that only contain a single
+/// raw NAL unit can be passed in without special casing.
+/// </summary>
+/// <returns>The number of NAL units that were found</returns>
+int annexBSplitNalUnits(
+	const char *data, int size, AnnexBNalUnitList *nalsOut)
+{
+	int numNals = 0;
+	int codeSize;
+	int nalStart = 0;
+	int codeOff = findStartCode(data, size, 0, &codeSize);
+	for(;;) {
+		// Trailing zero bytes belong to the byte stream and not the NAL unit
+		int nalEnd = codeOff;
+		while(nalEnd > nalStart && data[nalEnd - 1] == 0)
+			nalEnd--;
+		if(nalEnd > nalStart) {
+			AnnexBNalUnit nal;
+			nal.off = nalStart;
+			nal.size = nalEnd - nalStart;
+			nalsOut->append(nal);
+			numNals++;
+		}
+		if(codeOff >= size)
+			break;
+		nalStart = codeOff + codeSize;
+		codeOff = findStartCode(data, size, nalStart, &codeSize);
+	}
+	return numNals;
+}
@@ -0,0 +1,252 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef BYTEORDER_H
+#define BYTEORDER_H
+
+#include <QtCore/QtGlobal>
+#include <string.h>
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
+
+// Internal header-only byte order codec. Everything in here is inlined into
+// the caller so that hot loops don't pay for a function call per field. The
+// exported `amfDecode*()` and `amfEncode*()` functions are thin wrappers
+// around these.
+
+#if Q_BYTE_ORDER != Q_LITTLE_ENDIAN
+#error Unsupported byte order
+#endif
+
+#if defined(_MSC_VER)
+#define LBC_BSWAP16(x) _byteswap_ushort(x)
+#define LBC_BSWAP32(x) _byteswap_ulong(x)
+#define LBC_BSWAP64(x) _byteswap_uint64(x)
+#elif defined(__GNUC__)
+#define LBC_BSWAP16(x) __builtin_bswap16(x)
+#define LBC_BSWAP32(x) __builtin_bswap32(x)
+#define LBC_BSWAP64(x) __builtin_bswap64(x)
+#else
+#error Unsupported compiler
+#endif
+
+//=============================================================================
+// Single field helpers. `memcpy()` of a constant size is compiled into a
+// single unaligned load or store.
+
+inline uint decodeBEUInt16(const char *data)
+{
+	quint16 val;
+	memcpy(&val, data, 2);
+	return LBC_BSWAP16(val);
+}
+
+inline uint decodeBEUInt24(const char *data)
+{
+	const unsigned char *uc = (const unsigned char *)data;
+	return ((uint)uc[0] << 16) | decodeBEUInt16(&data[1]);
+}
+
+inline uint decodeBEUInt32(const char *data)
+{
+	quint32 val;
+	memcpy(&val, data, 4);
+	return LBC_BSWAP32(val);
+}
+
+/// <summary>
+/// The only little-endian field in all of RTMP is the message stream ID of a
+/// chunk type 0 header.
+/// </summary>
+inline uint decodeLEUInt32(const char *data)
+{
+	quint32 val;
+	memcpy(&val, data, 4);
+	return val;
+}
+
+inline double decodeBEDouble(const char *data)
+{
+	// WARNING: Do we need to worry about platforms that store floats in a
+	// different byte order than integers?
+	quint64 ival;
+	memcpy(&ival, data, 8);
+	ival = LBC_BSWAP64(ival);
+	double val;
+	memcpy(&val, &ival, 8);
+	return val;
+}
+
+/// <returns>A pointer to the next byte to write</returns>
+inline char *encodeBEUInt16(char *data, uint val)
+{
+	quint16 bval = LBC_BSWAP16((quint16)val);
+	memcpy(data, &bval, 2);
+	return data + 2;
+}
+
+/// <returns>A pointer to the next byte to write</returns>
+inline char *encodeBEUInt24(char *data, uint val)
+{
+	data[0] = (char)((val >> 16) & 0xFF);
+	return encodeBEUInt16(&data[1], val);
+}
+
+/// <returns>A pointer to the next byte to write</returns>
+inline char *encodeBEUInt32(char *data, uint val)
+{
+	quint32 bval = LBC_BSWAP32((quint32)val);
+	memcpy(data, &bval, 4);
+	return data + 4;
+}
+
+/// <returns>A pointer to the next byte to write</returns>
+inline char *encodeLEUInt32(char *data, uint val)
+{
+	quint32 lval = val;
+	memcpy(data, &lval, 4);
+	return data + 4;
+}
+
+/// <returns>A pointer to the next byte to write</returns>
+inline char *encodeBEDouble(char *data, double val)
+{
+	quint64 ival;
+	memcpy(&ival, &val, 8);
+	ival = LBC_BSWAP64(ival);
+	memcpy(data, &ival, 8);
+	return data + 8;
+}
+
+//=============================================================================
+/// <summary>
+/// All the fields of a single RTMP chunk header. Which fields are used depends
+/// on the header format: type 0 uses all fields, type 1 excludes the message
+/// stream ID, type 2 only has the timestamp and type 3 has no message header
+/// at all. `timestamp` is an absolute timestamp for type 0 headers and a delta
+/// for types 1 and 2.
+/// </summary>
+struct RTMPChunkHeader {
+	uint	fmt;
+	uint	csId;
+	quint32	timestamp;
+	uint	msgLen;
+	uint	msgType;
+	uint	msgStreamId;
+};
+
+// 3 byte "basic header" + 11 byte "type 0 message header" + 4 byte extended
+// timestamp
+const int RTMP_MAX_CHUNK_HEADER_SIZE = 3 + 11 + 4;
+
+/// <summary>
+/// Encodes an entire chunk header using the smallest basic header that can
+/// represent the chunk stream ID. `data` must have room for at least
+/// `RTMP_MAX_CHUNK_HEADER_SIZE` bytes.
+/// </summary>
+/// <returns>The size of the encoded header in bytes</returns>
+inline int encodeRTMPChunkHeader(char *data, const RTMPChunkHeader &hdr)
+{
+	unsigned char *uc = (unsigned char *)data;
+	char *ptr;
+
+	// Basic header
+	if(hdr.csId <= 63) {
+		uc[0] = (hdr.fmt << 6) | hdr.csId;
+		ptr = data + 1;
+	} else if(hdr.csId <= 319) {
+		uc[0] = (hdr.fmt << 6);
+		uc[1] = hdr.csId - 64;
+		ptr = data + 2;
+	} else {
+		uc[0] = (hdr.fmt << 6) | 1;
+		uc[1] = (hdr.csId - 64) & 0xFF;
+		uc[2] = (hdr.csId - 64) >> 8;
+		ptr = data + 3;
+	}
+	if(hdr.fmt == 3)
+		return ptr - data;
+
+	// Message header
+	bool isExtended = (hdr.timestamp >= 0xFFFFFF);
+	ptr = encodeBEUInt24(ptr, isExtended ? 0xFFFFFF : hdr.timestamp);
+	if(hdr.fmt <= 1) {
+		ptr = encodeBEUInt24(ptr, hdr.msgLen);
+		*ptr++ = (char)hdr.msgType;
+		if(hdr.fmt == 0)
+			ptr = encodeLEUInt32(ptr, hdr.msgStreamId); // Little-endian
+	}
+	if(isExtended)
+		ptr = encodeBEUInt32(ptr, hdr.timestamp);
+	return ptr - data;
+}
+
+/// <summary>
+/// Decodes an entire chunk header. Fields that are not included in the
+/// header's format are left untouched.
+/// </summary>
+/// <returns>The size of the header in bytes or 0 if `size` is too small to
+/// contain the entire header</returns>
+inline int decodeRTMPChunkHeader(
+	const char *data, int size, RTMPChunkHeader *hdrOut)
+{
+	const unsigned char *uc = (const unsigned char *)data;
+	if(size < 1)
+		return 0;
+
+	// Basic header
+	int off = 1;
+	hdrOut->fmt = (uc[0] & 0xC0) >> 6;
+	hdrOut->csId = (uc[0] & 0x3F);
+	if(hdrOut->csId == 0) {
+		off = 2;
+		if(size < off)
+			return 0;
+		hdrOut->csId = (uint)uc[1] + 64;
+	} else if(hdrOut->csId == 1) {
+		off = 3;
+		if(size < off)
+			return 0;
+		hdrOut->csId = (uint)uc[2] * 256 + (uint)uc[1] + 64;
+	}
+	if(hdrOut->fmt == 3)
+		return off;
+
+	// Message header
+	static const int msgHeadSizes[3] = { 11, 7, 3 };
+	int headEnd = off + msgHeadSizes[hdrOut->fmt];
+	if(size < headEnd)
+		return 0;
+	hdrOut->timestamp = decodeBEUInt24(&data[off]);
+	if(hdrOut->fmt <= 1) {
+		hdrOut->msgLen = decodeBEUInt24(&data[off + 3]);
+		hdrOut->msgType = uc[off + 6];
+		if(hdrOut->fmt == 0)
+			hdrOut->msgStreamId = decodeLEUInt32(&data[off + 7]);
+	}
+	if(hdrOut->timestamp >= 0xFFFFFF) {
+		// Timestamp is in the extended header
+		if(size < headEnd + 4)
+			return 0;
+		hdrOut->timestamp = decodeBEUInt32(&data[headEnd]);
+		headEnd += 4;
+	}
+	return headEnd;
+}
+
+#endif // BYTEORDER_H
@@ -0,0 +1,258 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "include/dnscache.h"
+#include <QtNetwork/QDnsLookup>
+
+// Results are never cached for longer than this by default even if the DNS
+// server says that we can
+const uint DEFAULT_MAX_TTL_SECS = 60 * 60; // 1 hour
+
+//=============================================================================
+// SystemDNSResolver class
+
+/// <summary>
+/// Resolves host names using the DNS servers that are configured in the OS.
+/// Both the `A` and `AAAA` queries are sent at the same time and the result
+/// is reported once both have completed.
+/// </summary>
+class SystemDNSResolver : public DNSResolver
+{
+private: // Datatypes ---------------------------------------------------------
+	struct Query {
+		DNSCache *			cache;
+		QString				host;
+		QList<QHostAddress>	addrs;
+		uint				ttl; // Lowest TTL of all received records
+		int					numPending;
+	};
+
+public: // Methods ------------------------------------------------------------
+	virtual void	lookup(DNSCache *cache, const QString &host);
+
+private:
+	static void		queryFinished(Query *query, QDnsLookup *dns);
+};
+
+void SystemDNSResolver::lookup(DNSCache *cache, const QString &host)
+{
+	Query *query = new Query();
+	query->cache = cache;
+	query->host = host;
+	query->ttl = UINT_MAX;
+	query->numPending = 2;
+
+	QDnsLookup *dnsA = new QDnsLookup(QDnsLookup::A, host);
+	QDnsLookup *dnsAaaa = new QDnsLookup(QDnsLookup::AAAA, host);
+	QObject::connect(dnsA, &QDnsLookup::finished, [=]() {
+		queryFinished(query, dnsA);
+	});
+	QObject::connect(dnsAaaa, &QDnsLookup::finished, [=]() {
+		queryFinished(query, dnsAaaa);
+	});
+	dnsA->lookup();
+	dnsAaaa->lookup();
+}
+
+void SystemDNSResolver::queryFinished(Query *query, QDnsLookup *dns)
+{
+	// A missing record type is not an error as many hosts are IPv4-only
+	if(dns->error() == QDnsLookup::NoError) {
+		QList<QDnsHostAddressRecord> records = dns->hostAddressRecords();
+		for(int i = 0; i < records.size(); i++) {
+			const QDnsHostAddressRecord &record = records.at(i);
+			if(!query->addrs.contains(record.value()))
+				query->addrs.append(record.value());
+			query->ttl = qMin(query->ttl, (uint)record.timeToLive());
+		}
+	}
+	dns->deleteLater(); // We're inside its signal
+
+	query->numPending--;
+	if(query->numPending > 0)
+		return; // Wait for the other query
+	if(query->addrs.isEmpty())
+		query->ttl = 0;
+	query->cache->addResult(query->host, query->addrs, query->ttl);
+	delete query;
+}
+
+//=============================================================================
+// DNSResolver class
+
+DNSResolver::~DNSResolver()
+{
+}
+
+//=============================================================================
+// DNSCache class
+
+DNSCache *DNSCache::s_instance = NULL;
+
+/// <summary>
+/// Creates the process-wide cache. Called by `INIT_LIBBROADCAST()`.
+/// </summary>
+void DNSCache::createSingleton()
+{
+	if(s_instance != NULL)
+		return; // Already created
+	s_instance = new DNSCache();
+}
+
+/// <summary>
+/// Reorders a list of resolved addresses into the order that connections
+/// should be attempted in. Following RFC 8305 the address families are
+/// interleaved starting with IPv6 so that a broken IPv6 path only delays the
+/// connection by a single attempt instead of all of them.
+/// </summary>
+QList<QHostAddress> DNSCache::sortForConnect(const QList<QHostAddress> &addrs)
+{
+	QList<QHostAddress> v6;
+	QList<QHostAddress> v4;
+	for(int i = 0; i < addrs.size(); i++) {
+		const QHostAddress &addr = addrs.at(i);
+		if(addr.protocol() == QAbstractSocket::IPv6Protocol)
+			v6.append(addr);
+		else
+			v4.append(addr);
+	}
+
+	QList<QHostAddress> ret;
+	int i6 = 0;
+	int i4 = 0;
+	while(i6 < v6.size() || i4 < v4.size()) {
+		if(i6 < v6.size())
+			ret.append(v6.at(i6++));
+		if(i4 < v4.size())
+			ret.append(v4.at(i4++));
+	}
+	return ret;
+}
+
+/// <summary>
+/// Creates a new cache that uses `resolver` to perform queries. If `resolver`
+/// is NULL then the system's DNS servers are used. The cache takes ownership
+/// of the resolver.
+/// </summary>
+DNSCache::DNSCache(DNSResolver *resolver)
+	: QObject()
+	, m_mutex()
+	, m_entries()
+	, m_clock()
+	, m_resolver(resolver)
+	, m_maxTtl(DEFAULT_MAX_TTL_SECS)
+{
+	if(m_resolver == NULL)
+		m_resolver = new SystemDNSResolver();
+	m_clock.start();
+}
+
+DNSCache::~DNSCache()
+{
+	delete m_resolver;
+	if(s_instance == this)
+		s_instance = NULL;
+}
+
+/// <summary>
+/// Replaces the resolver that is used for new queries. The cache takes
+/// ownership of the new resolver. Should only be called when there are no
+/// queries in progress.
+/// </summary>
+void DNSCache::setResolver(DNSResolver *resolver)
+{
+	if(resolver == NULL)
+		resolver = new SystemDNSResolver();
+	if(resolver == m_resolver)
+		return;
+	delete m_resolver;
+	m_resolver = resolver;
+}
+
+/// <summary>
+/// Returns the cached addresses of `host` in `addrsOut` if we have a result
+/// that hasn't expired yet. Otherwise a query is started, if one isn't
+/// already in progress, and `hostResolved()` is emitted once it completes.
+/// </summary>
+/// <returns>True if `addrsOut` was filled from the cache</returns>
+bool DNSCache::lookup(const QString &host, QList<QHostAddress> *addrsOut)
+{
+	QString key = host.toLower();
+	m_mutex.lock();
+	if(m_entries.contains(key)) {
+		const Entry &entry = m_entries[key];
+		if(entry.pending) {
+			m_mutex.unlock();
+			return false; // Somebody else already asked
+		}
+		if(entry.expiry > m_clock.elapsed()) {
+			if(addrsOut != NULL)
+				*addrsOut = entry.addrs;
+			m_mutex.unlock();
+			return true; // Still fresh
+		}
+	}
+	Entry entry;
+	entry.expiry = 0;
+	entry.pending = true;
+	m_entries[key] = entry;
+	m_mutex.unlock();
+
+	// The resolver is allowed to call `addResult()` immediately
+	m_resolver->lookup(this, key);
+	return false;
+}
+
+/// <summary>
+/// Called by the resolver when a query completes. Failed lookups are not
+/// cached so that the next `lookup()` tries again.
+/// </summary>
+void DNSCache::addResult(
+	const QString &host, const QList<QHostAddress> &addrs, uint ttlSecs)
+{
+	QString key = host.toLower();
+	m_mutex.lock();
+	if(addrs.isEmpty()) {
+		m_entries.remove(key);
+	} else {
+		Entry entry;
+		entry.addrs = addrs;
+		entry.expiry = m_clock.elapsed() +
+			(qint64)qMin(ttlSecs, m_maxTtl) * 1000LL;
+		entry.pending = false;
+		m_entries[key] = entry;
+	}
+	m_mutex.unlock();
+
+	emit hostResolved(key, addrs);
+}
+
+/// <summary>
+/// Forgets all cached results. Queries that are in progress are unaffected.
+/// </summary>
+void DNSCache::clear()
+{
+	m_mutex.lock();
+	QHash<QString, Entry>::iterator it = m_entries.begin();
+	while(it != m_entries.end()) {
+		if(it.value().pending)
+			++it;
+		else
+			it = m_entries.erase(it);
+	}
+	m_mutex.unlock();
+}
@@ -19,8 +19,11 @@
 #define AMF_H
 
 #include "brolog.h"
+#include <QtCore/QHash>
 #include <QtCore/QMap>
+#include <QtCore/QMetaType>
 #include <QtCore/QString>
+#include <QtCore/QVector>
 
 // WARNING WARNING WARNING WARNING WARNING WARNING WARNING WARNING WARNING
 //*****************************************************************************
@@ -28,6 +31,7 @@
 //*****************************************************************************
 // WARNING WARNING WARNING WARNING WARNING WARNING WARNING WARNING WARNING
 
+class AMFType;
 class AMFNumber;
 class AMFBoolean;
 class AMFString;
@@ -48,6 +52,44 @@ LBC_EXPORT char *	amfEncodeUInt24(char *data, uint val);
 LBC_EXPORT char *	amfEncodeUInt32(char *data, uint val);
 LBC_EXPORT char *	amfEncodeDouble(char *data, double val);
 LBC_EXPORT char *	amfEncodeUtf8String(char *data, const QByteArray &str);
+LBC_EXPORT uint		amfDecodeU29(const char *data, uint *valOut);
+LBC_EXPORT char *	amfEncodeU29(char *data, uint val);
+
+//=============================================================================
+/// <summary>
+/// Holds the string, object and trait reference tables of a single AMF 3
+/// value. As AMF 3 data is always embedded in an AMF 0 stream when it is
+/// transmitted over RTMP a new context is created every time the AMF 0
+/// "avmplus-object-marker" is encountered. The encoding and decoding tables
+/// are independent of each other.
+/// </summary>
+class LBC_EXPORT AMF3Context
+{
+public: // Datatypes ----------------------------------------------------------
+	struct Traits {
+		QString				className;
+		bool				isDynamic;
+		QVector<QString>	sealedNames;
+	};
+
+public: // Members ------------------------------------------------------------
+	// Encoding tables
+	QHash<QString, uint>			stringRefs;
+	QHash<const AMFType *, uint>	objectRefs;
+	QHash<QString, uint>			traitRefs; // Keyed by class name
+
+	// Decoding tables. Objects are not owned by the context.
+	QVector<QString>	strings;
+	QVector<AMFType *>	objects;
+	QVector<Traits>		traits;
+
+public: // Constructor/destructor ---------------------------------------------
+	AMF3Context();
+
+public: // Methods ------------------------------------------------------------
+	void	reset();
+};
+//=============================================================================
 
 //=============================================================================
 class LBC_EXPORT AMFType
@@ -79,16 +121,22 @@ protected: // Members ---------------------------------------------------------
 
 public: // Static methods -----------------------------------------------------
 	static uint	decode(const char *data, AMFType **resultOut);
+	static uint	decodeAmf3(
+		const char *data, AMFType **resultOut, AMF3Context *ctx);
 
 public: // Constructor/destructor ---------------------------------------------
 	AMFType(ValueType type);
+	virtual ~AMFType();
 
 public: // Methods ------------------------------------------------------------
 	ValueType			getAmfType() const;
 	void				setAmfVer(int amfVer);
 	int					getAmfVer() const;
 
-	virtual QByteArray	serialized() const = 0;
+	QByteArray			serialized() const;
+	virtual QByteArray	serializedAmf0() const = 0;
+	virtual QByteArray	serializedAmf3(AMF3Context *ctx) const = 0;
+	virtual AMFType *	clone() const = 0;
 	virtual QString		debugString(int indent = 0) const = 0;
 
 	AMFNumber *				asNumber();
@@ -140,7 +188,9 @@ public: // Methods ------------------------------------------------------------
 	void				setValue(double value);
 	double				getValue() const;
 
-	virtual QByteArray	serialized() const;
+	virtual QByteArray	serializedAmf0() const;
+	virtual QByteArray	serializedAmf3(AMF3Context *ctx) const;
+	virtual AMFType *	clone() const;
 	virtual QString		debugString(int indent = 0) const;
 };
 //=============================================================================
@@ -170,7 +220,9 @@ public: // Methods ------------------------------------------------------------
 	void				setValue(bool value);
 	bool				getValue() const;
 
-	virtual QByteArray	serialized() const;
+	virtual QByteArray	serializedAmf0() const;
+	virtual QByteArray	serializedAmf3(AMF3Context *ctx) const;
+	virtual AMFType *	clone() const;
 	virtual QString		debugString(int indent = 0) const;
 };
 //=============================================================================
@@ -195,10 +247,14 @@ public: // Constructor/destructor ---------------------------------------------
 	AMFString();
 	AMFString(const QString &str);
 	AMFString(const AMFString &other);
+	AMFString(AMFString &&other);
 	AMFString &operator=(const AMFString &other);
+	AMFString &operator=(AMFString &&other);
 
 public: // Methods ------------------------------------------------------------
-	virtual QByteArray	serialized() const;
+	virtual QByteArray	serializedAmf0() const;
+	virtual QByteArray	serializedAmf3(AMF3Context *ctx) const;
+	virtual AMFType *	clone() const;
 	virtual QString		debugString(int indent = 0) const;
 };
 //=============================================================================
@@ -208,19 +264,27 @@ public: // Methods ------------------------------------------------------------
 /// An anonymous ActionScript object. Takes memory ownership of all child
 /// values. We use a QMap as the order of QHashes change every execution and
 /// makes it difficult to test.
+///
+/// As every child has exactly one owner objects can only be moved, never
+/// copied. Use `clone()` to explicitly create a deep copy.
 /// </summary>
 class LBC_EXPORT AMFObject : public QMap<QString, AMFType *>, public AMFType
 {
 public: // Constructor/destructor ---------------------------------------------
 	AMFObject();
-	AMFObject(const AMFObject &other);
-	AMFObject &operator=(const AMFObject &other);
+	AMFObject(AMFObject &&other);
+	AMFObject &operator=(AMFObject &&other);
 	~AMFObject();
+private:
+	AMFObject(const AMFObject &other); // Not implemented
+	AMFObject &operator=(const AMFObject &other); // Not implemented
 
 public: // Methods ------------------------------------------------------------
 	void				deepClear();
 
-	virtual QByteArray	serialized() const;
+	virtual QByteArray	serializedAmf0() const;
+	virtual QByteArray	serializedAmf3(AMF3Context *ctx) const;
+	virtual AMFType *	clone() const;
 	virtual QString		debugString(int indent = 0) const;
 };
 //=============================================================================
@@ -238,12 +302,17 @@ private: // Members -----------------------------------------------------------
 
 public: // Constructor/destructor ---------------------------------------------
 	AMFEcmaArray();
-	AMFEcmaArray(const AMFEcmaArray &other);
-	AMFEcmaArray &operator=(const AMFEcmaArray &other);
+	AMFEcmaArray(AMFEcmaArray &&other);
+	AMFEcmaArray &operator=(AMFEcmaArray &&other);
+private:
+	AMFEcmaArray(const AMFEcmaArray &other); // Not implemented
+	AMFEcmaArray &operator=(const AMFEcmaArray &other); // Not implemented
 
 public: // Methods ------------------------------------------------------------
-	void	setAssociativeCount(uint count);
-	uint	getAssociativeCount() const;
+	void				setAssociativeCount(uint count);
+	uint				getAssociativeCount() const;
+
+	virtual AMFType *	clone() const;
 };
 //=============================================================================
 
@@ -266,7 +335,9 @@ public: // Constructor/destructor ---------------------------------------------
 	AMFNull &operator=(const AMFNull &other);
 
 public: // Methods ------------------------------------------------------------
-	virtual QByteArray	serialized() const;
+	virtual QByteArray	serializedAmf0() const;
+	virtual QByteArray	serializedAmf3(AMF3Context *ctx) const;
+	virtual AMFType *	clone() const;
 	virtual QString		debugString(int indent = 0) const;
 };
 //=============================================================================
@@ -280,9 +351,36 @@ public: // Constructor/destructor ---------------------------------------------
 	AMFUndefined &operator=(const AMFUndefined &other);
 
 public: // Methods ------------------------------------------------------------
-	virtual QByteArray	serialized() const;
+	virtual QByteArray	serializedAmf0() const;
+	virtual QByteArray	serializedAmf3(AMF3Context *ctx) const;
+	virtual AMFType *	clone() const;
 	virtual QString		debugString(int indent = 0) const;
 };
 //=============================================================================
 
+//=============================================================================
+/// <summary>
+/// An ordered list of AMF values such as the parameters of an RTMP command.
+/// Takes memory ownership of all values in the list. Copying the list deep
+/// copies every value with `AMFType::clone()` so that it can be passed
+/// through queued signal connections, moving it transfers the values without
+/// copying them. Use `takeAt()` to take ownership of a single value without
+/// copying it.
+/// </summary>
+class LBC_EXPORT AMFTypeList : public QVector<AMFType *>
+{
+public: // Constructor/destructor ---------------------------------------------
+	AMFTypeList();
+	AMFTypeList(const AMFTypeList &other);
+	AMFTypeList(AMFTypeList &&other);
+	AMFTypeList &operator=(const AMFTypeList &other);
+	AMFTypeList &operator=(AMFTypeList &&other);
+	~AMFTypeList();
+
+public: // Methods ------------------------------------------------------------
+	void	deepClear();
+};
+Q_DECLARE_METATYPE(AMFTypeList);
+//=============================================================================
+
 #endif // AMF_H
@@ -0,0 +1,46 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef ANNEXB_H
+#define ANNEXB_H
+
+#include "libbroadcast.h"
+#include <QtCore/QByteArray>
+#include <QtCore/QVector>
+
+// Helpers for H.264 "byte stream format" data as specified in Annex B of ITU-T
+// H.264. Encoders output access units as a sequence of NAL units each prefixed
+// with a 3-byte (0x000001) or 4-byte (0x00000001) start code.
+
+//=============================================================================
+/// <summary>
+/// The location of a single NAL unit within a byte stream buffer excluding its
+/// start code and any trailing zero bytes.
+/// </summary>
+struct AnnexBNalUnit {
+	int	off;
+	int	size;
+};
+typedef QVector<AnnexBNalUnit> AnnexBNalUnitList;
+
+LBC_EXPORT int	annexBFindStartCode(
+	const char *data, int size, int *codeSizeOut = NULL);
+LBC_EXPORT int	annexBSkipStartCode(const char *data, int size);
+LBC_EXPORT int	annexBSplitNalUnits(
+	const char *data, int size, AnnexBNalUnitList *nalsOut);
+
+#endif // ANNEXB_H
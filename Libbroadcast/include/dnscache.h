@@ -0,0 +1,140 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include "libbroadcast.h"
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtNetwork/QHostAddress>
+
+class DNSCache;
+
+//=============================================================================
+/// <summary>
+/// Performs the actual DNS queries for a `DNSCache`. The default resolver
+/// queries the system's DNS servers but tests can install a stub resolver
+/// that answers without touching the network.
+/// </summary>
+class LBC_EXPORT DNSResolver
+{
+public: // Constructor/destructor ---------------------------------------------
+	virtual ~DNSResolver();
+
+public: // Methods ------------------------------------------------------------
+	/// <summary>
+	/// Begins resolving all IPv4 and IPv6 addresses of `host`. The resolver
+	/// must eventually call `DNSCache::addResult()` exactly once, either from
+	/// within this method or later from the event loop. An empty address list
+	/// indicates failure.
+	/// </summary>
+	virtual void	lookup(DNSCache *cache, const QString &host) = 0;
+};
+//=============================================================================
+
+//=============================================================================
+/// <summary>
+/// A thread-safe cache of host name to address mappings that respects the TTL
+/// of the DNS records. Concurrent lookups of the same host are merged into a
+/// single query. A single process-wide instance is shared by every
+/// `RTMPClient`.
+/// </summary>
+class LBC_EXPORT DNSCache : public QObject
+{
+	Q_OBJECT
+
+private: // Datatypes ---------------------------------------------------------
+	struct Entry {
+		QList<QHostAddress>	addrs;
+		qint64				expiry; // In `m_clock` msec
+		bool				pending; // Waiting for the resolver
+	};
+
+protected: // Static members --------------------------------------------------
+	static DNSCache *	s_instance;
+
+private: // Members -----------------------------------------------------------
+	QMutex					m_mutex; // Protects `m_entries`
+	QHash<QString, Entry>	m_entries; // Keys are lowercase
+	QElapsedTimer			m_clock;
+	DNSResolver *			m_resolver;
+	uint					m_maxTtl;
+
+public: // Static methods -----------------------------------------------------
+	static DNSCache *			getSingleton();
+	static void					createSingleton();
+	static QList<QHostAddress>	sortForConnect(
+		const QList<QHostAddress> &addrs);
+
+public: // Constructor/destructor ---------------------------------------------
+	DNSCache(DNSResolver *resolver = NULL);
+	~DNSCache();
+
+public: // Methods ------------------------------------------------------------
+	void			setResolver(DNSResolver *resolver);
+	DNSResolver *	getResolver() const;
+	void			setMaxTtl(uint secs);
+	uint			getMaxTtl() const;
+
+	bool			lookup(const QString &host, QList<QHostAddress> *addrsOut);
+	void			addResult(
+		const QString &host, const QList<QHostAddress> &addrs, uint ttlSecs);
+	void			clear();
+
+Q_SIGNALS: // Signals ---------------------------------------------------------
+	/// <summary>
+	/// Emitted whenever a query that was started by `lookup()` completes.
+	/// `addrs` is empty if the host couldn't be resolved.
+	/// </summary>
+	void			hostResolved(
+		const QString &host, const QList<QHostAddress> &addrs);
+};
+Q_DECLARE_METATYPE(QList<QHostAddress>);
+//=============================================================================
+
+/// <summary>
+/// Returns the process-wide cache. `createSingleton()` must have been called
+/// first which is done by `INIT_LIBBROADCAST()`.
+/// </summary>
+inline DNSCache *DNSCache::getSingleton()
+{
+	return s_instance;
+}
+
+inline DNSResolver *DNSCache::getResolver() const
+{
+	return m_resolver;
+}
+
+/// <summary>
+/// Sets the maximum amount of time in seconds that a result is cached for
+/// regardless of the TTL that the DNS server returned.
+/// </summary>
+inline void DNSCache::setMaxTtl(uint secs)
+{
+	m_maxTtl = secs;
+}
+
+inline uint DNSCache::getMaxTtl() const
+{
+	return m_maxTtl;
+}
+
+#endif // DNSCACHE_H
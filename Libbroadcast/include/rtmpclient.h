@@ -18,18 +18,119 @@
 #ifndef RTMPCLIENT_H
 #define RTMPCLIENT_H
 
+#include "amf.h"
 #include "rtmptargetinfo.h"
+#include "spscqueue.h"
 #include <QtCore/QBuffer>
 #include <QtCore/QDataStream>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QObject>
+#include <QtCore/QQueue>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QSocketNotifier>
 #include <QtNetwork/QTcpSocket>
 
-class AMFObject;
-class AMFType;
+class QTimer;
+class QWinEventNotifier;
 class RTMPClient;
+class RTMPPublisher;
 
-typedef QVector<AMFType *> AMFTypeList;
+/// <summary>
+/// Called once the library no longer references an externally owned buffer
+/// that was passed to `RTMPPublisher::writeExternalVideoFrame()` or
+/// `RTMPPublisher::writeExternalAudioFrame()`. `data` is the pointer that was
+/// originally passed in and `opaque` is the application's context pointer.
+/// </summary>
+typedef void (*RTMPReleaseFunc)(void *opaque, const char *data);
+
+//=============================================================================
+/// <summary>
+/// A thread-safe entry point into an `RTMPPublisher` for a single encoder
+/// thread. Frames are pushed into a lock-free queue that is drained by the
+/// thread that owns the RTMP client, so the push methods never block, never
+/// take a mutex and never touch the network. Each producer may only be used
+/// by one thread at a time; create one producer per encoder. Created via
+/// `RTMPPublisher::createProducer()` and reference counted so that encoder
+/// threads can safely keep using it after the publisher has been deleted.
+/// Once the publisher is gone or `RTMPPublisher::deleteProducer()` has been
+/// called the producer is closed and every push is rejected.
+/// </summary>
+class LBC_EXPORT RTMPProducer
+{
+	friend class RTMPPublisher;
+
+private: // Datatypes ---------------------------------------------------------
+	struct Frame {
+		bool			isVideo;
+		quint32			timestamp;
+		QByteArray		header;
+		QByteArray		data; // Empty for external frames
+		const char *	extData;
+		int				extSize;
+		RTMPReleaseFunc	release;
+		void *			opaque;
+	};
+
+private: // Members -----------------------------------------------------------
+	RTMPPublisher *		m_publisher; // NULL once closed
+	SPSCQueue<Frame>	m_queue;
+	QAtomicInt			m_numRejected; // Frames that didn't fit in the queue
+	QAtomicInt			m_isClosed;
+
+private: // Constructor/destructor ---------------------------------------------
+	RTMPProducer(RTMPPublisher *publisher, int capacity);
+	RTMPProducer(const RTMPProducer &); // Not implemented
+	RTMPProducer &operator=(const RTMPProducer &); // Not implemented
+public:
+	~RTMPProducer();
+
+public: // Methods ------------------------------------------------------------
+	bool			pushVideoFrame(
+		quint32 timestamp, const QByteArray &header,
+		const QByteArray &accessUnit);
+	bool			pushAudioFrame(
+		quint32 timestamp, const QByteArray &header, const QByteArray &data);
+	bool			pushExternalVideoFrame(
+		quint32 timestamp, const QByteArray &header, const char *data,
+		int size, RTMPReleaseFunc release, void *opaque);
+	bool			pushExternalAudioFrame(
+		quint32 timestamp, const QByteArray &header, const char *data,
+		int size, RTMPReleaseFunc release, void *opaque);
+
+	int				getCapacity() const;
+	uint			getRejectedFrameCount() const;
+	bool			isClosed() const;
+
+private:
+	bool			push(const Frame &frame);
+	void			close();
+	void			discardQueuedFrames();
+};
+//=============================================================================
+
+inline int RTMPProducer::getCapacity() const
+{
+	return m_queue.getCapacity();
+}
+
+/// <summary>
+/// Returns the number of frames that were rejected because the queue was
+/// full. Safe to call from any thread.
+/// </summary>
+inline uint RTMPProducer::getRejectedFrameCount() const
+{
+	return (uint)m_numRejected.load();
+}
+
+/// <summary>
+/// Returns true if the producer's publisher has been deleted or the producer
+/// was removed from it. All pushes to a closed producer are rejected. Safe to
+/// call from any thread.
+/// </summary>
+inline bool RTMPProducer::isClosed() const
+{
+	return m_isClosed.load() != 0;
+}
 
 //=============================================================================
 /// <summary>
@@ -41,12 +142,23 @@ typedef QVector<AMFType *> AMFTypeList;
 class LBC_EXPORT RTMPPublisher : public QObject
 {
 	friend class RTMPClient;
+	friend class RTMPClientOutQueueTest;
 	Q_OBJECT
 
 private: // Members -----------------------------------------------------------
 	RTMPClient *	m_client;
 	bool			m_isReady;
 	bool			m_isAvc;
+	bool			m_isAvccPassthrough; // Frames are already length-prefixed
+
+	// Reserved video frame
+	QByteArray		m_reserveBuf;
+	int				m_reserveOff; // Offset of the encoder's span
+	int				m_reserveSize; // -1 if nothing is reserved
+
+	// Multi-threaded ingress
+	QVector<QSharedPointer<RTMPProducer> >	m_producers;
+	QTimer *		m_drainTimer;
 
 private: // Constructor/destructor ---------------------------------------------
 	RTMPPublisher(RTMPClient *client);
@@ -54,6 +166,8 @@ private: // Constructor/destructor ---------------------------------------------
 
 public: // Methods ------------------------------------------------------------
 	bool			isReady() const;
+	void			setAvccPassthrough(bool enabled);
+	bool			isAvccPassthrough() const;
 
 	bool			beginPublishing();
 	bool			finishPublishing();
@@ -62,16 +176,64 @@ public: // Methods ------------------------------------------------------------
 	void			endForceBufferWrite();
 	bool			willWriteBuffer() const;
 	bool			writeDataFrame(AMFObject *data);
+	bool			writeDataFrame(AMFObject &&data);
+	const AMFObject *	getDataFrame() const;
 	bool			writeAvcConfigRecord(
-		const QByteArray &sps, const QByteArray &pps);
+		const QByteArray &sps, const QByteArray &pps,
+		bool framesAreAvcc = false);
 	bool			writeAacSequenceHeader(const QByteArray &oob);
 	bool			writeVideoFrame(
-		quint32 timestamp, const QByteArray &header, QVector<QByteArray> pkts);
+		quint32 timestamp, const QByteArray &header,
+		const QVector<QByteArray> &pkts);
+	bool			writeVideoFrame(
+		quint32 timestamp, const QByteArray &header,
+		const QByteArray &accessUnit);
 	bool			writeAudioFrame(
 		quint32 timestamp, const QByteArray &header, const QByteArray &data);
+	bool			writeExternalVideoFrame(
+		quint32 timestamp, const QByteArray &header, const char *data,
+		int size, RTMPReleaseFunc release, void *opaque);
+	bool			writeExternalAudioFrame(
+		quint32 timestamp, const QByteArray &header, const char *data,
+		int size, RTMPReleaseFunc release, void *opaque);
+
+	void			setFrameDropThresholds(uint maxBytes, uint maxMsecs);
+	uint			getDroppedFrameCount() const;
+	int				cancelQueuedVideoFrames();
+	void			setLatencyBudget(uint msecs);
+	uint			getLatencyBudget() const;
+	uint			getQueueingDelay() const;
+	uint			getAverageQueueingDelay() const;
+	void			setMuxWindow(uint msecs);
+	uint			getMuxWindow() const;
+	uint			getAdjustedTimestampCount() const;
+	void			setBitrateLimits(uint floorKbps, uint ceilingKbps);
+	void			setBitrateHysteresis(uint percent, uint holdMsecs);
+	uint			getRecommendedBitrate() const;
+
+	bool			beginVideoFrame(
+		quint32 timestamp, const QByteArray &header, uint dataSize);
+	bool			appendVideoFrameData(const QByteArray &data);
+	bool			appendVideoFrameNal(const QByteArray &nal);
+	void			abortVideoFrame();
+
+	char *			reserveVideoFrame(int maxSize);
+	bool			commitVideoFrame(
+		quint32 timestamp, const QByteArray &header, int size);
+	void			cancelVideoFrame();
+
+	QSharedPointer<RTMPProducer>	createProducer(int capacity = 64);
+	void			deleteProducer(
+		const QSharedPointer<RTMPProducer> &producer);
+	void			setProducerPollInterval(int msecs);
+	int				getProducerPollInterval() const;
 
 private:
 	void			setReady(bool isReady);
+	bool			queueVideoFrame(
+		quint32 timestamp, const QByteArray &header,
+		const QVector<QByteArray> &pkts, const char *extData,
+		RTMPReleaseFunc release, void *opaque);
 
 Q_SIGNALS: // Signals ---------------------------------------------------------
 	void			ready();
@@ -83,6 +245,25 @@ Q_SIGNALS: // Signals ---------------------------------------------------------
 	/// `numBytes` in size.
 	/// </summary>
 	void			socketDataRequest(uint numBytes);
+
+	/// <summary>
+	/// Emitted when the frame drop engine had to drop reference frames and
+	/// the stream cannot be decoded again until the next keyframe. The
+	/// encoder should generate an IDR frame as soon as possible.
+	/// </summary>
+	void			keyframeRequested();
+
+	/// <summary>
+	/// Emitted when the adaptive bitrate controller recommends that the
+	/// encoder changes its target bitrate to `kbps`. Decreases are emitted as
+	/// soon as the queue starts to build so that frames don't have to be
+	/// dropped while increases are emitted gradually once capacity returns.
+	/// </summary>
+	void			recommendedBitrate(uint kbps);
+
+	private
+Q_SLOTS: // Slots -------------------------------------------------------------
+	void			drainProducers();
 };
 //=============================================================================
 
@@ -91,11 +272,28 @@ inline bool RTMPPublisher::isReady() const
 	return m_isReady;
 }
 
+/// <summary>
+/// Enables or disables AVCC passthrough mode. When enabled all H.264 frames
+/// passed to `writeVideoFrame()` must already be in "AVCSample" layout, i.e.
+/// every NAL unit is prefixed with a 32-bit big-endian length instead of an
+/// Annex B start code, and are transmitted exactly as given.
+/// </summary>
+inline void RTMPPublisher::setAvccPassthrough(bool enabled)
+{
+	m_isAvccPassthrough = enabled;
+}
+
+inline bool RTMPPublisher::isAvccPassthrough() const
+{
+	return m_isAvccPassthrough;
+}
+
 //=============================================================================
 class LBC_EXPORT RTMPClient : public QObject
 {
 	friend class RTMPPublisher;
 	friend class RTMPClientInitializeTest;
+	friend class RTMPClientOutQueueTest;
 	Q_OBJECT
 
 public: // Datatypes ----------------------------------------------------------
@@ -121,13 +319,20 @@ public: // Datatypes ----------------------------------------------------------
 		InvalidWriteError,
 		RtmpConnectRejectedError,
 		RtmpCreateStreamError,
-		RtmpPublishRejectedError
+		RtmpPublishRejectedError,
+		ConnectionStalledError
 	};
 	enum AckLimitType {
 		HardLimitType = 0,
 		SoftLimitType = 1,
 		DynamicLimitType = 2
 	};
+	enum VideoFrameType {
+		NotVideoFrame = 0, // Not droppable
+		KeyVideoFrame, // IDR
+		RefVideoFrame, // Inter frame that other frames may depend on
+		NonRefVideoFrame // Disposable inter frame
+	};
 
 private:
 	enum RTMPMsgType {
@@ -175,17 +380,123 @@ private:
 		QByteArray	msg;
 	};
 
+	/// <summary>
+	/// Calls the application's release callback for an externally owned
+	/// buffer once the last reference to it has been destroyed.
+	/// </summary>
+	class ExternalBuffer {
+	public:
+		ExternalBuffer(
+			const char *data, RTMPReleaseFunc release, void *opaque);
+		~ExternalBuffer();
+	private:
+		ExternalBuffer(const ExternalBuffer &); // Not implemented
+		ExternalBuffer &operator=(const ExternalBuffer &); // Not implemented
+	private:
+		const char *	m_data;
+		RTMPReleaseFunc	m_release;
+		void *			m_opaque;
+	};
+
+	/// <summary>
+	/// A contiguous range of bytes inside of a reference counted buffer.
+	/// Allows us to reference parts of the application's data without copying
+	/// it. If `buf` references external memory then `owner` keeps it alive.
+	/// Only the message's payload segments hold owners so the external memory
+	/// is released as soon as the message is deleted.
+	/// </summary>
+	struct OutSegment {
+		QByteArray	buf;
+		int			off;
+		int			len;
+		QSharedPointer<ExternalBuffer>	owner;
+	};
+	typedef QVector<OutSegment> OutSegmentList;
+
+	/// <summary>
+	/// A single message in the output queue. The chunked "wire" form of the
+	/// message, which interleaves chunk headers with references to the
+	/// payload, is only generated once the message is about to be transmitted
+	/// so that the chunk stream state always matches what the remote host has
+	/// received. Progressively written messages are queued before their entire
+	/// payload is known and their wire form is extended as more of the
+	/// payload is appended.
+	/// </summary>
+	struct OutMessage {
+		bool			isRaw; // Unchunked data such as handshake packets
+		uint			csId;
+		uint			msgStreamId;
+		RTMPMsgType		msgType;
+		quint32			timestamp;
+		uint			msgLen;
+		OutSegmentList	payload;
+		uint			payloadLen; // Less than `msgLen` if still being written
+		VideoFrameType	frameType; // Used by the frame drop engine
+		qint64			enqueueTime; // `m_outClock` time in msec
+
+		// Wire form
+		bool			isGenerated;
+		bool			isAborted; // Terminated with an "Abort Message"
+		QByteArray		headers; // First chunk's header then the "type 3" one
+		int				firstHeaderSize;
+		int				contHeaderSize;
+		uint			chunkSize; // Maximum chunk size when generated
+		OutSegmentList	wire;
+		uint			wireMapped; // Payload bytes that are in `wire`
+		int				mapSegIndex; // Next payload segment to add to `wire`
+		int				mapSegOff;
+		int				wireHeaderBytes; // Chunk header bytes in `wire`
+		int				wireIndex; // Next segment to transmit
+		int				wireOff; // Next byte to transmit in that segment
+
+		// Output state before the wire form was generated so that it can be
+		// reverted if the message is cancelled
+		ChunkStreamState	prevState;
+		uint				prevMaxChunkSize;
+
+		OutMessage();
+		bool			isStarted() const;
+		bool			isComplete() const;
+	};
+
+	// An audio or video message that is waiting in the A/V mux
+	struct MuxEntry {
+		RTMPMsgType		msgType;
+		quint32			timestamp; // Rebased but not clamped
+		OutSegmentList	payload;
+		VideoFrameType	frameType;
+	};
+
+	// A TCP connection attempt that is racing against the others
+	struct ConnectAttempt {
+		qintptr				socket;
+		void *				overlapped; // Win32 `OVERLAPPED`
+		QWinEventNotifier *	notifier;
+	};
+
+	// Statistics of our TCP connection as reported by the OS
+	struct OSTcpInfo {
+		quint64	bytesAcked; // Sent and acknowledged by the remote host
+		uint	bytesInFlight; // Sent but not yet acknowledged
+		uint	rttUs; // Smoothed by the OS
+		uint	minRttUs;
+		uint	cwnd; // Congestion window in bytes
+	};
+
 private: // Static members ----------------------------------------------------
 	static bool		s_inGamerMode;
 	static float	s_gamerTickFreq;
 
 private: // Members -----------------------------------------------------------
 	RTMPTargetInfo		m_remoteInfo;
-	QTcpSocket			m_socket;
+	QTcpSocket *		m_socket;
 	QSocketNotifier *	m_socketWriteNotifier;
 	bool				m_autoInitialize;
 	bool				m_autoAppConnect;
+	bool				m_fastOpenEnabled;
+	bool				m_pipelinedPublish;
 	QString				m_versionString;
+	uint				m_objectEncoding;
 	RTMPPublisher *		m_publisher;
 
 	// Connection state
@@ -204,29 +515,126 @@ private: // Members -----------------------------------------------------------
 	QHash<uint, uint>				m_nextTransactionIds;
 	bool			m_appConnected; // RTMP "connect()" completed
 	uint			m_appConnectTransId;
+	uint			m_appObjectEncoding; // Negotiated AMF version
 	bool			m_creatingStream; // "createStream()"
 	uint			m_createStreamTransId;
 	uint			m_publishStreamId;
 	bool			m_beginningPublish; // "publish()"
+	bool			m_publishRequested; // Waiting to pipeline "publish()"
 	quint32			m_lastPublishTimestamp;
 
 	// Input/output buffers
-	QByteArray		m_outBuf; // Output TCP socket buffer
+	QQueue<OutMessage *>	m_outQueue; // Output TCP socket queue
+	int				m_outQueueBytes; // Unsent bytes in the output queue
+	bool			m_outBlocked; // Waiting for the OS to accept more data
+	QElapsedTimer	m_outClock; // Monotonic clock for queueing delays
+	quint64			m_outTotalBytes; // Accepted by the OS, never reset
+	float			m_outAvgQueueDelay; // Msec, of fully sent media messages
 	int				m_bufferOutBufRef; // Force buffer writes
 	QBuffer			m_writeStreamBuf;
 	QDataStream		m_writeStream;
 	QByteArray		m_inBuf; // Input TCP socket buffer
 
+	// Frame drop engine
+	uint			m_dropMaxQueueBytes; // 0 = Disabled
+	uint			m_dropMaxQueueMsecs; // 0 = Disabled
+	bool			m_dropUntilKeyframe;
+	uint			m_latencyBudget; // Msec, 0 = Disabled
+	uint			m_droppedFrames;
+	OutMessage *	m_progressiveMsg; // Message that is being appended to
+
+	// Adaptive bitrate
+	uint			m_abrFloor; // Kbps
+	uint			m_abrCeiling; // Kbps, 0 = Disabled
+	uint			m_abrHysteresis; // Percent
+	uint			m_abrHoldMsecs; // Before increasing after a change
+	uint			m_abrBitrate; // Last recommendation in kbps
+	qint64			m_abrLastChange; // In `m_outClock` msec
+	int				m_abrLastQueueBytes;
+
+	// A/V mux
+	QList<MuxEntry>	m_muxQueue; // Sorted by timestamp
+	uint			m_muxWindow; // Msec, 0 = Disabled
+	int				m_muxNumVideo; // Video messages in `m_muxQueue`
+	bool			m_muxSeenTracks[2]; // Audio, video
+	quint32			m_muxLastInTimestamps[2]; // Audio, video
+	quint32			m_muxInOffsets[2]; // Audio, video
+	quint32			m_muxLastOutTimestamp;
+	uint			m_muxNumAdjusted; // Rebased or clamped messages
+
+	// Stream cache, persists across connections
+	AMFObject *		m_cacheDataFrame; // Last "@setDataFrame()" data
+	QByteArray		m_cacheVideoHeader; // Last video sequence header
+	QByteArray		m_cacheAudioHeader; // Last audio sequence header
+	bool			m_cacheIsAvc;
+	bool			m_cacheIsAvccPassthrough;
+	QList<MuxEntry>	m_cacheGop; // Media since the last keyframe
+	uint			m_cacheGopBytes;
+	uint			m_cacheGopMaxBytes; // 0 = Disabled
+	bool			m_cacheGopValid; // Begins with a keyframe
+
+	// Connection racing and TCP Fast Open
+	bool					m_resolvingHost; // Waiting for `DNSCache`
+	QList<QHostAddress>		m_connectAddrs; // In order of preference
+	int						m_connectNextAddr;
+	QList<ConnectAttempt>	m_connectAttempts; // In progress
+	QTimer *				m_connectAttemptTimer;
+	QByteArray				m_fastOpenData; // C0+C1 that is sent with the SYN
+	bool					m_fastOpenSentHandshake;
+
+	// Reconnect supervisor
+	bool			m_reconnectEnabled;
+	int				m_reconnectMaxAttempts; // 0 = Unlimited
+	bool			m_reconnecting;
+	int				m_reconnectAttempt;
+	QTimer *		m_reconnectTimer;
+	QHostAddress	m_resolvedAddress; // Of the last successful connection
+	QList<MuxEntry>	m_reconnectHeld; // Unsent media of the lost connection
+
+	// Hot standby
+	RTMPTargetInfo	m_standbyInfo;
+	RTMPClient *	m_standby; // Idle connection to `m_standbyInfo`
+	QTimer *		m_standbyTimer;
+
+	// Stall watchdog
+	uint			m_stallTimeout; // Msec, 0 = Disabled
+	QTimer *		m_stallTimer;
+	qint64			m_stallLastProgress; // In `m_outClock` msec
+	quint64			m_stallLastOutBytes;
+	quint64			m_stallLastAckedBytes;
+
+	// Network estimator
+	QTimer *		m_estTimer;
+	qint64			m_estLastSampleTime; // In `m_outClock` msec, -1 = None
+	quint64			m_estLastBytes; // Acknowledged or accepted by the OS
+	float			m_estBandwidth; // Bytes per second, 0 = Unknown
+	float			m_estRtt; // Smoothed msec, 0 = Unknown
+	float			m_estRttVar; // Msec
+	float			m_estMinRtt; // Msec, 0 = Unknown
+	uint			m_estCwnd; // Bytes, 0 = Unknown
+	quint32			m_estLastAckSeq; // Of the last RTMP acknowledgement
+	qint64			m_estLastAckTime; // In `m_outClock` msec, -1 = None
+	quint64			m_estOutBytesAtAck; // `m_outTotalBytes` at the last ack
+	float			m_estAckRate; // Bytes per second from RTMP acks
+
+	// Client ping
+	uint			m_pingInterval; // Msec, 0 = Disabled
+	QTimer *		m_pingTimer;
+	bool			m_pingSent; // At least one request on this connection
+	float			m_pingRtt; // Smoothed msec, 0 = Unknown
+	uint			m_pingLastRtt; // Msec
+	QVector<uint>	m_pingHistogram; // See `getPingHistogramBounds()`
+
 	// Gamer mode
-	int				m_gamerBytesLeft;
-	QByteArray		m_gamerOutBuf; // Internal output buffer
 	int				m_gamerAvgUploadBytes; // Approx. bytes per second
+	bool			m_gamerAutoUpload; // Use `m_estBandwidth`
 	bool			m_gamerInSatMode; // In saturation mode
 	float			m_gamerSatModeTimer; // Timer for exiting saturation mode
 	float			m_gamerExitSatModeTime; // Time to exit saturation mode
 
 public: // Static methods -----------------------------------------------------
 	static QString	errorToString(RTMPClient::RTMPError error);
+	static QVector<uint>	getPingHistogramBounds();
 
 	static void		gamerModeSetEnabled(bool enabled);
 	static void		gamerSetTickFreq(float freq);
@@ -244,8 +652,15 @@ public: // Methods ------------------------------------------------------------
 	bool			getAutoInitialize() const;
 	void			setAutoConnectToApp(bool autoAppConnect);
 	bool			getAutoConnectToApp() const;
+	void			setFastOpen(bool enabled);
+	bool			getFastOpen() const;
+	void			setPipelinedPublish(bool pipelined);
+	bool			getPipelinedPublish() const;
 	void			setVersionString(const QString &string);
 	QString			getVersionString() const;
+	void			setObjectEncoding(uint amfVer);
+	uint			getObjectEncoding() const;
+	uint			getAppObjectEncoding() const;
 
 	bool			setRemoteTarget(const RTMPTargetInfo &info);
 	bool			setRemoteTarget(const QString &url);
@@ -265,6 +680,42 @@ public: // Methods ------------------------------------------------------------
 	bool			setAckWinSize(uint ackWinSize);
 	bool			setPeerBandwidth(uint ackWinSize, AckLimitType limitType);
 
+	// Stream cache
+	void			setGopCacheLimit(uint maxBytes);
+	uint			getGopCacheLimit() const;
+	void			clearStreamCache();
+
+	// Reconnect supervisor
+	void			setAutoReconnect(bool enabled, int maxAttempts = 0);
+	bool			getAutoReconnect() const;
+	bool			isReconnecting() const;
+
+	// Hot standby
+	void			setStandbyTarget(const RTMPTargetInfo &info);
+	RTMPTargetInfo	getStandbyTarget() const;
+	bool			isStandbyReady() const;
+	bool			failover();
+
+	// Stall watchdog
+	void			setStallTimeout(uint msecs);
+	uint			getStallTimeout() const;
+
+	// Network estimator
+	uint			getEstimatedBandwidth() const;
+	float			getEstimatedRtt() const;
+	float			getEstimatedRttVar() const;
+	float			getMinRtt() const;
+	uint			getCongestionWindow() const;
+	bool			isNetworkCongested() const;
+
+	// Client ping
+	void			setPingInterval(uint msecs);
+	uint			getPingInterval() const;
+	float			getPingRtt() const;
+	uint			getLastPingRtt() const;
+	QVector<uint>	getPingHistogram() const;
+	void			clearPingHistogram();
+
 	// Gamer mode
 	void			gamerSetAverageUpload(int avgUploadBytes);
 	void			gamerSetExitSatModeTime(float exitTime);
@@ -276,8 +727,24 @@ private:
 private:
 	// Generic writing methods
 	bool			write(const QByteArray &data);
-	int				socketWrite(
-		const QByteArray &data, bool emitDataRequest = false);
+	bool			queueMessage(OutMessage *msg);
+	bool			flushIfAllowed();
+	void			generateMsgWire(OutMessage *msg);
+	void			extendMsgWire(OutMessage *msg);
+	int				flushOutQueue(
+		int maxBytes = -1, bool emitDataRequest = false);
+	int				socketWriteGather(const OutSegmentList &segs);
+	void			advanceOutQueue(int numBytes);
+	void			clearOutQueue(bool pushToSocket = false);
+	uint			getOutQueueMediaMsecs() const;
+	bool			isOutQueueCongested() const;
+	bool			dropFramesIfCongested(OutMessage *newMsg);
+	void			dropOutMessage(int index);
+	void			rewindOutQueue();
+	bool			abortPartialOutMessage();
+	int				cancelQueuedVideo();
+	void			dropExpiredMessages();
+	uint			getOutQueueDelay() const;
 	void			beginForceBufferWrite();
 	void			endForceBufferWrite();
 	bool			attemptToEmptyOutBuf(bool emitDataRequest = false);
@@ -293,10 +760,67 @@ private:
 	bool			writeMessage(
 		uint streamId, RTMPMsgType type, quint32 timestamp,
 		const QByteArray &msg, uint chunkStreamId);
+	bool			writeMessage(
+		uint streamId, RTMPMsgType type, quint32 timestamp,
+		const OutSegmentList &payload, uint chunkStreamId,
+		VideoFrameType frameType = NotVideoFrame);
+	bool			beginProgressiveMessage(
+		uint streamId, RTMPMsgType type, quint32 timestamp, uint msgLen,
+		uint chunkStreamId, VideoFrameType frameType = NotVideoFrame);
+	bool			appendProgressiveMessage(const OutSegment &seg);
+	void			abortProgressiveMessage();
 	bool			writeAcknowledge();
+	bool			writePingRequest();
 	bool			writePingResponse(uint timestamp);
 	bool			writeVideoData(uint timestamp, const QByteArray &data);
+	bool			writeVideoData(
+		uint timestamp, const OutSegmentList &data,
+		VideoFrameType frameType = NotVideoFrame);
 	bool			writeAudioData(uint timestamp, const QByteArray &data);
+	bool			writeAudioData(uint timestamp, const OutSegmentList &data);
+
+	// A/V mux
+	bool			muxMediaMessage(
+		RTMPMsgType type, quint32 timestamp, const OutSegmentList &payload,
+		VideoFrameType frameType = NotVideoFrame);
+	bool			releaseMuxMessages(bool releaseAll = false);
+	quint32			clampMuxTimestamp(quint32 timestamp);
+	int				cancelMuxedVideo();
+
+	// Stream cache
+	OutSegmentList	retainableSegments(const OutSegmentList &segs) const;
+	void			cacheMediaMessage(const MuxEntry &entry);
+	void			invalidateGopCache();
+	void			replayStreamCache();
+
+	// Connection racing
+	void			beginConnectAttempts(const QList<QHostAddress> &addrs);
+	void			startNextConnectAttempt();
+	bool			beginConnectAttempt(const QHostAddress &addr);
+	void			abortConnectAttempts();
+	void			fallbackConnect();
+
+	// Reconnect supervisor
+	bool			shouldReconnect() const;
+	void			beginReconnect();
+	void			scheduleReconnect();
+	void			cancelReconnect();
+	void			holdUnsentMedia();
+
+	// Hot standby
+	void			startStandby();
+	void			stopStandby();
+	void			swapConnection(RTMPClient *other);
+
+	// Network estimator
+	void			resetNetworkEstimate();
+	void			processAcknowledgement(quint32 seq);
+
+	// Adaptive bitrate
+	void			updateRecommendedBitrate();
+
+	// Client ping
+	void			processPingResponse(quint32 timestamp);
 
 	// Specific writing methods for AMF 0 commands
 	bool			writeConnectMsg(uint transactionId);
@@ -307,11 +831,17 @@ private:
 
 	// Miscellaneous
 	void			resetStateMembers();
+	void			resetPublishStateMembers();
+	void			attachSocket();
+	void			createSocketWriteNotifier();
+	bool			getOSTcpInfo(OSTcpInfo *info) const;
 	void			processSocketData(QBuffer &buffer);
 	bool			readChunkFromSocket(QBuffer &buffer);
 	void			processMessage(
 		uint streamId, RTMPMsgType type, quint32 timestamp,
 		const QByteArray &msg);
+	bool			decodeAmfMessage(
+		const QByteArray &msg, int off, AMFTypeList *params);
 	bool			initInChunkStreamState(int id);
 	bool			initOutChunkStreamState(int id);
 
@@ -322,10 +852,44 @@ Q_SIGNALS: // Signals ---------------------------------------------------------
 	void			connectedToApp(); // "connect()" command complete
 	void			createdStream(uint streamId);
 	void			disconnected();
+
+	/// <summary>
+	/// Emitted when the connection of a publishing client was lost and the
+	/// reconnect supervisor is about to make the specified attempt. The
+	/// publisher remains valid but is not ready until `reconnected()`.
+	/// </summary>
+	void			reconnecting(int attempt);
+	void			reconnected();
+
+	/// <summary>
+	/// Emitted when the primary connection was replaced by the hot standby
+	/// connection. The publisher is not ready until `reconnected()`.
+	/// </summary>
+	void			failedOver();
 	void			error(RTMPClient::RTMPError error);
 	void			dataWritten(const QByteArray &data);
+
+	/// <summary>
+	/// Emitted whenever an AMF command or data message is received. The
+	/// parameters are deleted once the message has been processed so
+	/// directly connected listeners must copy the list or clone individual
+	/// values to keep them.
+	/// </summary>
 	void			receivedAmfCommandMsg(
 		uint streamId, const AMFTypeList &params);
+	void			receivedAmfDataMsg(
+		uint streamId, const AMFTypeList &params);
+
+	/// <summary>
+	/// Emitted immediately after `receivedAmfCommandMsg()` and
+	/// `receivedAmfDataMsg()` respectively so that a listener can take
+	/// ownership of the parameters without copying them, either by moving
+	/// the entire list or with `params->takeAt()`. Only a single listener
+	/// should take anything and it must be directly connected. Everything
+	/// that remains is deleted once the signal returns.
+	/// </summary>
+	void			adoptAmfCommandMsg(uint streamId, AMFTypeList *params);
+	void			adoptAmfDataMsg(uint streamId, AMFTypeList *params);
 
 	private
 Q_SLOTS: // Slots -------------------------------------------------------------
@@ -335,6 +899,18 @@ Q_SLOTS: // Slots -------------------------------------------------------------
 	void			socketDataReady();
 	void			socketReadyForWrite();
 	void			socketRemoteDisconnectTimeout();
+	void			reconnectTimeout();
+	void			hostResolved(
+		const QString &host, const QList<QHostAddress> &addrs);
+	void			connectAttemptTimeout();
+	void			connectAttemptFinished();
+	void			standbyConnectedToApp();
+	void			standbyCreatedStream(uint streamId);
+	void			standbyDisconnected();
+	void			standbyTimeout();
+	void			stallWatchdogTimeout();
+	void			estimatorTimeout();
+	void			pingTimeout();
 };
 //=============================================================================
 
@@ -383,6 +959,41 @@ inline bool RTMPClient::getAutoConnectToApp() const
 	return m_autoAppConnect;
 }
 
+/// <summary>
+/// Enables or disables TCP Fast Open. When enabled and the client initializes
+/// automatically, C0 and C1 are sent in the TCP SYN which saves a round
+/// trip. The OS caches the Fast Open cookie of every server. If the server or
+/// OS doesn't support Fast Open the data is sent after the TCP handshake as
+/// usual. Takes effect on the next connection attempt.
+/// </summary>
+inline void RTMPClient::setFastOpen(bool enabled)
+{
+	m_fastOpenEnabled = enabled;
+}
+
+inline bool RTMPClient::getFastOpen() const
+{
+	return m_fastOpenEnabled;
+}
+
+/// <summary>
+/// Enables or disables optimistic publish startup. When enabled and the
+/// application has called `RTMPPublisher::beginPublishing()` before the
+/// RTMP "connect()" command is sent then "createStream()" and "publish()"
+/// are sent in the same burst as "connect()" instead of waiting for each
+/// result. We assume that the server will assign the conventional stream ID
+/// of 1 and fall back to publishing on the real stream ID if it doesn't.
+/// </summary>
+inline void RTMPClient::setPipelinedPublish(bool pipelined)
+{
+	m_pipelinedPublish = pipelined;
+}
+
+inline bool RTMPClient::getPipelinedPublish() const
+{
+	return m_pipelinedPublish;
+}
+
 inline void RTMPClient::setVersionString(const QString &string)
 {
 	m_versionString = string;
@@ -393,6 +1004,124 @@ inline QString RTMPClient::getVersionString() const
 	return m_versionString;
 }
 
+/// <summary>
+/// Sets the AMF version that we request when connecting to the application.
+/// Only AMF 0 (The default) and AMF 3 are valid. Takes effect on the next
+/// "connect()".
+/// </summary>
+inline void RTMPClient::setObjectEncoding(uint amfVer)
+{
+	m_objectEncoding = (amfVer == 3) ? 3 : 0;
+}
+
+inline uint RTMPClient::getObjectEncoding() const
+{
+	return m_objectEncoding;
+}
+
+/// <summary>
+/// Returns the AMF version that was negotiated with the server during
+/// "connect()". The server is allowed to downgrade our request to AMF 0.
+/// </summary>
+inline uint RTMPClient::getAppObjectEncoding() const
+{
+	return m_appObjectEncoding;
+}
+
+inline uint RTMPClient::getGopCacheLimit() const
+{
+	return m_cacheGopMaxBytes;
+}
+
+inline bool RTMPClient::getAutoReconnect() const
+{
+	return m_reconnectEnabled;
+}
+
+inline bool RTMPClient::isReconnecting() const
+{
+	return m_reconnecting;
+}
+
+/// <summary>
+/// Returns the target of the hot standby connection. After a failover this
+/// is the previous primary target.
+/// </summary>
+inline RTMPTargetInfo RTMPClient::getStandbyTarget() const
+{
+	return m_standbyInfo;
+}
+
+inline uint RTMPClient::getStallTimeout() const
+{
+	return m_stallTimeout;
+}
+
+/// <summary>
+/// Returns the estimated bandwidth of the connection in bytes per second or 0
+/// if it is unknown.
+/// </summary>
+inline uint RTMPClient::getEstimatedBandwidth() const
+{
+	return (uint)m_estBandwidth;
+}
+
+/// <summary>
+/// Returns the smoothed round-trip time of the connection in msec or 0 if it
+/// is unknown.
+/// </summary>
+inline float RTMPClient::getEstimatedRtt() const
+{
+	return m_estRtt;
+}
+
+inline float RTMPClient::getEstimatedRttVar() const
+{
+	return m_estRttVar;
+}
+
+/// <summary>
+/// Returns the lowest round-trip time that the OS has seen on the connection
+/// in msec or 0 if it is unknown.
+/// </summary>
+inline float RTMPClient::getMinRtt() const
+{
+	return m_estMinRtt;
+}
+
+inline uint RTMPClient::getCongestionWindow() const
+{
+	return m_estCwnd;
+}
+
+inline uint RTMPClient::getPingInterval() const
+{
+	return m_pingInterval;
+}
+
+/// <summary>
+/// Returns the smoothed application-level round-trip time in msec that was
+/// measured with client pings or 0 if it is unknown.
+/// </summary>
+inline float RTMPClient::getPingRtt() const
+{
+	return m_pingRtt;
+}
+
+inline uint RTMPClient::getLastPingRtt() const
+{
+	return m_pingLastRtt;
+}
+
+/// <summary>
+/// Returns the number of ping RTT samples in each of the buckets that are
+/// described by `getPingHistogramBounds()`.
+/// </summary>
+inline QVector<uint> RTMPClient::getPingHistogram() const
+{
+	return m_pingHistogram;
+}
+
 inline uint RTMPClient::getNextTransactionId(uint streamId)
 {
 	if(m_nextTransactionIds.contains(streamId))
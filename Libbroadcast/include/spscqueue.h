@@ -0,0 +1,176 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <QtCore/QAtomicInt>
+#include <utility>
+
+// Assumed size of a CPU cache line. The producer and consumer indices are kept
+// on separate lines so that the two threads don't fight over ownership.
+#define LBC_CACHE_LINE_SIZE 64
+
+//=============================================================================
+/// <summary>
+/// A fixed capacity, lock-free, single producer single consumer FIFO queue.
+/// Exactly one thread may call `push()` and exactly one other thread may call
+/// `peek()` and `pop()` at any given time. Neither side ever blocks or
+/// allocates memory after construction; `push()` simply fails when the queue
+/// is full.
+///
+/// Items are assigned into preallocated slots so `T` must be default
+/// constructible and assignable. Popped slots are reset to `T()` by the
+/// consumer so that any resources they reference are released on the
+/// consumer's thread.
+/// </summary>
+template<typename T>
+class SPSCQueue
+{
+private: // Members -----------------------------------------------------------
+	T *			m_slots;
+	int			m_mask; // Number of slots minus one, always a power of two
+
+	char		m_pad0[LBC_CACHE_LINE_SIZE];
+	QAtomicInt	m_head; // Next slot to pop, only written by the consumer
+	char		m_pad1[LBC_CACHE_LINE_SIZE - sizeof(QAtomicInt)];
+	QAtomicInt	m_tail; // Next slot to push, only written by the producer
+	char		m_pad2[LBC_CACHE_LINE_SIZE - sizeof(QAtomicInt)];
+
+public: // Constructor/destructor ---------------------------------------------
+	SPSCQueue(int capacity);
+	~SPSCQueue();
+
+private:
+	SPSCQueue(const SPSCQueue &); // Not implemented
+	SPSCQueue &operator=(const SPSCQueue &); // Not implemented
+
+public: // Methods ------------------------------------------------------------
+	int			getCapacity() const;
+
+	// Producer thread
+	bool		push(const T &item);
+
+	// Consumer thread
+	bool		isEmpty() const;
+	int			getCount() const;
+	T *			peek();
+	bool		pop(T *itemOut = NULL);
+};
+//=============================================================================
+
+/// <summary>
+/// Creates a queue that can hold at least `capacity` items. The capacity is
+/// rounded up so that one empty slot plus the requested items fill a power of
+/// two.
+/// </summary>
+template<typename T>
+SPSCQueue<T>::SPSCQueue(int capacity)
+	: m_slots(NULL)
+	, m_mask(0)
+	, m_head(0)
+	, m_tail(0)
+{
+	int size = 2;
+	while(size < capacity + 1)
+		size <<= 1;
+	m_slots = new T[size];
+	m_mask = size - 1;
+}
+
+template<typename T>
+SPSCQueue<T>::~SPSCQueue()
+{
+	delete[] m_slots;
+}
+
+template<typename T>
+int SPSCQueue<T>::getCapacity() const
+{
+	return m_mask; // One slot is always kept empty
+}
+
+/// <summary>
+/// Appends a copy of `item` to the end of the queue. Must only be called from
+/// the producer thread.
+/// </summary>
+/// <returns>False if the queue is full</returns>
+template<typename T>
+bool SPSCQueue<T>::push(const T &item)
+{
+	int tail = m_tail.load(); // We are the only writer
+	int next = (tail + 1) & m_mask;
+	if(next == m_head.loadAcquire())
+		return false; // Full
+	m_slots[tail] = item;
+	m_tail.storeRelease(next); // Publish the slot to the consumer
+	return true;
+}
+
+/// <summary>
+/// Must only be called from the consumer thread.
+/// </summary>
+template<typename T>
+bool SPSCQueue<T>::isEmpty() const
+{
+	return m_head.load() == m_tail.loadAcquire();
+}
+
+/// <summary>
+/// Returns the number of items that are currently available to the consumer.
+/// The producer may add more at any time. Must only be called from the
+/// consumer thread.
+/// </summary>
+template<typename T>
+int SPSCQueue<T>::getCount() const
+{
+	return (m_tail.loadAcquire() - m_head.load()) & m_mask;
+}
+
+/// <summary>
+/// Returns the item at the front of the queue without removing it. Must only
+/// be called from the consumer thread.
+/// </summary>
+/// <returns>NULL if the queue is empty</returns>
+template<typename T>
+T *SPSCQueue<T>::peek()
+{
+	int head = m_head.load(); // We are the only writer
+	if(head == m_tail.loadAcquire())
+		return NULL; // Empty
+	return &m_slots[head];
+}
+
+/// <summary>
+/// Removes the item at the front of the queue and optionally moves it into
+/// `itemOut`. Must only be called from the consumer thread.
+/// </summary>
+/// <returns>False if the queue is empty</returns>
+template<typename T>
+bool SPSCQueue<T>::pop(T *itemOut)
+{
+	int head = m_head.load(); // We are the only writer
+	if(head == m_tail.loadAcquire())
+		return false; // Empty
+	if(itemOut != NULL)
+		*itemOut = std::move(m_slots[head]);
+	m_slots[head] = T();
+	m_head.storeRelease((head + 1) & m_mask); // Hand the slot back
+	return true;
+}
+
+#endif // SPSCQUEUE_H
@@ -16,6 +16,7 @@
 //*****************************************************************************
 
 #include "include/libbroadcast.h"
+#include "include/dnscache.h"
 #include "include/rtmpclient.h"
 #include <iostream>
 #ifdef Q_OS_WIN
@@ -101,6 +102,11 @@ bool initLibbroadcast_internal(
 
 	// Register our signal datatypes with Qt
 	qRegisterMetaType<RTMPClient::RTMPError>();
+	qRegisterMetaType<AMFTypeList>();
+	qRegisterMetaType<QList<QHostAddress> >();
+
+	// Shared by all clients
+	DNSCache::createSingleton();
 
 	return true;
 }
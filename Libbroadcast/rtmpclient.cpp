@@ -16,13 +16,50 @@
 //*****************************************************************************
 
 #include "include/rtmpclient.h"
+#include "byteorder.h"
 #include "include/amf.h"
+#include "include/annexb.h"
 #include "include/brolog.h"
+#include "include/dnscache.h"
 #include "include/libbroadcast.h"
 #include <QtCore/QDateTime>
 #include <QtCore/QTimer>
 #ifdef Q_OS_WIN
+#include <QtCore/QWinEventNotifier>
 #include <WinSock2.h>
+#include <MSWSock.h>
+#include <WS2tcpip.h>
+
+// Only defined by Windows 10 SDKs and later
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 15
+#endif
+
+// Only defined by Windows 10 version 1703 SDKs and later
+#ifndef SIO_TCP_INFO
+#define SIO_TCP_INFO _WSAIORW(IOC_VENDOR, 39)
+typedef struct _TCP_INFO_v0 {
+	ULONG	State; // `TCPSTATE`
+	ULONG	Mss;
+	ULONG64	ConnectionTimeMs;
+	BOOLEAN	TimestampsEnabled;
+	ULONG	RttUs;
+	ULONG	MinRttUs;
+	ULONG	BytesInFlight;
+	ULONG	Cwnd;
+	ULONG	SndWnd;
+	ULONG	RcvWnd;
+	ULONG	RcvBuf;
+	ULONG64	BytesOut;
+	ULONG64	BytesIn;
+	ULONG	BytesReordered;
+	ULONG	BytesRetrans;
+	ULONG	FastRetrans;
+	ULONG	DupAcksIn;
+	ULONG	TimeoutEpisodes;
+	UCHAR	SynRetrans;
+} TCP_INFO_v0;
+#endif
 #endif
 
 const QString LOG_CAT = QStringLiteral("RTMP");
@@ -43,6 +80,109 @@ static QString numberToHexString(quint64 num)
 	return QStringLiteral("0x") + QString::number(num, 16).toUpper();
 }
 
+/// <summary>
+/// Returns a copy of `data` that owns its memory. Byte arrays that were
+/// created with `QByteArray::fromRawData()` have no allocation of their own
+/// and are deep copied so that they can safely be referenced after the
+/// caller has returned, all other byte arrays are implicitly shared.
+/// </summary>
+static QByteArray ownedByteArray(const QByteArray &data)
+{
+	if(data.isEmpty() || const_cast<QByteArray &>(data).data_ptr()->alloc)
+		return data;
+	return QByteArray(data.constData(), data.size());
+}
+
+/// <summary>
+/// Fills `data` with pseudo-random bytes using a xorshift64* generator that
+/// is seeded from `qrand()` and the current time. This is many times faster
+/// than calling `qrand()` per byte and is only intended for data that does
+/// not need to be unpredictable such as handshake padding.
+/// </summary>
+static void fillRandomBytes(char *data, int size)
+{
+	quint64 state = ((quint64)qrand() << 32) ^ (quint64)qrand() ^
+		(quint64)QDateTime::currentMSecsSinceEpoch();
+	if(state == 0)
+		state = Q_UINT64_C(0x9E3779B97F4A7C15); // Must be non-zero
+	int i = 0;
+	for(; i + 8 <= size; i += 8) {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		quint64 val = state * Q_UINT64_C(0x2545F4914F6CDD1D);
+		memcpy(&data[i], &val, 8);
+	}
+	if(i < size) {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		quint64 val = state * Q_UINT64_C(0x2545F4914F6CDD1D);
+		memcpy(&data[i], &val, size - i);
+	}
+}
+
+/// <summary>
+/// Determines the frame type from the "FrameType" field of an FLV
+/// "VideoTagHeader" structure.
+/// </summary>
+static RTMPClient::VideoFrameType flvVideoFrameType(const QByteArray &header)
+{
+	if(header.isEmpty())
+		return RTMPClient::RefVideoFrame;
+	switch(((uchar)header.at(0) >> 4) & 0x0F) {
+	case 1: // Keyframe
+		return RTMPClient::KeyVideoFrame;
+	case 3: // Disposable inter frame
+		return RTMPClient::NonRefVideoFrame;
+	default:
+		return RTMPClient::RefVideoFrame;
+	}
+}
+
+/// <summary>
+/// Refines a frame type with the information in an H.264 NAL unit header
+/// byte. An IDR slice makes the frame a keyframe and a non-IDR slice with a
+/// "nal_ref_idc" of zero means that no other frame references it.
+/// </summary>
+static RTMPClient::VideoFrameType avcVideoFrameType(
+	RTMPClient::VideoFrameType type, uchar nalHeader)
+{
+	switch(nalHeader & 0x1F) { // "nal_unit_type"
+	case 5: // IDR slice
+		return RTMPClient::KeyVideoFrame;
+	case 1: // Non-IDR slice
+		if(type == RTMPClient::KeyVideoFrame)
+			return type;
+		if(((nalHeader >> 5) & 0x03) == 0) // "nal_ref_idc"
+			return RTMPClient::NonRefVideoFrame;
+		return RTMPClient::RefVideoFrame;
+	default:
+		return type;
+	}
+}
+
+/// <summary>
+/// Finds the first slice in data that is in "AVCSample" layout and uses it to
+/// refine the frame type.
+/// </summary>
+static RTMPClient::VideoFrameType avccVideoFrameType(
+	RTMPClient::VideoFrameType type, const char *data, int size)
+{
+	int off = 0;
+	while(off + 4 < size) {
+		uint nalSize = decodeBEUInt32(&data[off]);
+		uchar nalHeader = (uchar)data[off + 4];
+		uint nalType = nalHeader & 0x1F;
+		if(nalType == 1 || nalType == 5)
+			return avcVideoFrameType(type, nalHeader);
+		if(nalSize > (uint)(size - off - 4))
+			break; // Corrupt
+		off += 4 + nalSize;
+	}
+	return type;
+}
+
 QString getSocketErrorString(QAbstractSocket::SocketError error)
 {
 	switch(error) {
@@ -104,41 +244,6 @@ quint32 getCurrentTime32()
 	return QDateTime::currentMSecsSinceEpoch() % UINT_MAX;
 }
 
-/// <summary>
-/// QDataStream doesn't support 24-bit integers.
-/// </summary>
-void writeUInt24(QDataStream *stream, uint val)
-{
-	char data[3];
-	amfEncodeUInt24(data, val);
-	stream->writeRawData(data, 3);
-}
-
-/// <summary>
-/// Writes a 32-bit little-endian unsigned integer to the specified
-/// QDataStream. The only little-endian field in all of RTMP is the message
-/// stream ID of a chunk type 0 header.
-/// </summary>
-void writeLEUInt32(QDataStream *stream, uint val)
-{
-	QDataStream::ByteOrder order = stream->byteOrder();
-	stream->setByteOrder(QDataStream::LittleEndian);
-	*stream << (quint32)val;
-	stream->setByteOrder(order);
-}
-
-/// <summary>
-/// Decodes a little-endian 32-bit unsigned integer. The only little-endian
-/// field in all of RTMP is the message stream ID of a chunk type 0 header.
-/// </summary>
-uint decodeLEUInt32(const char *data)
-{
-#if Q_BYTE_ORDER != Q_LITTLE_ENDIAN
-#error Unsupported byte order
-#endif
-	return (uint)(*((quint32 *)data));
-}
-
 //=============================================================================
 // RTMP Notes
 /*
@@ -196,19 +301,156 @@ therefore if the client receives a "_result()" then it assumes that it is also
 a "StreamBegin" message if one hasn't already been received.
 
 */
+//=============================================================================
+// RTMPProducer class
+
+RTMPProducer::RTMPProducer(RTMPPublisher *publisher, int capacity)
+	: m_publisher(publisher)
+	, m_queue(capacity)
+	, m_numRejected(0)
+	, m_isClosed(0)
+{
+}
+
+RTMPProducer::~RTMPProducer()
+{
+	// Release any external buffers that were pushed after the producer was
+	// closed. As this is the last reference no thread is using it anymore.
+	discardQueuedFrames();
+}
+
+bool RTMPProducer::push(const Frame &frame)
+{
+	if(m_isClosed.load() == 0 && m_queue.push(frame))
+		return true;
+	m_numRejected.fetchAndAddOrdered(1);
+	return false;
+}
+
+/// <summary>
+/// Detaches the producer from its publisher and discards every frame that
+/// hasn't been drained yet. Called on the RTMP client's thread which is the
+/// only consumer of the queue.
+/// </summary>
+void RTMPProducer::close()
+{
+	m_isClosed.fetchAndStoreOrdered(1);
+	m_publisher = NULL;
+	discardQueuedFrames();
+}
+
+/// <summary>
+/// Pops every queued frame and releases any external buffers. Must only be
+/// called by the queue's consumer.
+/// </summary>
+void RTMPProducer::discardQueuedFrames()
+{
+	Frame frame;
+	while(m_queue.pop(&frame)) {
+		if(frame.release != NULL)
+			frame.release(frame.opaque, frame.extData);
+	}
+}
+
+/// <summary>
+/// Queues a video frame for `RTMPPublisher::writeVideoFrame()`. Safe to call
+/// from the producer's thread while the RTMP client is running on another.
+/// The frame data is referenced, not copied, and is released on the RTMP
+/// client's thread.
+/// </summary>
+/// <returns>False if the queue is full and the frame was discarded</returns>
+bool RTMPProducer::pushVideoFrame(
+	quint32 timestamp, const QByteArray &header,
+	const QByteArray &accessUnit)
+{
+	Frame frame = {
+		true, timestamp, header, accessUnit, NULL, 0, NULL, NULL };
+	return push(frame);
+}
+
+/// <summary>
+/// Queues an audio frame for `RTMPPublisher::writeAudioFrame()`. See
+/// `pushVideoFrame()` for details.
+/// </summary>
+/// <returns>False if the queue is full and the frame was discarded</returns>
+bool RTMPProducer::pushAudioFrame(
+	quint32 timestamp, const QByteArray &header, const QByteArray &data)
+{
+	Frame frame = {
+		false, timestamp, header, data, NULL, 0, NULL, NULL };
+	return push(frame);
+}
+
+/// <summary>
+/// Queues an externally owned video frame for
+/// `RTMPPublisher::writeExternalVideoFrame()`. `release` is always called on
+/// the RTMP client's thread if the frame was accepted unless the producer was
+/// closed while the frame was being pushed in which case it's called when the
+/// last reference to the producer is released. If the queue is full or the
+/// producer is closed `release` is NOT called and the application keeps
+/// ownership of the buffer.
+/// </summary>
+/// <returns>False if the queue is full and the frame was discarded</returns>
+bool RTMPProducer::pushExternalVideoFrame(
+	quint32 timestamp, const QByteArray &header, const char *data, int size,
+	RTMPReleaseFunc release, void *opaque)
+{
+	Frame frame = {
+		true, timestamp, header, QByteArray(), data, size, release, opaque };
+	return push(frame);
+}
+
+/// <summary>
+/// Queues an externally owned audio frame for
+/// `RTMPPublisher::writeExternalAudioFrame()`. See `pushExternalVideoFrame()`
+/// for details on when `release` is called.
+/// </summary>
+/// <returns>False if the queue is full and the frame was discarded</returns>
+bool RTMPProducer::pushExternalAudioFrame(
+	quint32 timestamp, const QByteArray &header, const char *data, int size,
+	RTMPReleaseFunc release, void *opaque)
+{
+	Frame frame = {
+		false, timestamp, header, QByteArray(), data, size, release, opaque };
+	return push(frame);
+}
+
 //=============================================================================
 // RTMPPublisher class
 
+// How often the RTMP client's thread checks the producer queues. Producers
+// cannot wake us up themselves as posting an event takes a mutex.
+const int DEFAULT_PRODUCER_POLL_MSECS = 2;
+
+// Maximum number of producer frames to write per poll so that a runaway
+// producer cannot starve the event loop
+const int MAX_PRODUCER_FRAMES_PER_POLL = 256;
+
 RTMPPublisher::RTMPPublisher(RTMPClient *client)
 	: QObject()
 	, m_client(client)
 	, m_isReady(false)
 	, m_isAvc(false)
+	, m_isAvccPassthrough(false)
+	, m_reserveBuf()
+	, m_reserveOff(0)
+	, m_reserveSize(-1)
+	, m_producers()
+	, m_drainTimer(NULL)
 {
+	m_drainTimer = new QTimer(this);
+	m_drainTimer->setTimerType(Qt::PreciseTimer);
+	m_drainTimer->setInterval(DEFAULT_PRODUCER_POLL_MSECS);
+	QObject::connect(m_drainTimer, &QTimer::timeout,
+		this, &RTMPPublisher::drainProducers);
 }
 
 RTMPPublisher::~RTMPPublisher()
 {
+	// Encoder threads may still hold references to our producers
+	for(int i = 0; i < m_producers.size(); i++)
+		m_producers.at(i)->close();
+	m_producers.clear();
 }
 
 void RTMPPublisher::setReady(bool isReady)
@@ -217,6 +459,7 @@ void RTMPPublisher::setReady(bool isReady)
 		return; // No change
 	m_isReady = isReady;
 	if(isReady) {
+		m_client->replayStreamCache();
 		emit ready();
 		// TODO: Emit data request?
 	}
@@ -225,11 +468,19 @@ void RTMPPublisher::setReady(bool isReady)
 /// <summary>
 /// Begins the creation of the publishing stream. The application should
 /// connect to the `ready()` and `socketDataRequest()` signals before calling
-/// this method.
+/// this method. If pipelined publishing is enabled on the client then this
+/// may be called before connecting, see `RTMPClient::setPipelinedPublish()`.
 /// </summary>
 /// <returns>True if the stream creation process has begun</returns>
 bool RTMPPublisher::beginPublishing()
 {
+	// If pipelining is enabled and we haven't connected to the application
+	// yet then the stream is created along with the application connection
+	if(m_client->m_pipelinedPublish && !m_client->m_appConnected) {
+		m_client->m_publishRequested = true;
+		return true;
+	}
+
 	// TODO: Prevent multiple calls
 	return m_client->writeCreateStreamMsg();
 }
@@ -238,6 +489,7 @@ bool RTMPPublisher::finishPublishing()
 {
 	if(!m_isReady)
 		return false;
+	m_client->releaseMuxMessages(true);
 	return m_client->writeDeleteStreamMsg(0); // Autodetect stream ID
 }
 
@@ -271,14 +523,39 @@ bool RTMPPublisher::willWriteBuffer() const
 
 /// <summary>
 /// Writes the "@setDataFrame" message to the output buffer. This should be
-/// called before any video or audio frames are written.
+/// called before any video or audio frames are written. The application
+/// retains ownership of `data`.
 /// </summary>
 /// <returns>True if the message was added to the output buffer</returns>
 bool RTMPPublisher::writeDataFrame(AMFObject *data)
 {
 	if(!m_isReady)
 		return false;
-	return m_client->writeSetDataFrameMsg(data);
+	return m_client->writeSetDataFrameMsg(
+		static_cast<AMFObject *>(data->clone()));
+}
+
+/// <summary>
+/// Identical to `writeDataFrame(AMFObject *)` except that the publisher takes
+/// ownership of the data without copying it. The data remains accessible
+/// through `getDataFrame()`.
+/// </summary>
+/// <returns>True if the message was added to the output buffer</returns>
+bool RTMPPublisher::writeDataFrame(AMFObject &&data)
+{
+	if(!m_isReady)
+		return false;
+	return m_client->writeSetDataFrameMsg(
+		new AMFObject(static_cast<AMFObject &&>(data)));
+}
+
+/// <summary>
+/// Returns the last "@setDataFrame" data that was written or NULL if none
+/// has been written since the stream cache was last cleared.
+/// </summary>
+const AMFObject *RTMPPublisher::getDataFrame() const
+{
+	return m_client->m_cacheDataFrame;
 }
 
 /// <summary>
@@ -286,16 +563,24 @@ bool RTMPPublisher::writeDataFrame(AMFObject *data)
 /// of ISO 14496-15:2004 to the output buffer. This should be written before
 /// any H.264 video frames are written otherwise some decoders such as Flash
 /// will not be able to parse the video stream.
+///
+/// If `framesAreAvcc` is true then the encoder outputs frames that are already
+/// in "AVCSample" layout with 32-bit lengths and AVCC passthrough mode is
+/// enabled, see `setAvccPassthrough()`.
 /// </summary>
 /// <returns>True if the record has added to the output buffer</returns>
 bool RTMPPublisher::writeAvcConfigRecord(
-	const QByteArray &sps, const QByteArray &pps)
+	const QByteArray &sps, const QByteArray &pps, bool framesAreAvcc)
 {
 	if(!m_isReady)
 		return false;
 	if(sps.isEmpty() || pps.isEmpty())
 		return false;
 	m_isAvc = true;
+	if(framesAreAvcc)
+		m_isAvccPassthrough = true;
+	m_client->m_cacheIsAvc = m_isAvc;
+	m_client->m_cacheIsAvccPassthrough = m_isAvccPassthrough;
 
 	// Create FLV "VideoTagHeader" structure
 	char header[5];
@@ -306,19 +591,9 @@ bool RTMPPublisher::writeAvcConfigRecord(
 	header[4] = 0x00;
 	QByteArray headerBuf = QByteArray::fromRawData(header, sizeof(header));
 
-	// Find start of SPS NAL unit (Removes 0x00000001 if it exists)
-	int spsOff = 0;
-	while(spsOff < sps.size() - 1 && sps[spsOff] == 0)
-		spsOff++;
-	if(spsOff > 0 && sps[spsOff] == 0x01)
-		spsOff++;
-
-	// Find start of PPS NAL unit (Removes 0x00000001 if it exists)
-	int ppsOff = 0;
-	while(ppsOff < pps.size() - 1 && pps[ppsOff] == 0)
-		ppsOff++;
-	if(ppsOff > 0 && pps[ppsOff] == 0x01)
-		ppsOff++;
+	// Find start of SPS and PPS NAL units (Removes 0x00000001 if it exists)
+	int spsOff = annexBSkipStartCode(sps.constData(), sps.size());
+	int ppsOff = annexBSkipStartCode(pps.constData(), pps.size());
 
 	//-------------------------------------------------------------------------
 	// Write record
@@ -339,13 +614,13 @@ bool RTMPPublisher::writeAvcConfigRecord(
 	// Write SPS to record including the H.264 "nal_unit" header byte
 	data += (char)(0xE0 | 1); // "numOfSequenceParameterSets" with reserved bits set
 	data += QByteArray(2, 0x00); // Reserve space for encode
-	amfEncodeUInt16(&(data.data()[data.size()-2]), sps.size() - spsOff);
+	encodeBEUInt16(&(data.data()[data.size()-2]), sps.size() - spsOff);
 	data += sps.right(sps.size() - spsOff);
 
 	// Write PPS to record including the H.264 "nal_unit" header byte
 	data += 1; // "numOfPictureParameterSets"
 	data += QByteArray(2, 0x00); // Reserve space for encode
-	amfEncodeUInt16(&(data.data()[data.size()-2]), pps.size() - ppsOff);
+	encodeBEUInt16(&(data.data()[data.size()-2]), pps.size() - ppsOff);
 	data += pps.right(pps.size() - ppsOff);
 
 	return m_client->writeVideoData(0, headerBuf + data);
@@ -373,7 +648,11 @@ bool RTMPPublisher::writeAacSequenceHeader(const QByteArray &oob)
 ///
 /// This method will automatically wrap H.264 in a valid "AVCSample" structure
 /// as specified in section 5.3.4.2 of ISO 14496-15:2004. All NAL units must be
-/// grouped as specified by section 5.2.2 of the same specification.
+/// grouped as specified by section 5.2.2 of the same specification. Each
+/// packet may contain either a single NAL unit or several NAL units in Annex B
+/// byte stream format, i.e. an entire access unit. If AVCC passthrough mode
+/// is enabled then the packets must already be in "AVCSample" layout and are
+/// transmitted without being scanned or modified.
 ///
 /// When the FLV specification refers to a "composition time offset" it means
 /// the difference between the PTS and DTS in milliseconds, i.e.
@@ -382,189 +661,1022 @@ bool RTMPPublisher::writeAacSequenceHeader(const QByteArray &oob)
 /// ISO 14496-12:2008. The FLV specifications mention section 8.15.3 of the
 /// second (2005) edition which has since been moved to section 8.6.1.3 in the
 /// third (2008) edition.
+///
+/// The packet data is implicitly shared with the output queue and is not
+/// copied. Packets that were created with `QByteArray::fromRawData()` do not
+/// own their memory and are deep copied before this method returns so that
+/// the caller is free to reuse the underlying buffer immediately. Use
+/// `writeExternalVideoFrame()` to transmit application-owned memory without
+/// copying it.
 /// </summary>
 /// <returns>True if the video frame was added to the output buffer</returns>
 bool RTMPPublisher::writeVideoFrame(
-	quint32 timestamp, const QByteArray &header, QVector<QByteArray> pkts)
+	quint32 timestamp, const QByteArray &header,
+	const QVector<QByteArray> &pkts)
 {
-	if(!m_isReady)
-		return false;
-	QByteArray frameData;
-	if(m_isAvc) {
-		// Wrap H.264 in a "AVCSample" structure
-
-		frameData = header;
+	QVector<QByteArray> ownedPkts;
+	ownedPkts.reserve(pkts.size());
+	for(int i = 0; i < pkts.size(); i++)
+		ownedPkts.append(ownedByteArray(pkts.at(i)));
+	return queueVideoFrame(
+		timestamp, ownedByteArray(header), ownedPkts, NULL, NULL, NULL);
+}
 
-		// Allocate memory all at once (Guessing maximum size)
-		int dataSize = frameData.size();
-		for(int i = 0; i < pkts.size(); i++)
-			dataSize += pkts.at(i).size() + 4;
-		frameData.reserve(dataSize);
+/// <summary>
+/// Implementation of all the `writeVideoFrame()` variants. If `release` is
+/// not NULL then it is called with `extData` once the frame has been
+/// transmitted or dropped.
+/// </summary>
+bool RTMPPublisher::queueVideoFrame(
+	quint32 timestamp, const QByteArray &header,
+	const QVector<QByteArray> &pkts, const char *extData,
+	RTMPReleaseFunc release, void *opaque)
+{
+	// Create the owner first so that the external buffer is always released
+	QSharedPointer<RTMPClient::ExternalBuffer> owner;
+	if(release != NULL) {
+		owner = QSharedPointer<RTMPClient::ExternalBuffer>(
+			new RTMPClient::ExternalBuffer(extData, release, opaque));
+	}
 
+	if(!m_isReady)
+		return false;
+	RTMPClient::VideoFrameType frameType = flvVideoFrameType(header);
+	RTMPClient::OutSegmentList segs;
+	if(m_isAvc && !m_isAvccPassthrough) {
+		// Split every packet into its individual NAL units in a single pass
+		AnnexBNalUnitList nals;
+		QVector<int> pktNalEnds;
+		nals.reserve(pkts.size());
+		pktNalEnds.reserve(pkts.size());
 		for(int i = 0; i < pkts.size(); i++) {
 			const QByteArray &data = pkts.at(i);
+			annexBSplitNalUnits(data.constData(), data.size(), &nals);
+			pktNalEnds.append(nals.size());
+		}
 
-			// Find start of NAL unit (Removes 0x00000001 if it exists)
-			int off = 0;
-			while(off < data.size() - 1 && data[off] == 0)
-				off++;
-			if(off > 0 && data[off] == 0x01)
-				off++;
-
-			// Convert data to a raw NAL unit
-			QByteArray nal = data.right(data.size() - off);
+		// Wrap H.264 in a "AVCSample" structure. The FLV tag header and all
+		// the 32-bit NAL unit length fields are stored in a single small
+		// buffer and the NAL units themselves are referenced in place.
+		QByteArray prefixes(header.size() + nals.size() * 4, 0);
+		char *ptr = prefixes.data();
+		memcpy(ptr, header.constData(), header.size());
+		ptr += header.size();
+		RTMPClient::OutSegment seg = { prefixes, 0, header.size() };
+		segs.reserve(nals.size() * 2 + 1);
+		segs.append(seg);
+
+		int pkt = 0;
+		for(int i = 0; i < nals.size(); i++) {
+			while(i >= pktNalEnds.at(pkt))
+				pkt++;
+			const AnnexBNalUnit &nal = nals.at(i);
 
 			// Generate "AVCSample" header which is just a 32-bit length field
-			char sample[4];
-			amfEncodeUInt32(sample, nal.size());
-			QByteArray sampleBuf =
-				QByteArray::fromRawData(sample, sizeof(sample));
-
-			// Append to frame data
-			frameData += sampleBuf + nal;
+			RTMPClient::OutSegment lenSeg =
+				{ prefixes, (int)(ptr - prefixes.constData()), 4 };
+			ptr = encodeBEUInt32(ptr, nal.size);
+			segs.append(lenSeg);
+
+			// Reference the raw NAL unit
+			const QByteArray &pktData = pkts.at(pkt);
+			RTMPClient::OutSegment nalSeg = { pktData, nal.off, nal.size };
+			segs.append(nalSeg);
+			frameType = avcVideoFrameType(
+				frameType, (uchar)pktData.at(nal.off));
 		}
 	} else {
-		frameData = header;
-
-		// Allocate memory all at once
-		int dataSize = frameData.size();
-		for(int i = 0; i < pkts.size(); i++)
-			dataSize += pkts.at(i).size();
-		frameData.reserve(dataSize);
-
-		for(int i = 0; i < pkts.size(); i++)
-			frameData += pkts.at(i);
+		// Non-H.264 video or H.264 that is already in AVCC layout. Both are
+		// transmitted as-is.
+		segs.reserve(pkts.size() + 1);
+		RTMPClient::OutSegment seg = { header, 0, header.size() };
+		segs.append(seg);
+		for(int i = 0; i < pkts.size(); i++) {
+			RTMPClient::OutSegment pktSeg = { pkts.at(i), 0, pkts.at(i).size() };
+			segs.append(pktSeg);
+		}
+		if(m_isAvc && !pkts.isEmpty()) {
+			frameType = avccVideoFrameType(
+				frameType, pkts.at(0).constData(), pkts.at(0).size());
+		}
 	}
-	return m_client->writeVideoData(timestamp, frameData);
+	segs[0].owner = owner;
+	return m_client->writeVideoData(timestamp, segs, frameType);
 }
 
 /// <summary>
-/// Writes a single audio frame to the output buffer. RTMP requires all frames
-/// to be prefixed with the FLV "AudioTagHeader" structure which can be found
-/// in section E.4.2.1 of the FLV and F4V specifications (v10.1).
+/// Writes a single video frame that is contained in a single buffer. For H.264
+/// video `accessUnit` is an entire access unit in Annex B byte stream format
+/// as output by most encoders. See the other `writeVideoFrame()` for details.
 /// </summary>
-/// <returns>True if the audio frame was added to the output buffer</returns>
-bool RTMPPublisher::writeAudioFrame(
-	quint32 timestamp, const QByteArray &header, const QByteArray &data)
+/// <returns>True if the video frame was added to the output buffer</returns>
+bool RTMPPublisher::writeVideoFrame(
+	quint32 timestamp, const QByteArray &header, const QByteArray &accessUnit)
+{
+	QVector<QByteArray> pkts;
+	pkts.append(accessUnit);
+	return writeVideoFrame(timestamp, header, pkts);
+}
+
+/// <summary>
+/// Begins writing a video frame progressively so that it can be transmitted
+/// while the encoder is still producing it. `dataSize` is the exact amount of
+/// bytes that will follow the FLV "VideoTagHeader" and must include the 4
+/// byte length field of every NAL unit that is appended with
+/// `appendVideoFrameNal()`. Every chunk of the frame is transmitted as soon as
+/// it is complete. Nothing else is transmitted until the entire frame has
+/// been appended so the frame should be completed or aborted with
+/// `abortVideoFrame()` quickly.
+/// </summary>
+/// <returns>True if the video frame was added to the output buffer</returns>
+bool RTMPPublisher::beginVideoFrame(
+	quint32 timestamp, const QByteArray &header, uint dataSize)
 {
 	if(!m_isReady)
 		return false;
-	return m_client->writeAudioData(timestamp, header + data);
+	m_client->releaseMuxMessages(true);
+	timestamp = m_client->clampMuxTimestamp(timestamp);
+	if(flvVideoFrameType(header) != RTMPClient::NonRefVideoFrame)
+		m_client->invalidateGopCache(); // Can't cache partial frames
+	if(!m_client->beginProgressiveMessage(
+		m_client->m_publishStreamId, RTMPClient::VideoMsgType, timestamp,
+		header.size() + dataSize, 4, flvVideoFrameType(header)))
+	{
+		return false;
+	}
+	if(timestamp > m_client->m_lastPublishTimestamp)
+		m_client->m_lastPublishTimestamp = timestamp;
+	RTMPClient::OutSegment seg = { header, 0, header.size() };
+	return m_client->appendProgressiveMessage(seg);
 }
 
-//=============================================================================
-// RTMPClient class
-
-bool RTMPClient::s_inGamerMode = false;
-float RTMPClient::s_gamerTickFreq = 1.0f;
+/// <summary>
+/// Appends data to the video frame that was begun with `beginVideoFrame()`
+/// exactly as-is. For H.264 the data must already be in "AVCSample" layout.
+/// </summary>
+/// <returns>False if the frame was dropped or too much data was appended
+/// </returns>
+bool RTMPPublisher::appendVideoFrameData(const QByteArray &data)
+{
+	RTMPClient::OutSegment seg = { data, 0, data.size() };
+	return m_client->appendProgressiveMessage(seg);
+}
 
-QString RTMPClient::errorToString(RTMPClient::RTMPError error)
+/// <summary>
+/// Appends a single H.264 NAL unit to the video frame that was begun with
+/// `beginVideoFrame()` prefixed with its 32-bit "AVCSample" length. Any Annex
+/// B start code is removed first. The NAL unit is referenced and not copied.
+/// </summary>
+/// <returns>False if the frame was dropped or too much data was appended
+/// </returns>
+bool RTMPPublisher::appendVideoFrameNal(const QByteArray &nal)
 {
-	switch(error) {
-	case RTMPClient::UnknownError:
-		return QStringLiteral("Unknown error");
-	case RTMPClient::ConnectionRefusedError:
-		return QStringLiteral("Connection refused");
-	case RTMPClient::RemoteHostClosedError:
-		return QStringLiteral("Remote host closed connection");
-	case RTMPClient::HostNotFoundError:
-		return QStringLiteral("Host address not found");
-	case RTMPClient::TimeoutError:
-		return QStringLiteral("Timed out");
-	case RTMPClient::NetworkError:
-		return QStringLiteral("Network error");
-	case RTMPClient::SslHandshakeFailedError:
-		return QStringLiteral("SSL/TLS handshake failed");
-	case RTMPClient::UnexpectedResponseError:
-		return QStringLiteral("Unexpected response");
-	case RTMPClient::InvalidWriteError:
-		return QStringLiteral("Invalid write");
-	case RTMPClient::RtmpConnectRejectedError:
-		return QStringLiteral("RTMP application connection rejected");
-	case RTMPClient::RtmpCreateStreamError:
-		return QStringLiteral("RTMP stream creation failed");
-	case RTMPClient::RtmpPublishRejectedError:
-		return QStringLiteral("Server rejected publish");
-	default:
-		return numberToHexString((uint)error);
+	RTMPClient::OutMessage *msg = m_client->m_progressiveMsg;
+	if(msg == NULL)
+		return false;
+	int off = annexBSkipStartCode(nal.constData(), nal.size());
+	int nalSize = nal.size() - off;
+	if((uint)(4 + nalSize) > msg->msgLen - msg->payloadLen) {
+		abortVideoFrame();
+		return false; // Frame size was declared incorrectly
 	}
+	if(nalSize > 0) {
+		msg->frameType = avcVideoFrameType(
+			msg->frameType, (uchar)nal.at(off));
+	}
+
+	QByteArray prefix(4, 0);
+	encodeBEUInt32(prefix.data(), nalSize);
+	RTMPClient::OutSegment prefixSeg = { prefix, 0, 4 };
+	RTMPClient::OutSegment nalSeg = { nal, off, nalSize };
+	if(!m_client->appendProgressiveMessage(prefixSeg))
+		return false;
+	return m_client->appendProgressiveMessage(nalSeg);
 }
 
 /// <summary>
-/// Used to enable or disable "gamer mode" which reduces network interference
-/// at the expense of increased maintenance and slightly slower responsiveness
-/// to network congestion. Gamer mode is disabled by default. This setting must
-/// only be changed when there are no active clients. If the OS output buffer
-/// fills then gamer mode is temporarily disabled automatically as it can't
-/// handle congestion properly and will have no effect anyway on a saturated
-/// network.
+/// Stops writing the video frame that was begun with `beginVideoFrame()`. If
+/// part of the frame has already been transmitted then it is terminated with
+/// an RTMP "Abort Message". If other frames may depend on it then
+/// `keyframeRequested()` is emitted and video is dropped until the next
+/// keyframe.
 /// </summary>
-void RTMPClient::gamerModeSetEnabled(bool enabled)
+void RTMPPublisher::abortVideoFrame()
 {
-	s_inGamerMode = enabled;
+	m_client->abortProgressiveMessage();
 }
 
 /// <summary>
-/// Used to change the expected frequency of `gamerTickEvent()` calls. If the
-/// method isn't called that many times per second (Or if all dropped ticks are
-/// not accounted for) then the behaviour is undefined. This setting must only
-/// be changed when there are no active clients.
+/// Configures the frame drop engine. Whenever a video frame is written and the
+/// output queue contains more than `maxBytes` bytes or more than `maxMsecs`
+/// milliseconds of media then queued video frames are dropped, non-reference
+/// frames first followed by the remainder of the GOP. A value of zero
+/// disables that threshold. Both are disabled by default. When the engine
+/// drops reference frames it emits `keyframeRequested()` and all following
+/// video frames are rejected until the next keyframe is written. Audio is
+/// never dropped.
 /// </summary>
-void RTMPClient::gamerSetTickFreq(float freq)
+void RTMPPublisher::setFrameDropThresholds(uint maxBytes, uint maxMsecs)
 {
-	s_gamerTickFreq = freq;
+	m_client->m_dropMaxQueueBytes = maxBytes;
+	m_client->m_dropMaxQueueMsecs = maxMsecs;
 }
 
-RTMPClient::RTMPClient()
-	: QObject()
-	, m_remoteInfo()
-	, m_socket(this)
-	, m_socketWriteNotifier(NULL)
-	, m_autoInitialize(true)
-	, m_autoAppConnect(true)
-	, m_versionString(QStringLiteral("FMLE/3.0 (compatible; FMSc/1.0)"))
-	, m_publisher(NULL)
-
-	// Connection state
-	, m_handshakeState(DisconnectedState)
-	, m_handshakeRandomData()
-	// All other members are initialized in `resetStateMembers()`
-
-	// Input/output buffers
-	, m_outBuf()
-	, m_bufferOutBufRef(0)
-	, m_writeStreamBuf(this)
-	, m_writeStream()
-	, m_inBuf()
+/// <summary>
+/// Returns the total number of video frames that the frame drop engine has
+/// dropped since the stream was created.
+/// </summary>
+uint RTMPPublisher::getDroppedFrameCount() const
+{
+	return m_client->m_droppedFrames;
+}
 
-	// Gamer mode
-	, m_gamerOutBuf()
-	, m_gamerAvgUploadBytes(100 * 1024 * 1024) // 100 MB/s
-	, m_gamerInSatMode(false)
-	, m_gamerSatModeTimer(0.0f)
-	, m_gamerExitSatModeTime(10.0f)
+/// <summary>
+/// Cancels all video frames that are waiting in the output queue including
+/// any frame that is partially transmitted. Used when the application knows
+/// that the queued frames are stale. Emits `keyframeRequested()` and drops all
+/// following video frames until a keyframe is written.
+/// </summary>
+/// <returns>The number of frames that were cancelled</returns>
+int RTMPPublisher::cancelQueuedVideoFrames()
 {
-	resetStateMembers();
+	return m_client->cancelQueuedVideo();
+}
 
-	// Connect socket signals
-	void (QAbstractSocket:: *fpseAS)(QAbstractSocket::SocketError) =
-		&QAbstractSocket::error;
-	QObject::connect(&m_socket, &QAbstractSocket::connected,
-		this, &RTMPClient::socketConnected);
-	QObject::connect(&m_socket, &QAbstractSocket::disconnected,
-		this, &RTMPClient::socketDisconnected);
-	QObject::connect(&m_socket, fpseAS,
-		this, &RTMPClient::socketError);
-	QObject::connect(&m_socket, &QIODevice::readyRead,
-		this, &RTMPClient::socketDataReady);
+/// <summary>
+/// Sets the maximum amount of time in milliseconds that an audio or video
+/// frame may wait in the output queue. Frames that haven't begun transmission
+/// before their deadline passes are dropped when the queue is next flushed.
+/// Video drops respect GOP dependencies and emit `keyframeRequested()` when a
+/// reference frame had to be dropped. A value of zero disables the budget
+/// which is the default.
+/// </summary>
+void RTMPPublisher::setLatencyBudget(uint msecs)
+{
+	m_client->m_latencyBudget = msecs;
 }
 
-void RTMPClient::resetStateMembers()
+uint RTMPPublisher::getLatencyBudget() const
 {
-	if(m_publisher != NULL) {
-		delete m_publisher;
-		m_publisher = NULL;
+	return m_client->m_latencyBudget;
+}
+
+/// <summary>
+/// Returns how long in milliseconds the oldest audio or video frame in the
+/// output queue has been waiting to be transmitted. Zero if the queue has no
+/// media in it.
+/// </summary>
+uint RTMPPublisher::getQueueingDelay() const
+{
+	return m_client->getOutQueueDelay();
+}
+
+/// <summary>
+/// Returns the smoothed time in milliseconds between when audio and video
+/// frames were written and when their last byte was handed to the OS.
+/// </summary>
+uint RTMPPublisher::getAverageQueueingDelay() const
+{
+	return (uint)(m_client->m_outAvgQueueDelay + 0.5f);
+}
+
+/// <summary>
+/// Sets how long in milliseconds of media time the A/V mux may hold an audio
+/// or video frame while it waits for the other track to catch up. This
+/// allows audio and video to be written by independent pipelines that run
+/// slightly out of step without their timestamps going back in time on the
+/// wire. A window of zero (The default) writes frames immediately and only
+/// rebases or clamps out of order timestamps. Frames written with
+/// `beginVideoFrame()` bypass the window.
+/// </summary>
+void RTMPPublisher::setMuxWindow(uint msecs)
+{
+	m_client->m_muxWindow = msecs;
+	if(msecs == 0)
+		m_client->releaseMuxMessages(true);
+}
+
+uint RTMPPublisher::getMuxWindow() const
+{
+	return m_client->m_muxWindow;
+}
+
+/// <summary>
+/// Returns the number of audio and video frames whose timestamps had to be
+/// rebased or clamped by the A/V mux because they went back in time.
+/// </summary>
+uint RTMPPublisher::getAdjustedTimestampCount() const
+{
+	return m_client->m_muxNumAdjusted;
+}
+
+/// <summary>
+/// Enables the adaptive bitrate controller which emits
+/// `recommendedBitrate()` with a value between `floorKbps` and `ceilingKbps`.
+/// The recommendation is based on the measured delivery rate of the network,
+/// the growth of the output queue and how quickly the server acknowledges our
+/// data. The encoder is assumed to start at `ceilingKbps`. A ceiling of zero
+/// disables the controller which is the default.
+/// </summary>
+void RTMPPublisher::setBitrateLimits(uint floorKbps, uint ceilingKbps)
+{
+	m_client->m_abrFloor = qMin(floorKbps, ceilingKbps);
+	m_client->m_abrCeiling = ceilingKbps;
+	if(ceilingKbps == 0)
+		m_client->m_abrBitrate = 0;
+	else if(m_client->m_abrBitrate == 0)
+		m_client->m_abrBitrate = ceilingKbps;
+	else {
+		m_client->m_abrBitrate = qBound(
+			m_client->m_abrFloor, m_client->m_abrBitrate, ceilingKbps);
+	}
+}
+
+/// <summary>
+/// Sets the minimum change in percent that is worth recommending and how long
+/// in milliseconds the network must be stable before the bitrate is
+/// increased again. Defaults to 10% and 5 seconds.
+/// </summary>
+void RTMPPublisher::setBitrateHysteresis(uint percent, uint holdMsecs)
+{
+	m_client->m_abrHysteresis = percent;
+	m_client->m_abrHoldMsecs = holdMsecs;
+}
+
+/// <summary>
+/// Returns the bitrate in kbps that was last recommended or 0 if the
+/// adaptive bitrate controller is disabled.
+/// </summary>
+uint RTMPPublisher::getRecommendedBitrate() const
+{
+	return m_client->m_abrBitrate;
+}
+
+/// <summary>
+/// Reserves a writable span of `maxSize` bytes that the video encoder can
+/// write a single frame's bitstream directly into. The span is located inside
+/// the message buffer that is queued for transmission after room for the FLV
+/// "VideoTagHeader" and, for H.264 that isn't in AVCC passthrough mode, the
+/// 32-bit "AVCSample" length field. In that case the span may contain either
+/// a single raw NAL unit without a start code, which is transmitted entirely
+/// in place, or an access unit in Annex B byte stream format, in which case
+/// the NAL units are still referenced in place but their length fields are
+/// stored in a separate small buffer.
+///
+/// Once the frame has been written call `commitVideoFrame()` with its final
+/// size or `cancelVideoFrame()` to discard it. Only one frame can be reserved
+/// at a time and the returned pointer is invalid after either call.
+/// </summary>
+/// <returns>A pointer to the start of the span or NULL on error</returns>
+char *RTMPPublisher::reserveVideoFrame(int maxSize)
+{
+	if(!m_isReady)
+		return NULL;
+	if(m_reserveSize >= 0 || maxSize < 0)
+		return NULL; // Already reserved or invalid size
+
+	// Leave room for the largest possible "VideoTagHeader" (AVC = 5 bytes)
+	m_reserveOff = 5;
+	if(m_isAvc && !m_isAvccPassthrough)
+		m_reserveOff += 4;
+	m_reserveSize = maxSize;
+
+	// The previous buffer can be reused once the output queue has released it
+	// which is usually the case unless the network is congested
+	int bufSize = m_reserveOff + maxSize;
+	if(!m_reserveBuf.isDetached() || m_reserveBuf.size() < bufSize)
+		m_reserveBuf = QByteArray(bufSize, Qt::Uninitialized);
+	return m_reserveBuf.data() + m_reserveOff;
+}
+
+/// <summary>
+/// Writes the video frame that was previously reserved with
+/// `reserveVideoFrame()` to the output buffer. `size` is the amount of bytes
+/// that the encoder actually wrote to the span. The frame's "VideoTagHeader"
+/// and "AVCSample" length field are written in front of the span and the
+/// message is queued without copying it. If the span contains more than one
+/// NAL unit then every unit receives its own length field.
+/// </summary>
+/// <returns>True if the video frame was added to the output buffer</returns>
+bool RTMPPublisher::commitVideoFrame(
+	quint32 timestamp, const QByteArray &header, int size)
+{
+	if(m_reserveSize < 0)
+		return false; // Nothing reserved
+	int maxSize = m_reserveSize;
+	m_reserveSize = -1;
+	if(!m_isReady)
+		return false;
+	if(size < 0 || size > maxSize)
+		return false;
+	if(header.size() > 5)
+		return false; // Doesn't fit in the reserved space
+
+	// Write the prefixes backwards from the start of the span
+	char *data = m_reserveBuf.data();
+	int off = m_reserveOff;
+	RTMPClient::VideoFrameType frameType = flvVideoFrameType(header);
+	if(m_reserveOff > 5) { // Reserved room for an "AVCSample" length
+		// A single raw NAL unit is split into exactly itself, anything else
+		// is a byte stream that needs a length field per NAL unit
+		AnnexBNalUnitList nals;
+		annexBSplitNalUnits(&data[m_reserveOff], size, &nals);
+		if(nals.size() > 1 ||
+			(nals.size() == 1 && nals.at(0).size != size))
+		{
+			// The FLV tag header and all the 32-bit NAL unit length fields
+			// are stored in a single small buffer and the NAL units
+			// themselves are referenced in place
+			QByteArray prefixes(header.size() + nals.size() * 4, 0);
+			char *ptr = prefixes.data();
+			memcpy(ptr, header.constData(), header.size());
+			ptr += header.size();
+			RTMPClient::OutSegmentList segs;
+			RTMPClient::OutSegment seg = { prefixes, 0, header.size() };
+			segs.reserve(nals.size() * 2 + 1);
+			segs.append(seg);
+			for(int i = 0; i < nals.size(); i++) {
+				const AnnexBNalUnit &nal = nals.at(i);
+				RTMPClient::OutSegment lenSeg =
+					{ prefixes, (int)(ptr - prefixes.constData()), 4 };
+				ptr = encodeBEUInt32(ptr, nal.size);
+				segs.append(lenSeg);
+
+				// NAL unit offsets are relative to the start of the span
+				RTMPClient::OutSegment nalSeg =
+					{ m_reserveBuf, m_reserveOff + nal.off, nal.size };
+				segs.append(nalSeg);
+				frameType = avcVideoFrameType(
+					frameType, (uchar)data[m_reserveOff + nal.off]);
+			}
+			return m_client->writeVideoData(timestamp, segs, frameType);
+		}
+		off -= 4;
+		encodeBEUInt32(&data[off], size);
+		if(size > 0) {
+			frameType = avcVideoFrameType(
+				frameType, (uchar)data[m_reserveOff]);
+		}
+	} else if(m_isAvc) {
+		frameType = avccVideoFrameType(frameType, &data[m_reserveOff], size);
+	}
+	off -= header.size();
+	memcpy(&data[off], header.constData(), header.size());
+
+	RTMPClient::OutSegmentList segs;
+	RTMPClient::OutSegment seg =
+		{ m_reserveBuf, off, m_reserveOff + size - off };
+	segs.append(seg);
+	return m_client->writeVideoData(timestamp, segs, frameType);
+}
+
+/// <summary>
+/// Discards the video frame that was previously reserved with
+/// `reserveVideoFrame()`.
+/// </summary>
+void RTMPPublisher::cancelVideoFrame()
+{
+	m_reserveSize = -1;
+}
+
+/// <summary>
+/// Writes a single audio frame to the output buffer. RTMP requires all frames
+/// to be prefixed with the FLV "AudioTagHeader" structure which can be found
+/// in section E.4.2.1 of the FLV and F4V specifications (v10.1).
+/// </summary>
+/// <returns>True if the audio frame was added to the output buffer</returns>
+bool RTMPPublisher::writeAudioFrame(
+	quint32 timestamp, const QByteArray &header, const QByteArray &data)
+{
+	if(!m_isReady)
+		return false;
+	// Byte arrays that don't own their memory must be copied as the data is
+	// referenced until it has been transmitted
+	RTMPClient::OutSegmentList segs;
+	RTMPClient::OutSegment headerSeg =
+		{ ownedByteArray(header), 0, header.size() };
+	RTMPClient::OutSegment dataSeg = { ownedByteArray(data), 0, data.size() };
+	segs.append(headerSeg);
+	segs.append(dataSeg);
+	return m_client->writeAudioData(timestamp, segs);
+}
+
+/// <summary>
+/// Writes a single video frame that is stored in memory that is owned by the
+/// application without copying it. The library references the memory until
+/// the last byte of the frame has been handed to the OS or the frame has been
+/// dropped at which point `release` is called, if it's not NULL, so that the
+/// application can reuse the buffer. `release` is called from the thread
+/// that owns the RTMP client and is called before this method returns if the
+/// frame could not be queued. See `writeVideoFrame()` for the format of the
+/// data.
+/// </summary>
+/// <returns>True if the video frame was added to the output buffer</returns>
+bool RTMPPublisher::writeExternalVideoFrame(
+	quint32 timestamp, const QByteArray &header, const char *data, int size,
+	RTMPReleaseFunc release, void *opaque)
+{
+	QVector<QByteArray> pkts;
+	pkts.append(QByteArray::fromRawData(data, size));
+	return queueVideoFrame(
+		timestamp, ownedByteArray(header), pkts, data, release, opaque);
+}
+
+/// <summary>
+/// Writes a single audio frame that is stored in memory that is owned by the
+/// application without copying it. See `writeExternalVideoFrame()` for
+/// details on when `release` is called.
+/// </summary>
+/// <returns>True if the audio frame was added to the output buffer</returns>
+bool RTMPPublisher::writeExternalAudioFrame(
+	quint32 timestamp, const QByteArray &header, const char *data, int size,
+	RTMPReleaseFunc release, void *opaque)
+{
+	// Create the owner first so that the external buffer is always released
+	QSharedPointer<RTMPClient::ExternalBuffer> owner;
+	if(release != NULL) {
+		owner = QSharedPointer<RTMPClient::ExternalBuffer>(
+			new RTMPClient::ExternalBuffer(data, release, opaque));
+	}
+
+	if(!m_isReady)
+		return false;
+	RTMPClient::OutSegmentList segs;
+	RTMPClient::OutSegment headerSeg =
+		{ ownedByteArray(header), 0, header.size() };
+	RTMPClient::OutSegment dataSeg =
+		{ QByteArray::fromRawData(data, size), 0, size, owner };
+	segs.append(headerSeg);
+	segs.append(dataSeg);
+	return m_client->writeAudioData(timestamp, segs);
+}
+
+/// <summary>
+/// Creates a new thread-safe ingress queue that can hold up to `capacity`
+/// frames. Frames from all producers are written in timestamp order by the
+/// thread that owns the RTMP client. The returned producer is closed when the
+/// publisher is deleted but remains valid for as long as the application
+/// holds a reference to it.
+/// </summary>
+QSharedPointer<RTMPProducer> RTMPPublisher::createProducer(int capacity)
+{
+	QSharedPointer<RTMPProducer> producer(
+		new RTMPProducer(this, qMax(capacity, 1)));
+	m_producers.append(producer);
+	if(!m_drainTimer->isActive())
+		m_drainTimer->start();
+	return producer;
+}
+
+/// <summary>
+/// Closes and removes a producer that was created with `createProducer()`.
+/// Frames that are still queued are discarded and all future pushes are
+/// rejected. The object itself is deleted once the application releases its
+/// last reference.
+/// </summary>
+void RTMPPublisher::deleteProducer(
+	const QSharedPointer<RTMPProducer> &producer)
+{
+	int index = m_producers.indexOf(producer);
+	if(index < 0)
+		return;
+	m_producers.remove(index);
+	producer->close();
+	if(m_producers.isEmpty())
+		m_drainTimer->stop();
+}
+
+void RTMPPublisher::setProducerPollInterval(int msecs)
+{
+	m_drainTimer->setInterval(qMax(msecs, 1));
+}
+
+int RTMPPublisher::getProducerPollInterval() const
+{
+	return m_drainTimer->interval();
+}
+
+/// <summary>
+/// Moves every frame that is currently waiting in the producer queues to the
+/// output queue. When multiple producers have frames waiting the one with the
+/// lowest timestamp is always written first so that audio and video are
+/// interleaved on the wire.
+/// </summary>
+void RTMPPublisher::drainProducers()
+{
+	RTMPProducer::Frame frame;
+	for(int n = 0; n < MAX_PRODUCER_FRAMES_PER_POLL; n++) {
+		// Find the producer with the oldest frame at the front of its queue
+		RTMPProducer *oldest = NULL;
+		quint32 oldestTimestamp = 0;
+		for(int i = 0; i < m_producers.size(); i++) {
+			RTMPProducer *producer = m_producers.at(i).data();
+			RTMPProducer::Frame *head = producer->m_queue.peek();
+			if(head == NULL)
+				continue;
+			if(oldest == NULL || head->timestamp < oldestTimestamp) {
+				oldest = producer;
+				oldestTimestamp = head->timestamp;
+			}
+		}
+		if(oldest == NULL)
+			return; // All queues are empty
+		oldest->m_queue.pop(&frame);
+
+		// Write the frame. External buffers are released by the write
+		// methods even on failure.
+		if(frame.extData != NULL) {
+			if(frame.isVideo) {
+				writeExternalVideoFrame(
+					frame.timestamp, frame.header, frame.extData,
+					frame.extSize, frame.release, frame.opaque);
+			} else {
+				writeExternalAudioFrame(
+					frame.timestamp, frame.header, frame.extData,
+					frame.extSize, frame.release, frame.opaque);
+			}
+		} else if(frame.isVideo)
+			writeVideoFrame(frame.timestamp, frame.header, frame.data);
+		else
+			writeAudioFrame(frame.timestamp, frame.header, frame.data);
+	}
+}
+
+//=============================================================================
+// RTMPClient::ExternalBuffer class
+
+RTMPClient::ExternalBuffer::ExternalBuffer(
+	const char *data, RTMPReleaseFunc release, void *opaque)
+	: m_data(data)
+	, m_release(release)
+	, m_opaque(opaque)
+{
+}
+
+RTMPClient::ExternalBuffer::~ExternalBuffer()
+{
+	if(m_release != NULL)
+		m_release(m_opaque, m_data);
+}
+
+//=============================================================================
+// RTMPClient::OutMessage struct
+
+RTMPClient::OutMessage::OutMessage()
+	: isRaw(false)
+	, csId(0)
+	, msgStreamId(0)
+	, msgType(NullMsgType)
+	, timestamp(0)
+	, msgLen(0)
+	, payload()
+	, payloadLen(0)
+	, frameType(NotVideoFrame)
+	, enqueueTime(0)
+
+	// Wire form
+	, isGenerated(false)
+	, isAborted(false)
+	, headers()
+	, firstHeaderSize(0)
+	, contHeaderSize(0)
+	, chunkSize(128)
+	, wire()
+	, wireMapped(0)
+	, mapSegIndex(0)
+	, mapSegOff(0)
+	, wireHeaderBytes(0)
+	, wireIndex(0)
+	, wireOff(0)
+
+	, prevState()
+	, prevMaxChunkSize(128)
+{
+}
+
+/// <summary>
+/// Has any of the message been handed to the OS?
+/// </summary>
+bool RTMPClient::OutMessage::isStarted() const
+{
+	return wireIndex > 0 || wireOff > 0;
+}
+
+/// <summary>
+/// Is the message's entire payload in its wire form? Aborted messages are
+/// complete once the chunk that was being transmitted is.
+/// </summary>
+bool RTMPClient::OutMessage::isComplete() const
+{
+	return isAborted || wireMapped >= msgLen;
+}
+
+//=============================================================================
+// RTMPClient class
+
+bool RTMPClient::s_inGamerMode = false;
+float RTMPClient::s_gamerTickFreq = 1.0f;
+
+// A track that goes back in time by more than this is assumed to have been
+// restarted and is rebased instead of being clamped
+const quint32 MUX_REBASE_THRESHOLD_MSECS = 1000;
+
+// Delays between automatic reconnect attempts. The first attempt is made
+// immediately and the delay doubles after every failure.
+const int RECONNECT_BASE_DELAY_MSECS = 250;
+const int RECONNECT_MAX_DELAY_MSECS = 5000;
+
+// Delay between starting parallel connection attempts to the different
+// addresses of the server. Recommended value from RFC 8305.
+const int CONNECT_ATTEMPT_DELAY_MSECS = 250;
+
+// Delay before the hot standby connection is reestablished after it was lost
+// or after we failed over to it
+const int STANDBY_RETRY_DELAY_MSECS = 2000;
+
+// Limits of how often the stall watchdog samples the connection. The interval
+// is a quarter of the stall timeout within these limits.
+const int STALL_MIN_POLL_MSECS = 100;
+const int STALL_MAX_POLL_MSECS = 1000;
+
+// How often the network estimator samples the OS's TCP statistics
+const int EST_SAMPLE_MSECS = 250;
+
+// Weights of new samples in the network estimator's moving averages. The RTT
+// weights are the ones recommended by RFC 6298.
+const float EST_BANDWIDTH_GAIN = 0.25f;
+const float EST_RTT_GAIN = 0.125f;
+const float EST_RTT_VAR_GAIN = 0.25f;
+
+// The network is considered congested once the smoothed RTT exceeds the
+// minimum RTT by this amount or by the minimum RTT itself, whichever is
+// larger
+const float EST_MIN_QUEUE_DELAY_MSECS = 50.0f;
+
+// Gamer mode always uploads at least this many bytes per second so that we
+// get some sort of output if something goes wrong
+const int GAMER_MIN_AVG_UPLOAD_BYTES = 5 * 1024;
+
+// Adaptive bitrate defaults and tuning. The bitrate is decreased by a fixed
+// factor whenever the queue builds and increased in small steps once the
+// network has been stable for the hold time.
+const uint DEFAULT_ABR_HYSTERESIS_PERCENT = 10;
+const uint DEFAULT_ABR_HOLD_MSECS = 5000;
+const float ABR_DECREASE = 0.75f;
+const float ABR_INCREASE = 1.15f;
+const float ABR_HEADROOM = 0.9f; // Of the measured delivery rate
+const uint ABR_MAX_QUEUE_DELAY_MSECS = 250;
+const int ABR_MIN_INTERVAL_MSECS = 1000; // Between any two changes
+
+// Upper bounds in msec of the buckets of the client ping RTT histogram. The
+// last bucket has no upper bound.
+const uint PING_HISTOGRAM_BOUNDS[] = {
+	10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+const int PING_HISTOGRAM_SIZE =
+	sizeof(PING_HISTOGRAM_BOUNDS) / sizeof(PING_HISTOGRAM_BOUNDS[0]) + 1;
+
+// Ping responses that claim a longer RTT than this can't be to our requests
+const uint PING_MAX_RTT_MSECS = 60 * 1000;
+
+// The stream ID that we assume the server will assign to our stream when
+// pipelining "publish()". FMS, Wowza and nginx-rtmp all number the streams of
+// a connection from 1.
+const uint PIPELINED_PUBLISH_STREAM_ID = 1;
+
+QString RTMPClient::errorToString(RTMPClient::RTMPError error)
+{
+	switch(error) {
+	case RTMPClient::UnknownError:
+		return QStringLiteral("Unknown error");
+	case RTMPClient::ConnectionRefusedError:
+		return QStringLiteral("Connection refused");
+	case RTMPClient::RemoteHostClosedError:
+		return QStringLiteral("Remote host closed connection");
+	case RTMPClient::HostNotFoundError:
+		return QStringLiteral("Host address not found");
+	case RTMPClient::TimeoutError:
+		return QStringLiteral("Timed out");
+	case RTMPClient::NetworkError:
+		return QStringLiteral("Network error");
+	case RTMPClient::SslHandshakeFailedError:
+		return QStringLiteral("SSL/TLS handshake failed");
+	case RTMPClient::UnexpectedResponseError:
+		return QStringLiteral("Unexpected response");
+	case RTMPClient::InvalidWriteError:
+		return QStringLiteral("Invalid write");
+	case RTMPClient::RtmpConnectRejectedError:
+		return QStringLiteral("RTMP application connection rejected");
+	case RTMPClient::RtmpCreateStreamError:
+		return QStringLiteral("RTMP stream creation failed");
+	case RTMPClient::RtmpPublishRejectedError:
+		return QStringLiteral("Server rejected publish");
+	case RTMPClient::ConnectionStalledError:
+		return QStringLiteral("Connection stalled");
+	default:
+		return numberToHexString((uint)error);
 	}
+}
+
+/// <summary>
+/// Returns the upper bounds in msec of the buckets that are returned by
+/// `getPingHistogram()`. The histogram has one more bucket than there are
+/// bounds which counts everything above the last bound.
+/// </summary>
+QVector<uint> RTMPClient::getPingHistogramBounds()
+{
+	QVector<uint> ret;
+	for(int i = 0; i < PING_HISTOGRAM_SIZE - 1; i++)
+		ret.append(PING_HISTOGRAM_BOUNDS[i]);
+	return ret;
+}
+
+/// <summary>
+/// Used to enable or disable "gamer mode" which reduces network interference
+/// at the expense of increased maintenance and slightly slower responsiveness
+/// to network congestion. Gamer mode is disabled by default. This setting must
+/// only be changed when there are no active clients. If the OS output buffer
+/// fills then gamer mode is temporarily disabled automatically as it can't
+/// handle congestion properly and will have no effect anyway on a saturated
+/// network.
+/// </summary>
+void RTMPClient::gamerModeSetEnabled(bool enabled)
+{
+	s_inGamerMode = enabled;
+}
+
+/// <summary>
+/// Used to change the expected frequency of `gamerTickEvent()` calls. If the
+/// method isn't called that many times per second (Or if all dropped ticks are
+/// not accounted for) then the behaviour is undefined. This setting must only
+/// be changed when there are no active clients.
+/// </summary>
+void RTMPClient::gamerSetTickFreq(float freq)
+{
+	s_gamerTickFreq = freq;
+}
+
+RTMPClient::RTMPClient()
+	: QObject()
+	, m_remoteInfo()
+	, m_socket(NULL)
+	, m_socketWriteNotifier(NULL)
+	, m_autoInitialize(true)
+	, m_autoAppConnect(true)
+	, m_fastOpenEnabled(false)
+	, m_pipelinedPublish(false)
+	, m_versionString(QStringLiteral("FMLE/3.0 (compatible; FMSc/1.0)"))
+	, m_objectEncoding(0)
+	, m_publisher(NULL)
+
+	// Connection state
+	, m_handshakeState(DisconnectedState)
+	, m_handshakeRandomData()
+	, m_publishRequested(false) // Read by `resetStateMembers()`
+	// All other members are initialized in `resetStateMembers()`
+
+	// Input/output buffers
+	, m_outQueue()
+	, m_outQueueBytes(0)
+	, m_outBlocked(false)
+	, m_outClock()
+	, m_outTotalBytes(0)
+	, m_outAvgQueueDelay(0.0f)
+	, m_bufferOutBufRef(0)
+	, m_writeStreamBuf(this)
+	, m_writeStream()
+	, m_inBuf()
+
+	// Frame drop engine
+	, m_dropMaxQueueBytes(0)
+	, m_dropMaxQueueMsecs(0)
+	, m_dropUntilKeyframe(false)
+	, m_latencyBudget(0)
+	, m_droppedFrames(0)
+	, m_progressiveMsg(NULL)
+
+	// Adaptive bitrate
+	, m_abrFloor(0)
+	, m_abrCeiling(0)
+	, m_abrHysteresis(DEFAULT_ABR_HYSTERESIS_PERCENT)
+	, m_abrHoldMsecs(DEFAULT_ABR_HOLD_MSECS)
+	, m_abrBitrate(0)
+	, m_abrLastChange(0)
+	, m_abrLastQueueBytes(0)
+
+	// A/V mux
+	, m_muxQueue()
+	, m_muxWindow(0)
+	, m_muxNumVideo(0)
+	, m_muxLastOutTimestamp(0)
+	, m_muxNumAdjusted(0)
+
+	// Stream cache
+	, m_cacheDataFrame(NULL)
+	, m_cacheVideoHeader()
+	, m_cacheAudioHeader()
+	, m_cacheIsAvc(false)
+	, m_cacheIsAvccPassthrough(false)
+	, m_cacheGop()
+	, m_cacheGopBytes(0)
+	, m_cacheGopMaxBytes(0)
+	, m_cacheGopValid(false)
+
+	// Connection racing and TCP Fast Open
+	, m_resolvingHost(false)
+	, m_connectAddrs()
+	, m_connectNextAddr(0)
+	, m_connectAttempts()
+	, m_connectAttemptTimer(NULL)
+	, m_fastOpenData()
+	, m_fastOpenSentHandshake(false)
+
+	// Reconnect supervisor
+	, m_reconnectEnabled(false)
+	, m_reconnectMaxAttempts(0)
+	, m_reconnecting(false)
+	, m_reconnectAttempt(0)
+	, m_reconnectTimer(NULL)
+	, m_resolvedAddress()
+	, m_reconnectHeld()
+
+	// Hot standby
+	, m_standbyInfo()
+	, m_standby(NULL)
+	, m_standbyTimer(NULL)
+
+	// Stall watchdog
+	, m_stallTimeout(0)
+	, m_stallTimer(NULL)
+	, m_stallLastProgress(0)
+	, m_stallLastOutBytes(0)
+	, m_stallLastAckedBytes(0)
+
+	// Network estimator
+	, m_estTimer(NULL)
+	, m_estLastSampleTime(-1)
+	, m_estLastBytes(0)
+	, m_estBandwidth(0.0f)
+	, m_estRtt(0.0f)
+	, m_estRttVar(0.0f)
+	, m_estMinRtt(0.0f)
+	, m_estCwnd(0)
+	, m_estLastAckSeq(0)
+	, m_estLastAckTime(-1)
+	, m_estOutBytesAtAck(0)
+	, m_estAckRate(0.0f)
+
+	// Client ping
+	, m_pingInterval(0)
+	, m_pingTimer(NULL)
+	, m_pingSent(false)
+	, m_pingRtt(0.0f)
+	, m_pingLastRtt(0)
+	, m_pingHistogram(PING_HISTOGRAM_SIZE, 0)
+
+	// Gamer mode
+	, m_gamerAvgUploadBytes(100 * 1024 * 1024) // 100 MB/s
+	, m_gamerAutoUpload(true)
+	, m_gamerInSatMode(false)
+	, m_gamerSatModeTimer(0.0f)
+	, m_gamerExitSatModeTime(10.0f)
+{
+	resetStateMembers();
+	m_outClock.start();
+
+	m_reconnectTimer = new QTimer(this);
+	m_reconnectTimer->setSingleShot(true);
+	QObject::connect(m_reconnectTimer, &QTimer::timeout,
+		this, &RTMPClient::reconnectTimeout);
+	m_connectAttemptTimer = new QTimer(this);
+	m_connectAttemptTimer->setSingleShot(true);
+	QObject::connect(m_connectAttemptTimer, &QTimer::timeout,
+		this, &RTMPClient::connectAttemptTimeout);
+	QObject::connect(DNSCache::getSingleton(), &DNSCache::hostResolved,
+		this, &RTMPClient::hostResolved);
+	m_standbyTimer = new QTimer(this);
+	m_standbyTimer->setSingleShot(true);
+	QObject::connect(m_standbyTimer, &QTimer::timeout,
+		this, &RTMPClient::standbyTimeout);
+	m_stallTimer = new QTimer(this);
+	QObject::connect(m_stallTimer, &QTimer::timeout,
+		this, &RTMPClient::stallWatchdogTimeout);
+	m_estTimer = new QTimer(this);
+	QObject::connect(m_estTimer, &QTimer::timeout,
+		this, &RTMPClient::estimatorTimeout);
+	m_pingTimer = new QTimer(this);
+	QObject::connect(m_pingTimer, &QTimer::timeout,
+		this, &RTMPClient::pingTimeout);
+
+	m_socket = new QTcpSocket(this);
+	attachSocket();
+}
+
+void RTMPClient::resetStateMembers()
+{
+	// The publish session survives automatic reconnects and a publisher that
+	// is waiting to be pipelined was created for this connection
+	if(!m_reconnecting && !m_publishRequested)
+		resetPublishStateMembers();
 
 	m_inMaxChunkSize = 128;
 	m_outMaxChunkSize = 128;
@@ -579,21 +1691,94 @@ void RTMPClient::resetStateMembers()
 	m_nextTransactionIds.clear();
 	m_appConnected = false;
 	m_appConnectTransId = 0;
+	m_appObjectEncoding = 0;
 	m_creatingStream = false;
 	m_createStreamTransId = 0;
 	m_publishStreamId = 0;
 	m_beginningPublish = false;
-	m_lastPublishTimestamp = 0;
 }
 
-RTMPClient::~RTMPClient()
+/// <summary>
+/// Deletes the publisher and resets all state that belongs to its publish
+/// session such as timestamps and frame dropping settings.
+/// </summary>
+void RTMPClient::resetPublishStateMembers()
 {
 	if(m_publisher != NULL) {
 		delete m_publisher;
 		m_publisher = NULL;
 	}
-	if(m_socketWriteNotifier != NULL) {
-		delete m_socketWriteNotifier;
+	m_reconnectHeld.clear();
+	m_publishRequested = false;
+
+	m_lastPublishTimestamp = 0;
+	m_dropMaxQueueBytes = 0;
+	m_dropMaxQueueMsecs = 0;
+	m_dropUntilKeyframe = false;
+	m_latencyBudget = 0;
+	m_droppedFrames = 0;
+	m_outAvgQueueDelay = 0.0f;
+	m_muxQueue.clear();
+	m_muxWindow = 0;
+	m_muxNumVideo = 0;
+	for(int i = 0; i < 2; i++) {
+		m_muxSeenTracks[i] = false;
+		m_muxLastInTimestamps[i] = 0;
+		m_muxInOffsets[i] = 0;
+	}
+	m_muxLastOutTimestamp = 0;
+	m_muxNumAdjusted = 0;
+	m_abrFloor = 0;
+	m_abrCeiling = 0;
+	m_abrHysteresis = DEFAULT_ABR_HYSTERESIS_PERCENT;
+	m_abrHoldMsecs = DEFAULT_ABR_HOLD_MSECS;
+	m_abrBitrate = 0;
+	m_abrLastChange = 0;
+	m_abrLastQueueBytes = 0;
+}
+
+/// <summary>
+/// Connects the signals of `m_socket` to our slots.
+/// </summary>
+void RTMPClient::attachSocket()
+{
+	void (QAbstractSocket:: *fpseAS)(QAbstractSocket::SocketError) =
+		&QAbstractSocket::error;
+	QObject::connect(m_socket, &QAbstractSocket::connected,
+		this, &RTMPClient::socketConnected);
+	QObject::connect(m_socket, &QAbstractSocket::disconnected,
+		this, &RTMPClient::socketDisconnected);
+	QObject::connect(m_socket, fpseAS,
+		this, &RTMPClient::socketError);
+	QObject::connect(m_socket, &QIODevice::readyRead,
+		this, &RTMPClient::socketDataReady);
+}
+
+/// <summary>
+/// Creates the write notifier for the descriptor of a connected `m_socket`.
+/// </summary>
+void RTMPClient::createSocketWriteNotifier()
+{
+	// Create socket notifier and disable it immediately due to Windows
+	// implementation issues (See QSocketNotifier documentation). Note that we
+	// will received a "Multiple socket notifiers for same socket" warning from
+	// Qt as QTcpSocket already has an internal notifier that we can't access.
+	Q_ASSERT(m_socketWriteNotifier == NULL);
+	m_socketWriteNotifier = new QSocketNotifier(
+		m_socket->socketDescriptor(), QSocketNotifier::Write, this);
+	m_socketWriteNotifier->setEnabled(false);
+	QObject::connect(m_socketWriteNotifier, &QSocketNotifier::activated,
+		this, &RTMPClient::socketReadyForWrite);
+}
+
+RTMPClient::~RTMPClient()
+{
+	if(m_publisher != NULL) {
+		delete m_publisher;
+		m_publisher = NULL;
+	}
+	if(m_socketWriteNotifier != NULL) {
+		delete m_socketWriteNotifier;
 		m_socketWriteNotifier = NULL;
 	}
 
@@ -601,189 +1786,752 @@ RTMPClient::~RTMPClient()
 	if(m_writeStream.device() != NULL)
 		endWriteStream(false);
 
-	// Disconnect immediately if needed (Will be unclean)
-	disconnect(false);
+	// Disconnect immediately if needed (Will be unclean)
+	disconnect(false);
+	stopStandby();
+	clearOutQueue();
+	clearStreamCache();
+}
+
+/// <summary>
+/// Configures the client to connect to the specified remote host.
+/// </summary>
+/// <returns>True if the target is valid</returns>
+bool RTMPClient::setRemoteTarget(const RTMPTargetInfo &info)
+{
+	// TODO: Validate input
+	m_remoteInfo = info;
+	return true;
+}
+
+/// <summary>
+/// Configures the client to connect to the specified remote host using a URL.
+/// </summary>
+/// <returns>True if the URL is valid</returns>
+bool RTMPClient::setRemoteTarget(const QString &url)
+{
+	// TODO: Unimplemented
+	return false;
+}
+
+/// <summary>
+/// Returns true if the network socket is connected to the remote host.
+/// </summary>
+bool RTMPClient::isSocketConnected() const
+{
+	switch(m_handshakeState) {
+	default:
+	case DisconnectedState:
+	case ConnectingState:
+		return false;
+	case ConnectedState:
+	case VersionSentState:
+	case VersionReceivedState:
+	case AckSentState:
+	case InitializedState:
+	case DisconnectingState: // Still technically connected
+		return true;
+	}
+	// Should never happen
+	return false;
+}
+
+/// <summary>
+/// Begins the RTMP connection process. Signals will be emitted at specific
+/// events to notify the caller when the connection is ready for use or if an
+/// error occurred.
+/// </summary>
+/// <returns>True if the connection process was started</returns>
+bool RTMPClient::connect()
+{
+	if(m_handshakeState != DisconnectedState)
+		return false; // Already connected or connecting
+	// TODO: Test for invalid host/port
+	m_handshakeState = ConnectingState;
+	clearOutQueue();
+	m_inBuf.clear();
+	m_gamerInSatMode = false;
+	m_fastOpenSentHandshake = false;
+	m_fastOpenData.clear();
+	emit connecting();
+	startStandby();
+
+	// When reconnecting we skip the DNS lookup by reusing the address of the
+	// connection that was lost. Otherwise host names go through the shared
+	// cache which may need to query the DNS servers first.
+	QList<QHostAddress> addrs;
+	QHostAddress addr;
+	if(m_reconnecting && !m_resolvedAddress.isNull())
+		addrs.append(m_resolvedAddress);
+	else if(addr.setAddress(m_remoteInfo.host))
+		addrs.append(addr);
+	else {
+		// The cache might emit `hostResolved()` before `lookup()` returns
+		m_resolvingHost = true;
+		if(!DNSCache::getSingleton()->lookup(m_remoteInfo.host, &addrs))
+			return true; // Continued in `hostResolved()`
+		m_resolvingHost = false;
+	}
+	beginConnectAttempts(addrs);
+
+	return true;
+}
+
+/// <summary>
+/// Begin the RTMP handshake process.
+/// </summary>
+/// <returns>True if the handshake process was started</returns>
+bool RTMPClient::initialize()
+{
+	// From RTMP specification:
+	// "The handshake begins with the client sending the C0 and C1 chunks."
+	// Both are transmitted in a single write.
+	beginForceBufferWrite();
+	if(!writeC0S0() || !writeC1S1()) {
+		endForceBufferWrite();
+		return false;
+	}
+	m_handshakeState = VersionSentState;
+	endForceBufferWrite();
+	return true;
+}
+
+/// <summary>
+/// Begin the RTMP application connection process ("connect()" command).
+/// </summary>
+/// <returns>True if the connection process was started</returns>
+bool RTMPClient::connectToApp()
+{
+	beginForceBufferWrite();
+	if(!setMaxChunkSize(4096)) {
+		endForceBufferWrite();
+		return false;
+	}
+	m_appConnectTransId = getNextTransactionId(0);
+	bool ret = writeConnectMsg(m_appConnectTransId);
+
+	// Don't wait for the result before creating the publish stream
+	if(ret && m_pipelinedPublish && m_publisher != NULL &&
+		(m_publishRequested || m_reconnecting))
+	{
+		if(writeCreateStreamMsg()) {
+			m_publishStreamId = PIPELINED_PUBLISH_STREAM_ID;
+			writePublishMsg(m_publishStreamId);
+		}
+	}
+	endForceBufferWrite();
+	return ret;
+}
+
+/// <summary>
+/// Marks this client as a publisher and prepares the `RTMPPublisher` object.
+/// The actual RTMP stream is not created until the application calls
+/// `RTMPPublisher::beginPublishing()`.
+/// </summary>
+RTMPPublisher *RTMPClient::createPublishStream()
+{
+	if(m_publisher == NULL)
+		m_publisher = new RTMPPublisher(this);
+	return m_publisher;
+}
+
+void RTMPClient::deletePublishStream()
+{
+	if(m_publisher == NULL)
+		return;
+	delete m_publisher;
+	m_publisher = NULL;
+}
+
+void RTMPClient::disconnect(bool cleanDisconnect)
+{
+	stopStandby();
+
+	// Disconnecting while reconnecting stops the reconnect supervisor
+	if(m_reconnecting) {
+		cancelReconnect();
+		if(m_handshakeState == DisconnectedState) {
+			// Waiting for the next attempt, the publisher is still alive
+			resetPublishStateMembers();
+			emit disconnected();
+			return;
+		}
+	}
+
+	if(m_handshakeState == DisconnectedState)
+		return; // Already disconnected
+	if(m_resolvingHost || !m_connectAttempts.isEmpty()) {
+		// Still resolving or racing connection attempts
+		m_resolvingHost = false;
+		abortConnectAttempts();
+		m_handshakeState = DisconnectedState;
+		emit disconnected();
+		return;
+	}
+
+	// If we're still in forced buffer mode then something is probably wrong
+	if(m_bufferOutBufRef > 0) {
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Attempting to disconnect while still in forced buffer mode");
+		while(m_bufferOutBufRef > 0)
+			endForceBufferWrite();
+	}
+
+	if(m_publisher != NULL) {
+		delete m_publisher;
+		m_publisher = NULL;
+	}
+	if(m_socketWriteNotifier != NULL) {
+		delete m_socketWriteNotifier;
+		m_socketWriteNotifier = NULL;
+	}
+
+	if(!cleanDisconnect) {
+		// Disconnect uncleanly by closing the socket immediately
+		m_socket->abort();
+		m_handshakeState = DisconnectedState;
+		clearOutQueue();
+		m_inBuf.clear();
+		emit disconnected();
+		return;
+	}
+
+	// TODO: Write RTMP NetConnection "close()" message here?
+
+	// Push all queued data to Qt
+	clearOutQueue(true);
+
+	// Disconnect cleanly taking into account that we might not have even fully
+	// connected yet
+	m_handshakeState = DisconnectingState;
+	m_socket->disconnectFromHost();
+	m_inBuf.clear();
+	if(m_handshakeState == DisconnectingState &&
+		m_socket->state() == QAbstractSocket::UnconnectedState)
+	{
+		// `socketDisconnected()` was never called but the socket is actually
+		// disconnected
+		m_handshakeState = DisconnectedState;
+		emit disconnected();
+	}
+}
+
+/// <summary>
+/// Begins racing TCP connections to `addrs` in the style of RFC 8305 ("Happy
+/// Eyeballs"). The addresses are attempted one after the other, staggered by
+/// `CONNECT_ATTEMPT_DELAY_MSECS`, without cancelling the earlier attempts and
+/// the first connection to complete wins. This prevents a broken IPv6 path
+/// from stalling the connection for the full TCP timeout.
+/// </summary>
+void RTMPClient::beginConnectAttempts(const QList<QHostAddress> &addrs)
+{
+	m_connectAddrs = DNSCache::sortForConnect(addrs);
+	m_connectNextAddr = 0;
+
+	// Build C0 and C1 if we can send them in the SYN. This is identical to
+	// what `initialize()` writes.
+	if(m_fastOpenEnabled && (m_autoInitialize || m_reconnecting)) {
+		m_handshakeRandomData.resize(1528);
+		fillRandomBytes(m_handshakeRandomData.data(), 1528);
+		m_fastOpenData.resize(1 + 8);
+		char *off = m_fastOpenData.data();
+		*off++ = 3; // "3" = RTMP v1.0
+		off = encodeBEUInt32(off, getCurrentTime32());
+		off = encodeBEUInt32(off, 0);
+		m_fastOpenData.append(m_handshakeRandomData);
+	}
+
+	startNextConnectAttempt();
+}
+
+/// <summary>
+/// Starts a connection attempt to the next address in the list and schedules
+/// the one after that. If there are no more addresses to try and there are
+/// no attempts in progress then we fall back to a regular connect.
+/// </summary>
+void RTMPClient::startNextConnectAttempt()
+{
+	m_connectAttemptTimer->stop();
+	while(m_connectNextAddr < m_connectAddrs.size()) {
+		if(beginConnectAttempt(m_connectAddrs.at(m_connectNextAddr++))) {
+			if(m_connectNextAddr < m_connectAddrs.size())
+				m_connectAttemptTimer->start(CONNECT_ATTEMPT_DELAY_MSECS);
+			return;
+		}
+	}
+	if(m_connectAttempts.isEmpty())
+		fallbackConnect();
+}
+
+/// <summary>
+/// Starts an overlapped `ConnectEx()` to `addr`. If TCP Fast Open is enabled
+/// then C0 and C1 are carried in the SYN. The OS falls back to a regular TCP
+/// handshake followed by the data if it doesn't have a Fast Open cookie for
+/// the server yet.
+/// </summary>
+/// <returns>False if the attempt couldn't be started</returns>
+bool RTMPClient::beginConnectAttempt(const QHostAddress &addr)
+{
+#ifdef Q_OS_WIN
+	int family;
+	if(addr.protocol() == QAbstractSocket::IPv4Protocol)
+		family = AF_INET;
+	else if(addr.protocol() == QAbstractSocket::IPv6Protocol)
+		family = AF_INET6;
+	else
+		return false;
+
+	SOCKET sock = WSASocket(
+		family, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+	if(sock == INVALID_SOCKET)
+		return false;
+
+	// Enable Fast Open if the OS supports it. If it doesn't then the
+	// handshake is written normally once connected.
+	bool fastOpen = false;
+	if(!m_fastOpenData.isEmpty()) {
+		DWORD enable = 1;
+		fastOpen = (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+			(char *)&enable, sizeof(enable)) == 0);
+	}
+
+	// `ConnectEx()` requires the socket to be bound
+	sockaddr_storage local;
+	memset(&local, 0, sizeof(local));
+	local.ss_family = family;
+	int addrLen = (family == AF_INET)
+		? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+	if(bind(sock, (sockaddr *)&local, addrLen) != 0) {
+		closesocket(sock);
+		return false;
+	}
+
+	// Fetch the `ConnectEx()` function pointer
+	LPFN_CONNECTEX connectEx = NULL;
+	GUID guid = WSAID_CONNECTEX;
+	DWORD bytes = 0;
+	if(WSAIoctl(sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid),
+		&connectEx, sizeof(connectEx), &bytes, NULL, NULL) != 0)
+	{
+		closesocket(sock);
+		return false;
+	}
+
+	// Build the remote address
+	sockaddr_storage remote;
+	memset(&remote, 0, sizeof(remote));
+	if(family == AF_INET) {
+		sockaddr_in *in4 = (sockaddr_in *)&remote;
+		in4->sin_family = AF_INET;
+		in4->sin_port = htons(m_remoteInfo.port);
+		in4->sin_addr.s_addr = htonl(addr.toIPv4Address());
+	} else {
+		sockaddr_in6 *in6 = (sockaddr_in6 *)&remote;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(m_remoteInfo.port);
+		Q_IPV6ADDR ip6 = addr.toIPv6Address();
+		memcpy(&in6->sin6_addr, &ip6, sizeof(ip6));
+	}
+
+	OVERLAPPED *ov = new OVERLAPPED;
+	memset(ov, 0, sizeof(OVERLAPPED));
+	ov->hEvent = WSACreateEvent();
+	if(ov->hEvent == WSA_INVALID_EVENT) {
+		delete ov;
+		closesocket(sock);
+		return false;
+	}
+	if(!connectEx(sock, (sockaddr *)&remote, addrLen,
+		fastOpen ? m_fastOpenData.data() : NULL,
+		fastOpen ? m_fastOpenData.size() : 0, NULL, ov) &&
+		WSAGetLastError() != ERROR_IO_PENDING)
+	{
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Failed to begin connection attempt to %1, error = %2")
+			.arg(addr.toString())
+			.arg(WSAGetLastError());
+		WSACloseEvent(ov->hEvent);
+		delete ov;
+		closesocket(sock);
+		return false;
+	}
+
+	// Wait for the connect to complete in the event loop
+	ConnectAttempt attempt;
+	attempt.socket = sock;
+	attempt.overlapped = ov;
+	attempt.notifier = new QWinEventNotifier(ov->hEvent, this);
+	QObject::connect(attempt.notifier, &QWinEventNotifier::activated,
+		this, &RTMPClient::connectAttemptFinished);
+	m_connectAttempts.append(attempt);
+	return true;
+#else
+#error Unsupported platform
+#endif
+}
+
+/// <summary>
+/// Cancels all connection attempts that are in progress and releases their
+/// resources.
+/// </summary>
+void RTMPClient::abortConnectAttempts()
+{
+	m_connectAttemptTimer->stop();
+	m_connectAddrs.clear();
+	m_connectNextAddr = 0;
+#ifdef Q_OS_WIN
+	for(int i = 0; i < m_connectAttempts.size(); i++) {
+		const ConnectAttempt &attempt = m_connectAttempts.at(i);
+		SOCKET sock = (SOCKET)attempt.socket;
+		OVERLAPPED *ov = (OVERLAPPED *)attempt.overlapped;
+
+		// The OS owns the `OVERLAPPED` structure until the operation completes
+		DWORD bytes = 0;
+		DWORD flags = 0;
+		CancelIoEx((HANDLE)sock, ov);
+		WSAGetOverlappedResult(sock, ov, &bytes, TRUE, &flags);
+		closesocket(sock);
+
+		attempt.notifier->setEnabled(false);
+		attempt.notifier->deleteLater(); // We might be inside its signal
+		WSACloseEvent(ov->hEvent);
+		delete ov;
+	}
+#else
+#error Unsupported platform
+#endif
+	m_connectAttempts.clear();
+}
+
+/// <summary>
+/// Connects using `QTcpSocket` directly. Used when all connection attempts
+/// failed so that the error is reported through `socketError()` as usual.
+/// </summary>
+void RTMPClient::fallbackConnect()
+{
+	QList<QHostAddress> addrs = m_connectAddrs;
+	abortConnectAttempts();
+	m_fastOpenData.clear();
+
+	// We use an unbuffered socket so we can control the maximum amount of data
+	// that can be pending for write. This is required to do more efficient
+	// frame dropping.
+	if(!addrs.isEmpty()) {
+		m_socket->connectToHost(addrs.first(), m_remoteInfo.port,
+			QIODevice::ReadWrite | QIODevice::Unbuffered);
+	} else {
+		m_socket->connectToHost(m_remoteInfo.host, m_remoteInfo.port,
+			QIODevice::ReadWrite | QIODevice::Unbuffered);
+	}
+}
+
+/// <summary>
+/// Returns true if the connection that was just lost should be recovered by
+/// the reconnect supervisor.
+/// </summary>
+bool RTMPClient::shouldReconnect() const
+{
+	if(m_reconnecting)
+		return true; // A reconnect attempt failed
+	return m_reconnectEnabled && m_publisher != NULL &&
+		m_publisher->isReady();
+}
+
+/// <summary>
+/// Cleans up a lost connection without deleting the publisher and schedules
+/// the next reconnect attempt.
+/// </summary>
+void RTMPClient::beginReconnect()
+{
+	if(m_socketWriteNotifier != NULL) {
+		delete m_socketWriteNotifier;
+		m_socketWriteNotifier = NULL;
+	}
+	m_bufferOutBufRef = 0; // Nothing can be written to the lost socket
+
+	if(!m_reconnecting) {
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Connection lost while publishing, reconnecting");
+		holdUnsentMedia();
+		m_reconnecting = true;
+		m_reconnectAttempt = 0;
+		m_publisher->setReady(false);
+	}
+
+	m_socket->abort();
+	m_handshakeState = DisconnectedState;
+	clearOutQueue();
+	m_inBuf.clear();
+	scheduleReconnect();
 }
 
 /// <summary>
-/// Configures the client to connect to the specified remote host.
+/// Starts the timer for the next reconnect attempt or gives up if we have
+/// run out of attempts.
 /// </summary>
-/// <returns>True if the target is valid</returns>
-bool RTMPClient::setRemoteTarget(const RTMPTargetInfo &info)
+void RTMPClient::scheduleReconnect()
 {
-	// TODO: Validate input
-	m_remoteInfo = info;
-	return true;
+	if(m_reconnectMaxAttempts > 0 &&
+		m_reconnectAttempt >= m_reconnectMaxAttempts)
+	{
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Giving up reconnecting after %L1 attempt(s)")
+			.arg(m_reconnectAttempt);
+		cancelReconnect();
+		stopStandby();
+		resetPublishStateMembers();
+		emit disconnected();
+		return;
+	}
+
+	int delay = 0;
+	if(m_reconnectAttempt > 0) {
+		// The previous attempt failed, the server may have moved
+		m_resolvedAddress = QHostAddress();
+		delay = RECONNECT_BASE_DELAY_MSECS << qMin(m_reconnectAttempt - 1, 5);
+		delay = qMin(delay, RECONNECT_MAX_DELAY_MSECS);
+	}
+	m_reconnectTimer->start(delay);
 }
 
 /// <summary>
-/// Configures the client to connect to the specified remote host using a URL.
+/// Stops the reconnect supervisor. Does not delete the publisher.
 /// </summary>
-/// <returns>True if the URL is valid</returns>
-bool RTMPClient::setRemoteTarget(const QString &url)
+void RTMPClient::cancelReconnect()
 {
-	// TODO: Unimplemented
-	return false;
+	m_reconnectTimer->stop();
+	m_reconnecting = false;
+	m_reconnectAttempt = 0;
+	m_reconnectHeld.clear();
 }
-
 /// <summary>
-/// Returns true if the network socket is connected to the remote host.
+/// Remembers the media messages that were queued but not yet transmitted on
+/// the lost connection so that they can be resent if there is no cached GOP.
+/// Frame data that we don't own is copied so that externally owned buffers
+/// are released when the output queue is cleared instead of being kept
+/// alive for the entire reconnect.
 /// </summary>
-bool RTMPClient::isSocketConnected() const
+void RTMPClient::holdUnsentMedia()
 {
-	switch(m_handshakeState) {
-	default:
-	case DisconnectedState:
-	case ConnectingState:
-		return false;
-	case ConnectedState:
-	case VersionSentState:
-	case VersionReceivedState:
-	case AckSentState:
-	case InitializedState:
-	case DisconnectingState: // Still technically connected
-		return true;
+	m_reconnectHeld.clear();
+	for(int i = 0; i < m_outQueue.size(); i++) {
+		const OutMessage *msg = m_outQueue.at(i);
+		if(msg->isStarted() || msg->payloadLen < msg->msgLen)
+			continue;
+		if(msg->msgType != AudioMsgType && msg->msgType != VideoMsgType)
+			continue;
+		MuxEntry entry;
+		entry.msgType = msg->msgType;
+		entry.timestamp = msg->timestamp;
+		entry.payload = retainableSegments(msg->payload);
+		entry.frameType = msg->frameType;
+		m_reconnectHeld.append(entry);
 	}
-	// Should never happen
-	return false;
 }
 
 /// <summary>
-/// Begins the RTMP connection process. Signals will be emitted at specific
-/// events to notify the caller when the connection is ready for use or if an
-/// error occurred.
+/// Sets the server that the hot standby connection is made to. While the
+/// client is connected a second connection to this server is kept fully
+/// handshaked, connected to the application and with a stream created. If
+/// the primary connection is lost while publishing, or the application calls
+/// `failover()`, the client switches to the standby connection, issues
+/// "publish()" and replays the stream cache. This only costs a single round
+/// trip instead of a full reconnect. The previous primary server then
+/// becomes the new standby. An empty host disables the standby.
 /// </summary>
-/// <returns>True if the connection process was started</returns>
-bool RTMPClient::connect()
+void RTMPClient::setStandbyTarget(const RTMPTargetInfo &info)
 {
-	if(m_handshakeState != DisconnectedState)
-		return false; // Already connected or connecting
-	// TODO: Test for invalid host/port
-	m_handshakeState = ConnectingState;
-	m_outBuf.clear();
-	m_inBuf.clear();
-	m_gamerOutBuf.clear();
-	m_gamerInSatMode = false;
-	emit connecting();
-
-	// We use an unbuffered socket so we can control the maximum amount of data
-	// that can be pending for write. This is required to do more efficient
-	// frame dropping.
-	m_socket.connectToHost(m_remoteInfo.host, m_remoteInfo.port,
-		QIODevice::ReadWrite | QIODevice::Unbuffered);
-
-	return true;
+	stopStandby();
+	m_standbyInfo = info;
+	if(m_handshakeState != DisconnectedState || m_reconnecting)
+		startStandby();
 }
 
 /// <summary>
-/// Begin the RTMP handshake process.
+/// Returns true if the hot standby connection can be switched to
+/// immediately.
 /// </summary>
-/// <returns>True if the handshake process was started</returns>
-bool RTMPClient::initialize()
+bool RTMPClient::isStandbyReady() const
 {
-	// From RTMP specification:
-	// "The handshake begins with the client sending the C0 and C1 chunks."
-	if(!writeC0S0())
-		return false;
-	if(!writeC1S1())
-		return false;
-	m_handshakeState = VersionSentState;
-	return true;
+	return m_standby != NULL && m_standby->isSocketConnected() &&
+		m_standby->m_appConnected && !m_standby->m_creatingStream &&
+		m_standby->m_publishStreamId != 0;
 }
 
 /// <summary>
-/// Begin the RTMP application connection process ("connect()" command).
+/// Switches publishing over to the hot standby connection. Called
+/// automatically when the primary connection is lost but can also be called
+/// by the application if it detects that the primary connection has stalled.
+/// The standby then reconnects to the previous primary target in the
+/// background.
 /// </summary>
-/// <returns>True if the connection process was started</returns>
-bool RTMPClient::connectToApp()
+/// <returns>True if we switched to the standby connection</returns>
+bool RTMPClient::failover()
 {
-	beginForceBufferWrite();
-	if(!setMaxChunkSize(4096)) {
-		endForceBufferWrite();
+	if(!isStandbyReady() || m_publisher == NULL)
 		return false;
+	if(!m_publisher->isReady() && !m_reconnecting)
+		return false; // Not publishing yet
+
+	broLog(LOG_CAT, BroLog::Warning)
+		<< QStringLiteral("Failing over to standby server \"%1\"")
+		.arg(m_standby->m_remoteInfo.asUrl());
+
+	// Tear down the primary connection without deleting the publisher. We
+	// don't want `abort()` to call our slots.
+	if(m_socketWriteNotifier != NULL) {
+		delete m_socketWriteNotifier;
+		m_socketWriteNotifier = NULL;
 	}
-	m_appConnectTransId = getNextTransactionId(0);
-	bool ret = writeConnectMsg(m_appConnectTransId);
-	endForceBufferWrite();
-	return ret;
+	m_bufferOutBufRef = 0; // Nothing can be written to the lost socket
+	if(!m_reconnecting) {
+		holdUnsentMedia();
+		m_reconnecting = true;
+		m_reconnectAttempt = 0;
+		m_publisher->setReady(false);
+	}
+	m_reconnectTimer->stop();
+	m_resolvingHost = false;
+	abortConnectAttempts();
+	QObject::disconnect(m_socket, NULL, this, NULL);
+	m_socket->abort();
+	m_handshakeState = DisconnectedState;
+	clearOutQueue();
+	m_inBuf.clear();
+
+	// Adopt the standby connection. The standby is left with our dead one
+	swapConnection(m_standby);
+	m_standby->resetStateMembers();
+	m_gamerInSatMode = false;
+	createSocketWriteNotifier();
+	resetNetworkEstimate(); // Different network path
+	m_standbyInfo = m_standby->m_remoteInfo;
+	m_standbyTimer->start(STANDBY_RETRY_DELAY_MSECS);
+	emit failedOver();
+
+	// The standby already created our stream. Publishing resumes once the
+	// server replies to "publish()" exactly like after a reconnect.
+	if(!writePublishMsg(m_publishStreamId)) {
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Failed to publish on the standby connection");
+		disconnect(false);
+		return false;
+	}
+	return true;
 }
 
 /// <summary>
-/// Marks this client as a publisher and prepares the `RTMPPublisher` object.
-/// The actual RTMP stream is not created until the application calls
-/// `RTMPPublisher::beginPublishing()`.
+/// Creates the hot standby client and begins connecting it if a standby
+/// target has been set.
 /// </summary>
-RTMPPublisher *RTMPClient::createPublishStream()
+void RTMPClient::startStandby()
 {
-	if(m_publisher == NULL)
-		m_publisher = new RTMPPublisher(this);
-	return m_publisher;
+	if(m_standby != NULL || m_standbyInfo.host.isEmpty())
+		return;
+	m_standby = new RTMPClient();
+	m_standby->setRemoteTarget(m_standbyInfo);
+	m_standby->setVersionString(m_versionString);
+	m_standby->setObjectEncoding(m_objectEncoding);
+	m_standby->setFastOpen(m_fastOpenEnabled);
+	QObject::connect(m_standby, &RTMPClient::connectedToApp,
+		this, &RTMPClient::standbyConnectedToApp);
+	QObject::connect(m_standby, &RTMPClient::createdStream,
+		this, &RTMPClient::standbyCreatedStream);
+	QObject::connect(m_standby, &RTMPClient::disconnected,
+		this, &RTMPClient::standbyDisconnected);
+	m_standby->connect();
 }
 
-void RTMPClient::deletePublishStream()
+/// <summary>
+/// Disconnects and deletes the hot standby client.
+/// </summary>
+void RTMPClient::stopStandby()
 {
-	if(m_publisher == NULL)
+	m_standbyTimer->stop();
+	if(m_standby == NULL)
 		return;
-	delete m_publisher;
-	m_publisher = NULL;
+	QObject::disconnect(m_standby, NULL, this, NULL);
+	m_standby->disconnect();
+	m_standby->deleteLater(); // We might be inside one of its signals
+	m_standby = NULL;
 }
 
-void RTMPClient::disconnect(bool cleanDisconnect)
+/// <summary>
+/// Exchanges the TCP socket, target and all RTMP connection state with
+/// `other`. Publish state such as the publisher, stream cache and
+/// timestamps is not exchanged.
+/// </summary>
+void RTMPClient::swapConnection(RTMPClient *other)
 {
-	if(m_handshakeState == DisconnectedState)
-		return; // Already disconnected
-
-	// If we're still in forced buffer mode then something is probably wrong
-	if(m_bufferOutBufRef > 0) {
-		broLog(LOG_CAT, BroLog::Warning)
-			<< QStringLiteral("Attempting to disconnect while still in forced buffer mode");
-		while(m_bufferOutBufRef > 0)
-			endForceBufferWrite();
-	}
-
-	if(m_publisher != NULL) {
-		delete m_publisher;
-		m_publisher = NULL;
-	}
+	// Socket notifiers are bound to their descriptor and are recreated
 	if(m_socketWriteNotifier != NULL) {
 		delete m_socketWriteNotifier;
 		m_socketWriteNotifier = NULL;
 	}
-
-	if(!cleanDisconnect) {
-		// Disconnect uncleanly by closing the socket immediately
-		m_socket.abort();
-		m_handshakeState = DisconnectedState;
-		m_outBuf.clear();
-		m_inBuf.clear();
-		m_gamerOutBuf.clear();
-		emit disconnected();
-		return;
+	if(other->m_socketWriteNotifier != NULL) {
+		delete other->m_socketWriteNotifier;
+		other->m_socketWriteNotifier = NULL;
 	}
 
-	// TODO: Write RTMP NetConnection "close()" message here?
+	// Move the sockets between the clients
+	QObject::disconnect(m_socket, NULL, this, NULL);
+	QObject::disconnect(other->m_socket, NULL, other, NULL);
+	qSwap(m_socket, other->m_socket);
+	m_socket->setParent(this);
+	other->m_socket->setParent(other);
+	attachSocket();
+	other->attachSocket();
 
-	// Push all buffered data to Qt
-	m_socket.write(m_outBuf);
-	m_outBuf.clear();
-	if(s_inGamerMode) {
-		m_socket.write(m_gamerOutBuf);
-		m_gamerOutBuf.clear();
-	}
+	qSwap(m_remoteInfo, other->m_remoteInfo);
+	qSwap(m_resolvedAddress, other->m_resolvedAddress);
 
-	// Disconnect cleanly taking into account that we might not have even fully
-	// connected yet
-	m_handshakeState = DisconnectingState;
-	m_socket.disconnectFromHost();
-	m_inBuf.clear();
-	if(m_handshakeState == DisconnectingState &&
-		m_socket.state() == QAbstractSocket::UnconnectedState)
-	{
-		// `socketDisconnected()` was never called but the socket is actually
-		// disconnected
-		m_handshakeState = DisconnectedState;
-		emit disconnected();
+	// Connection state
+	qSwap(m_handshakeState, other->m_handshakeState);
+	qSwap(m_handshakeRandomData, other->m_handshakeRandomData);
+	qSwap(m_inMaxChunkSize, other->m_inMaxChunkSize);
+	qSwap(m_outMaxChunkSize, other->m_outMaxChunkSize);
+	qSwap(m_inAckWinSize, other->m_inAckWinSize);
+	qSwap(m_outAckWinSize, other->m_outAckWinSize);
+	qSwap(m_inAckLimitType, other->m_inAckLimitType);
+	qSwap(m_inBytesSinceLastAck, other->m_inBytesSinceLastAck);
+	qSwap(m_outBytesSinceLastAck, other->m_outBytesSinceLastAck);
+	qSwap(m_inBytesSinceHandshake, other->m_inBytesSinceHandshake);
+	qSwap(m_inChunkStreams, other->m_inChunkStreams);
+	qSwap(m_outChunkStreams, other->m_outChunkStreams);
+	qSwap(m_nextTransactionIds, other->m_nextTransactionIds);
+	qSwap(m_appConnected, other->m_appConnected);
+	qSwap(m_appConnectTransId, other->m_appConnectTransId);
+	qSwap(m_appObjectEncoding, other->m_appObjectEncoding);
+	qSwap(m_creatingStream, other->m_creatingStream);
+	qSwap(m_createStreamTransId, other->m_createStreamTransId);
+	qSwap(m_publishStreamId, other->m_publishStreamId);
+	qSwap(m_beginningPublish, other->m_beginningPublish);
+
+	// Input/output buffers
+	qSwap(m_outQueue, other->m_outQueue);
+	qSwap(m_outQueueBytes, other->m_outQueueBytes);
+	qSwap(m_outBlocked, other->m_outBlocked);
+	qSwap(m_inBuf, other->m_inBuf);
+}
+
+/// <summary>
+/// Sets how long the connection may go without making any forward progress
+/// while we have data waiting to be transmitted before it is declared
+/// stalled. A half-dead network path that never reports an error is
+/// otherwise only detected once the OS times out the socket which can take
+/// minutes. A stalled connection emits `ConnectionStalledError` and is then
+/// handled as if it was lost. The default of 0 disables the watchdog.
+/// </summary>
+void RTMPClient::setStallTimeout(uint msecs)
+{
+	m_stallTimeout = msecs;
+	m_stallLastProgress = m_outClock.elapsed();
+	if(m_stallTimeout == 0) {
+		m_stallTimer->stop();
+		return;
 	}
+	m_stallTimer->start(qBound(STALL_MIN_POLL_MSECS, (int)m_stallTimeout / 4,
+		STALL_MAX_POLL_MSECS));
 }
 
 /// <summary>
@@ -794,7 +2542,7 @@ void RTMPClient::disconnect(bool cleanDisconnect)
 int RTMPClient::getOSWriteBufferSize() const
 {
 #ifdef Q_OS_WIN
-	SOCKET desc = m_socket.socketDescriptor();
+	SOCKET desc = m_socket->socketDescriptor();
 	int size = 0;
 	int len = sizeof(size);
 	int ret = getsockopt(desc, SOL_SOCKET, SO_SNDBUF, (char *)&size, &len);
@@ -815,7 +2563,7 @@ int RTMPClient::getOSWriteBufferSize() const
 int RTMPClient::setOSWriteBufferSize(int size)
 {
 #ifdef Q_OS_WIN
-	SOCKET desc = m_socket.socketDescriptor();
+	SOCKET desc = m_socket->socketDescriptor();
 	int ret =
 		setsockopt(desc, SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(size));
 	if(ret != 0)
@@ -826,74 +2574,345 @@ int RTMPClient::setOSWriteBufferSize(int size)
 	return 0;
 }
 
-/// <summary>
-/// Appends the specified data to the output buffer that will be transmitted
-/// sometime in the future.
-///
-/// WARNING: This is a low-level method and should only be used for testing
-/// purposes.
-/// </summary>
-/// <returns>True if the data was added to the buffer</returns>
-bool RTMPClient::write(const QByteArray &data)
-{
-	// We can only write if we have a connected socket
-	switch(m_handshakeState) {
-	case DisconnectedState:
-	case ConnectingState:
-	case DisconnectingState:
-		emit error(InvalidWriteError);
-		return false;
-	default:
+/// <summary>
+/// Queries the OS for the statistics of our TCP connection. This requires
+/// Windows 10 version 1703 or later.
+/// </summary>
+/// <returns>True if `info` was filled</returns>
+bool RTMPClient::getOSTcpInfo(OSTcpInfo *info) const
+{
+#ifdef Q_OS_WIN
+	SOCKET desc = m_socket->socketDescriptor();
+	if(desc == INVALID_SOCKET)
+		return false;
+	DWORD ver = 0;
+	TCP_INFO_v0 tcpInfo;
+	DWORD len = 0;
+	int ret = WSAIoctl(desc, SIO_TCP_INFO, &ver, sizeof(ver),
+		&tcpInfo, sizeof(tcpInfo), &len, NULL, NULL);
+	if(ret != 0 || len < sizeof(tcpInfo))
+		return false;
+
+	// `BytesOut` includes retransmissions
+	quint64 sent = tcpInfo.BytesOut -
+		qMin(tcpInfo.BytesOut, (ULONG64)tcpInfo.BytesRetrans);
+	info->bytesInFlight = tcpInfo.BytesInFlight;
+	info->rttUs = tcpInfo.RttUs;
+	info->minRttUs = tcpInfo.MinRttUs;
+	info->cwnd = tcpInfo.Cwnd;
+	info->bytesAcked = sent - qMin(sent, (quint64)tcpInfo.BytesInFlight);
+	return true;
+#else
+#error Unsupported platform
+#endif
+}
+
+/// <summary>
+/// Appends the specified data to the output buffer that will be transmitted
+/// sometime in the future.
+///
+/// WARNING: This is a low-level method and should only be used for testing
+/// purposes.
+/// </summary>
+/// <returns>True if the data was added to the buffer</returns>
+bool RTMPClient::write(const QByteArray &data)
+{
+	// Fast exit if there is no data to write
+	if(data.isEmpty()) {
+		// We can only write if we have a connected socket
+		switch(m_handshakeState) {
+		case DisconnectedState:
+		case ConnectingState:
+		case DisconnectingState:
+			emit error(InvalidWriteError);
+			return false;
+		default:
+			break;
+		}
+		return true;
+	}
+
+	OutMessage *msg = new OutMessage();
+	msg->isRaw = true;
+	msg->msgLen = msg->payloadLen = data.size();
+	OutSegment seg = { data, 0, data.size() };
+	msg->payload.append(seg);
+	return queueMessage(msg);
+}
+
+/// <summary>
+/// Appends the specified message to the end of the output queue and attempts
+/// to transmit it immediately if we are allowed to. Takes ownership of `msg`.
+/// </summary>
+/// <returns>True if the message was added to the queue</returns>
+bool RTMPClient::queueMessage(OutMessage *msg)
+{
+	// We can only write if we have a connected socket
+	switch(m_handshakeState) {
+	case DisconnectedState:
+	case ConnectingState:
+	case DisconnectingState:
+		if(msg == m_progressiveMsg)
+			m_progressiveMsg = NULL;
+		delete msg;
+		emit error(InvalidWriteError);
+		return false;
+	default:
+		break;
+	}
+
+	// Once the frame drop engine has dropped a reference frame nothing can be
+	// decoded until the next keyframe
+	if(m_dropUntilKeyframe && msg->frameType != NotVideoFrame) {
+		if(msg->frameType != KeyVideoFrame) {
+			m_droppedFrames++;
+			if(msg == m_progressiveMsg)
+				m_progressiveMsg = NULL;
+			delete msg;
+			return false;
+		}
+		m_dropUntilKeyframe = false;
+	}
+
+	msg->enqueueTime = m_outClock.elapsed();
+	if(msg->csId == 2 &&
+		(msg->msgType == UserControlMsgType || msg->msgType == AckMsgType))
+	{
+		// Pings and acknowledgements are latency sensitive so they overtake
+		// queued media whose wire form hasn't been generated yet. Messages
+		// are still generated in queue order so the chunk stream state
+		// remains consistent.
+		int i = m_outQueue.size();
+		for(; i > 0; i--) {
+			const OutMessage *prev = m_outQueue.at(i - 1);
+			if(prev->isGenerated || prev->isRaw || prev == m_progressiveMsg)
+				break;
+			if(prev->msgType != AudioMsgType && prev->msgType != VideoMsgType)
+				break;
+		}
+		m_outQueue.insert(i, msg);
+	} else
+		m_outQueue.enqueue(msg);
+	m_outQueueBytes += msg->payloadLen;
+	if(msg->frameType != NotVideoFrame && dropFramesIfCongested(msg))
+		return false;
+
+	return flushIfAllowed();
+}
+
+/// <summary>
+/// Attempts to transmit the output queue immediately if we are allowed to.
+/// </summary>
+/// <returns>False if there was a socket error</returns>
+bool RTMPClient::flushIfAllowed()
+{
+	// If we're in gamer mode then we only write once per tick unless we're in
+	// "saturation mode" which we then behave normally.
+	if(s_inGamerMode && !m_gamerInSatMode)
+		return true;
+
+	// If we have been forced to buffer all writes then do so and return
+	if(m_bufferOutBufRef > 0)
+		return true;
+
+	// If the OS buffer is full then we'll continue once it has room
+	if(m_outBlocked)
+		return true;
+
+	// Write to the socket
+	if(flushOutQueue() < 0)
+		return false;
+	return true;
+}
+
+/// <summary>
+/// Generates the chunked form of the message that will actually be sent over
+/// the network. This MUST be called in the same order that messages are
+/// transmitted as it updates the output chunk stream state.
+/// </summary>
+void RTMPClient::generateMsgWire(OutMessage *msg)
+{
+	if(msg->isRaw) {
+		// Unchunked data is transmitted as-is
+		msg->isGenerated = true;
+		msg->wire = msg->payload;
+		msg->wireMapped = msg->payloadLen;
+		return;
+	}
+
+	// Initialize output chunk stream state if it's a new chunk stream
+	uint csId = msg->csId;
+	bool isNew = initOutChunkStreamState(csId);
+	if(isNew) {
+#if DEBUG_LOW_LEVEL_RTMP
+		broLog(LOG_CAT)
+			<< QStringLiteral("New output chunk stream ID: %L1").arg(csId);
+#endif // DEBUG_LOW_LEVEL_RTMP
+	}
+	ChunkStreamState state = m_outChunkStreams[csId];
+	quint32 timestamp = msg->timestamp;
+	msg->prevState = state;
+	msg->prevMaxChunkSize = m_outMaxChunkSize;
+
+	// Determine which message header type we will use. We want to use the
+	// smallest one possible.
+	uint fmt = 3;
+	// TODO: Make sure fmt=0: Delta = timestamp (Needed?)
+	if(state.timestampDelta != timestamp - state.timestamp)
+		fmt = 2;
+	if(state.msgLen != msg->msgLen || state.msgType != msg->msgType)
+		fmt = 1;
+	if(timestamp == 0 || timestamp < state.timestamp ||
+		state.msgStreamId != msg->msgStreamId)
+	{
+		fmt = 0;
+		if(timestamp < state.timestamp) {
+			// Timestamps should never decrease. See:
+			// http://www.wowza.com/forums/showthread.php?19539-RTMP-timestamp-values-on-live-streaming
+			broLog(LOG_CAT, BroLog::Warning)
+				<< QStringLiteral("Timestamp went back in time. Was=%L1, now=%L2")
+				.arg(state.timestamp).arg(timestamp);
+		}
+	}
+
+	// Update chunk stream state
+	RTMPChunkHeader hdr;
+	hdr.csId = csId;
+	hdr.fmt = fmt;
+	switch(fmt) {
+	default: // It's impossible to get a result that's outside 0-3
+	case 0:
+		state.timestamp = timestamp;
+		state.timestampDelta = timestamp; // Specification is weird
+		state.msgLen = msg->msgLen;
+		state.msgType = msg->msgType;
+		state.msgStreamId = msg->msgStreamId;
+		hdr.timestamp = state.timestamp;
+		break;
+	case 1:
+		state.timestampDelta = timestamp - state.timestamp;
+		state.timestamp = timestamp;
+		state.msgLen = msg->msgLen;
+		state.msgType = msg->msgType;
+		hdr.timestamp = state.timestampDelta;
+		break;
+	case 2:
+		state.timestampDelta = timestamp - state.timestamp;
+		state.timestamp = timestamp;
+		hdr.timestamp = state.timestampDelta;
+		break;
+	case 3:
+		// No header
 		break;
 	}
+	hdr.msgLen = state.msgLen;
+	hdr.msgType = state.msgType;
+	hdr.msgStreamId = state.msgStreamId;
+
+	// The first chunk uses the header that we calculated above while all
+	// following chunks use "type 3" headers. We assume that the timestamp
+	// delta is only applied to "type 3" headers if the current chunk isn't a
+	// continuation of the previous one. See the comments in
+	// `readChunkFromSocket()` about header types. As every "type 3" header of
+	// a message is identical we only encode it once. The `headers` buffer is
+	// never resized from here on so it's safe to reference it.
+	msg->headers.resize(2 * RTMP_MAX_CHUNK_HEADER_SIZE);
+	char *headPtr = msg->headers.data();
+	msg->firstHeaderSize = encodeRTMPChunkHeader(headPtr, hdr);
+	hdr.fmt = 3;
+	msg->contHeaderSize =
+		encodeRTMPChunkHeader(&headPtr[msg->firstHeaderSize], hdr);
+	msg->chunkSize = m_outMaxChunkSize;
+	msg->isGenerated = true;
+	msg->wire.clear();
+	msg->wire.reserve(
+		msg->msgLen / msg->chunkSize + msg->payload.size() + 2);
+	msg->wireMapped = 0;
+	msg->mapSegIndex = 0;
+	msg->mapSegOff = 0;
+	msg->wireHeaderBytes = 0;
+	if(msg->msgLen == 0) {
+		// Empty messages still need a header
+		OutSegment headSeg = { msg->headers, 0, msg->firstHeaderSize };
+		msg->wire.append(headSeg);
+		msg->wireHeaderBytes += headSeg.len;
+		m_outQueueBytes += headSeg.len;
+	}
+	extendMsgWire(msg);
 
-	// Fast exit if there is no data to write
-	if(data.isEmpty())
-		return true;
+	// Remember state for next time
+	m_outChunkStreams[csId] = state;
 
-	// If we're in gamer mode then we buffer writes so we can write it once per
-	// tick unless we're in "saturation mode" which we then behave normally.
-	if(s_inGamerMode && !m_gamerInSatMode) {
-		m_gamerOutBuf.append(data);
-		return true;
+	// Our maximum chunk size only changes once the remote host knows about it
+	if(msg->msgType == SetChunkSizeMsgType && msg->msgLen >= 4) {
+		const OutSegment &seg = msg->payload.at(0);
+		m_outMaxChunkSize =
+			decodeBEUInt32(&seg.buf.constData()[seg.off]) & 0x7FFFFFFF;
 	}
+}
 
-	// If we have been forced to buffer all writes then do so and return
-	if(m_bufferOutBufRef > 0) {
-		m_outBuf.append(data);
-		return true;
-	}
+/// <summary>
+/// Splits any part of the message's payload that isn't in its wire form yet
+/// into chunks. A chunk header is only added once the first byte of its chunk
+/// is available so that progressively written messages never contain a
+/// header without data following it.
+/// </summary>
+void RTMPClient::extendMsgWire(OutMessage *msg)
+{
+	if(msg->isRaw || msg->isAborted)
+		return;
+	uint chunkSize = msg->chunkSize;
+	while(msg->wireMapped < msg->payloadLen) {
+		// Chunk header
+		uint chunkOff = msg->wireMapped % chunkSize;
+		if(chunkOff == 0) {
+			OutSegment headSeg;
+			headSeg.buf = msg->headers;
+			if(msg->wireMapped == 0) {
+				headSeg.off = 0;
+				headSeg.len = msg->firstHeaderSize;
+			} else {
+				headSeg.off = msg->firstHeaderSize;
+				headSeg.len = msg->contHeaderSize;
+			}
+			msg->wire.append(headSeg);
+			msg->wireHeaderBytes += headSeg.len;
+			m_outQueueBytes += headSeg.len;
+		}
 
-	// Write to the socket taking into account our internal buffer
-	int ret = socketWrite(data);
-	if(ret < 0)
-		return false;
-	return true;
+		// Chunk payload, possibly spanning multiple payload segments
+		const OutSegment &seg = msg->payload.at(msg->mapSegIndex);
+		int len = qMin((int)(chunkSize - chunkOff), seg.len - msg->mapSegOff);
+		if(len > 0) {
+			OutSegment paySeg = { seg.buf, seg.off + msg->mapSegOff, len };
+			msg->wire.append(paySeg);
+			msg->wireMapped += len;
+			msg->mapSegOff += len;
+		}
+		if(msg->mapSegOff >= seg.len) {
+			msg->mapSegIndex++;
+			msg->mapSegOff = 0;
+		}
+	}
 }
 
 /// <summary>
-/// Writes the specified data to the Qt socket in a way that doesn't overflow
-/// the OS buffer. Always use this instead of `m_socket.write()`. Will attempt
-/// to write the internal buffer before the specified data if it's not empty.
-/// Pass an empty `data` to attempt to flush the internal buffer only. If
-/// `emitDataRequest` is true then if the buffer is fully emptied by this call
-/// the class will request any listening publishers to write more data to the
-/// socket.
+/// Transmits as much of the output queue as the OS will accept without
+/// overflowing its buffer. If `maxBytes` is not negative then no more than
+/// that amount of bytes is written. Always use this instead of
+/// `m_socket->write()`. If `emitDataRequest` is true then if the queue is fully
+/// emptied by this call the class will request any listening publishers to
+/// write more data to the socket.
 /// </summary>
 /// <returns>
 /// The best guess of the number of free bytes in the OS's send buffer or -1 if
 /// there was a socket error.
 /// </returns>
-int RTMPClient::socketWrite(const QByteArray &data, bool emitDataRequest)
+int RTMPClient::flushOutQueue(int maxBytes, bool emitDataRequest)
 {
-	// TODO: Currently this method doesn't support emitting a data request at
-	// the same time as writing more data to the socket. This is non-trivial to
-	// add and may require partial rewriting.
-	Q_ASSERT(!(emitDataRequest && !data.isEmpty()));
-
 	if(isSocketConnected() &&
-		(m_socket.state() == QAbstractSocket::UnconnectedState ||
-		m_socket.socketDescriptor() == -1))
+		(m_socket->state() == QAbstractSocket::UnconnectedState ||
+		m_socket->socketDescriptor() == -1))
 	{
 		// The socket was disconnected but Qt never emitted a `disconnect()` or
 		// `error()` signal. What most likely happened is that the remote host
@@ -913,115 +2932,556 @@ int RTMPClient::socketWrite(const QByteArray &data, bool emitDataRequest)
 		return -1;
 	}
 
-	// If there is anything in Qt's buffer attempt to flush it. If it cannot be
-	// flushed then we know that the OS buffer is full.
-	if(m_socket.bytesToWrite() > 0) {
-		// If we fully flush then we know that the OS buffer is partially
-		// filled and we shouldn't attempt to write as much data later
-		osWriteBufSize -= m_socket.bytesToWrite();
+	// We never write through Qt while connected but if there is anything in
+	// Qt's buffer attempt to flush it. If it cannot be flushed then we know
+	// that the OS buffer is full.
+	if(m_socket->bytesToWrite() > 0) {
+		osWriteBufSize -= m_socket->bytesToWrite();
 		osWriteBufSize = qMax(0, osWriteBufSize); // Done for safety
-		m_socketWriteNotifier->setEnabled(false);
-		m_socket.flush();
-		if(m_socket.bytesToWrite() > 0) {
-			//broLog() << "Waiting to empty Qt buffer: "
-			//	<< m_socket.bytesToWrite();
-			// OS buffer is full, buffer the new data for later
-			m_outBuf.append(data);
+		m_socket->flush();
+		if(m_socket->bytesToWrite() > 0) {
+			m_outBlocked = true;
 			m_socketWriteNotifier->setEnabled(true);
 			gamerEnterSatMode();
 			return 0;
 		}
 	}
 
-	// Attempt to flush any pending data in the buffer
-	if(!m_outBuf.isEmpty()) {
-		// Prevent just moving our internal buffer to Qt's buffer where we can
-		// no longer track congestion.
-		int bytesToWrite = qMin(m_outBuf.size(), osWriteBufSize);
+	// Stale media is worthless in low latency streams
+	dropExpiredMessages();
+
+	// Never write more than the size of the OS buffer at once. Windows will
+	// happily accept a single write that is larger than its buffer which
+	// prevents us from being able to track congestion.
+	int osBudget = osWriteBufSize;
+	int budget = osWriteBufSize;
+	if(maxBytes >= 0)
+		budget = qMin(budget, maxBytes);
+
+	// Transmit the queue using as few system calls as possible by gathering
+	// the segments of multiple messages into a single write
+	const int MAX_GATHER_SEGMENTS = 256;
+	int written = 0;
+	bool osFull = false;
+	OutSegmentList segs;
+	segs.reserve(MAX_GATHER_SEGMENTS);
+	while(!m_outQueue.isEmpty() && written < budget) {
+		segs.clear();
+		int gathered = 0;
+		for(int i = 0; i < m_outQueue.size(); i++) {
+			if(segs.size() >= MAX_GATHER_SEGMENTS)
+				break;
+			if(written + gathered >= budget)
+				break;
+			OutMessage *msg = m_outQueue.at(i);
+			if(!msg->isGenerated)
+				generateMsgWire(msg);
+			else
+				extendMsgWire(msg);
+			int off = msg->wireOff;
+			int j = msg->wireIndex;
+			for(; j < msg->wire.size(); j++) {
+				if(segs.size() >= MAX_GATHER_SEGMENTS)
+					break;
+				const OutSegment &seg = msg->wire.at(j);
+				int len = qMin(seg.len - off, budget - written - gathered);
+				if(len <= 0)
+					break;
+				OutSegment sendSeg = { seg.buf, seg.off + off, len };
+				segs.append(sendSeg);
+				gathered += len;
+				off = 0;
+			}
+			if(j < msg->wire.size() || !msg->isComplete())
+				break; // Messages must be transmitted in order
+		}
+		if(gathered == 0)
+			break;
 
-		// Call Qt's `write()` method. In "unbuffered" mode Qt will still
-		// buffer any data that was not written to the OS buffer so `written`
-		// can only be used to detect writing errors.
-		m_socketWriteNotifier->setEnabled(false);
-		qint64 written = m_socket.write(m_outBuf, bytesToWrite);
-		//broLog() << "Wrote: " << bytesToWrite;
-		if(written < 0)
+		int sent = socketWriteGather(segs);
+		if(sent < 0)
 			return -1;
-		Q_ASSERT(written == bytesToWrite); // Should be all or nothing
-
-		// Remove written data from our internal buffer
-		if(written >= m_outBuf.size()) {
-			emit dataWritten(m_outBuf); // TODO: Remove if possible
-			m_outBuf.clear();
-		} else {
-			emit dataWritten(m_outBuf.left(written)); // TODO: Remove if possible
-			m_outBuf.remove(0, written);
-			m_socketWriteNotifier->setEnabled(true);
-			//gamerEnterSatMode(); // Dangerous as it can write to the buffer
+		advanceOutQueue(sent);
+		written += sent;
+		if(sent < gathered) {
+			// The OS buffer is full
+			osFull = true;
+			break;
 		}
+	}
+
+	// As we just wrote to the OS buffer we know that it's now partially filled
+	osWriteBufSize = qMax(0, osWriteBufSize - written);
 
-		// As we just wrote to the OS buffer we know that it's now partially
-		// filled.
-		osWriteBufSize = qMax(0, osWriteBufSize - (int)written);
+	if(m_outQueue.isEmpty()) {
+		m_outBlocked = false;
+		m_socketWriteNotifier->setEnabled(false);
 
-		// Emit a data request if we now have an empty buffer. In gamer mode we
-		// let the caller emit the request as gamer mode has its own separate
-		// buffer.
-		if(m_outBuf.isEmpty() && emitDataRequest) {
-			//broLog() << "Buffer empty, emitting data request";
+		// Emit a data request now that we have an empty queue. In gamer mode we
+		// let the caller emit the request as gamer mode manages the queue
+		// itself.
+		if(emitDataRequest) {
+			//broLog() << "Queue empty, emitting data request";
 			if(!s_inGamerMode || m_gamerInSatMode) {
 				int bytesLeft = qMax(1, osWriteBufSize); // Ensure >= 1
 				if(m_publisher != NULL)
 					m_publisher->socketDataRequest(bytesLeft); // Remote emit
 			}
-			return 0; // TODO?
 		}
+	} else if(osFull || written >= osBudget) {
+		// We filled the OS buffer, continue once it has room again
+		m_outBlocked = true;
+		m_socketWriteNotifier->setEnabled(true);
+		gamerEnterSatMode();
+	}
+	return osWriteBufSize;
+}
 
-		// If there is anything in Qt's buffer or our buffer then we know that
-		// the new data will never be written to the OS buffer. Buffer it and
-		// return.
-		if(m_socket.bytesToWrite() > 0 || !m_outBuf.isEmpty()) {
-			m_outBuf.append(data);
-			m_socketWriteNotifier->setEnabled(true);
-			gamerEnterSatMode();
-			//broLog() << "Waiting to empty buffers: Qt="
-			//	<< m_socket.bytesToWrite() << ", internal=" << m_outBuf.size();
-			return 0;
+/// <summary>
+/// Writes the specified segments directly to the OS using a single system
+/// call. The socket is non-blocking so the OS may accept less than what was
+/// requested.
+/// </summary>
+/// <returns>The amount of bytes the OS accepted or -1 on error</returns>
+int RTMPClient::socketWriteGather(const OutSegmentList &segs)
+{
+#ifdef Q_OS_WIN
+	WSABUF bufs[256];
+	int numBufs = qMin(segs.size(), 256);
+	for(int i = 0; i < numBufs; i++) {
+		const OutSegment &seg = segs.at(i);
+		bufs[i].buf = const_cast<char *>(&seg.buf.constData()[seg.off]);
+		bufs[i].len = seg.len;
+	}
+	DWORD sent = 0;
+	SOCKET desc = m_socket->socketDescriptor();
+	int ret = WSASend(desc, bufs, numBufs, &sent, 0, NULL, NULL);
+	if(ret == SOCKET_ERROR) {
+		int err = WSAGetLastError();
+		if(err == WSAEWOULDBLOCK)
+			return 0; // OS buffer is full
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Failed to write to socket. Reason = %1")
+			.arg(err);
+		return -1;
+	}
+	return (int)sent;
+#else
+#error Unsupported platform
+#endif
+}
+
+/// <summary>
+/// Marks the next `numBytes` bytes of the output queue as transmitted and
+/// releases any messages that have been fully sent.
+/// </summary>
+void RTMPClient::advanceOutQueue(int numBytes)
+{
+	// Only bother creating a copy of the written data if someone is listening
+	bool emitWritten = (receivers(SIGNAL(dataWritten(QByteArray))) > 0);
+	QByteArray written;
+	qint64 now = m_outClock.elapsed();
+
+	m_outQueueBytes -= numBytes;
+	m_outTotalBytes += numBytes;
+	while(numBytes > 0 && !m_outQueue.isEmpty()) {
+		OutMessage *msg = m_outQueue.head();
+		if(msg->wireIndex >= msg->wire.size())
+			break; // Waiting for more of a progressively written message
+		const OutSegment &seg = msg->wire.at(msg->wireIndex);
+		int len = qMin(seg.len - msg->wireOff, numBytes);
+		if(emitWritten)
+			written.append(&seg.buf.constData()[seg.off + msg->wireOff], len);
+		numBytes -= len;
+		msg->wireOff += len;
+		if(msg->wireOff >= seg.len) {
+			msg->wireIndex++;
+			msg->wireOff = 0;
+		}
+		if(msg->wireIndex >= msg->wire.size() && msg->isComplete()) {
+#if DEBUG_LOW_LEVEL_RTMP
+			if(!msg->isRaw) {
+				broLog(LOG_CAT)
+					<< QStringLiteral(">>   Sent message type %L1 of size %L2 to stream %L3")
+					.arg((uint)msg->msgType).arg(msg->msgLen)
+					.arg(msg->msgStreamId);
+			}
+#endif // DEBUG_LOW_LEVEL_RTMP
+			if(msg->msgType == AudioMsgType || msg->msgType == VideoMsgType) {
+				m_outAvgQueueDelay = fltLerp(m_outAvgQueueDelay,
+					(float)(now - msg->enqueueTime), 0.1f);
+			}
+			delete m_outQueue.dequeue();
 		}
 	}
 
-	if(data.isEmpty())
-		return osWriteBufSize; // Nothing else to do
+	if(emitWritten)
+		emit dataWritten(written);
+}
 
-	// Prevent just moving our internal buffer to Qt's buffer where we can no
-	// longer track congestion.
-	int bytesToWrite = qMin(data.size(), osWriteBufSize);
+/// <summary>
+/// Releases every message in the output queue. If `pushToSocket` is true then
+/// all unsent data is first handed to Qt so that it can be transmitted before
+/// the socket is closed.
+/// </summary>
+void RTMPClient::clearOutQueue(bool pushToSocket)
+{
+	while(!m_outQueue.isEmpty()) {
+		OutMessage *msg = m_outQueue.dequeue();
+		if(pushToSocket) {
+			if(!msg->isGenerated)
+				generateMsgWire(msg);
+			int off = msg->wireOff;
+			for(int i = msg->wireIndex; i < msg->wire.size(); i++) {
+				const OutSegment &seg = msg->wire.at(i);
+				m_socket->write(
+					&seg.buf.constData()[seg.off + off], seg.len - off);
+				off = 0;
+			}
+		}
+		delete msg;
+	}
+	m_outQueueBytes = 0;
+	m_outBlocked = false;
+	m_progressiveMsg = NULL;
+}
 
-	// Call Qt's `write()` method. In "unbuffered" mode Qt will still
-	// buffer any data that was not written to the OS buffer so `written`
-	// can only be used to detect writing errors.
-	m_socketWriteNotifier->setEnabled(false);
-	qint64 written = m_socket.write(data, bytesToWrite);
-	//broLog() << "Wrote: " << bytesToWrite;
-	if(written < 0)
-		return -1;
-	Q_ASSERT(written == bytesToWrite); // Should be all or nothing
+/// <summary>
+/// Calculates the duration of audio and video that is waiting in the output
+/// queue based on the timestamps of the oldest and newest unsent messages.
+/// </summary>
+uint RTMPClient::getOutQueueMediaMsecs() const
+{
+	const OutMessage *oldest = NULL;
+	const OutMessage *newest = NULL;
+	for(int i = 0; i < m_outQueue.size(); i++) {
+		const OutMessage *msg = m_outQueue.at(i);
+		if(msg->msgType != AudioMsgType && msg->msgType != VideoMsgType)
+			continue;
+		if(oldest == NULL)
+			oldest = msg;
+		newest = msg;
+	}
+	if(oldest == NULL || newest->timestamp < oldest->timestamp)
+		return 0;
+	return newest->timestamp - oldest->timestamp;
+}
 
-	// As we just wrote to the OS buffer we know that it's now partially filled
-	osWriteBufSize = qMax(0, osWriteBufSize - (int)written);
+/// <summary>
+/// Has the output queue exceeded the thresholds of the frame drop engine?
+/// </summary>
+bool RTMPClient::isOutQueueCongested() const
+{
+	if(m_dropMaxQueueBytes > 0 && (uint)m_outQueueBytes > m_dropMaxQueueBytes)
+		return true;
+	if(m_dropMaxQueueMsecs > 0 &&
+		getOutQueueMediaMsecs() > m_dropMaxQueueMsecs)
+	{
+		return true;
+	}
+	return false;
+}
 
-	if(written == data.size()) {
-		//broLog() << "Wrote entire message";
-		emit dataWritten(data); // TODO: Remove if possible
-	} else {
-		// We only partially wrote our data to the socket, buffer the rest
-		//broLog() << "Only wrote " << written << " out of " << data.size();
-		emit dataWritten(data.left(written)); // TODO: Remove if possible
-		m_outBuf.append(data.right(data.size() - written));
-		m_socketWriteNotifier->setEnabled(true);
-		gamerEnterSatMode();
+/// <summary>
+/// The frame drop engine. If the output queue is congested then video frames
+/// that haven't begun transmission are dropped in an order that keeps the
+/// stream decodable: First non-reference frames from oldest to newest until
+/// the queue is no longer congested and then, if that wasn't enough, the
+/// first queued reference frame and every frame that depends on it up until
+/// the next keyframe. If there is no keyframe in the queue then all future
+/// frames are dropped until one arrives and the publisher requests one from
+/// the encoder. Audio and non-media messages are never dropped.
+/// </summary>
+/// <returns>True if `newMsg` was one of the dropped messages</returns>
+bool RTMPClient::dropFramesIfCongested(OutMessage *newMsg)
+{
+	if(!isOutQueueCongested())
+		return false;
+	bool droppedNew = false;
+
+	// Make every message that hasn't begun transmission removable
+	rewindOutQueue();
+
+	// Drop non-reference frames
+	for(int i = 0; i < m_outQueue.size(); i++) {
+		OutMessage *msg = m_outQueue.at(i);
+		if(msg->frameType != NonRefVideoFrame || msg->isGenerated)
+			continue;
+		if(msg == newMsg)
+			droppedNew = true;
+		dropOutMessage(i);
+		i--;
+		if(!isOutQueueCongested())
+			return droppedNew;
 	}
-	return osWriteBufSize;
+
+	// Drop the rest of the GOP starting from the first unsent reference frame
+	int i = 0;
+	for(; i < m_outQueue.size(); i++) {
+		OutMessage *msg = m_outQueue.at(i);
+		if(msg->frameType == RefVideoFrame && !msg->isGenerated)
+			break;
+	}
+	if(i >= m_outQueue.size())
+		return droppedNew; // Nothing left that we can drop
+	bool foundKeyframe = false;
+	while(i < m_outQueue.size()) {
+		OutMessage *msg = m_outQueue.at(i);
+		if(msg->frameType == KeyVideoFrame) {
+			foundKeyframe = true;
+			break;
+		}
+		if(msg->frameType == NotVideoFrame) {
+			i++;
+			continue;
+		}
+		if(msg == newMsg)
+			droppedNew = true;
+		dropOutMessage(i);
+	}
+	if(!foundKeyframe) {
+		m_dropUntilKeyframe = true;
+		if(m_publisher != NULL)
+			m_publisher->keyframeRequested(); // Remote emit
+	}
+
+	broLog(LOG_CAT, BroLog::Warning)
+		<< QStringLiteral("Output queue congested, dropped video until next keyframe");
+	return droppedNew;
+}
+
+/// <summary>
+/// Removes a message that hasn't begun transmission from the output queue.
+/// `rewindOutQueue()` must be called first if the message has a wire form.
+/// </summary>
+void RTMPClient::dropOutMessage(int index)
+{
+	OutMessage *msg = m_outQueue.takeAt(index);
+	m_outQueueBytes -= msg->payloadLen;
+	if(msg->frameType != NotVideoFrame)
+		m_droppedFrames++;
+	if(msg == m_progressiveMsg)
+		m_progressiveMsg = NULL;
+	delete msg;
+}
+
+/// <summary>
+/// Discards the wire form of every message that hasn't begun transmission and
+/// restores the output chunk stream states and chunk size to what they were
+/// before the wire forms were generated. As messages are transmitted in order
+/// this only ever affects the tail of the queue. Afterwards any message that
+/// hasn't begun transmission can be removed from the queue as its wire form
+/// will be regenerated once it is about to be sent.
+/// </summary>
+void RTMPClient::rewindOutQueue()
+{
+	// Revert in the opposite order to how they were generated
+	for(int i = m_outQueue.size() - 1; i >= 0; i--) {
+		OutMessage *msg = m_outQueue.at(i);
+		if(!msg->isGenerated)
+			continue; // Not generated yet
+		if(msg->isStarted())
+			break; // Already partially transmitted
+		if(!msg->isRaw) {
+			m_outChunkStreams[msg->csId] = msg->prevState;
+			m_outMaxChunkSize = msg->prevMaxChunkSize;
+		}
+		m_outQueueBytes -= msg->wireHeaderBytes; // Payload is still queued
+		msg->isGenerated = false;
+		msg->wire.clear();
+		msg->headers.clear();
+		msg->wireMapped = 0;
+		msg->mapSegIndex = 0;
+		msg->mapSegOff = 0;
+		msg->wireHeaderBytes = 0;
+	}
+}
+
+/// <summary>
+/// Terminates the partially transmitted message at the front of the output
+/// queue. The remainder of the chunk that is currently being transmitted is
+/// still sent so that the remote host can parse the chunk stream but all
+/// following chunks are discarded and an RTMP "Abort Message" is sent for
+/// the message's chunk stream instead. If the current chunk of a
+/// progressively written message isn't complete yet then it is padded with
+/// zeros as the remote host discards it anyway. The chunk stream state
+/// doesn't need to be changed as the remote host keeps the header fields of
+/// the aborted message.
+/// </summary>
+/// <returns>True if the message was terminated</returns>
+bool RTMPClient::abortPartialOutMessage()
+{
+	if(m_outQueue.isEmpty())
+		return false;
+	OutMessage *msg = m_outQueue.head();
+	if(msg->isRaw || msg->isAborted || !msg->isStarted())
+		return false; // Not started or cannot be aborted
+	extendMsgWire(msg);
+
+	// Find the beginning of the next chunk. Chunk headers are the only wire
+	// segments that reference the headers buffer.
+	const char *headers = msg->headers.constData();
+	int cut = msg->wireIndex;
+	if(msg->wireOff > 0)
+		cut++;
+	for(; cut < msg->wire.size(); cut++) {
+		if(msg->wire.at(cut).buf.constData() == headers)
+			break;
+	}
+	if(cut >= msg->wire.size()) {
+		if(msg->isComplete())
+			return false; // Currently sending the last chunk, let it complete
+
+		// Pad the rest of the current chunk
+		uint chunkOff = msg->wireMapped % msg->chunkSize;
+		if(chunkOff > 0) {
+			int padLen = (int)qMin(
+				msg->chunkSize - chunkOff, msg->msgLen - msg->wireMapped);
+			OutSegment padSeg = { QByteArray(padLen, 0), 0, padLen };
+			msg->wire.append(padSeg);
+			m_outQueueBytes += padLen;
+		}
+		cut = msg->wire.size();
+	}
+	for(int i = cut; i < msg->wire.size(); i++)
+		m_outQueueBytes -= msg->wire.at(i).len;
+	msg->wire.resize(cut);
+	msg->isAborted = true;
+	if(msg == m_progressiveMsg)
+		m_progressiveMsg = NULL;
+	if(msg->frameType != NotVideoFrame)
+		m_droppedFrames++;
+
+	// Queue the "Abort Message" directly after it
+	char data[4];
+	encodeBEUInt32(data, msg->csId);
+	OutMessage *abortMsg = new OutMessage();
+	abortMsg->csId = 2;
+	abortMsg->msgType = AbortMsgType;
+	abortMsg->msgLen = abortMsg->payloadLen = sizeof(data);
+	abortMsg->enqueueTime = m_outClock.elapsed();
+	OutSegment seg = { QByteArray(data, sizeof(data)), 0, sizeof(data) };
+	abortMsg->payload.append(seg);
+	m_outQueue.insert(1, abortMsg);
+	m_outQueueBytes += abortMsg->payloadLen;
+
+	// If we were cut exactly at a chunk boundary then nothing of the aborted
+	// message remains to be transmitted and it would otherwise block the
+	// queue forever
+	if(msg->wireIndex >= msg->wire.size())
+		delete m_outQueue.dequeue();
+
+	return true;
+}
+
+/// <summary>
+/// Removes every video frame from the output queue that hasn't been fully
+/// transmitted yet. A frame that is partially transmitted is terminated with
+/// an RTMP "Abort Message". As the stream cannot be decoded until the next
+/// keyframe all following video frames are dropped until one is written.
+/// </summary>
+/// <returns>The number of frames that were cancelled</returns>
+int RTMPClient::cancelQueuedVideo()
+{
+	uint prevDropped = m_droppedFrames;
+	cancelMuxedVideo();
+	rewindOutQueue();
+	for(int i = 0; i < m_outQueue.size(); i++) {
+		OutMessage *msg = m_outQueue.at(i);
+		if(msg->frameType == NotVideoFrame)
+			continue;
+		if(msg->isStarted()) {
+			abortPartialOutMessage();
+			continue;
+		}
+		dropOutMessage(i);
+		i--;
+	}
+	int numCancelled = (int)(m_droppedFrames - prevDropped);
+	if(numCancelled > 0 && !m_dropUntilKeyframe) {
+		m_dropUntilKeyframe = true;
+		if(m_publisher != NULL)
+			m_publisher->keyframeRequested(); // Remote emit
+	}
+	return numCancelled;
+}
+
+/// <summary>
+/// Enforces the latency budget by dropping every media message that hasn't
+/// begun transmission and has been in the queue for longer than the budget.
+/// Audio frames are independent of each other and are dropped individually.
+/// Expired non-reference video frames are also dropped individually but an
+/// expired reference frame or keyframe takes every following video frame
+/// with it up until the next keyframe that hasn't expired. If there is no
+/// such keyframe then we drop all video until one is written.
+/// </summary>
+void RTMPClient::dropExpiredMessages()
+{
+	if(m_latencyBudget == 0 || m_outQueue.isEmpty())
+		return;
+	qint64 deadline = m_outClock.elapsed() - (qint64)m_latencyBudget;
+
+	// Messages are queued in order so if the oldest unsent media message
+	// hasn't expired then nothing has
+	bool anyExpired = false;
+	for(int i = 0; i < m_outQueue.size(); i++) {
+		const OutMessage *msg = m_outQueue.at(i);
+		if(msg->msgType != AudioMsgType && msg->msgType != VideoMsgType)
+			continue;
+		if(msg->isStarted())
+			continue;
+		anyExpired = (msg->enqueueTime < deadline);
+		break;
+	}
+	if(!anyExpired)
+		return;
+
+	rewindOutQueue();
+	bool dropGop = false;
+	for(int i = 0; i < m_outQueue.size(); i++) {
+		OutMessage *msg = m_outQueue.at(i);
+		if(msg->isStarted())
+			continue; // Already being transmitted
+		bool expired = (msg->enqueueTime < deadline);
+		if(msg->msgType == AudioMsgType) {
+			if(expired) {
+				dropOutMessage(i);
+				i--;
+			}
+			continue;
+		}
+		if(msg->frameType == NotVideoFrame)
+			continue; // Not droppable
+		if(msg->frameType == KeyVideoFrame && !expired)
+			dropGop = false; // Decodable again from here
+		if(dropGop || expired) {
+			if(msg->frameType != NonRefVideoFrame)
+				dropGop = true;
+			dropOutMessage(i);
+			i--;
+		}
+	}
+	if(dropGop && !m_dropUntilKeyframe) {
+		m_dropUntilKeyframe = true;
+		if(m_publisher != NULL)
+			m_publisher->keyframeRequested(); // Remote emit
+	}
+}
+
+/// <summary>
+/// Calculates how long the oldest media message in the output queue has been
+/// waiting to be transmitted.
+/// </summary>
+/// <returns>The queueing delay in milliseconds</returns>
+uint RTMPClient::getOutQueueDelay() const
+{
+	for(int i = 0; i < m_outQueue.size(); i++) {
+		const OutMessage *msg = m_outQueue.at(i);
+		if(msg->msgType != AudioMsgType && msg->msgType != VideoMsgType)
+			continue;
+		return (uint)qMax((qint64)0, m_outClock.elapsed() - msg->enqueueTime);
+	}
+	return 0;
 }
 
 /// <summary>
@@ -1047,20 +3507,20 @@ void RTMPClient::endForceBufferWrite()
 }
 
 /// <summary>
-/// Attempt to write the entire pending output buffer to the socket. If
-/// `emitDataRequest` is true then if the buffer is fully emptied by this call
+/// Attempt to write the entire pending output queue to the socket. If
+/// `emitDataRequest` is true then if the queue is fully emptied by this call
 /// the class will request any listening publishers to write more data to the
 /// socket.
 /// </summary>
-/// <returns>True if the output buffer is empty</returns>
+/// <returns>True if the output queue is empty</returns>
 bool RTMPClient::attemptToEmptyOutBuf(bool emitDataRequest)
 {
-	if(m_outBuf.isEmpty())
-		return true; // Buffer is already empty
+	if(m_outQueue.isEmpty())
+		return true; // Queue is already empty
 	if(s_inGamerMode && !m_gamerInSatMode)
-		return m_outBuf.isEmpty();
-	socketWrite(QByteArray(), emitDataRequest);
-	return m_outBuf.isEmpty();
+		return false; // Gamer mode writes once per tick
+	flushOutQueue(-1, emitDataRequest);
+	return m_outQueue.isEmpty();
 }
 
 /// <summary>
@@ -1073,9 +3533,9 @@ bool RTMPClient::willWriteBuffer() const
 	// If we've forced buffering then it will definitely buffer
 	if(m_bufferOutBufRef > 0)
 		return true;
-	// If we have anything in our internal buffer then it's most likely because
-	// the OS's TCP write buffer is full.
-	if(!m_outBuf.isEmpty())
+	// If we're waiting for the OS then it's because the OS's TCP write buffer
+	// is full.
+	if(m_outBlocked)
 		return true;
 	return false;
 }
@@ -1158,8 +3618,7 @@ bool RTMPClient::writeC1S1()
 {
 	// Generate 1528 random bytes
 	m_handshakeRandomData.resize(1528);
-	for(int i = 0; i < m_handshakeRandomData.size(); i++)
-		m_handshakeRandomData.data()[i] = (char)qrand();
+	fillRandomBytes(m_handshakeRandomData.data(), 1528);
 
 	QDataStream *stream = beginWriteStream();
 	*stream << getCurrentTime32();
@@ -1190,185 +3649,149 @@ bool RTMPClient::writeC2S2(quint32 time, const QByteArray &echo)
 	bool ret = endWriteStream();
 #if DEBUG_RTMP_HANDSHAKE
 	if(ret)
-		broLog(LOG_CAT) << "Wrote C2";
-	else
-		broLog(LOG_CAT, BroLog::Warning) << "Failed to write C2";
-#endif
-	return ret;
-}
-
-/// <summary>
-/// Writes the specified RTMP message to the output buffer.
-/// </summary>
-/// <returns>True if the message was added to the buffer</returns>
-bool RTMPClient::writeMessage(
-	uint streamId,  RTMPClient::RTMPMsgType type, quint32 timestamp,
-	const QByteArray &msg, uint csId)
-{
-	// Initialize output chunk stream state if it's a new chunk stream
-	bool isNew = initOutChunkStreamState(csId);
-	if(isNew) {
-#if DEBUG_LOW_LEVEL_RTMP
-		broLog(LOG_CAT)
-			<< QStringLiteral("New output chunk stream ID: %L1").arg(csId);
-#endif // DEBUG_LOW_LEVEL_RTMP
-	}
-	ChunkStreamState state = m_outChunkStreams[csId];
-
-	// Validate input
-	if(csId > 65599 || csId <= 1) {
-		emit error(InvalidWriteError);
-		return false;
-	}
-
-	// Determine which message header type we will use. We want to use the
-	// smallest one possible.
-	uint fmt = 3;
-	// TODO: Make sure fmt=0: Delta = timestamp (Needed?)
-	if(state.timestampDelta != timestamp - state.timestamp)
-		fmt = 2;
-	if(state.msgLen != msg.size() || state.msgType != type)
-		fmt = 1;
-	if(timestamp == 0 || timestamp < state.timestamp ||
-		state.msgStreamId != streamId)
-	{
-		fmt = 0;
-		if(timestamp < state.timestamp) {
-			// Timestamps should never decrease. See:
-			// http://www.wowza.com/forums/showthread.php?19539-RTMP-timestamp-values-on-live-streaming
-			broLog(LOG_CAT, BroLog::Warning)
-				<< QStringLiteral("Timestamp went back in time. Was=%L1, now=%L2")
-				.arg(state.timestamp).arg(timestamp);
-		}
-	}
-
-	// Split the message up into chunks while writing to the data stream
-	QDataStream *stream = beginWriteStream();
-	Q_ASSERT(state.msgLenRemaining == 0);
-	state.msgLenRemaining = msg.size();
-	do {
-		// How much of the message can we send in this chunk?
-		int chunkLen = qMin(state.msgLenRemaining, m_outMaxChunkSize);
-
-		// Write basic header. We want to use the smallest one possible that
-		// can represent the chunk stream ID
-		int headSize = 0;
-		if(csId <= 63) {
-			// 1 byte basic header
-			unsigned char uc[1];
-			uc[0] = (fmt << 6) | csId;
-			stream->writeRawData((char *)uc, 1);
-			headSize += 1;
-		} else if(csId <= 319) {
-			// 2 byte basic header
-			unsigned char uc[2];
-			uc[0] = (fmt << 6);
-			uc[1] = csId - 64;
-			stream->writeRawData((char *)uc, 2);
-			headSize += 2;
-		} else {
-			// 3 byte basic header
-			unsigned char uc[3];
-			uc[0] = (fmt << 6) | 1;
-			uc[1] = ((csId - 64) >> 8);
-			uc[2] = (csId - 64) & 0xff;
-			stream->writeRawData((char *)uc, 3);
-			headSize += 3;
-		}
-
-		// Write message header
-		switch(fmt) {
-		default: // It's impossible to get a result that's outside 0-3
-		case 0:
-			// Update state
-			state.timestamp = timestamp;
-			state.timestampDelta = timestamp; // Specification is weird
-			state.msgLen = msg.size();
-			state.msgType = type;
-			state.msgStreamId = streamId;
-
-			// Write header
-			if(state.timestamp >= 0xFFFFFF)
-				writeUInt24(stream, 0xFFFFFF);
-			else
-				writeUInt24(stream, state.timestamp);
-			writeUInt24(stream, state.msgLen);
-			*stream << (quint8)state.msgType;
-			writeLEUInt32(stream, state.msgStreamId); // Little-endian
-			headSize += 11;
-			if(state.timestamp >= 0xFFFFFF) {
-				// Write extended timestamp
-				*stream << (quint32)state.timestamp;
-				headSize += 4;
-			}
-			break;
-		case 1:
-			// Update state
-			state.timestampDelta = timestamp - state.timestamp;
-			state.timestamp = timestamp;
-			state.msgLen = msg.size();
-			state.msgType = type;
-
-			// Write header
-			writeUInt24(stream, state.timestampDelta);
-			writeUInt24(stream, state.msgLen);
-			*stream << (quint8)state.msgType;
-			headSize += 7;
-			break;
-		case 2:
-			// Update state
-			state.timestampDelta = timestamp - state.timestamp;
-			state.timestamp = timestamp;
-
-			// Write header
-			writeUInt24(stream, state.timestampDelta);
-			headSize += 3;
-			break;
-		case 3:
-			// No header
-			break;
-		}
+		broLog(LOG_CAT) << "Wrote C2";
+	else
+		broLog(LOG_CAT, BroLog::Warning) << "Failed to write C2";
+#endif
+	return ret;
+}
 
-		// Write chunk payload
-		const char *data =
-			&msg.constData()[msg.size() - state.msgLenRemaining];
-		stream->writeRawData(data, chunkLen);
-		state.msgLenRemaining -= chunkLen;
+/// <summary>
+/// Writes the specified RTMP message to the output buffer.
+/// </summary>
+/// <returns>True if the message was added to the buffer</returns>
+bool RTMPClient::writeMessage(
+	uint streamId,  RTMPClient::RTMPMsgType type, quint32 timestamp,
+	const QByteArray &msg, uint csId)
+{
+	OutSegmentList payload;
+	OutSegment seg = { msg, 0, msg.size() };
+	payload.append(seg);
+	return writeMessage(streamId, type, timestamp, payload, csId);
+}
 
-#if DEBUG_LOW_LEVEL_RTMP
-		broLog(LOG_CAT)
-			<< QStringLiteral(">>   Sent chunk type %1 of size %L2 to chunk stream %L3")
-			.arg(fmt).arg(headSize + chunkLen).arg(csId);
-#endif // DEBUG_LOW_LEVEL_RTMP
+/// <summary>
+/// Writes the specified RTMP message to the output buffer. The message
+/// payload is the concatenation of all the segments in `payload`. The
+/// segments are referenced and not copied so buffers created with
+/// `QByteArray::fromRawData()` must remain valid until the message has been
+/// transmitted.
+/// </summary>
+/// <returns>True if the message was added to the buffer</returns>
+bool RTMPClient::writeMessage(
+	uint streamId,  RTMPClient::RTMPMsgType type, quint32 timestamp,
+	const OutSegmentList &payload, uint csId, VideoFrameType frameType)
+{
+	// Validate input
+	if(csId > 65599 || csId <= 1) {
+		emit error(InvalidWriteError);
+		return false;
+	}
 
-		// Do we need to send more chunks to completely write this message?
-		if(state.msgLenRemaining > 0) {
-			// We do. Change the message header format to "type 3". We assume
-			// that the timestamp delta is only applied to "type 3" headers if
-			// the current chunk isn't a continuation of the previous one. See
-			// the comments in `readChunkFromSocket()` about header types.
-			fmt = 3;
-		}
-	} while(state.msgLenRemaining > 0);
+	OutMessage *msg = new OutMessage();
+	msg->csId = csId;
+	msg->msgStreamId = streamId;
+	msg->msgType = type;
+	msg->timestamp = timestamp;
+	msg->payload = payload;
+	msg->frameType = frameType;
+	for(int i = 0; i < payload.size(); i++)
+		msg->msgLen += payload.at(i).len;
+	msg->payloadLen = msg->msgLen;
 
 	// TODO: We need to monitor `m_outBytesSinceLastAck` and not write data to
 	// the socket if the remote host hasn't acknowledged the previous window.
 
-	// Write the chunks to the output buffer
-	bool ret = endWriteStream();
-	if(!ret)
-		return false; // Failed to write
+	return queueMessage(msg);
+}
 
-#if DEBUG_LOW_LEVEL_RTMP
-	broLog(LOG_CAT)
-		<< QStringLiteral(">>   Sent message type %L1 of size %L2 to stream %L3")
-		.arg((uint)type).arg(msg.size()).arg(streamId);
-#endif // DEBUG_LOW_LEVEL_RTMP
+/// <summary>
+/// Begins writing an RTMP message whose payload isn't entirely known yet. The
+/// message is queued immediately and its payload is appended with
+/// `appendProgressiveMessage()`. Every chunk is transmitted as soon as it is
+/// complete. As messages are transmitted in order nothing that is queued
+/// after this message is sent until its entire payload has been appended.
+/// Only one progressive message can be written at a time.
+/// </summary>
+/// <returns>True if the message was added to the queue</returns>
+bool RTMPClient::beginProgressiveMessage(
+	uint streamId, RTMPMsgType type, quint32 timestamp, uint msgLen,
+	uint csId, VideoFrameType frameType)
+{
+	// Validate input
+	if(csId > 65599 || csId <= 1 || m_progressiveMsg != NULL) {
+		emit error(InvalidWriteError);
+		return false;
+	}
 
-	// Remember state for next time
-	m_outChunkStreams[csId] = state;
+	OutMessage *msg = new OutMessage();
+	msg->csId = csId;
+	msg->msgStreamId = streamId;
+	msg->msgType = type;
+	msg->timestamp = timestamp;
+	msg->msgLen = msgLen;
+	msg->frameType = frameType;
+	if(msgLen > 0)
+		m_progressiveMsg = msg; // Cleared if the message is deleted
+	return queueMessage(msg);
+}
 
-	return true;
+/// <summary>
+/// Appends the specified segment to the payload of the message that was
+/// begun with `beginProgressiveMessage()`. The message is complete once its
+/// entire declared length has been appended.
+/// </summary>
+/// <returns>True if the data was added to the message, false if there is no
+/// message or it was dropped while it was being written</returns>
+bool RTMPClient::appendProgressiveMessage(const OutSegment &seg)
+{
+	OutMessage *msg = m_progressiveMsg;
+	if(msg == NULL)
+		return false;
+	if(seg.len > (int)(msg->msgLen - msg->payloadLen)) {
+		emit error(InvalidWriteError);
+		return false;
+	}
+	if(seg.len <= 0)
+		return true;
+	msg->payload.append(seg);
+	msg->payloadLen += seg.len;
+	m_outQueueBytes += seg.len;
+	if(msg->payloadLen >= msg->msgLen)
+		m_progressiveMsg = NULL; // Complete
+	return flushIfAllowed();
+}
+
+/// <summary>
+/// Stops writing the message that was begun with `beginProgressiveMessage()`.
+/// If none of the message has been transmitted then it is removed from the
+/// queue otherwise it is terminated with an RTMP "Abort Message". Aborting a
+/// video frame that other frames may depend on drops all video until the
+/// next keyframe.
+/// </summary>
+void RTMPClient::abortProgressiveMessage()
+{
+	OutMessage *msg = m_progressiveMsg;
+	if(msg == NULL)
+		return;
+	VideoFrameType frameType = msg->frameType;
+	if(msg->isStarted()) {
+		abortPartialOutMessage();
+		m_progressiveMsg = NULL;
+		flushIfAllowed();
+	} else {
+		rewindOutQueue();
+		int index = m_outQueue.indexOf(msg);
+		if(index >= 0)
+			dropOutMessage(index);
+	}
+	if(frameType != NotVideoFrame && frameType != NonRefVideoFrame &&
+		!m_dropUntilKeyframe)
+	{
+		m_dropUntilKeyframe = true;
+		if(m_publisher != NULL)
+			m_publisher->keyframeRequested(); // Remote emit
+	}
 }
 
 /// <summary>
@@ -1379,9 +3802,25 @@ bool RTMPClient::writeAcknowledge()
 {
 	char data[4];
 	char *off = data;
-	off = amfEncodeUInt32(off, m_inBytesSinceHandshake);
+	off = encodeBEUInt32(off, m_inBytesSinceHandshake);
 	return writeMessage(0, AckMsgType, 0,
-		QByteArray::fromRawData(data, sizeof(data)), 2);
+		QByteArray(data, sizeof(data)), 2);
+}
+
+/// <summary>
+/// Asks the remote host to echo our current time so that we can measure the
+/// application-level round-trip time.
+/// </summary>
+/// <returns>True if the request was added to the output buffer</returns>
+bool RTMPClient::writePingRequest()
+{
+	char data[6];
+	char *off = data;
+	off = encodeBEUInt16(off, PingRequestType);
+	off = encodeBEUInt32(off, (quint32)m_outClock.elapsed());
+	m_pingSent = true;
+	return writeMessage(0, UserControlMsgType, 0,
+		QByteArray(data, sizeof(data)), 2);
 }
 
 /// <summary>
@@ -1392,14 +3831,22 @@ bool RTMPClient::writePingResponse(uint timestamp)
 {
 	char data[6];
 	char *off = data;
-	off = amfEncodeUInt16(off, PingResponseType);
-	off = amfEncodeUInt32(off, timestamp);
+	off = encodeBEUInt16(off, PingResponseType);
+	off = encodeBEUInt32(off, timestamp);
 	return writeMessage(0, UserControlMsgType, 0,
-		QByteArray::fromRawData(data, sizeof(data)), 2);
+		QByteArray(data, sizeof(data)), 2);
 }
 
+/// <summary>
+/// Writes an out-of-band video message such as a sequence header. Everything
+/// that is waiting in the A/V mux is written first and the timestamp is
+/// clamped so that it never goes back in time.
+/// </summary>
 bool RTMPClient::writeVideoData(uint timestamp, const QByteArray &data)
 {
+	releaseMuxMessages(true);
+	timestamp = clampMuxTimestamp(timestamp);
+	m_cacheVideoHeader = data;
 	bool ret = writeMessage(
 		m_publishStreamId, VideoMsgType, timestamp, data, 4);
 	if(ret && timestamp > m_lastPublishTimestamp)
@@ -1407,8 +3854,21 @@ bool RTMPClient::writeVideoData(uint timestamp, const QByteArray &data)
 	return ret;
 }
 
+bool RTMPClient::writeVideoData(
+	uint timestamp, const OutSegmentList &data, VideoFrameType frameType)
+{
+	return muxMediaMessage(VideoMsgType, timestamp, data, frameType);
+}
+
+/// <summary>
+/// Writes an out-of-band audio message. See the `QByteArray` version of
+/// `writeVideoData()`.
+/// </summary>
 bool RTMPClient::writeAudioData(uint timestamp, const QByteArray &data)
 {
+	releaseMuxMessages(true);
+	timestamp = clampMuxTimestamp(timestamp);
+	m_cacheAudioHeader = data;
 	bool ret = writeMessage(
 		m_publishStreamId, AudioMsgType, timestamp, data, 4);
 	if(ret && timestamp > m_lastPublishTimestamp)
@@ -1416,6 +3876,298 @@ bool RTMPClient::writeAudioData(uint timestamp, const QByteArray &data)
 	return ret;
 }
 
+bool RTMPClient::writeAudioData(uint timestamp, const OutSegmentList &data)
+{
+	return muxMediaMessage(AudioMsgType, timestamp, data);
+}
+
+/// <summary>
+/// Passes an audio or video message through the A/V mux. Audio and video
+/// share a single chunk stream so their timestamps must never decrease or
+/// the server may reject the stream. Each track's input timestamps are first
+/// rebased if they jump far back in time, such as when an encoder restarts.
+/// If the mux window is enabled the message is then held in timestamp order
+/// until the other track has caught up with it or it is older than the
+/// window. Any timestamp that would still be out of order once it leaves the
+/// mux is clamped to the last one that was written.
+/// </summary>
+/// <returns>True if the message was accepted</returns>
+bool RTMPClient::muxMediaMessage(
+	RTMPMsgType type, quint32 timestamp, const OutSegmentList &payload,
+	VideoFrameType frameType)
+{
+	// We can only write if we have a connected socket
+	switch(m_handshakeState) {
+	case DisconnectedState:
+	case ConnectingState:
+	case DisconnectingState:
+		emit error(InvalidWriteError);
+		return false;
+	default:
+		break;
+	}
+
+	// Rebase the track if it went far back in time
+	int track = (type == VideoMsgType) ? 1 : 0;
+	timestamp += m_muxInOffsets[track];
+	quint32 lastIn = m_muxLastInTimestamps[track];
+	if(m_muxSeenTracks[track] &&
+		timestamp + MUX_REBASE_THRESHOLD_MSECS < lastIn)
+	{
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Rebasing %1 timestamps. Was=%L2, now=%L3")
+			.arg(track == 1 ? QStringLiteral("video") : QStringLiteral("audio"))
+			.arg(lastIn).arg(timestamp);
+		m_muxInOffsets[track] += lastIn - timestamp;
+		timestamp = lastIn;
+		m_muxNumAdjusted++;
+	}
+	if(!m_muxSeenTracks[track] || timestamp > lastIn)
+		m_muxLastInTimestamps[track] = timestamp;
+	m_muxSeenTracks[track] = true;
+
+	// Insert the message into the mux in timestamp order. Messages with the
+	// same timestamp keep the order that they were written in. New messages
+	// almost always belong at the end so search backwards.
+	MuxEntry entry;
+	entry.msgType = type;
+	entry.timestamp = timestamp;
+	entry.payload = payload;
+	entry.frameType = frameType;
+	int index = m_muxQueue.size();
+	while(index > 0 && m_muxQueue.at(index - 1).timestamp > timestamp)
+		index--;
+	m_muxQueue.insert(index, entry);
+	if(track == 1)
+		m_muxNumVideo++;
+
+	return releaseMuxMessages();
+}
+
+/// <summary>
+/// Writes every message at the front of the A/V mux that can no longer be
+/// preceded by a message from the other track. As each track is monotonic
+/// this is the case once the other track has a later message waiting, if
+/// the other track has never been written to or if the message has been
+/// waiting for longer than the mux window. If `releaseAll` is true then the
+/// entire mux is written.
+/// </summary>
+/// <returns>False if a message could not be written</returns>
+bool RTMPClient::releaseMuxMessages(bool releaseAll)
+{
+	bool ret = true;
+	while(!m_muxQueue.isEmpty()) {
+		const MuxEntry &head = m_muxQueue.first();
+		bool isVideo = (head.msgType == VideoMsgType);
+		if(!releaseAll && m_muxWindow > 0) {
+			int numOther = isVideo
+				? m_muxQueue.size() - m_muxNumVideo : m_muxNumVideo;
+			bool otherSeen = m_muxSeenTracks[isVideo ? 0 : 1];
+			quint32 waited = m_muxQueue.last().timestamp - head.timestamp;
+			if(otherSeen && numOther == 0 && waited < m_muxWindow)
+				break; // The other track may still write an earlier message
+		}
+		MuxEntry entry = m_muxQueue.takeFirst();
+		if(isVideo)
+			m_muxNumVideo--;
+
+		entry.timestamp = clampMuxTimestamp(entry.timestamp);
+		quint32 timestamp = entry.timestamp;
+		cacheMediaMessage(entry);
+		if(!writeMessage(m_publishStreamId, entry.msgType, timestamp,
+			entry.payload, 4, entry.frameType))
+		{
+			ret = false;
+			continue;
+		}
+		if(timestamp > m_lastPublishTimestamp)
+			m_lastPublishTimestamp = timestamp;
+	}
+	return ret;
+}
+
+/// <summary>
+/// Returns the timestamp that a media message should be written with so that
+/// the shared audio/video chunk stream never goes back in time. Must be
+/// called in the same order that messages are written.
+/// </summary>
+quint32 RTMPClient::clampMuxTimestamp(quint32 timestamp)
+{
+	if(timestamp < m_muxLastOutTimestamp) {
+		timestamp = m_muxLastOutTimestamp;
+		m_muxNumAdjusted++;
+	}
+	m_muxLastOutTimestamp = timestamp;
+	return timestamp;
+}
+
+/// <summary>
+/// Removes all video messages that are waiting in the A/V mux.
+/// </summary>
+/// <returns>The number of video messages that were removed</returns>
+int RTMPClient::cancelMuxedVideo()
+{
+	int numCancelled = 0;
+	for(int i = 0; i < m_muxQueue.size(); i++) {
+		if(m_muxQueue.at(i).msgType != VideoMsgType)
+			continue;
+		m_muxQueue.removeAt(i);
+		i--;
+		numCancelled++;
+	}
+	m_muxNumVideo = 0;
+	m_droppedFrames += numCancelled;
+	return numCancelled;
+}
+
+/// <summary>
+/// Returns a payload that can be kept for longer than the message's trip
+/// through the output queue. Segments that reference memory we don't own,
+/// i.e. externally owned frames, `QByteArray::fromRawData()` buffers and the
+/// publisher's reusable reserve buffer, are coalesced into a single copy so
+/// that the application's memory is released and can be reused as soon as
+/// the message has been transmitted. Payloads that only reference implicitly
+/// shared buffers are returned as-is.
+/// </summary>
+RTMPClient::OutSegmentList RTMPClient::retainableSegments(
+	const OutSegmentList &segs) const
+{
+	const char *reserveBuf = NULL;
+	if(m_publisher != NULL && !m_publisher->m_reserveBuf.isEmpty())
+		reserveBuf = m_publisher->m_reserveBuf.constData();
+	bool needsCopy = false;
+	int size = 0;
+	for(int i = 0; i < segs.size(); i++) {
+		const OutSegment &seg = segs.at(i);
+		size += seg.len;
+		if(!seg.owner.isNull() || seg.buf.constData() == reserveBuf ||
+			const_cast<QByteArray &>(seg.buf).data_ptr()->alloc == 0)
+		{
+			needsCopy = true;
+		}
+	}
+	if(!needsCopy)
+		return segs;
+
+	QByteArray data(size, Qt::Uninitialized);
+	char *ptr = data.data();
+	for(int i = 0; i < segs.size(); i++) {
+		const OutSegment &seg = segs.at(i);
+		memcpy(ptr, &seg.buf.constData()[seg.off], seg.len);
+		ptr += seg.len;
+	}
+	OutSegmentList ret;
+	OutSegment seg = { data, 0, size };
+	ret.append(seg);
+	return ret;
+}
+
+/// <summary>
+/// Adds a media message that has left the A/V mux to the cached GOP. The
+/// cache is restarted at every keyframe. If the GOP grows larger than the
+/// cache limit then nothing is cached until the next keyframe as a partial
+/// GOP cannot be decoded. Frame data that we don't own is copied into the
+/// cache.
+/// </summary>
+void RTMPClient::cacheMediaMessage(const MuxEntry &entry)
+{
+	if(m_cacheGopMaxBytes == 0)
+		return;
+	if(entry.frameType == KeyVideoFrame) {
+		m_cacheGop.clear();
+		m_cacheGopBytes = 0;
+		m_cacheGopValid = true;
+	} else if(!m_cacheGopValid)
+		return;
+
+	uint size = 0;
+	for(int i = 0; i < entry.payload.size(); i++)
+		size += entry.payload.at(i).len;
+	if(m_cacheGopBytes + size > m_cacheGopMaxBytes) {
+		invalidateGopCache();
+		return;
+	}
+	MuxEntry cached = entry;
+	cached.payload = retainableSegments(entry.payload);
+	m_cacheGop.append(cached);
+	m_cacheGopBytes += size;
+}
+
+/// <summary>
+/// Empties the cached GOP and stops caching until the next keyframe.
+/// </summary>
+void RTMPClient::invalidateGopCache()
+{
+	m_cacheGop.clear();
+	m_cacheGopBytes = 0;
+	m_cacheGopValid = false;
+}
+
+/// <summary>
+/// Writes the cached metadata, sequence headers and GOP to a publish stream
+/// that has just become ready so that viewers can begin decoding without
+/// waiting for the application to resend them and for the next keyframe.
+/// If there is no cached GOP then any media that was held when the previous
+/// connection was lost is written instead.
+/// The cached GOP keeps its original timestamps and the A/V mux is seeded
+/// with them so that an application that restarts its timeline at zero is
+/// rebased to continue from the replayed frames.
+/// </summary>
+void RTMPClient::replayStreamCache()
+{
+	if(m_publisher == NULL || m_publishStreamId == 0)
+		return;
+	m_publisher->m_isAvc = m_cacheIsAvc;
+	m_publisher->m_isAvccPassthrough = m_cacheIsAvccPassthrough;
+
+	// Transmit everything together
+	beginForceBufferWrite();
+	if(m_cacheDataFrame != NULL)
+		writeSetDataFrameMsg(m_cacheDataFrame);
+	if(!m_cacheVideoHeader.isEmpty()) {
+		writeMessage(
+			m_publishStreamId, VideoMsgType, 0, m_cacheVideoHeader, 4);
+	}
+	if(!m_cacheAudioHeader.isEmpty()) {
+		writeMessage(
+			m_publishStreamId, AudioMsgType, 0, m_cacheAudioHeader, 4);
+	}
+	// Without a cached GOP the best we can do is to resend the media that
+	// was still queued when the connection was lost. It may depend on frames
+	// that were lost with the connection so request a new keyframe.
+	const QList<MuxEntry> &replay =
+		m_cacheGop.isEmpty() ? m_reconnectHeld : m_cacheGop;
+	if(m_cacheGop.isEmpty() && m_reconnecting && !m_dropUntilKeyframe) {
+		m_dropUntilKeyframe = true;
+		m_publisher->keyframeRequested(); // Remote emit
+	}
+
+	// The replayed media precedes the last message that was written on the
+	// lost connection so rewind the output clock or every replayed message
+	// would be clamped to the same timestamp
+	if(!replay.isEmpty())
+		m_muxLastOutTimestamp = replay.first().timestamp;
+	for(int i = 0; i < replay.size(); i++) {
+		const MuxEntry &entry = replay.at(i);
+		quint32 timestamp = clampMuxTimestamp(entry.timestamp);
+		int track = (entry.msgType == VideoMsgType) ? 1 : 0;
+		m_muxSeenTracks[track] = true;
+		m_muxLastInTimestamps[track] = timestamp;
+		if(timestamp > m_lastPublishTimestamp)
+			m_lastPublishTimestamp = timestamp;
+		writeMessage(m_publishStreamId, entry.msgType, timestamp,
+			entry.payload, 4, entry.frameType);
+	}
+	endForceBufferWrite();
+
+	if(!replay.isEmpty()) {
+		broLog(LOG_CAT)
+			<< QStringLiteral("Replayed %L1 cached media messages")
+			.arg(replay.size());
+	}
+	m_reconnectHeld.clear();
+}
+
 /// <summary>
 /// Writes the AMF 0 "connect()" message to the output buffer.
 /// </summary>
@@ -1442,6 +4194,10 @@ bool RTMPClient::writeConnectMsg(uint transactionId)
 	obj["type"] = new AMFString("nonprivate");
 	obj["flashVer"] = new AMFString(m_versionString);
 	obj["swfUrl"] = new AMFString(m_remoteInfo.asUrl());
+	if(m_objectEncoding == 3) {
+		// FMLE never sends this so only include it when it's needed
+		obj["objectEncoding"] = new AMFNumber(3.0);
+	}
 	data.append(obj.serialized());
 
 	return writeMessage(0, CommandAmf0MsgType, 0, data, 3);
@@ -1576,17 +4332,36 @@ bool RTMPClient::writePublishMsg(uint streamId)
 }
 
 /// <summary>
-/// Writes the AMF 0 "@setDataFrame()" message to the output buffer.
+/// Writes the "@setDataFrame()" message to the output buffer. If AMF 3 was
+/// negotiated during "connect()" then the stream data is sent as an AMF 3
+/// value inside of an AMF 3 data message. Takes ownership of `streamData`
+/// which replaces the cached data frame.
 /// </summary>
 /// <returns>True if the message was added to the buffer</returns>
 bool RTMPClient::writeSetDataFrameMsg(AMFObject *streamData)
 {
+	if(streamData != m_cacheDataFrame) {
+		delete m_cacheDataFrame;
+		m_cacheDataFrame = streamData;
+	}
 	if(m_publisher == NULL || m_publishStreamId == 0)
 		return false;
-	QByteArray data = AMFString("@setDataFrame").serialized();
+	if(m_appObjectEncoding != 3) {
+		QByteArray data = AMFString("@setDataFrame").serialized();
+		data.append(AMFString("onMetaData").serialized());
+		data.append(streamData->serialized());
+		return writeMessage(m_publishStreamId, DataAmf0MsgType, 0, data, 4);
+	}
+
+	// AMF 3 messages are prefixed with a single byte that is always zero and
+	// the body itself is still an AMF 0 stream
+	AMF3Context ctx;
+	QByteArray data(1, 0x00);
+	data.append(AMFString("@setDataFrame").serialized());
 	data.append(AMFString("onMetaData").serialized());
-	data.append(streamData->serialized());
-	return writeMessage(m_publishStreamId, DataAmf0MsgType, 0, data, 4);
+	data.append((char)0x11); // "avmplus-object-marker"
+	data.append(streamData->serializedAmf3(&ctx));
+	return writeMessage(m_publishStreamId, DataAmf3MsgType, 0, data, 4);
 }
 
 /// <summary>
@@ -1597,13 +4372,10 @@ bool RTMPClient::setMaxChunkSize(uint maxSize)
 {
 	char data[4];
 	char *off = data;
-	off = amfEncodeUInt32(off, maxSize & 0x7FFFFFFF);
-	bool ret = writeMessage(0, SetChunkSizeMsgType, 0,
-		QByteArray::fromRawData(data, sizeof(data)), 2);
-	if(!ret)
-		return false;
-	m_outMaxChunkSize = maxSize;
-	return true;
+	off = encodeBEUInt32(off, maxSize & 0x7FFFFFFF);
+	// Our maximum chunk size is updated once the message is transmitted
+	return writeMessage(0, SetChunkSizeMsgType, 0,
+		QByteArray(data, sizeof(data)), 2);
 }
 
 /// <summary>
@@ -1614,40 +4386,281 @@ bool RTMPClient::setAckWinSize(uint ackWinSize)
 {
 	char data[4];
 	char *off = data;
-	off = amfEncodeUInt32(off, ackWinSize);
+	off = encodeBEUInt32(off, ackWinSize);
 	bool ret = writeMessage(0, WindowAckSizeMsgType, 0,
-		QByteArray::fromRawData(data, sizeof(data)), 2);
+		QByteArray(data, sizeof(data)), 2);
 	if(!ret)
 		return false;
 	m_outAckWinSize = ackWinSize;
 	return true;
 }
 
-/// <summary>
-/// Request that the remote host limit its output bandwidth by setting its
-/// acknowledgement window to the specified settings.
-/// </summary>
-/// <returns>True if the message was added to the output buffer</returns>
-bool RTMPClient::setPeerBandwidth(uint ackWinSize, AckLimitType limitType)
-{
-	char data[5];
-	char *off = data;
-	off = amfEncodeUInt32(off, ackWinSize);
-	off = amfEncodeUInt8(off, limitType);
-	return writeMessage(0, SetPeerBWMsgType, 0,
-		QByteArray::fromRawData(data, sizeof(data)), 2);
+/// <summary>
+/// Request that the remote host limit its output bandwidth by setting its
+/// acknowledgement window to the specified settings.
+/// </summary>
+/// <returns>True if the message was added to the output buffer</returns>
+bool RTMPClient::setPeerBandwidth(uint ackWinSize, AckLimitType limitType)
+{
+	char data[5];
+	char *off = data;
+	off = encodeBEUInt32(off, ackWinSize);
+	off = amfEncodeUInt8(off, limitType);
+	return writeMessage(0, SetPeerBWMsgType, 0,
+		QByteArray(data, sizeof(data)), 2);
+}
+
+/// <summary>
+/// Sets the maximum size in bytes of the group of pictures that is cached
+/// and replayed to new publish streams. GOP caching is disabled (zero) by
+/// default and the last metadata and sequence headers are always cached.
+/// Implicitly shared frame data is referenced by the cache while externally
+/// owned frames, `QByteArray::fromRawData()` buffers and frames written with
+/// `RTMPPublisher::reserveVideoFrame()` are copied so that their memory can
+/// be released or reused immediately. Enabling the cache therefore costs a
+/// `memcpy()` of every such frame on the write path, which is significant at
+/// high bitrates, in exchange for viewers being able to decode immediately
+/// after a reconnect.
+/// </summary>
+void RTMPClient::setGopCacheLimit(uint maxBytes)
+{
+	m_cacheGopMaxBytes = maxBytes;
+	if(m_cacheGopBytes > maxBytes)
+		invalidateGopCache();
+}
+
+/// <summary>
+/// Enables or disables the reconnect supervisor. When enabled and the
+/// connection of a client that is publishing is lost without the application
+/// calling `disconnect()` the publisher is kept alive and the client
+/// immediately reconnects to the same address, recreates the publish stream
+/// and replays the stream cache without any application involvement.
+/// Timestamps continue from where they were. `reconnecting()` is emitted
+/// before every attempt and the publisher's `ready()` and `reconnected()`
+/// are emitted once publishing has resumed. The socket error that caused the
+/// connection loss is still reported with `error()` but `disconnected()` is
+/// only emitted if the supervisor gives up after `maxAttempts` attempts
+/// (0 = Unlimited) or the application calls `disconnect()`.
+/// </summary>
+void RTMPClient::setAutoReconnect(bool enabled, int maxAttempts)
+{
+	m_reconnectEnabled = enabled;
+	m_reconnectMaxAttempts = qMax(maxAttempts, 0);
+	if(!enabled && m_reconnecting)
+		disconnect(false);
+}
+
+/// <summary>
+/// Forgets all cached metadata, sequence headers and media. Must be called
+/// before publishing a different stream with this client.
+/// </summary>
+void RTMPClient::clearStreamCache()
+{
+	delete m_cacheDataFrame;
+	m_cacheDataFrame = NULL;
+	m_cacheVideoHeader.clear();
+	m_cacheAudioHeader.clear();
+	m_cacheIsAvc = false;
+	m_cacheIsAvccPassthrough = false;
+	invalidateGopCache();
+}
+
+/// <summary>
+/// Forgets everything that the network estimator has learnt. Called whenever
+/// we start using a different TCP connection.
+/// </summary>
+void RTMPClient::resetNetworkEstimate()
+{
+	m_estLastSampleTime = -1;
+	m_estLastBytes = 0;
+	m_estBandwidth = 0.0f;
+	m_estRtt = 0.0f;
+	m_estRttVar = 0.0f;
+	m_estMinRtt = 0.0f;
+	m_estCwnd = 0;
+	m_estLastAckSeq = 0;
+	m_estLastAckTime = -1;
+	m_estOutBytesAtAck = 0;
+	m_estAckRate = 0.0f;
+	m_abrLastQueueBytes = 0;
+	m_pingSent = false;
+	m_pingRtt = 0.0f;
+	if(isSocketConnected())
+		m_estTimer->start(EST_SAMPLE_MSECS);
+}
+
+/// <summary>
+/// Called whenever the server acknowledges that it has received `seq` bytes
+/// from us. The rate that the sequence number advances at is how quickly our
+/// data actually reaches the server.
+/// </summary>
+void RTMPClient::processAcknowledgement(quint32 seq)
+{
+	qint64 now = m_outClock.elapsed();
+	if(m_estLastAckTime >= 0 && now > m_estLastAckTime) {
+		// Sequence numbers wrap at 4 GB
+		float rate = (float)(quint32)(seq - m_estLastAckSeq) * 1000.0f /
+			(float)(now - m_estLastAckTime);
+		if(m_estAckRate <= 0.0f)
+			m_estAckRate = rate;
+		else
+			m_estAckRate = fltLerp(m_estAckRate, rate, EST_BANDWIDTH_GAIN);
+	}
+	m_estLastAckSeq = seq;
+	m_estLastAckTime = now;
+	m_estOutBytesAtAck = m_outTotalBytes;
+}
+
+/// <summary>
+/// Enables sending a ping request to the server every `msecs` milliseconds
+/// once the handshake is complete. The time until the server responds is an
+/// end-to-end latency figure that includes server processing and queueing
+/// which the OS's TCP statistics cannot see. Not all servers respond to
+/// client pings. A value of 0 disables pings which is the default.
+/// </summary>
+void RTMPClient::setPingInterval(uint msecs)
+{
+	m_pingInterval = msecs;
+	if(m_pingInterval == 0) {
+		m_pingTimer->stop();
+		return;
+	}
+	m_pingTimer->start(m_pingInterval);
+}
+
+void RTMPClient::clearPingHistogram()
+{
+	m_pingHistogram.fill(0);
+}
+
+/// <summary>
+/// Adds a round-trip time sample from the response to one of our ping
+/// requests. `timestamp` is the `m_outClock` time that we sent it at.
+/// </summary>
+void RTMPClient::processPingResponse(quint32 timestamp)
+{
+	quint32 rtt = (quint32)m_outClock.elapsed() - timestamp; // Can wrap
+	if(!m_pingSent || rtt > PING_MAX_RTT_MSECS) {
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Received unexpected ping response, ignoring");
+		return;
+	}
+
+	m_pingLastRtt = rtt;
+	if(m_pingRtt <= 0.0f)
+		m_pingRtt = (float)rtt;
+	else
+		m_pingRtt = fltLerp(m_pingRtt, (float)rtt, EST_RTT_GAIN);
+
+	int bucket = 0;
+	while(bucket < PING_HISTOGRAM_SIZE - 1 &&
+		rtt > PING_HISTOGRAM_BOUNDS[bucket])
+	{
+		bucket++;
+	}
+	m_pingHistogram[bucket]++;
+}
+
+/// <summary>
+/// Returns true if the smoothed round-trip time has risen well above the
+/// minimum of the connection. This means that our packets are queueing
+/// somewhere along the network path well before the OS write buffer fills.
+/// </summary>
+bool RTMPClient::isNetworkCongested() const
+{
+	if(m_estRtt <= 0.0f || m_estMinRtt <= 0.0f)
+		return false; // Unknown
+	return m_estRtt - m_estMinRtt >
+		qMax(EST_MIN_QUEUE_DELAY_MSECS, m_estMinRtt);
+}
+
+/// <summary>
+/// Recalculates the bitrate that the encoder should use and emits
+/// `RTMPPublisher::recommendedBitrate()` if it changed by more than the
+/// hysteresis. Called after every network estimator sample.
+/// </summary>
+void RTMPClient::updateRecommendedBitrate()
+{
+	if(m_abrCeiling == 0 || m_publisher == NULL || !m_publisher->isReady())
+		return;
+	qint64 now = m_outClock.elapsed();
+	if(now - m_abrLastChange < ABR_MIN_INTERVAL_MSECS)
+		return;
+
+	// Rate that our data is leaving the machine or reaching the server
+	float capacity = m_estBandwidth;
+	if(capacity <= 0.0f)
+		capacity = m_estAckRate;
+
+	// The queue only grows if we're writing faster than the network can
+	// transmit
+	uint queueDelay = getOutQueueDelay();
+	bool queueGrowing = (m_outQueueBytes > m_abrLastQueueBytes &&
+		queueDelay >= ABR_MAX_QUEUE_DELAY_MSECS);
+	m_abrLastQueueBytes = m_outQueueBytes;
+
+	// The server acknowledges every `m_outAckWinSize` bytes. If it falls more
+	// than two windows behind then our data is stuck in the network.
+	bool ackLagging = (m_estLastAckTime >= 0 &&
+		m_outTotalBytes - m_estOutBytesAtAck > 2 * (quint64)m_outAckWinSize);
+
+	uint target = m_abrBitrate;
+	if(queueGrowing || ackLagging || isNetworkCongested()) {
+		// Step down but never above what the network is actually delivering
+		target = (uint)((float)m_abrBitrate * ABR_DECREASE);
+		if(capacity > 0.0f) {
+			target = qMin(target,
+				(uint)(capacity * 8.0f / 1000.0f * ABR_HEADROOM));
+		}
+	} else if(queueDelay < ABR_MAX_QUEUE_DELAY_MSECS &&
+		now - m_abrLastChange >= (qint64)m_abrHoldMsecs)
+	{
+		// Step up but not beyond what the congestion window allows. The
+		// window in bytes divided by the RTT in msec is conveniently kB/s.
+		target = (uint)((float)m_abrBitrate * ABR_INCREASE);
+		if(m_estCwnd > 0 && m_estRtt > 0.0f) {
+			target = qMax(m_abrBitrate, qMin(target,
+				(uint)((float)m_estCwnd / m_estRtt * 8.0f)));
+		}
+	}
+	target = qBound(m_abrFloor, target, m_abrCeiling);
+	if(target == m_abrBitrate)
+		return;
+
+	// Ignore small changes unless we're hitting a limit
+	uint diff = (target > m_abrBitrate) ?
+		target - m_abrBitrate : m_abrBitrate - target;
+	if(diff * 100 < m_abrBitrate * m_abrHysteresis &&
+		target != m_abrFloor && target != m_abrCeiling)
+	{
+		return;
+	}
+
+	broLog(LOG_CAT) << QStringLiteral("Recommending a bitrate of %L1 kbps")
+		.arg(target);
+	m_abrBitrate = target;
+	m_abrLastChange = now;
+	m_publisher->recommendedBitrate(target); // Remote emit
 }
 
 /// <summary>
 /// Sets the approximate upload speed (In bytes per second) that gamer mode
 /// will use to calculate how much it should throttle. The actual throttle
 /// amount will be higher than what is set here in order to allow for error.
+/// If `avgUploadBytes` is 0 then the bandwidth that is estimated from the
+/// OS's TCP statistics is used instead which is the default.
 /// </summary>
 void RTMPClient::gamerSetAverageUpload(int avgUploadBytes)
 {
-	// Minimum value is there just to make sure we get some sort of output if
-	// something goes wrong
-	m_gamerAvgUploadBytes = qMax(5 * 1024, avgUploadBytes);
+	m_gamerAutoUpload = (avgUploadBytes <= 0);
+	if(m_gamerAutoUpload) {
+		if(m_estBandwidth > 0.0f) {
+			m_gamerAvgUploadBytes =
+				qMax(GAMER_MIN_AVG_UPLOAD_BYTES, (int)m_estBandwidth);
+		}
+		return;
+	}
+	m_gamerAvgUploadBytes = qMax(GAMER_MIN_AVG_UPLOAD_BYTES, avgUploadBytes);
 }
 
 /// <summary>
@@ -1679,7 +4692,7 @@ void RTMPClient::gamerTickEvent(int numDropped)
 			return; // Still in saturation mode
 	}
 
-	if(m_gamerOutBuf.isEmpty())
+	if(m_outQueue.isEmpty())
 		return; // Nothing to write
 
 	//-------------------------------------------------------------------------
@@ -1691,7 +4704,7 @@ void RTMPClient::gamerTickEvent(int numDropped)
 	// should not be modified unless absolutely required.
 
 	float numSecsInBuf =
-		(float)m_gamerOutBuf.size() / (float)m_gamerAvgUploadBytes;
+		(float)m_outQueueBytes / (float)m_gamerAvgUploadBytes;
 
 	// Static multiplier: Ideally this should be between 1.2x and 1.5x. It
 	// seems that lower values causes instability as the bitrate nears the
@@ -1714,22 +4727,13 @@ void RTMPClient::gamerTickEvent(int numDropped)
 
 	//-------------------------------------------------------------------------
 
-	// Create our buffer of data to upload right now
-	QByteArray bufToOut;
-	if(maxBytes >= m_gamerOutBuf.size()) {
-		bufToOut = m_gamerOutBuf;
-		m_gamerOutBuf.clear();
-	} else {
-		bufToOut = m_gamerOutBuf.left(maxBytes);
-		m_gamerOutBuf.remove(0, maxBytes);
-	}
-
 	// Debugging
-	//broLog() << "Uploading " << bufToOut.size() << " B of a maximum of "
-	//	<< maxBytes << " B this tick";
+	//broLog() << "Uploading " << qMin(m_outQueueBytes, maxBytes)
+	//	<< " B of a maximum of " << maxBytes << " B this tick";
 
-	// Actually write to the socket (Or the overflow buffer)
-	socketWrite(bufToOut);
+	// Actually write to the socket. If the OS cannot accept everything then
+	// we enter saturation mode.
+	flushOutQueue(maxBytes);
 }
 
 /// <summary>
@@ -1755,18 +4759,12 @@ void RTMPClient::gamerEnterSatMode()
 	broLog(LOG_CAT, BroLog::Warning) << QStringLiteral(
 		"Network congestion detected, entering saturation mode");
 
-	// Enter saturation mode (Also prevents recursion with our flush)
+	// Enter saturation mode. The rest of the output queue is transmitted as
+	// soon as the OS is ready for it instead of once per tick.
 	m_gamerInSatMode = true;
 
 	// Enable Nagle's algorithm
-	m_socket.setSocketOption(QAbstractSocket::LowDelayOption, 0);
-
-	// Flush our gamer output buffer to the main output buffer
-	if(!m_gamerOutBuf.isEmpty()) {
-		QByteArray tmpBuf = m_gamerOutBuf;
-		m_gamerOutBuf.clear();
-		socketWrite(tmpBuf);
-	}
+	m_socket->setSocketOption(QAbstractSocket::LowDelayOption, 0);
 }
 
 void RTMPClient::gamerExitSatMode()
@@ -1786,35 +4784,33 @@ void RTMPClient::gamerExitSatMode()
 	m_gamerSatModeTimer = 0.0f;
 
 	// Disable Nagle's algorithm
-	m_socket.setSocketOption(QAbstractSocket::LowDelayOption, 1);
+	m_socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
 }
 
 void RTMPClient::socketConnected()
 {
 	Q_ASSERT(m_handshakeState == ConnectingState);
 	m_handshakeState = ConnectedState;
+	m_resolvedAddress = m_socket->peerAddress();
 	emit connected();
 	if(m_handshakeState != ConnectedState)
 		return; // Above slot disconnected our connection
-
-	// Create socket notifier and disable it immediately due to Windows
-	// implementation issues (See QSocketNotifier documentation). Note that we
-	// will received a "Multiple socket notifiers for same socket" warning from
-	// Qt as QTcpSocket already has an internal notifier that we can't access.
-	Q_ASSERT(m_socketWriteNotifier == NULL);
-	m_socketWriteNotifier = new QSocketNotifier(
-		m_socket.socketDescriptor(), QSocketNotifier::Write, this);
-	m_socketWriteNotifier->setEnabled(false);
-	QObject::connect(m_socketWriteNotifier, &QSocketNotifier::activated,
-		this, &RTMPClient::socketReadyForWrite);
+	createSocketWriteNotifier();
+	resetNetworkEstimate();
 
 	// We only disable Nagle's algorithm when in gamer mode as we use our own
 	// packet reduction algorithm. Nagle's algorithm is enabled again if we
 	// ever enter "saturation mode".
 	if(s_inGamerMode)
-		m_socket.setSocketOption(QAbstractSocket::LowDelayOption, 1);
-
-	if(m_autoInitialize) {
+		m_socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+	if(m_fastOpenSentHandshake) {
+		// C0 and C1 were sent along with the TCP handshake
+		m_handshakeState = VersionSentState;
+		if(!m_fastOpenData.isEmpty())
+			write(m_fastOpenData);
+		m_fastOpenData.clear();
+	} else if(m_autoInitialize || m_reconnecting) {
 		if(!initialize()) {
 			broLog(LOG_CAT, BroLog::Warning)
 				<< QStringLiteral("Failed to initiate RTMP handshake process");
@@ -1825,6 +4821,14 @@ void RTMPClient::socketConnected()
 
 void RTMPClient::socketDisconnected()
 {
+	if(m_handshakeState != DisconnectingState && failover())
+		return; // Switched to the hot standby
+	if(m_handshakeState != DisconnectingState && shouldReconnect()) {
+		// We didn't initiate the disconnect
+		beginReconnect();
+		return;
+	}
+
 	if(m_publisher != NULL) {
 		delete m_publisher;
 		m_publisher = NULL;
@@ -1834,10 +4838,10 @@ void RTMPClient::socketDisconnected()
 		m_socketWriteNotifier = NULL;
 	}
 
+	stopStandby();
 	m_handshakeState = DisconnectedState;
-	m_outBuf.clear();
+	clearOutQueue();
 	m_inBuf.clear();
-	m_gamerOutBuf.clear();
 	emit disconnected();
 }
 
@@ -1846,6 +4850,17 @@ void RTMPClient::socketError(QAbstractSocket::SocketError err)
 	broLog(LOG_CAT, BroLog::Warning)
 		<< QStringLiteral("Received network socket error: %1")
 		.arg(getSocketErrorString(err));
+	if(m_reconnecting) {
+		// Failures are expected while the reconnect supervisor is retrying
+		if(failover())
+			return; // Switched to the hot standby
+		if(m_handshakeState == ConnectingState) {
+			m_socket->abort(); // Make sure that the socket is closed
+			m_handshakeState = DisconnectedState;
+			scheduleReconnect();
+		}
+		return;
+	}
 	switch(err) {
 	case QAbstractSocket::ConnectionRefusedError:
 		emit error(ConnectionRefusedError);
@@ -1872,12 +4887,297 @@ void RTMPClient::socketError(QAbstractSocket::SocketError err)
 	}
 	if(m_handshakeState == ConnectingState) {
 		// Failed to connect, reset state
-		m_socket.abort(); // Make sure that the socket is closed
+		m_socket->abort(); // Make sure that the socket is closed
 		m_handshakeState = DisconnectedState;
+		stopStandby();
 		emit disconnected();
 	}
 }
 
+/// <summary>
+/// Makes the next attempt of the reconnect supervisor.
+/// </summary>
+void RTMPClient::reconnectTimeout()
+{
+	if(!m_reconnecting || m_handshakeState != DisconnectedState)
+		return;
+	m_reconnectAttempt++;
+	emit reconnecting(m_reconnectAttempt);
+	if(!m_reconnecting)
+		return; // Above slot disconnected
+	if(!connect())
+		scheduleReconnect();
+}
+
+/// <summary>
+/// Called by the shared `DNSCache` whenever any host has been resolved.
+/// </summary>
+void RTMPClient::hostResolved(
+	const QString &host, const QList<QHostAddress> &addrs)
+{
+	if(!m_resolvingHost ||
+		host.compare(m_remoteInfo.host, Qt::CaseInsensitive) != 0)
+	{
+		return; // Not for us
+	}
+	m_resolvingHost = false;
+	if(m_handshakeState != ConnectingState)
+		return;
+	if(addrs.isEmpty()) {
+		// Let `QTcpSocket` try the system resolver and report the error
+		fallbackConnect();
+		return;
+	}
+	beginConnectAttempts(addrs);
+}
+
+/// <summary>
+/// Called when an attempt has taken too long to connect. The attempt remains
+/// in progress while the next address is tried in parallel.
+/// </summary>
+void RTMPClient::connectAttemptTimeout()
+{
+	startNextConnectAttempt();
+}
+
+/// <summary>
+/// Called when a connection attempt that was started by
+/// `beginConnectAttempt()` completes. The first successful attempt cancels
+/// all others and its socket is handed to `m_socket` as if `connectToHost()`
+/// had connected normally.
+/// </summary>
+void RTMPClient::connectAttemptFinished()
+{
+#ifdef Q_OS_WIN
+	// Find the attempt that completed
+	QWinEventNotifier *notifier = static_cast<QWinEventNotifier *>(sender());
+	int index = -1;
+	for(int i = 0; i < m_connectAttempts.size(); i++) {
+		if(m_connectAttempts.at(i).notifier == notifier) {
+			index = i;
+			break;
+		}
+	}
+	if(index < 0)
+		return; // Already aborted
+	ConnectAttempt attempt = m_connectAttempts.takeAt(index);
+	SOCKET sock = (SOCKET)attempt.socket;
+	OVERLAPPED *ov = (OVERLAPPED *)attempt.overlapped;
+	DWORD sent = 0;
+	DWORD flags = 0;
+	BOOL success = WSAGetOverlappedResult(sock, ov, &sent, FALSE, &flags);
+	int err = success ? 0 : WSAGetLastError();
+
+	// Release everything but the socket
+	attempt.notifier->deleteLater(); // We're inside its signal
+	WSACloseEvent(ov->hEvent);
+	delete ov;
+
+	if(!success) {
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Connection attempt failed, error = %1")
+			.arg(err);
+		closesocket(sock);
+
+		// Don't wait for the timer before trying the next address
+		if(m_connectNextAddr < m_connectAddrs.size())
+			startNextConnectAttempt();
+		else if(m_connectAttempts.isEmpty())
+			fallbackConnect();
+		return;
+	}
+
+	// We have a winner
+	abortConnectAttempts();
+
+	// Required for `getpeername()` and friends to work. We use an unbuffered
+	// socket for the same reasons as `fallbackConnect()`.
+	setsockopt(sock, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+	if(!m_socket->setSocketDescriptor(sock, QAbstractSocket::ConnectedState,
+		QIODevice::ReadWrite | QIODevice::Unbuffered))
+	{
+		broLog(LOG_CAT, BroLog::Warning)
+			<< QStringLiteral("Failed to adopt connected socket: %1")
+			.arg(m_socket->errorString());
+		closesocket(sock);
+		fallbackConnect();
+		return;
+	}
+
+	// The OS normally sends the entire buffer but write anything that is
+	// remaining just in case. This includes attempts that didn't use Fast
+	// Open at all.
+	if(!m_fastOpenData.isEmpty()) {
+		m_fastOpenData.remove(0, (int)sent);
+		m_fastOpenSentHandshake = true;
+	}
+	socketConnected();
+#else
+#error Unsupported platform
+#endif
+}
+/// <summary>
+/// Creates the stream on the hot standby connection ahead of time so that a
+/// failover only needs to issue "publish()".
+/// </summary>
+void RTMPClient::standbyConnectedToApp()
+{
+	if(m_standby == NULL)
+		return;
+	m_standby->writeCreateStreamMsg();
+}
+
+void RTMPClient::standbyCreatedStream(uint streamId)
+{
+	if(m_standby == NULL)
+		return;
+	m_standby->m_publishStreamId = streamId;
+	broLog(LOG_CAT) << QStringLiteral("Hot standby connection to \"%1\" is ready")
+		.arg(m_standby->m_remoteInfo.asUrl());
+}
+
+void RTMPClient::standbyDisconnected()
+{
+	m_standbyTimer->start(STANDBY_RETRY_DELAY_MSECS);
+}
+
+/// <summary>
+/// Reestablishes the hot standby connection.
+/// </summary>
+void RTMPClient::standbyTimeout()
+{
+	if(m_standby == NULL ||
+		m_standby->getHandshakeState() != DisconnectedState)
+	{
+		return;
+	}
+	m_standby->connect();
+}
+
+/// <summary>
+/// Samples the progress of the connection. Progress is measured by the
+/// number of bytes that the remote host has acknowledged if the OS reports
+/// it or by the number of bytes that the OS has accepted from us otherwise.
+/// </summary>
+void RTMPClient::stallWatchdogTimeout()
+{
+	qint64 now = m_outClock.elapsed();
+	if(!isSocketConnected() || m_handshakeState == DisconnectingState) {
+		m_stallLastProgress = now;
+		return;
+	}
+
+	OSTcpInfo info;
+	bool haveInfo = getOSTcpInfo(&info);
+	bool pending = m_outQueueBytes > 0 || m_socket->bytesToWrite() > 0 ||
+		(haveInfo && info.bytesInFlight > 0);
+	bool progress;
+	if(haveInfo)
+		progress = (info.bytesAcked != m_stallLastAckedBytes);
+	else
+		progress = (m_outTotalBytes != m_stallLastOutBytes);
+	if(haveInfo)
+		m_stallLastAckedBytes = info.bytesAcked;
+	m_stallLastOutBytes = m_outTotalBytes;
+	if(progress || !pending) {
+		m_stallLastProgress = now;
+		return;
+	}
+	if(now - m_stallLastProgress < (qint64)m_stallTimeout)
+		return;
+
+	broLog(LOG_CAT, BroLog::Warning)
+		<< QStringLiteral("Connection made no progress for %L1 msec with %L2 bytes pending")
+		.arg(now - m_stallLastProgress)
+		.arg(m_outQueueBytes + (haveInfo ? info.bytesInFlight : 0));
+	m_stallLastProgress = now;
+	emit error(ConnectionStalledError);
+	if(!isSocketConnected() || m_handshakeState == DisconnectingState)
+		return; // The listener already dealt with it
+
+	// Closing the socket emits `disconnected()` which fails over, reconnects
+	// or disconnects as if the network had reported the failure
+	m_socket->abort();
+}
+
+/// <summary>
+/// Samples the OS's TCP statistics to maintain smoothed estimates of the
+/// bandwidth and round-trip time of the connection. In gamer mode the
+/// estimate replaces the application-supplied upload speed and a rising RTT
+/// enters saturation mode before the OS write buffer is full.
+/// </summary>
+void RTMPClient::estimatorTimeout()
+{
+	if(!isSocketConnected() || m_handshakeState == DisconnectingState) {
+		m_estTimer->stop();
+		return;
+	}
+	qint64 now = m_outClock.elapsed();
+
+	OSTcpInfo info;
+	bool haveInfo = getOSTcpInfo(&info);
+	bool appLimited = (m_outQueueBytes == 0 && m_socket->bytesToWrite() == 0);
+	quint64 bytes;
+	if(haveInfo) {
+		bytes = info.bytesAcked;
+		appLimited = appLimited && info.bytesInFlight < info.cwnd;
+	} else {
+		// Without TCP statistics the rate that the OS accepts our data only
+		// matches the rate of the network while its buffer is full
+		bytes = m_outTotalBytes;
+		appLimited = !m_outBlocked;
+	}
+
+	// Samples that were limited by how much data we had to send say nothing
+	// about the capacity of the network unless they exceed our estimate
+	if(m_estLastSampleTime >= 0 && now > m_estLastSampleTime &&
+		bytes >= m_estLastBytes)
+	{
+		float rate = (float)(bytes - m_estLastBytes) * 1000.0f /
+			(float)(now - m_estLastSampleTime);
+		if(m_estBandwidth <= 0.0f) {
+			if(rate > 0.0f)
+				m_estBandwidth = rate;
+		} else if(!appLimited || rate > m_estBandwidth)
+			m_estBandwidth = fltLerp(m_estBandwidth, rate, EST_BANDWIDTH_GAIN);
+	}
+	m_estLastSampleTime = now;
+	m_estLastBytes = bytes;
+
+	if(haveInfo && info.rttUs > 0) {
+		float rtt = (float)info.rttUs / 1000.0f;
+		if(m_estRtt <= 0.0f) {
+			m_estRtt = rtt;
+			m_estRttVar = rtt / 2.0f;
+		} else {
+			m_estRttVar = fltLerp(
+				m_estRttVar, qAbs(m_estRtt - rtt), EST_RTT_VAR_GAIN);
+			m_estRtt = fltLerp(m_estRtt, rtt, EST_RTT_GAIN);
+		}
+		m_estMinRtt = (float)info.minRttUs / 1000.0f;
+		m_estCwnd = info.cwnd;
+	}
+
+	updateRecommendedBitrate();
+
+	if(!s_inGamerMode)
+		return;
+	if(m_gamerAutoUpload && m_estBandwidth > 0.0f) {
+		m_gamerAvgUploadBytes =
+			qMax(GAMER_MIN_AVG_UPLOAD_BYTES, (int)m_estBandwidth);
+	}
+	if(isNetworkCongested())
+		gamerEnterSatMode(); // Also postpones exiting
+}
+
+void RTMPClient::pingTimeout()
+{
+	if(m_handshakeState != InitializedState)
+		return; // Handshake not complete or disconnecting
+	writePingRequest();
+}
+
+
 /// <summary>
 /// Called when we detect that the remote host closed the connection but Qt
 /// never notified us that it happened.
@@ -1885,8 +5185,8 @@ void RTMPClient::socketError(QAbstractSocket::SocketError err)
 void RTMPClient::socketRemoteDisconnectTimeout()
 {
 	if(isSocketConnected() &&
-		(m_socket.state() == QAbstractSocket::UnconnectedState ||
-		m_socket.socketDescriptor() == -1))
+		(m_socket->state() == QAbstractSocket::UnconnectedState ||
+		m_socket->socketDescriptor() == -1))
 	{
 		socketError(QAbstractSocket::RemoteHostClosedError);
 	}
@@ -1918,7 +5218,7 @@ void RTMPClient::socketDataReady()
 		// We cannot rely on "bytesAvailable()" to properly return the actual
 		// amount of bytes available from an "unbuffered" TCP socket.
 		qint64 oldSize = m_inBuf.size();
-		m_inBuf += m_socket.readAll();
+		m_inBuf += m_socket->readAll();
 		if(oldSize == m_inBuf.size())
 			break;
 		//broLog() << "In buffer size: " << m_inBuf.size();
@@ -1994,11 +5294,30 @@ void RTMPClient::processSocketData(QBuffer &buffer)
 		stream >> time;
 		stream >> zero;
 		QByteArray echo = buffer.read(1528);
+
+		// The server doesn't send anything after S2 until it receives a
+		// message from us so there is no need to wait for S2 before
+		// beginning the RTMP "connect()". Send it in the same write as C2.
+		beginForceBufferWrite();
 		if(!writeC2S2(time, echo)) {
+			endForceBufferWrite();
 			disconnect();
 			return;
 		}
 		m_handshakeState = AckSentState;
+		if(m_autoAppConnect || m_reconnecting) {
+			// Reset RTMP connection state
+			resetStateMembers();
+
+			if(!connectToApp()) {
+				endForceBufferWrite();
+				broLog(LOG_CAT, BroLog::Warning)
+					<< QStringLiteral("Failed to initiate RTMP application connection process");
+				disconnect();
+				return;
+			}
+		}
+		endForceBufferWrite();
 		/* Fall through */ }
 	case AckSentState: {
 		// We are waiting for a server S2
@@ -2025,22 +5344,14 @@ void RTMPClient::processSocketData(QBuffer &buffer)
 		broLog(LOG_CAT) << "Received valid S2";
 #endif
 
-		// Reset RTMP connection state
-		resetStateMembers();
+		// Reset RTMP connection state unless we already did so when we began
+		// the RTMP "connect()"
+		if(!m_autoAppConnect && !m_reconnecting)
+			resetStateMembers();
 
 		m_handshakeState = InitializedState;
 		emit initialized();
 
-		// Begin RTMP "connect()"
-		if(m_autoAppConnect) {
-			if(!connectToApp()) {
-				broLog(LOG_CAT, BroLog::Warning)
-					<< QStringLiteral("Failed to initiate RTMP application connection process");
-				disconnect();
-				return;
-			}
-		}
-
 		/* Fall through */ }
 	case InitializedState:
 		// All other RTMP traffic. Read all available chunks.
@@ -2055,32 +5366,16 @@ void RTMPClient::processSocketData(QBuffer &buffer)
 /// <returns>True if a chunk was read</returns>
 bool RTMPClient::readChunkFromSocket(QBuffer &buffer)
 {
-	// Due to RTMP's variable length headers we cannot use a QDataStream so the
-	// code below is slightly ugly.
-
-	// Max header size is the 3 byte "basic header" + 11 byte "type 0 message
-	// header" + 4 byte extended timestamp.
-	const int MAX_CHUNK_HEADER_SIZE = 3 + 11 + 4;
-	QByteArray header = buffer.peek(MAX_CHUNK_HEADER_SIZE);
-	const char *data = header.constData();
-	int basicSize = 1;
-
-	// Decode the "basic header"
-	if(header.size() < basicSize)
-		return false; // No more data to read
-	uint fmt = (data[0] & 0xC0) >> 6;
-	uint csId = (data[0] & 0x3F);
-	if(csId == 0) {
-		basicSize = 2;
-		if(header.size() < basicSize)
-			return false; // Not enough data in buffer
-		csId = (uint)data[1] + 64;
-	} else if(csId == 1) {
-		basicSize = 3;
-		if(header.size() < basicSize)
-			return false; // Not enough data in buffer
-		csId = (uint)data[2] * 256 + (uint)data[1] + 64;
-	}
+	// Due to RTMP's variable length headers we cannot use a QDataStream so we
+	// peek the largest possible header and decode it all at once
+	char head[RTMP_MAX_CHUNK_HEADER_SIZE];
+	int headLen = buffer.peek(head, RTMP_MAX_CHUNK_HEADER_SIZE);
+	RTMPChunkHeader hdr;
+	int dataStart = decodeRTMPChunkHeader(head, headLen, &hdr);
+	if(dataStart == 0)
+		return false; // Not enough data in buffer
+	uint fmt = hdr.fmt;
+	uint csId = hdr.csId;
 
 	// Initialize input chunk stream state if it's a new chunk stream
 	bool isNew = initInChunkStreamState(csId);
@@ -2091,55 +5386,38 @@ bool RTMPClient::readChunkFromSocket(QBuffer &buffer)
 #endif // DEBUG_LOW_LEVEL_RTMP
 	}
 
-	// Decode the "message header"
-	int dataStart = basicSize;
+	// Apply the "message header" to the chunk stream state
 	int chunkLen = 0;
 	bool doAbort = false;
 	ChunkStreamState state = m_inChunkStreams[csId];
 	switch(fmt) {
 	default: // It's impossible to get a result that's outside 0-3
 	case 0:
-		dataStart = basicSize + 11;
-		if(header.size() < dataStart)
-			return false; // Not enough data in buffer
-		state.timestamp = amfDecodeUInt24(&data[basicSize]);
-		if(state.timestamp >= 0xFFFFFF) {
-			// Timestamp is in the extended header
-			dataStart += 4;
-			if(header.size() < dataStart)
-				return false; // Not enough data in buffer
-			state.timestamp = amfDecodeUInt32(&data[basicSize+11]);
-		}
+		state.timestamp = hdr.timestamp;
 		state.timestampDelta = state.timestamp; // Specification is weird
-		state.msgLen = amfDecodeUInt24(&data[basicSize+3]);
+		state.msgLen = hdr.msgLen;
 		if(state.msgLenRemaining > 0)
 			doAbort = true;
 		state.msgLenRemaining = state.msgLen;
 		chunkLen = qMin(state.msgLen, m_inMaxChunkSize);
-		state.msgType = (RTMPMsgType)data[basicSize+6];
+		state.msgType = (RTMPMsgType)hdr.msgType;
 		// TODO: Validate message type
 		// The message stream ID is the only little-endian field in RTMP
-		state.msgStreamId = decodeLEUInt32(&data[basicSize+7]);
+		state.msgStreamId = hdr.msgStreamId;
 		break;
 	case 1:
-		dataStart = basicSize + 7;
-		if(header.size() < dataStart)
-			return false; // Not enough data in buffer
-		state.timestampDelta = amfDecodeUInt24(&data[basicSize]);
+		state.timestampDelta = hdr.timestamp;
 		state.timestamp += state.timestampDelta;
-		state.msgLen = amfDecodeUInt24(&data[basicSize+3]);
+		state.msgLen = hdr.msgLen;
 		if(state.msgLenRemaining > 0)
 			doAbort = true;
 		state.msgLenRemaining = state.msgLen;
 		chunkLen = qMin(state.msgLen, m_inMaxChunkSize);
-		state.msgType = (RTMPMsgType)data[basicSize+6];
+		state.msgType = (RTMPMsgType)hdr.msgType;
 		// TODO: Validate message type
 		break;
 	case 2:
-		dataStart = basicSize + 3;
-		if(header.size() < dataStart)
-			return false; // Not enough data in buffer
-		state.timestampDelta = amfDecodeUInt24(&data[basicSize]);
+		state.timestampDelta = hdr.timestamp;
 		state.timestamp += state.timestampDelta;
 		// Due to ambiguities in the specification we are lenient here to allow
 		// the remote host to send "type 2" headers for setting the delta to 0
@@ -2154,7 +5432,6 @@ bool RTMPClient::readChunkFromSocket(QBuffer &buffer)
 		}
 		break;
 	case 3:
-		dataStart = basicSize;
 		// WARNING: The RTMP specification contradicts itself about how
 		// timestamp deltas are handled for this header type. The first
 		// specification example (Section 5.3.2.1) shows that the delta is
@@ -2240,7 +5517,7 @@ void RTMPClient::processMessage(
 			disconnect();
 			return;
 		}
-		m_inMaxChunkSize = amfDecodeUInt32(msg.constData()) & 0x7FFFFFFF;
+		m_inMaxChunkSize = decodeBEUInt32(msg.constData()) & 0x7FFFFFFF;
 		break;
 	case AckMsgType:
 		if(msg.size() < 4) {
@@ -2249,7 +5526,7 @@ void RTMPClient::processMessage(
 			disconnect();
 			return;
 		}
-		// Ignore acknowledgements for now, TODO
+		processAcknowledgement(decodeBEUInt32(msg.constData()));
 		break;
 	case UserControlMsgType: {
 		if(msg.size() < 2) {
@@ -2259,7 +5536,7 @@ void RTMPClient::processMessage(
 			return;
 		}
 		UserControlType type =
-			(UserControlType)amfDecodeUInt16(msg.constData());
+			(UserControlType)decodeBEUInt16(msg.constData());
 		switch(type) {
 		case StreamBeginType:
 			// TODO
@@ -2278,10 +5555,12 @@ void RTMPClient::processMessage(
 			break;
 		case PingRequestType:
 			// Immediately respond with a ping reply
-			writePingResponse(amfDecodeUInt32(&msg.constData()[2]));
+			writePingResponse(decodeBEUInt32(&msg.constData()[2]));
 			break;
 		case PingResponseType:
-			// Clients should not receive this
+			// Reply to one of our own ping requests
+			if(msg.size() >= 6)
+				processPingResponse(decodeBEUInt32(&msg.constData()[2]));
 			break;
 		default:
 			// Unknown user control message, ignore it
@@ -2298,7 +5577,7 @@ void RTMPClient::processMessage(
 			disconnect();
 			return;
 		}
-		m_inAckWinSize = amfDecodeUInt32(msg.constData());
+		m_inAckWinSize = decodeBEUInt32(msg.constData());
 		break;
 	case SetPeerBWMsgType: {
 		if(msg.size() < 5) {
@@ -2307,7 +5586,7 @@ void RTMPClient::processMessage(
 			disconnect();
 			return;
 		}
-		uint winSize = amfDecodeUInt32(msg.constData());
+		uint winSize = decodeBEUInt32(msg.constData());
 		AckLimitType type = (AckLimitType)amfDecodeUInt8(&msg.constData()[4]);
 		switch(type) {
 		case HardLimitType:
@@ -2336,8 +5615,51 @@ void RTMPClient::processMessage(
 			break;
 		}
 		break; }
+	case DataAmf3MsgType:
+	case DataAmf0MsgType: {
+		// AMF 3 data messages are prefixed with a single byte that is always
+		// zero. The body itself is an AMF 0 stream that can switch to AMF 3
+		// on a per-value basis.
+		int off = (type == DataAmf3MsgType) ? 1 : 0;
+		if(msg.size() < off + 1) {
+			// TODO: Log reason
+			emit error(UnexpectedResponseError);
+			disconnect();
+			return;
+		}
+
+		// Decode AMF message
+		AMFTypeList params;
+		if(!decodeAmfMessage(msg, off, &params)) {
+			emit error(UnexpectedResponseError);
+			disconnect();
+			return;
+		}
+		if(params.count() == 0) {
+			// Ignore empty messages
+			break;
+		}
+
+#if DEBUG_LOW_LEVEL_RTMP
+		broLog(LOG_CAT) << "  << Received AMF data message: --------";
+		for(int i = 0; i < params.count(); i++)
+			broLog(LOG_CAT) << params.at(i);
+		broLog(LOG_CAT) << "--------";
+#endif // DEBUG_LOW_LEVEL_RTMP
+
+		// We don't use data messages internally so just forward them on. The
+		// list releases any parameters that the listeners didn't take.
+		emit receivedAmfDataMsg(streamId, params);
+		emit adoptAmfDataMsg(streamId, &params);
+
+		break; }
+	case CommandAmf3MsgType:
 	case CommandAmf0MsgType: {
-		if(msg.size() < 1) {
+		// AMF 3 command messages are prefixed with a single byte that is
+		// always zero. The body itself is an AMF 0 stream that can switch to
+		// AMF 3 on a per-value basis.
+		int off = (type == CommandAmf3MsgType) ? 1 : 0;
+		if(msg.size() < off + 1) {
 			// TODO: Log reason
 			emit error(UnexpectedResponseError);
 			disconnect();
@@ -2346,40 +5668,23 @@ void RTMPClient::processMessage(
 
 		// Decode AMF message
 		AMFTypeList params;
-		int off = 0;
-		while(off < msg.count()) {
-			AMFType *amfObj;
-			uint bytesRead = AMFType::decode(&msg.constData()[off], &amfObj);
-			if(bytesRead == 0) {
-				broLog(LOG_CAT, BroLog::Warning)
-					<< QStringLiteral("Failed to decode AMF message");
-				emit error(UnexpectedResponseError);
-				disconnect();
-				return;
-			}
-			if(amfObj == NULL) {
-				broLog(LOG_CAT, BroLog::Warning)
-					<< QStringLiteral("Failed to decode AMF message but still read %L1 bytes")
-					.arg(bytesRead);
-				emit error(UnexpectedResponseError);
-				disconnect();
-				return;
-			}
-			off += bytesRead;
-			if(off > msg.count()) {
-				// Buffer overflow
-				broLog(LOG_CAT, BroLog::Warning)
-					<< QStringLiteral("Buffer overflow while decoding AMF message");
-				emit error(UnexpectedResponseError);
-				disconnect();
-				return;
-			}
-			params.append(amfObj);
+		if(!decodeAmfMessage(msg, off, &params)) {
+			emit error(UnexpectedResponseError);
+			disconnect();
+			return;
 		}
 		if(params.count() == 0) {
 			// Ignore empty messages
 			break;
 		}
+		if(params.at(0)->asString() == NULL) {
+			// Command messages always begin with the command name
+			broLog(LOG_CAT, BroLog::Warning)
+				<< QStringLiteral("Received AMF command without a name");
+			emit error(UnexpectedResponseError);
+			disconnect();
+			return;
+		}
 
 #if DEBUG_LOW_LEVEL_RTMP
 		broLog(LOG_CAT) << "  << Received AMF message: --------";
@@ -2388,26 +5693,67 @@ void RTMPClient::processMessage(
 		broLog(LOG_CAT) << "--------";
 #endif // DEBUG_LOW_LEVEL_RTMP
 
+		// A listener is allowed to take ownership of the parameters so extract
+		// everything that we need for internal processing beforehand
+		QString invoke = *params.at(0)->asString();
+		double transId = -1.0;
+		if(params.count() >= 2 && params.at(1)->asNumber() != NULL)
+			transId = params.at(1)->asNumber()->getValue();
+		double resultNum = -1.0; // "createStream()" stream ID
+		uint objectEncoding = 0; // "connect()" AMF version
+		QString statusCode; // "onStatus()" code
+		if(params.count() >= 4) {
+			const AMFType *result = params.at(3);
+			if(result->asNumber() != NULL)
+				resultNum = result->asNumber()->getValue();
+			const AMFObject *info = result->asObject();
+			if(info != NULL && info->contains("objectEncoding")) {
+				const AMFNumber *enc =
+					info->value("objectEncoding")->asNumber();
+				if(enc != NULL && enc->getValue() == 3.0)
+					objectEncoding = 3;
+			}
+			if(info != NULL && info->contains("code")) {
+				const AMFString *code = info->value("code")->asString();
+				if(code != NULL)
+					statusCode = *code;
+			}
+		}
+		int numParams = params.count();
+
 		// Emit to listeners that we received a message
 		emit receivedAmfCommandMsg(streamId, params);
+		emit adoptAmfCommandMsg(streamId, &params);
+
+		// Release memory of any parameters that weren't taken
+		params.deepClear();
 
 		// Is it an internal message?
-		AMFString *invoke = params.at(0)->asString();
-		if((*invoke == QStringLiteral("_result") ||
-			*invoke == QStringLiteral("_error")) && params.count() >= 4)
+		if((invoke == QStringLiteral("_result") ||
+			invoke == QStringLiteral("_error")) && numParams >= 4)
 		{
 			// Result message
-			bool isError = (*invoke == QStringLiteral("_error"));
+			bool isError = (invoke == QStringLiteral("_error"));
 
-			AMFNumber *transId = params.at(1)->asNumber();
-			if(!m_appConnected &&
-				transId->getValue() == m_appConnectTransId)
-			{
+			if(!m_appConnected && transId == m_appConnectTransId) {
 				// This message is the result of our "connect()"
 				if(!isError) {
-					// TODO: Parse server information?
+					// The server tells us which AMF version it accepted in
+					// the information object. Servers that don't support AMF 3
+					// either omit it or reply with zero.
+					m_appObjectEncoding = 0;
+					if(m_objectEncoding == 3)
+						m_appObjectEncoding = objectEncoding;
+
 					m_appConnected = true;
 					emit connectedToApp();
+
+					// Recreate the publish stream immediately
+					if(m_reconnecting && m_publisher != NULL &&
+						!m_creatingStream && m_publishStreamId == 0)
+					{
+						writeCreateStreamMsg();
+					}
 				} else {
 					// Rejected from server
 					broLog(LOG_CAT, BroLog::Warning)
@@ -2417,21 +5763,27 @@ void RTMPClient::processMessage(
 					disconnect();
 					return;
 				}
-			} else if(m_creatingStream &&
-				transId->getValue() == m_createStreamTransId)
-			{
+			} else if(m_creatingStream && transId == m_createStreamTransId) {
 				// This message is the result of our "createStream()"
 				m_creatingStream = false;
 				m_createStreamTransId = 0;
 				if(!isError) {
-					AMFNumber *streamId = params.at(3)->asNumber();
-					if(streamId != NULL) { // TODO: Handle failure
-						emit createdStream(streamId->getValue());
+					if(resultNum >= 0.0) { // TODO: Handle failure
+						emit createdStream(resultNum);
 
 						// HACK/TODO: We assume only one stream is created per
 						// connection
-						if(m_publisher != NULL) {
-							m_publishStreamId = streamId->getValue();
+						if(m_publisher != NULL &&
+							m_publishStreamId == (uint)resultNum)
+						{
+							// Our pipelined "publish()" guessed correctly
+						} else if(m_publisher != NULL) {
+							if(m_publishStreamId != 0) {
+								broLog(LOG_CAT)
+									<< QStringLiteral("Server assigned stream ID %L1, republishing")
+									.arg((uint)resultNum);
+							}
+							m_publishStreamId = resultNum;
 
 							// Begin publishing immediately
 							writePublishMsg(m_publishStreamId);
@@ -2449,44 +5801,43 @@ void RTMPClient::processMessage(
 					return;
 				}
 			}
-		} else if(m_beginningPublish &&
-			*invoke == QStringLiteral("onStatus") && params.count() >= 4 &&
+		} else if(m_beginningPublish && !m_creatingStream &&
+			invoke == QStringLiteral("onStatus") && numParams >= 4 &&
 			streamId == m_publishStreamId)
 		{
-			// Our "publish()" has completed
+			// Our "publish()" has completed. Timestamps continue from where
+			// they were if we are reconnecting.
 			m_beginningPublish = false;
-			m_lastPublishTimestamp = 0;
+			m_publishRequested = false;
+			if(!m_reconnecting)
+				m_lastPublishTimestamp = 0;
 
-			AMFObject *result = params.at(3)->asObject();
-			if(result == NULL || !result->contains("code")) {
-				emit error(UnexpectedResponseError);
-				disconnect();
-				return;
-			}
-			AMFString *code = result->value("code")->asString();
-			if(code == NULL) {
+			if(statusCode.isEmpty()) {
 				emit error(UnexpectedResponseError);
 				disconnect();
 				return;
 			}
-			if(*code == QStringLiteral("NetStream.Publish.Start")) {
+			if(statusCode == QStringLiteral("NetStream.Publish.Start")) {
 				// Server accepted publish
 				m_publisher->setReady(true);
+				if(m_reconnecting) {
+					broLog(LOG_CAT)
+						<< QStringLiteral("Reconnected after %L1 attempt(s)")
+						.arg(m_reconnectAttempt);
+					m_reconnecting = false;
+					m_reconnectAttempt = 0;
+					emit reconnected();
+				}
 			} else {
 				// Server rejected publish
 				broLog(LOG_CAT, BroLog::Warning)
 					<< QStringLiteral("Server rejected publish. Reason = %1")
-					.arg(*code);
+					.arg(statusCode);
 				emit error(RtmpPublishRejectedError);
 				disconnect();
 			}
 		}
 
-		// Release memory
-		for(int i = 0; i < params.count(); i++)
-			delete params.at(i);
-		params.clear();
-
 		break; }
 	default:
 #if DEBUG_LOW_LEVEL_RTMP
@@ -2501,6 +5852,44 @@ void RTMPClient::processMessage(
 	}
 }
 
+/// <summary>
+/// Decodes all the AMF values in `msg` starting at byte `off` and appends them
+/// to `params`. AMF 3 values are automatically decoded if the message switches
+/// to AMF 3 with the "avmplus-object-marker".
+/// </summary>
+/// <returns>False if the message is malformed in which case `params` is left
+/// empty</returns>
+bool RTMPClient::decodeAmfMessage(
+	const QByteArray &msg, int off, AMFTypeList *params)
+{
+	while(off < msg.count()) {
+		AMFType *amfObj;
+		uint bytesRead = AMFType::decode(&msg.constData()[off], &amfObj);
+		if(bytesRead == 0 || amfObj == NULL || off + bytesRead > msg.count()) {
+			if(bytesRead == 0) {
+				broLog(LOG_CAT, BroLog::Warning)
+					<< QStringLiteral("Failed to decode AMF message");
+			} else if(amfObj == NULL) {
+				broLog(LOG_CAT, BroLog::Warning)
+					<< QStringLiteral("Failed to decode AMF message but still read %L1 bytes")
+					.arg(bytesRead);
+			} else {
+				// Buffer overflow
+				broLog(LOG_CAT, BroLog::Warning)
+					<< QStringLiteral("Buffer overflow while decoding AMF message");
+				delete amfObj;
+			}
+
+			// Release memory
+			params->deepClear();
+			return false;
+		}
+		off += bytesRead;
+		params->append(amfObj);
+	}
+	return true;
+}
+
 /// <returns>True if it is a new chunk stream</returns>
 bool RTMPClient::initInChunkStreamState(int id)
 {
@@ -381,3 +381,311 @@ TEST(AMF0Test, DecodeUndefined)
 
 	delete out;
 }
+
+TEST(AMF3Test, U29Boundaries)
+{
+	const uint values[] = {
+		0x00, 0x7F, 0x80, 0x3FFF, 0x4000, 0x1FFFFF, 0x200000, 0x1FFFFFFF };
+	const uint sizes[] = { 1, 1, 2, 2, 3, 3, 4, 4 };
+	for(int i = 0; i < 8; i++) {
+		char buf[4];
+		char *end = amfEncodeU29(buf, values[i]);
+		EXPECT_EQ(sizes[i], (uint)(end - buf));
+		uint out = 0;
+		EXPECT_EQ(sizes[i], amfDecodeU29(buf, &out));
+		EXPECT_EQ(values[i], out);
+	}
+}
+
+TEST(AMF3Test, EncodeInteger)
+{
+	AMFNumber val(300.0);
+	val.setAmfVer(3);
+	QByteArray data = val.serialized();
+	const char expected[] = {
+		0x11, // "avmplus-object-marker"
+		0x04, // Marker
+		(char)0x82, 0x2C
+	};
+	ASSERT_EQ(sizeof(expected), data.size());
+	for(int i = 0; i < data.size(); i++)
+		ASSERT_EQ(expected[i], data[i]);
+}
+
+TEST(AMF3Test, DecodeNegativeInteger)
+{
+	AMFNumber val(-5.0);
+	val.setAmfVer(3);
+	QByteArray data = val.serialized();
+	AMFType *out = NULL;
+	uint outSize = AMFType::decode(data.constData(), &out);
+	AMFNumber *outVal = out->asNumber();
+
+	ASSERT_FALSE(outVal == NULL);
+	EXPECT_EQ(6, outSize); // Negative numbers always use 4 bytes
+	EXPECT_EQ(-5.0, outVal->getValue());
+	EXPECT_EQ(3, outVal->getAmfVer());
+
+	delete out;
+}
+
+TEST(AMF3Test, DecodeDouble)
+{
+	AMFNumber val(0.5);
+	val.setAmfVer(3);
+	QByteArray data = val.serialized();
+	ASSERT_EQ(0x05, data[1]); // Marker
+	AMFType *out = NULL;
+	uint outSize = AMFType::decode(data.constData(), &out);
+	AMFNumber *outVal = out->asNumber();
+
+	ASSERT_FALSE(outVal == NULL);
+	EXPECT_EQ(10, outSize);
+	EXPECT_EQ(0.5, outVal->getValue());
+
+	delete out;
+}
+
+TEST(AMF3Test, EncodeStringReference)
+{
+	AMF3Context ctx;
+	AMFString val("abc");
+	QByteArray data = val.serializedAmf3(&ctx);
+	data += val.serializedAmf3(&ctx);
+	const char expected[] = {
+		0x06, // Marker
+		0x07, // Inline, length 3
+		0x61, 0x62, 0x63,
+		0x06, // Marker
+		0x00 // Reference 0
+	};
+	ASSERT_EQ(sizeof(expected), data.size());
+	for(int i = 0; i < data.size(); i++)
+		ASSERT_EQ(expected[i], data[i]);
+}
+
+TEST(AMF3Test, EncodeTraitReference)
+{
+	AMF3Context ctx;
+	AMFObject val1;
+	AMFObject val2;
+	QByteArray data = val1.serializedAmf3(&ctx);
+	data += val2.serializedAmf3(&ctx);
+	const char expected[] = {
+		0x0A, // Marker
+		0x0B, // Inline dynamic traits, no sealed members
+		0x01, // Anonymous class name
+		0x01, // End of dynamic members
+		0x0A, // Marker
+		0x01, // Trait reference 0
+		0x01 // End of dynamic members
+	};
+	ASSERT_EQ(sizeof(expected), data.size());
+	for(int i = 0; i < data.size(); i++)
+		ASSERT_EQ(expected[i], data[i]);
+}
+
+TEST(AMF3Test, DecodeObject)
+{
+	AMFObject val;
+	val.setAmfVer(3);
+	val["level"] = new AMFString("status");
+	val["code"] = new AMFString("NetStream.Publish.Start");
+	AMFObject *child = new AMFObject();
+	(*child)["code"] = new AMFString("status");
+	val["child"] = child;
+
+	QByteArray data = val.serialized();
+	AMFType *out = NULL;
+	uint outSize = AMFType::decode(data.constData(), &out);
+	AMFObject *outVal = out->asObject();
+
+	ASSERT_FALSE(outVal == NULL);
+	EXPECT_EQ(data.size(), outSize);
+	EXPECT_EQ(3, outVal->count());
+
+	AMFString *outStr = outVal->value("level")->asString();
+	ASSERT_FALSE(outStr == NULL);
+	EXPECT_EQ(QString("status"), outStr);
+
+	AMFObject *outChild = outVal->value("child")->asObject();
+	ASSERT_FALSE(outChild == NULL);
+	outStr = outChild->value("code")->asString();
+	ASSERT_FALSE(outStr == NULL);
+	EXPECT_EQ(QString("status"), outStr);
+
+	delete out;
+}
+
+TEST(AMF3Test, DecodeEcmaArray)
+{
+	const char data[] = {
+		0x11, // "avmplus-object-marker"
+		0x09, // Marker
+		0x05, // Inline, 2 dense elements
+		0x03, 0x61, // Key "a"
+		0x03, // True
+		0x01, // End of associative portion
+		0x04, 0x01, // Integer 1
+		0x06, 0x00 // String reference 0 ("a")
+	};
+	AMFType *out = NULL;
+	uint outSize = AMFType::decode(data, &out);
+	AMFEcmaArray *outVal = out->asEcmaArray();
+
+	ASSERT_FALSE(outVal == NULL);
+	EXPECT_EQ(sizeof(data), outSize);
+	EXPECT_EQ(3, outVal->count());
+	EXPECT_EQ(3, outVal->getAssociativeCount());
+	ASSERT_FALSE(outVal->value("a")->asBoolean() == NULL);
+	ASSERT_FALSE(outVal->value("0")->asNumber() == NULL);
+	EXPECT_EQ(1.0, outVal->value("0")->asNumber()->getValue());
+	ASSERT_FALSE(outVal->value("1")->asString() == NULL);
+	EXPECT_EQ(QString("a"), outVal->value("1")->asString());
+
+	delete out;
+}
+
+TEST(AMF3Test, DecodeObjectReference)
+{
+	const char data[] = {
+		0x11, // "avmplus-object-marker"
+		0x0A, // Marker
+		0x0B, // Inline dynamic traits, no sealed members
+		0x01, // Anonymous class name
+		0x03, 0x61, // Key "a"
+		0x0A, // Marker
+		0x01, // Trait reference 0
+		0x03, 0x62, // Key "b"
+		0x02, // False
+		0x01, // End of dynamic members
+		0x03, 0x63, // Key "c"
+		0x0A, // Marker
+		0x02, // Object reference 1 (The child object)
+		0x01 // End of dynamic members
+	};
+	AMFType *out = NULL;
+	uint outSize = AMFType::decode(data, &out);
+	AMFObject *outVal = out->asObject();
+
+	ASSERT_FALSE(outVal == NULL);
+	EXPECT_EQ(sizeof(data), outSize);
+	AMFObject *a = outVal->value("a")->asObject();
+	AMFObject *c = outVal->value("c")->asObject();
+	ASSERT_FALSE(a == NULL);
+	ASSERT_FALSE(c == NULL);
+	EXPECT_NE(a, c); // References are resolved as deep copies
+	EXPECT_TRUE(c->contains("b"));
+
+	delete out;
+}
+
+TEST(AMF3Test, EncodeAmf0ObjectWithAmf3Child)
+{
+	AMFObject val;
+	AMFBoolean *child = new AMFBoolean(true);
+	child->setAmfVer(3);
+	val["a"] = child;
+
+	QByteArray data = val.serialized();
+	const char expected[] = {
+		0x03, // Marker
+		0x00, 0x01, 0x61, // Key "a"
+		0x11, // "avmplus-object-marker"
+		0x03, // True
+		0x00, 0x00,
+		0x09 // End marker
+	};
+	ASSERT_EQ(sizeof(expected), data.size());
+	for(int i = 0; i < data.size(); i++)
+		ASSERT_EQ(expected[i], data[i]);
+}
+
+TEST(AMFOwnershipTest, MoveObject)
+{
+	AMFObject val;
+	val.setAmfVer(3);
+	AMFNumber *child = new AMFNumber(1.0);
+	val["a"] = child;
+
+	AMFObject moved(static_cast<AMFObject &&>(val));
+	EXPECT_TRUE(val.isEmpty());
+	ASSERT_EQ(1, moved.count());
+	EXPECT_EQ(child, moved.value("a")); // Not a copy
+	EXPECT_EQ(3, moved.getAmfVer());
+
+	AMFObject assigned;
+	assigned["b"] = new AMFNull();
+	assigned = static_cast<AMFObject &&>(moved);
+	EXPECT_TRUE(moved.isEmpty());
+	ASSERT_EQ(1, assigned.count());
+	EXPECT_EQ(child, assigned.value("a"));
+}
+
+TEST(AMFOwnershipTest, MoveEcmaArray)
+{
+	AMFEcmaArray val;
+	val.setAssociativeCount(1);
+	val["a"] = new AMFBoolean(true);
+
+	AMFEcmaArray moved(static_cast<AMFEcmaArray &&>(val));
+	EXPECT_TRUE(val.isEmpty());
+	EXPECT_EQ(1, moved.count());
+	EXPECT_EQ(1, moved.getAssociativeCount());
+	EXPECT_FALSE(moved.asEcmaArray() == NULL);
+}
+
+TEST(AMFOwnershipTest, CloneObject)
+{
+	AMFObject val;
+	AMFObject *child = new AMFObject();
+	(*child)["b"] = new AMFString("c");
+	val["a"] = child;
+
+	AMFType *out = val.clone();
+	AMFObject *outVal = out->asObject();
+	ASSERT_FALSE(outVal == NULL);
+	AMFObject *outChild = outVal->value("a")->asObject();
+	ASSERT_FALSE(outChild == NULL);
+	EXPECT_NE(child, outChild); // Deep copy
+	EXPECT_EQ(QString("c"), outChild->value("b")->asString());
+
+	delete out;
+}
+
+TEST(AMFOwnershipTest, TypeListTakeAt)
+{
+	AMFTypeList list;
+	list.append(new AMFString("a"));
+	list.append(new AMFNumber(1.0));
+
+	AMFTypeList moved(static_cast<AMFTypeList &&>(list));
+	EXPECT_TRUE(list.isEmpty());
+	ASSERT_EQ(2, moved.count());
+
+	// Taken values are no longer owned by the list
+	AMFType *taken = moved.takeAt(1);
+	EXPECT_EQ(1, moved.count());
+	ASSERT_FALSE(taken->asNumber() == NULL);
+	delete taken;
+}
+
+TEST(AMFOwnershipTest, TypeListCopyIsDeep)
+{
+	AMFTypeList list;
+	list.append(new AMFString("a"));
+	list.append(new AMFNumber(1.0));
+
+	AMFTypeList copy(list);
+	ASSERT_EQ(2, copy.count());
+	EXPECT_NE(list.at(0), copy.at(0));
+	EXPECT_EQ(QString("a"), *copy.at(0)->asString());
+
+	// Assignment replaces the existing values
+	AMFTypeList assigned;
+	assigned.append(new AMFNumber(2.0));
+	assigned = list;
+	ASSERT_EQ(2, assigned.count());
+	EXPECT_NE(list.at(1), assigned.at(1));
+	EXPECT_EQ(1.0, assigned.at(1)->asNumber()->getValue());
+}
@@ -0,0 +1,235 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include <gtest/gtest.h>
+#include <Libbroadcast/annexb.h>
+#include <QtCore/QElapsedTimer>
+
+#define DO_BENCHMARKS 0
+
+//=============================================================================
+// Helpers
+
+/// <summary>
+/// Simple byte-at-a-time splitter that the optimized version is validated
+/// against.
+/// </summary>
+static AnnexBNalUnitList referenceSplit(const QByteArray &data)
+{
+	AnnexBNalUnitList nals;
+	const unsigned char *uc = (const unsigned char *)data.constData();
+	int size = data.size();
+	int nalStart = 0;
+	int i = 0;
+	for(;;) {
+		// Find next "0x000001"
+		int codeOff = size;
+		int codeEnd = size;
+		for(; i + 2 < size; i++) {
+			if(uc[i] == 0 && uc[i + 1] == 0 && uc[i + 2] == 1) {
+				codeOff = i;
+				codeEnd = i + 3;
+				break;
+			}
+		}
+
+		// Trailing zeros are never part of a NAL unit
+		int nalEnd = codeOff;
+		while(nalEnd > nalStart && uc[nalEnd - 1] == 0)
+			nalEnd--;
+		if(nalEnd > nalStart) {
+			AnnexBNalUnit nal;
+			nal.off = nalStart;
+			nal.size = nalEnd - nalStart;
+			nals.append(nal);
+		}
+		if(codeOff >= size)
+			break;
+		nalStart = i = codeEnd;
+	}
+	return nals;
+}
+
+/// <summary>
+/// Generates a pseudo-random NAL unit payload that contains no start codes,
+/// just like real emulation-prevented H.264 data.
+/// </summary>
+static void appendNalPayload(QByteArray &out, int size, quint32 &seed)
+{
+	int numZeros = 0;
+	for(int i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		char c = (char)(seed >> 16);
+		if((seed >> 8) % 32 == 0)
+			c = 0; // Make zero bytes more frequent than in random data
+		if(numZeros >= 2 && (uchar)c <= 3) {
+			out.append((char)0x03); // "emulation_prevention_three_byte"
+			numZeros = 0;
+		}
+		out.append(c);
+		numZeros = (c == 0) ? numZeros + 1 : 0;
+	}
+	if(out.at(out.size() - 1) == 0)
+		out.append((char)0x80); // "rbsp_stop_one_bit"
+}
+
+#if DO_BENCHMARKS
+/// <summary>
+/// Generates an access unit that is about the same size and structure as a
+/// 3840x2160 H.264 IDR frame at a high bitrate: SPS, PPS, SEI and one slice
+/// per 16 macroblock rows.
+/// </summary>
+static QByteArray generate4KKeyframe(int *numNalsOut)
+{
+	static const char startCode4[] = { 0, 0, 0, 1 };
+	static const char startCode3[] = { 0, 0, 1 };
+	const int NUM_SLICES = 135 / 16 + 1; // 135 macroblock rows
+	const int KEYFRAME_SIZE = 2 * 1024 * 1024;
+
+	QByteArray au;
+	au.reserve(KEYFRAME_SIZE + 64 * 1024);
+	quint32 seed = 1234;
+	const int paramSizes[3] = { 24, 6, 600 }; // SPS, PPS, SEI
+	for(int i = 0; i < 3; i++) {
+		au.append(startCode4, sizeof(startCode4));
+		appendNalPayload(au, paramSizes[i], seed);
+	}
+	for(int i = 0; i < NUM_SLICES; i++) {
+		au.append(startCode3, sizeof(startCode3));
+		appendNalPayload(au, KEYFRAME_SIZE / NUM_SLICES, seed);
+	}
+	*numNalsOut = 3 + NUM_SLICES;
+	return au;
+}
+#endif // DO_BENCHMARKS
+
+static void expectSameNals(
+	const AnnexBNalUnitList &expected, const AnnexBNalUnitList &actual)
+{
+	ASSERT_EQ(expected.size(), actual.size());
+	for(int i = 0; i < expected.size(); i++) {
+		EXPECT_EQ(expected.at(i).off, actual.at(i).off);
+		EXPECT_EQ(expected.at(i).size, actual.at(i).size);
+	}
+}
+
+//=============================================================================
+// Tests
+
+TEST(AnnexBTest, FindStartCode)
+{
+	const char code3[] = { 0x09, 0x00, 0x00, 0x01, 0x65 };
+	const char code4[] = { 0x09, 0x00, 0x00, 0x00, 0x01, 0x65 };
+	const char none[] = { 0x09, 0x00, 0x00, 0x03, 0x01, 0x00, 0x00 };
+	int codeSize;
+
+	EXPECT_EQ(1, annexBFindStartCode(code3, sizeof(code3), &codeSize));
+	EXPECT_EQ(3, codeSize);
+	EXPECT_EQ(1, annexBFindStartCode(code4, sizeof(code4), &codeSize));
+	EXPECT_EQ(4, codeSize);
+	EXPECT_EQ((int)sizeof(none),
+		annexBFindStartCode(none, sizeof(none), &codeSize));
+	EXPECT_EQ(0, codeSize);
+}
+
+TEST(AnnexBTest, SkipStartCode)
+{
+	const char code3[] = { 0x00, 0x00, 0x01, 0x67 };
+	const char code4[] = { 0x00, 0x00, 0x00, 0x01, 0x67 };
+	const char raw[] = { 0x67, 0x42, 0x00, 0x1F };
+
+	EXPECT_EQ(3, annexBSkipStartCode(code3, sizeof(code3)));
+	EXPECT_EQ(4, annexBSkipStartCode(code4, sizeof(code4)));
+	EXPECT_EQ(0, annexBSkipStartCode(raw, sizeof(raw)));
+}
+
+TEST(AnnexBTest, SplitAccessUnit)
+{
+	// AUD, SPS (Followed by a trailing zero byte), PPS and a slice
+	const char au[] = {
+		0x00, 0x00, 0x00, 0x01, 0x09, 0xF0,
+		0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1F, 0x00,
+		0x00, 0x00, 0x00, 0x01, 0x68, 0xCE,
+		0x00, 0x00, 0x01, 0x65, 0x88, 0x00, 0x00, 0x03, 0x01 };
+	AnnexBNalUnitList nals;
+
+	ASSERT_EQ(4, annexBSplitNalUnits(au, sizeof(au), &nals));
+	ASSERT_EQ(4, nals.size());
+	EXPECT_EQ(4, nals.at(0).off);
+	EXPECT_EQ(2, nals.at(0).size);
+	EXPECT_EQ(9, nals.at(1).off);
+	EXPECT_EQ(4, nals.at(1).size);
+	EXPECT_EQ(18, nals.at(2).off);
+	EXPECT_EQ(2, nals.at(2).size);
+	EXPECT_EQ(23, nals.at(3).off);
+	EXPECT_EQ(6, nals.at(3).size);
+}
+
+TEST(AnnexBTest, SplitRawNalUnit)
+{
+	const char nal[] = { 0x65, 0x88, 0x84, 0x00, 0x00, 0x03, 0x00, 0x21 };
+	AnnexBNalUnitList nals;
+
+	ASSERT_EQ(1, annexBSplitNalUnits(nal, sizeof(nal), &nals));
+	EXPECT_EQ(0, nals.at(0).off);
+	EXPECT_EQ((int)sizeof(nal), nals.at(0).size);
+}
+
+TEST(AnnexBTest, SplitMatchesReference)
+{
+	// Place start codes at every possible alignment relative to the 16-byte
+	// blocks that the scanner processes
+	quint32 seed = 42;
+	for(int align = 0; align < 48; align++) {
+		QByteArray data;
+		for(int i = 0; i < 8; i++) {
+			data.append(QByteArray(i % 2 ? 3 : 4, 0x00));
+			data[data.size() - 1] = 0x01;
+			appendNalPayload(data, align + i * 7 + 1, seed);
+		}
+		AnnexBNalUnitList nals;
+		annexBSplitNalUnits(data.constData(), data.size(), &nals);
+		expectSameNals(referenceSplit(data), nals);
+	}
+}
+
+#if DO_BENCHMARKS
+TEST(AnnexBBenchmark, Split4KKeyframe)
+{
+	int numNals;
+	QByteArray au = generate4KKeyframe(&numNals);
+
+	// Verify correctness before timing
+	AnnexBNalUnitList nals;
+	nals.reserve(numNals);
+	ASSERT_EQ(numNals,
+		annexBSplitNalUnits(au.constData(), au.size(), &nals));
+	expectSameNals(referenceSplit(au), nals);
+
+	const int NUM_ITERATIONS = 200;
+	QElapsedTimer timer;
+	timer.start();
+	for(int i = 0; i < NUM_ITERATIONS; i++) {
+		nals.clear();
+		annexBSplitNalUnits(au.constData(), au.size(), &nals);
+	}
+	qint64 nsecs = qMax(timer.nsecsElapsed(), (qint64)1);
+	double mbPerSec = ((double)au.size() * NUM_ITERATIONS / 1048576.0) /
+		((double)nsecs / 1000000000.0);
+	RecordProperty("MBPerSec", (int)mbPerSec);
+}
+#endif // DO_BENCHMARKS
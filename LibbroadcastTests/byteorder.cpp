@@ -0,0 +1,203 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include <gtest/gtest.h>
+#include <QtCore/QByteArray>
+
+// The byte order codec is internal to the library and header-only
+#include "../Libbroadcast/byteorder.h"
+
+//=============================================================================
+// Helpers
+
+static QByteArray encodeHeader(const RTMPChunkHeader &hdr)
+{
+	char data[RTMP_MAX_CHUNK_HEADER_SIZE];
+	int size = encodeRTMPChunkHeader(data, hdr);
+	return QByteArray(data, size);
+}
+
+static RTMPChunkHeader makeHeader(
+	uint fmt, uint csId, quint32 timestamp, uint msgLen = 0,
+	uint msgType = 0, uint msgStreamId = 0)
+{
+	RTMPChunkHeader hdr = {
+		fmt, csId, timestamp, msgLen, msgType, msgStreamId };
+	return hdr;
+}
+
+//=============================================================================
+// Known vector tests
+
+TEST(ChunkHeaderTest, EncodesType0)
+{
+	const char expected[] = {
+		0x03, // fmt 0, csid 3
+		0x00, 0x01, 0x02, // Timestamp
+		0x00, 0x00, 0x10, // Message length
+		0x14, // Message type
+		0x01, 0x00, 0x00, 0x00 }; // Stream ID, little-endian
+	EXPECT_EQ(QByteArray(expected, sizeof(expected)),
+		encodeHeader(makeHeader(0, 3, 0x000102, 0x10, 0x14, 1)));
+}
+
+TEST(ChunkHeaderTest, EncodesType1And2And3)
+{
+	const char type1[] = {
+		0x44, // fmt 1, csid 4
+		0x00, 0x00, 0x21, // Timestamp delta
+		0x00, 0x01, 0x00, // Message length
+		0x09 }; // Message type
+	EXPECT_EQ(QByteArray(type1, sizeof(type1)),
+		encodeHeader(makeHeader(1, 4, 0x21, 0x100, 9, 1)));
+
+	const char type2[] = {
+		(char)0x84, // fmt 2, csid 4
+		0x00, 0x00, 0x21 }; // Timestamp delta
+	EXPECT_EQ(QByteArray(type2, sizeof(type2)),
+		encodeHeader(makeHeader(2, 4, 0x21, 0x100, 9, 1)));
+
+	const char type3[] = {
+		(char)0xC4 }; // fmt 3, csid 4
+	EXPECT_EQ(QByteArray(type3, sizeof(type3)),
+		encodeHeader(makeHeader(3, 4, 0x21, 0x100, 9, 1)));
+}
+
+TEST(ChunkHeaderTest, EncodesBasicHeaderSizes)
+{
+	// 1 byte form for IDs 2-63
+	const char csid2[] = { (char)0xC2 };
+	EXPECT_EQ(QByteArray(csid2, sizeof(csid2)),
+		encodeHeader(makeHeader(3, 2, 0)));
+	const char csid63[] = { (char)0xFF };
+	EXPECT_EQ(QByteArray(csid63, sizeof(csid63)),
+		encodeHeader(makeHeader(3, 63, 0)));
+
+	// 2 byte form for IDs 64-319
+	const char csid64[] = { (char)0xC0, 0x00 };
+	EXPECT_EQ(QByteArray(csid64, sizeof(csid64)),
+		encodeHeader(makeHeader(3, 64, 0)));
+	const char csid319[] = { (char)0xC0, (char)0xFF };
+	EXPECT_EQ(QByteArray(csid319, sizeof(csid319)),
+		encodeHeader(makeHeader(3, 319, 0)));
+
+	// 3 byte form for IDs 320-65599, the ID minus 64 is little-endian
+	const char csid320[] = { (char)0xC1, 0x00, 0x01 };
+	EXPECT_EQ(QByteArray(csid320, sizeof(csid320)),
+		encodeHeader(makeHeader(3, 320, 0)));
+	const char csid65599[] = { (char)0xC1, (char)0xFF, (char)0xFF };
+	EXPECT_EQ(QByteArray(csid65599, sizeof(csid65599)),
+		encodeHeader(makeHeader(3, 65599, 0)));
+}
+
+TEST(ChunkHeaderTest, EncodesExtendedTimestamps)
+{
+	// A timestamp of exactly 0xFFFFFF must also use the extended field
+	const char type0[] = {
+		0x02, // fmt 0, csid 2
+		(char)0xFF, (char)0xFF, (char)0xFF, // Timestamp marker
+		0x00, 0x00, 0x04, // Message length
+		0x03, // Message type
+		0x00, 0x00, 0x00, 0x00, // Stream ID
+		0x00, (char)0xFF, (char)0xFF, (char)0xFF }; // Extended timestamp
+	EXPECT_EQ(QByteArray(type0, sizeof(type0)),
+		encodeHeader(makeHeader(0, 2, 0xFFFFFF, 4, 3, 0)));
+
+	const char type1[] = {
+		0x42, // fmt 1, csid 2
+		(char)0xFF, (char)0xFF, (char)0xFF, // Timestamp marker
+		0x00, 0x00, 0x04, // Message length
+		0x03, // Message type
+		0x01, 0x00, 0x00, 0x00 }; // Extended timestamp delta
+	EXPECT_EQ(QByteArray(type1, sizeof(type1)),
+		encodeHeader(makeHeader(1, 2, 0x01000000, 4, 3, 0)));
+
+	const char type2[] = {
+		(char)0x82, // fmt 2, csid 2
+		(char)0xFF, (char)0xFF, (char)0xFF, // Timestamp marker
+		0x12, 0x34, 0x56, 0x78 }; // Extended timestamp delta
+	EXPECT_EQ(QByteArray(type2, sizeof(type2)),
+		encodeHeader(makeHeader(2, 2, 0x12345678, 4, 3, 0)));
+
+	// The largest timestamp that fits in the normal field
+	const char small[] = {
+		(char)0x82, // fmt 2, csid 2
+		(char)0xFF, (char)0xFF, (char)0xFE }; // Timestamp delta
+	EXPECT_EQ(QByteArray(small, sizeof(small)),
+		encodeHeader(makeHeader(2, 2, 0xFFFFFE, 4, 3, 0)));
+}
+
+TEST(ChunkHeaderTest, DecodesKnownVector)
+{
+	const char data[] = {
+		0x41, 0x00, 0x01, // fmt 1, csid 320
+		(char)0xFF, (char)0xFF, (char)0xFF, // Timestamp marker
+		0x00, 0x00, 0x20, // Message length
+		0x08, // Message type
+		0x01, 0x00, 0x00, 0x00 }; // Extended timestamp delta
+	RTMPChunkHeader hdr = makeHeader(0, 0, 0, 0, 0, 7);
+	EXPECT_EQ((int)sizeof(data),
+		decodeRTMPChunkHeader(data, sizeof(data), &hdr));
+	EXPECT_EQ(1, hdr.fmt);
+	EXPECT_EQ(320, hdr.csId);
+	EXPECT_EQ(0x01000000, hdr.timestamp);
+	EXPECT_EQ(0x20, hdr.msgLen);
+	EXPECT_EQ(8, hdr.msgType);
+	EXPECT_EQ(7, hdr.msgStreamId); // Not in a type 1 header
+}
+
+//=============================================================================
+// Round trip tests
+
+TEST(ChunkHeaderTest, RoundTripsAllFormats)
+{
+	const uint csIds[] = { 2, 63, 64, 319, 320, 65599 };
+	const quint32 timestamps[] = {
+		0, 1, 0xFFFFFE, 0xFFFFFF, 0x1000000, 0xFFFFFFFF };
+	for(int i = 0; i < (int)(sizeof(csIds) / sizeof(csIds[0])); i++) {
+		for(uint fmt = 0; fmt <= 3; fmt++) {
+			for(int j = 0;
+				j < (int)(sizeof(timestamps) / sizeof(timestamps[0])); j++)
+			{
+				RTMPChunkHeader in = makeHeader(
+					fmt, csIds[i], timestamps[j], 0x123456, 9, 0x01020304);
+				QByteArray data = encodeHeader(in);
+
+				// Every truncated header must be rejected
+				RTMPChunkHeader out = makeHeader(0, 0, 0, 0, 0, 0);
+				for(int k = 0; k < data.size(); k++) {
+					EXPECT_EQ(0,
+						decodeRTMPChunkHeader(data.constData(), k, &out));
+				}
+
+				out = makeHeader(0, 0, 0, 0, 0, 0);
+				ASSERT_EQ(data.size(), decodeRTMPChunkHeader(
+					data.constData(), data.size(), &out));
+				EXPECT_EQ(fmt, out.fmt);
+				EXPECT_EQ(csIds[i], out.csId);
+				if(fmt <= 2)
+					EXPECT_EQ(timestamps[j], out.timestamp);
+				if(fmt <= 1) {
+					EXPECT_EQ(in.msgLen, out.msgLen);
+					EXPECT_EQ(in.msgType, out.msgType);
+				}
+				if(fmt == 0)
+					EXPECT_EQ(in.msgStreamId, out.msgStreamId);
+			}
+		}
+	}
+}
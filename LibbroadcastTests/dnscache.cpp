@@ -0,0 +1,156 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include <gtest/gtest.h>
+#include <Libbroadcast/dnscache.h>
+
+//=============================================================================
+// Helpers
+
+/// <summary>
+/// A resolver that never touches the network. If `deferred` is false then
+/// every query is answered immediately with `addrs` and `ttl`, otherwise the
+/// test must call `DNSCache::addResult()` itself.
+/// </summary>
+class StubDNSResolver : public DNSResolver
+{
+public: // Members ------------------------------------------------------------
+	QList<QHostAddress>	addrs;
+	uint				ttl;
+	bool				deferred;
+	int					numLookups;
+
+public: // Constructor/destructor ---------------------------------------------
+	StubDNSResolver()
+		: addrs()
+		, ttl(60)
+		, deferred(false)
+		, numLookups(0)
+	{
+		addrs.append(QHostAddress(QStringLiteral("192.0.2.1")));
+		addrs.append(QHostAddress(QStringLiteral("2001:db8::1")));
+	}
+
+public: // Methods ------------------------------------------------------------
+	virtual void lookup(DNSCache *cache, const QString &host)
+	{
+		numLookups++;
+		if(!deferred)
+			cache->addResult(host, addrs, ttl);
+	}
+};
+
+//=============================================================================
+// Cache tests
+
+TEST(DNSCacheTest, CachesUntilTtl)
+{
+	StubDNSResolver *stub = new StubDNSResolver();
+	DNSCache cache(stub);
+	QList<QHostAddress> addrs;
+
+	// The first lookup always queries the resolver
+	EXPECT_FALSE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_EQ(1, stub->numLookups);
+
+	// Further lookups are answered from the cache, host names are not case
+	// sensitive
+	EXPECT_TRUE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_TRUE(cache.lookup(QStringLiteral("LIVE.example.com"), &addrs));
+	EXPECT_EQ(1, stub->numLookups);
+	EXPECT_EQ(stub->addrs, addrs);
+
+	// Clearing forces a new query
+	cache.clear();
+	EXPECT_FALSE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_EQ(2, stub->numLookups);
+}
+
+TEST(DNSCacheTest, RespectsZeroTtl)
+{
+	StubDNSResolver *stub = new StubDNSResolver();
+	stub->ttl = 0;
+	DNSCache cache(stub);
+	QList<QHostAddress> addrs;
+	EXPECT_FALSE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_FALSE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_EQ(2, stub->numLookups);
+}
+
+TEST(DNSCacheTest, ClampsToMaxTtl)
+{
+	StubDNSResolver *stub = new StubDNSResolver();
+	stub->ttl = 86400;
+	DNSCache cache(stub);
+	cache.setMaxTtl(0);
+	QList<QHostAddress> addrs;
+	EXPECT_FALSE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_FALSE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_EQ(2, stub->numLookups);
+}
+
+TEST(DNSCacheTest, MergesConcurrentLookups)
+{
+	StubDNSResolver *stub = new StubDNSResolver();
+	stub->deferred = true;
+	DNSCache cache(stub);
+	QList<QHostAddress> addrs;
+	EXPECT_FALSE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_FALSE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_EQ(1, stub->numLookups);
+
+	// Different hosts are queried separately
+	EXPECT_FALSE(cache.lookup(QStringLiteral("backup.example.com"), &addrs));
+	EXPECT_EQ(2, stub->numLookups);
+
+	cache.addResult(QStringLiteral("live.example.com"), stub->addrs, 60);
+	EXPECT_TRUE(cache.lookup(QStringLiteral("live.example.com"), &addrs));
+	EXPECT_EQ(2, stub->numLookups);
+	EXPECT_EQ(stub->addrs, addrs);
+}
+
+TEST(DNSCacheTest, DoesNotCacheFailures)
+{
+	StubDNSResolver *stub = new StubDNSResolver();
+	stub->addrs.clear();
+	DNSCache cache(stub);
+	QList<QHostAddress> addrs;
+	EXPECT_FALSE(cache.lookup(QStringLiteral("missing.example.com"), &addrs));
+	EXPECT_FALSE(cache.lookup(QStringLiteral("missing.example.com"), &addrs));
+	EXPECT_EQ(2, stub->numLookups);
+}
+
+//=============================================================================
+// Connection order tests
+
+TEST(DNSCacheTest, InterleavesAddressFamilies)
+{
+	QList<QHostAddress> in;
+	in.append(QHostAddress(QStringLiteral("192.0.2.1")));
+	in.append(QHostAddress(QStringLiteral("192.0.2.2")));
+	in.append(QHostAddress(QStringLiteral("192.0.2.3")));
+	in.append(QHostAddress(QStringLiteral("2001:db8::1")));
+	in.append(QHostAddress(QStringLiteral("2001:db8::2")));
+
+	QList<QHostAddress> out = DNSCache::sortForConnect(in);
+	ASSERT_EQ(5, out.size());
+	EXPECT_EQ(in.at(3), out.at(0)); // IPv6 first
+	EXPECT_EQ(in.at(0), out.at(1));
+	EXPECT_EQ(in.at(4), out.at(2));
+	EXPECT_EQ(in.at(1), out.at(3));
+	EXPECT_EQ(in.at(2), out.at(4));
+}
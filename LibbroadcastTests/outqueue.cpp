@@ -0,0 +1,996 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include <gtest/gtest.h>
+#include <Libbroadcast/rtmpclient.h>
+#include <QtCore/QHash>
+
+// The byte order codec is internal to the library and header-only
+#include "../Libbroadcast/byteorder.h"
+
+const uint VIDEO_CS_ID = 6;
+const uint AUDIO_CS_ID = 4;
+const uint AUDIO_MSG_TYPE = 8;
+const uint VIDEO_MSG_TYPE = 9;
+const uint ABORT_MSG_TYPE = 2;
+
+//=============================================================================
+// Helpers
+
+/// <summary>
+/// A single RTMP message that was reassembled from the chunk stream.
+/// </summary>
+struct DecodedMessage {
+	uint		csId;
+	uint		msgType;
+	quint32		timestamp;
+	uint		msgStreamId;
+	QByteArray	payload;
+};
+
+static QByteArray makePayload(int size, char seed)
+{
+	QByteArray data(size, 0);
+	for(int i = 0; i < size; i++)
+		data[i] = (char)(seed + i);
+	return data;
+}
+
+//=============================================================================
+// Output queue tests. The queue is serialized into a buffer instead of a
+// socket and the buffer is then decoded like a remote host would.
+
+class RTMPClientOutQueueTest : public testing::Test
+{
+protected:
+	// Per chunk stream state of the decoder
+	struct DecoderState {
+		RTMPChunkHeader	hdr;
+		quint32			timestamp;
+		quint32			timestampDelta;
+		bool			inMessage;
+		QByteArray		partial;
+	};
+
+	RTMPClient *	m_client;
+	QByteArray		m_wire; // Everything that was "transmitted"
+
+	virtual void SetUp()
+	{
+		// Pretend that we are connected and never touch the socket. All
+		// writes are buffered until we explicitly drain the queue.
+		m_client = new RTMPClient();
+		m_client->m_handshakeState = RTMPClient::InitializedState;
+		m_client->beginForceBufferWrite();
+		m_wire.clear();
+	};
+
+	virtual void TearDown()
+	{
+		m_client->clearOutQueue();
+		m_client->m_bufferOutBufRef = 0;
+		m_client->m_handshakeState = RTMPClient::DisconnectedState;
+		delete m_client;
+	};
+
+	bool writeMessage(
+		uint type, quint32 timestamp, const QByteArray &payload, uint csId,
+		RTMPClient::VideoFrameType frameType = RTMPClient::NotVideoFrame)
+	{
+		RTMPClient::OutSegmentList segs;
+		RTMPClient::OutSegment seg = { payload, 0, payload.size() };
+		segs.append(seg);
+		return m_client->writeMessage(1, (RTMPClient::RTMPMsgType)type,
+			timestamp, segs, csId, frameType);
+	};
+
+	bool beginProgressiveMessage(
+		uint type, quint32 timestamp, uint msgLen, uint csId,
+		RTMPClient::VideoFrameType frameType)
+	{
+		return m_client->beginProgressiveMessage(1,
+			(RTMPClient::RTMPMsgType)type, timestamp, msgLen, csId,
+			frameType);
+	};
+
+	bool appendProgressiveMessage(const QByteArray &data)
+	{
+		RTMPClient::OutSegment seg = { data, 0, data.size() };
+		return m_client->appendProgressiveMessage(seg);
+	};
+
+	// Generates the wire form of every message that can be generated just
+	// like `flushOutQueue()` does when it gathers the queue
+	void generateQueue()
+	{
+		for(int i = 0; i < m_client->m_outQueue.size(); i++) {
+			RTMPClient::OutMessage *msg = m_client->m_outQueue.at(i);
+			if(!msg->isGenerated)
+				m_client->generateMsgWire(msg);
+			else
+				m_client->extendMsgWire(msg);
+			if(!msg->isComplete())
+				break; // Messages must be transmitted in order
+		}
+	};
+
+	// Transmits up to `maxBytes` bytes of the queue into `m_wire` or
+	// everything if it's negative. Returns the amount of bytes that were
+	// transmitted.
+	int drain(int maxBytes = -1)
+	{
+		int written = 0;
+		while(!m_client->m_outQueue.isEmpty() &&
+			(maxBytes < 0 || written < maxBytes))
+		{
+			RTMPClient::OutMessage *msg = m_client->m_outQueue.head();
+			if(!msg->isGenerated)
+				m_client->generateMsgWire(msg);
+			else
+				m_client->extendMsgWire(msg);
+			if(msg->wireIndex >= msg->wire.size())
+				break; // Waiting for more of a progressive message
+			const RTMPClient::OutSegment &seg = msg->wire.at(msg->wireIndex);
+			int len = seg.len - msg->wireOff;
+			if(maxBytes >= 0)
+				len = qMin(len, maxBytes - written);
+			m_wire.append(
+				&seg.buf.constData()[seg.off + msg->wireOff], len);
+			m_client->advanceOutQueue(len);
+			written += len;
+		}
+		return written;
+	};
+
+	bool dropFramesIfCongested(uint maxQueueBytes)
+	{
+		m_client->m_dropMaxQueueBytes = maxQueueBytes;
+		bool ret = m_client->dropFramesIfCongested(NULL);
+		m_client->m_dropMaxQueueBytes = 0;
+		return ret;
+	};
+
+	// Pretends that every queued message was enqueued `msecs` earlier
+	void ageOutQueue(qint64 msecs)
+	{
+		for(int i = 0; i < m_client->m_outQueue.size(); i++)
+			m_client->m_outQueue.at(i)->enqueueTime -= msecs;
+	};
+
+	void dropExpiredMessages(uint latencyBudget)
+	{
+		m_client->m_latencyBudget = latencyBudget;
+		m_client->dropExpiredMessages();
+		m_client->m_latencyBudget = 0;
+	};
+
+	bool abortPartialOutMessage()
+	{
+		return m_client->abortPartialOutMessage();
+	};
+
+	void abortProgressiveMessage()
+	{
+		m_client->abortProgressiveMessage();
+	};
+
+	// Marks the client as publishing to message stream 1
+	RTMPPublisher *createPublisher()
+	{
+		RTMPPublisher *publisher = m_client->createPublishStream();
+		m_client->m_publishStreamId = 1;
+		return publisher;
+	};
+
+	// Makes the publisher accept H.264 frames in Annex B format. Becoming
+	// ready restores the codec from the stream cache so it's set afterwards.
+	void setAvcPublisherReady(RTMPPublisher *publisher)
+	{
+		publisher->setReady(true);
+		publisher->m_isAvc = true;
+		publisher->m_isAvccPassthrough = false;
+	};
+
+	bool muxMediaMessage(
+		uint type, quint32 timestamp, const QByteArray &payload,
+		RTMPClient::VideoFrameType frameType = RTMPClient::NotVideoFrame)
+	{
+		RTMPClient::OutSegmentList segs;
+		RTMPClient::OutSegment seg = { payload, 0, payload.size() };
+		segs.append(seg);
+		return m_client->muxMediaMessage(
+			(RTMPClient::RTMPMsgType)type, timestamp, segs, frameType);
+	};
+
+	bool releaseMuxMessages(bool releaseAll)
+	{
+		return m_client->releaseMuxMessages(releaseAll);
+	};
+
+	quint32 clampMuxTimestamp(quint32 timestamp)
+	{
+		return m_client->clampMuxTimestamp(timestamp);
+	};
+
+	bool writeSetDataFrameMsg(AMFObject *streamData)
+	{
+		return m_client->writeSetDataFrameMsg(streamData);
+	};
+
+	bool writeVideoData(uint timestamp, const QByteArray &data)
+	{
+		return m_client->writeVideoData(timestamp, data);
+	};
+
+	void replayStreamCache()
+	{
+		m_client->replayStreamCache();
+	};
+
+	// Forgets everything that was queued or transmitted as if the connection
+	// was lost and a new one was established. Media that wasn't transmitted
+	// is held for replay.
+	void loseConnection()
+	{
+		m_client->holdUnsentMedia();
+		m_client->clearOutQueue();
+		m_client->m_outChunkStreams.clear();
+		m_wire.clear();
+	};
+
+	int getOutQueueSize() const
+	{
+		return m_client->m_outQueue.size();
+	};
+
+	int getOutQueueBytes() const
+	{
+		return m_client->m_outQueueBytes;
+	};
+
+	uint getDroppedFrames() const
+	{
+		return m_client->m_droppedFrames;
+	};
+
+	// Decodes `m_wire` as an RTMP chunk stream. Fails the test if the stream
+	// cannot be parsed or ends in the middle of a message.
+	QList<DecodedMessage> decodeWire()
+	{
+		QList<DecodedMessage> msgs;
+		QHash<uint, DecoderState> states;
+		uint chunkSize = 128;
+		int pos = 0;
+		while(pos < m_wire.size()) {
+			const char *data = &m_wire.constData()[pos];
+			int size = m_wire.size() - pos;
+
+			// Determine the chunk stream first as the header fields that are
+			// omitted are inherited from the previous chunk
+			RTMPChunkHeader peek;
+			memset(&peek, 0, sizeof(peek));
+			if(decodeRTMPChunkHeader(data, size, &peek) == 0) {
+				ADD_FAILURE() << "Truncated chunk header at " << pos;
+				return msgs;
+			}
+			if(!states.contains(peek.csId)) {
+				DecoderState newState;
+				memset(&newState.hdr, 0, sizeof(newState.hdr));
+				newState.timestamp = 0;
+				newState.timestampDelta = 0;
+				newState.inMessage = false;
+				states[peek.csId] = newState;
+			}
+			DecoderState &state = states[peek.csId];
+			pos += decodeRTMPChunkHeader(data, size, &state.hdr);
+
+			// Timestamps only apply to the first chunk of a message
+			if(!state.inMessage) {
+				switch(state.hdr.fmt) {
+				case 0:
+					state.timestamp = state.hdr.timestamp;
+					state.timestampDelta = state.hdr.timestamp;
+					break;
+				case 1:
+				case 2:
+					state.timestampDelta = state.hdr.timestamp;
+					state.timestamp += state.timestampDelta;
+					break;
+				case 3:
+					state.timestamp += state.timestampDelta;
+					break;
+				}
+				state.inMessage = true;
+				state.partial.clear();
+			}
+
+			// Chunk payload
+			int len = qMin((int)chunkSize,
+				(int)state.hdr.msgLen - state.partial.size());
+			if(len > m_wire.size() - pos) {
+				ADD_FAILURE() << "Truncated chunk payload at " << pos;
+				return msgs;
+			}
+			state.partial.append(&m_wire.constData()[pos], len);
+			pos += len;
+			if(state.partial.size() < (int)state.hdr.msgLen)
+				continue;
+
+			// Message is complete
+			DecodedMessage msg;
+			msg.csId = state.hdr.csId;
+			msg.msgType = state.hdr.msgType;
+			msg.timestamp = state.timestamp;
+			msg.msgStreamId = state.hdr.msgStreamId;
+			msg.payload = state.partial;
+			msgs.append(msg);
+			state.inMessage = false;
+			state.partial.clear();
+			if(msg.msgType == 1 && msg.payload.size() >= 4) {
+				// "Set Chunk Size"
+				chunkSize =
+					decodeBEUInt32(msg.payload.constData()) & 0x7FFFFFFF;
+			} else if(msg.msgType == ABORT_MSG_TYPE &&
+				msg.payload.size() >= 4)
+			{
+				uint csId = decodeBEUInt32(msg.payload.constData());
+				if(states.contains(csId)) {
+					states[csId].inMessage = false;
+					states[csId].partial.clear();
+				}
+			}
+		}
+
+		// Every message must have been terminated
+		QHashIterator<uint, DecoderState> it(states);
+		while(it.hasNext()) {
+			it.next();
+			EXPECT_FALSE(it.value().inMessage)
+				<< "Chunk stream " << it.key() << " ended mid-message";
+		}
+		return msgs;
+	};
+};
+
+TEST_F(RTMPClientOutQueueTest, DropAfterGeneration)
+{
+	QByteArray key0 = makePayload(300, 0x10);
+	QByteArray nonRef33 = makePayload(200, 0x20);
+	QByteArray audio50 = makePayload(40, 0x30);
+	QByteArray ref66 = makePayload(250, 0x40);
+	QByteArray nonRef100 = makePayload(150, 0x50);
+	QByteArray key133 = makePayload(280, 0x60);
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 0, key0, VIDEO_CS_ID,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 33, nonRef33, VIDEO_CS_ID,
+		RTMPClient::NonRefVideoFrame));
+	ASSERT_TRUE(writeMessage(AUDIO_MSG_TYPE, 50, audio50, AUDIO_CS_ID));
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 66, ref66, VIDEO_CS_ID,
+		RTMPClient::RefVideoFrame));
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 100, nonRef100, VIDEO_CS_ID,
+		RTMPClient::NonRefVideoFrame));
+
+	// Begin transmitting the keyframe and generate the wire form of every
+	// following message so that the chunk stream state has advanced past
+	// the frames that are about to be dropped
+	ASSERT_EQ(50, drain(50));
+	generateQueue();
+
+	// Drop everything that can be dropped. The keyframe has begun
+	// transmission and audio is never dropped.
+	dropFramesIfCongested(1);
+	EXPECT_EQ(3, getDroppedFrames());
+	EXPECT_EQ(2, getOutQueueSize());
+
+	// The next frame must be encoded relative to the keyframe
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 133, key133, VIDEO_CS_ID,
+		RTMPClient::KeyVideoFrame));
+	drain();
+	EXPECT_EQ(0, getOutQueueSize());
+	EXPECT_EQ(0, getOutQueueBytes());
+
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(3, msgs.size());
+	EXPECT_EQ(VIDEO_CS_ID, msgs.at(0).csId);
+	EXPECT_EQ(VIDEO_MSG_TYPE, msgs.at(0).msgType);
+	EXPECT_EQ(0, msgs.at(0).timestamp);
+	EXPECT_EQ(1, msgs.at(0).msgStreamId);
+	EXPECT_EQ(key0, msgs.at(0).payload);
+	EXPECT_EQ(AUDIO_CS_ID, msgs.at(1).csId);
+	EXPECT_EQ(AUDIO_MSG_TYPE, msgs.at(1).msgType);
+	EXPECT_EQ(50, msgs.at(1).timestamp);
+	EXPECT_EQ(audio50, msgs.at(1).payload);
+	EXPECT_EQ(VIDEO_CS_ID, msgs.at(2).csId);
+	EXPECT_EQ(VIDEO_MSG_TYPE, msgs.at(2).msgType);
+	EXPECT_EQ(133, msgs.at(2).timestamp);
+	EXPECT_EQ(1, msgs.at(2).msgStreamId);
+	EXPECT_EQ(key133, msgs.at(2).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, DropExpiredUntilKeyframe)
+{
+	QByteArray key0 = makePayload(200, 0x10);
+	QByteArray audio10 = makePayload(20, 0x20);
+	QByteArray ref33 = makePayload(100, 0x30);
+	QByteArray nonRef66 = makePayload(50, 0x40);
+	QByteArray key100 = makePayload(200, 0x50);
+	QByteArray audio110 = makePayload(20, 0x60);
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 0, key0, VIDEO_CS_ID,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(writeMessage(AUDIO_MSG_TYPE, 10, audio10, AUDIO_CS_ID));
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 33, ref33, VIDEO_CS_ID,
+		RTMPClient::RefVideoFrame));
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 66, nonRef66, VIDEO_CS_ID,
+		RTMPClient::NonRefVideoFrame));
+	ASSERT_EQ(50, drain(50));
+	ageOutQueue(1000);
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 100, key100, VIDEO_CS_ID,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(writeMessage(AUDIO_MSG_TYPE, 110, audio110, AUDIO_CS_ID));
+
+	// Nothing has waited longer than the budget
+	dropExpiredMessages(2000);
+	EXPECT_EQ(6, getOutQueueSize());
+
+	// Expired frames are dropped except for the one that has begun
+	// transmission and the stream is decodable again from the keyframe
+	dropExpiredMessages(500);
+	EXPECT_EQ(2, getDroppedFrames());
+	EXPECT_EQ(3, getOutQueueSize());
+	drain();
+	EXPECT_EQ(0, getOutQueueBytes());
+
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(3, msgs.size());
+	EXPECT_EQ(0, msgs.at(0).timestamp);
+	EXPECT_EQ(key0, msgs.at(0).payload);
+	EXPECT_EQ(100, msgs.at(1).timestamp);
+	EXPECT_EQ(key100, msgs.at(1).payload);
+	EXPECT_EQ(110, msgs.at(2).timestamp);
+	EXPECT_EQ(audio110, msgs.at(2).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, DropExpiredReferenceFrame)
+{
+	QByteArray key0 = makePayload(200, 0x10);
+	QByteArray ref33 = makePayload(100, 0x20);
+	QByteArray ref66 = makePayload(100, 0x30);
+	QByteArray audio70 = makePayload(20, 0x40);
+	QByteArray ref100 = makePayload(100, 0x50);
+	QByteArray key133 = makePayload(200, 0x60);
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 0, key0, VIDEO_CS_ID,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 33, ref33, VIDEO_CS_ID,
+		RTMPClient::RefVideoFrame));
+	ASSERT_EQ(50, drain(50));
+	ageOutQueue(1000);
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 66, ref66, VIDEO_CS_ID,
+		RTMPClient::RefVideoFrame));
+	ASSERT_TRUE(writeMessage(AUDIO_MSG_TYPE, 70, audio70, AUDIO_CS_ID));
+
+	// Frames that depend on an expired reference frame are dropped with it
+	// even if they haven't expired themselves
+	dropExpiredMessages(500);
+	EXPECT_EQ(2, getDroppedFrames());
+	EXPECT_EQ(2, getOutQueueSize());
+
+	// Nothing can be decoded until the next keyframe
+	EXPECT_FALSE(writeMessage(VIDEO_MSG_TYPE, 100, ref100, VIDEO_CS_ID,
+		RTMPClient::RefVideoFrame));
+	EXPECT_EQ(3, getDroppedFrames());
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 133, key133, VIDEO_CS_ID,
+		RTMPClient::KeyVideoFrame));
+	drain();
+	EXPECT_EQ(0, getOutQueueBytes());
+
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(3, msgs.size());
+	EXPECT_EQ(key0, msgs.at(0).payload);
+	EXPECT_EQ(70, msgs.at(1).timestamp);
+	EXPECT_EQ(audio70, msgs.at(1).payload);
+	EXPECT_EQ(133, msgs.at(2).timestamp);
+	EXPECT_EQ(key133, msgs.at(2).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, AbortMidChunk)
+{
+	QByteArray ref10 = makePayload(300, 0x10);
+	QByteArray audio20 = makePayload(20, 0x20);
+	QByteArray key30 = makePayload(200, 0x30);
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 10, ref10, VIDEO_CS_ID,
+		RTMPClient::RefVideoFrame));
+
+	// Transmit part of the first chunk
+	ASSERT_EQ(50, drain(50));
+	ASSERT_TRUE(writeMessage(AUDIO_MSG_TYPE, 20, audio20, AUDIO_CS_ID));
+	ASSERT_TRUE(abortPartialOutMessage());
+	EXPECT_EQ(1, getDroppedFrames());
+
+	// The next frame must be encoded relative to the aborted frame's header
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 30, key30, VIDEO_CS_ID,
+		RTMPClient::KeyVideoFrame));
+	drain();
+	EXPECT_EQ(0, getOutQueueSize());
+	EXPECT_EQ(0, getOutQueueBytes());
+
+	// The first chunk is always completed before the "Abort Message"
+	ASSERT_LT(12 + 128, m_wire.size());
+	EXPECT_EQ(0x02, m_wire.at(12 + 128)); // fmt 0, csid 2
+
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(3, msgs.size());
+	EXPECT_EQ(2, msgs.at(0).csId);
+	EXPECT_EQ(ABORT_MSG_TYPE, msgs.at(0).msgType);
+	ASSERT_EQ(4, msgs.at(0).payload.size());
+	EXPECT_EQ(VIDEO_CS_ID, decodeBEUInt32(msgs.at(0).payload.constData()));
+	EXPECT_EQ(AUDIO_CS_ID, msgs.at(1).csId);
+	EXPECT_EQ(20, msgs.at(1).timestamp);
+	EXPECT_EQ(audio20, msgs.at(1).payload);
+	EXPECT_EQ(VIDEO_CS_ID, msgs.at(2).csId);
+	EXPECT_EQ(VIDEO_MSG_TYPE, msgs.at(2).msgType);
+	EXPECT_EQ(30, msgs.at(2).timestamp);
+	EXPECT_EQ(key30, msgs.at(2).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, CommitAnnexBFramePerNalLengths)
+{
+	static const char startCode4[] = { 0, 0, 0, 1 };
+	static const char startCode3[] = { 0, 0, 1 };
+	static const char tagHeader[] = { 0x17, 0x01, 0x00, 0x00, 0x00 };
+	QByteArray sei = makePayload(10, 0x06);
+	QByteArray idr1 = makePayload(150, 0x65);
+	QByteArray idr2 = makePayload(40, 0x65);
+	RTMPPublisher *publisher = createPublisher();
+	setAvcPublisherReady(publisher);
+
+	// Encode an access unit straight into the reserved buffer
+	QByteArray au;
+	au.append(startCode4, sizeof(startCode4));
+	au.append(sei);
+	au.append(startCode3, sizeof(startCode3));
+	au.append(idr1);
+	au.append(startCode4, sizeof(startCode4));
+	au.append(idr2);
+	char *span = publisher->reserveVideoFrame(1024);
+	ASSERT_TRUE(span != NULL);
+	memcpy(span, au.constData(), au.size());
+	ASSERT_TRUE(publisher->commitVideoFrame(66,
+		QByteArray(tagHeader, sizeof(tagHeader)), au.size()));
+	drain();
+
+	// Every NAL unit is prefixed with its own length without start codes
+	char len[4];
+	QByteArray expected(tagHeader, sizeof(tagHeader));
+	encodeBEUInt32(len, sei.size());
+	expected.append(len, sizeof(len));
+	expected.append(sei);
+	encodeBEUInt32(len, idr1.size());
+	expected.append(len, sizeof(len));
+	expected.append(idr1);
+	encodeBEUInt32(len, idr2.size());
+	expected.append(len, sizeof(len));
+	expected.append(idr2);
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(1, msgs.size());
+	EXPECT_EQ(VIDEO_MSG_TYPE, msgs.at(0).msgType);
+	EXPECT_EQ(66, msgs.at(0).timestamp);
+	EXPECT_EQ(expected, msgs.at(0).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, CommitSingleRawNal)
+{
+	static const char tagHeader[] = { 0x27, 0x01, 0x00, 0x00, 0x00 };
+	QByteArray slice = makePayload(200, 0x41);
+	RTMPPublisher *publisher = createPublisher();
+	setAvcPublisherReady(publisher);
+	char *span = publisher->reserveVideoFrame(1024);
+	ASSERT_TRUE(span != NULL);
+	memcpy(span, slice.constData(), slice.size());
+	ASSERT_TRUE(publisher->commitVideoFrame(33,
+		QByteArray(tagHeader, sizeof(tagHeader)), slice.size()));
+	drain();
+
+	char len[4];
+	encodeBEUInt32(len, slice.size());
+	QByteArray expected(tagHeader, sizeof(tagHeader));
+	expected.append(len, sizeof(len));
+	expected.append(slice);
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(1, msgs.size());
+	EXPECT_EQ(33, msgs.at(0).timestamp);
+	EXPECT_EQ(expected, msgs.at(0).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, MuxRebasesBackwardJump)
+{
+	QByteArray key5000 = makePayload(60, 0x10);
+	QByteArray key100 = makePayload(60, 0x20);
+	QByteArray ref133 = makePayload(60, 0x30);
+	QByteArray audio5040 = makePayload(20, 0x40);
+	RTMPPublisher *publisher = createPublisher();
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 5000, key5000,
+		RTMPClient::KeyVideoFrame));
+
+	// The video track restarts at zero and continues from where it was
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 100, key100,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 133, ref133,
+		RTMPClient::RefVideoFrame));
+	EXPECT_EQ(1, publisher->getAdjustedTimestampCount());
+
+	// Tracks are rebased independently
+	ASSERT_TRUE(muxMediaMessage(AUDIO_MSG_TYPE, 5040, audio5040));
+	EXPECT_EQ(1, publisher->getAdjustedTimestampCount());
+
+	drain();
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(4, msgs.size());
+	EXPECT_EQ(5000, msgs.at(0).timestamp);
+	EXPECT_EQ(5000, msgs.at(1).timestamp);
+	EXPECT_EQ(key100, msgs.at(1).payload);
+	EXPECT_EQ(5033, msgs.at(2).timestamp);
+	EXPECT_EQ(ref133, msgs.at(2).payload);
+	EXPECT_EQ(5040, msgs.at(3).timestamp);
+	EXPECT_EQ(audio5040, msgs.at(3).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, MuxClampsSmallBackwardJump)
+{
+	QByteArray audio1000 = makePayload(20, 0x10);
+	QByteArray audio990 = makePayload(20, 0x20);
+	QByteArray key980 = makePayload(60, 0x30);
+	RTMPPublisher *publisher = createPublisher();
+	ASSERT_TRUE(muxMediaMessage(AUDIO_MSG_TYPE, 1000, audio1000));
+
+	// Jitter within a track and tracks that are out of step are clamped
+	// without rebasing so the timeline isn't shifted
+	ASSERT_TRUE(muxMediaMessage(AUDIO_MSG_TYPE, 990, audio990));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 980, key980,
+		RTMPClient::KeyVideoFrame));
+	EXPECT_EQ(2, publisher->getAdjustedTimestampCount());
+	EXPECT_EQ(1000, clampMuxTimestamp(500));
+	EXPECT_EQ(1500, clampMuxTimestamp(1500));
+	EXPECT_EQ(3, publisher->getAdjustedTimestampCount());
+
+	drain();
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(3, msgs.size());
+	EXPECT_EQ(1000, msgs.at(0).timestamp);
+	EXPECT_EQ(1000, msgs.at(1).timestamp);
+	EXPECT_EQ(audio990, msgs.at(1).payload);
+	EXPECT_EQ(1000, msgs.at(2).timestamp);
+	EXPECT_EQ(key980, msgs.at(2).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, MuxWindowHoldsUntilOtherTrack)
+{
+	QByteArray audio0 = makePayload(20, 0x10);
+	QByteArray key10 = makePayload(60, 0x20);
+	QByteArray audio5 = makePayload(20, 0x30);
+	QByteArray ref120 = makePayload(60, 0x40);
+	RTMPPublisher *publisher = createPublisher();
+	publisher->setMuxWindow(100);
+
+	// Nothing is held until both tracks have been seen
+	ASSERT_TRUE(muxMediaMessage(AUDIO_MSG_TYPE, 0, audio0));
+	EXPECT_EQ(1, getOutQueueSize());
+
+	// Video is held as audio may still write an earlier frame
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 10, key10,
+		RTMPClient::KeyVideoFrame));
+	EXPECT_EQ(1, getOutQueueSize());
+	ASSERT_TRUE(muxMediaMessage(AUDIO_MSG_TYPE, 5, audio5));
+	EXPECT_EQ(2, getOutQueueSize());
+
+	// The held frame is released once it has waited for the entire window
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 120, ref120,
+		RTMPClient::RefVideoFrame));
+	EXPECT_EQ(3, getOutQueueSize());
+	ASSERT_TRUE(releaseMuxMessages(false));
+	EXPECT_EQ(3, getOutQueueSize());
+	ASSERT_TRUE(releaseMuxMessages(true));
+	EXPECT_EQ(4, getOutQueueSize());
+	EXPECT_EQ(0, publisher->getAdjustedTimestampCount());
+
+	drain();
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(4, msgs.size());
+	EXPECT_EQ(0, msgs.at(0).timestamp);
+	EXPECT_EQ(audio0, msgs.at(0).payload);
+	EXPECT_EQ(5, msgs.at(1).timestamp);
+	EXPECT_EQ(audio5, msgs.at(1).payload);
+	EXPECT_EQ(10, msgs.at(2).timestamp);
+	EXPECT_EQ(key10, msgs.at(2).payload);
+	EXPECT_EQ(120, msgs.at(3).timestamp);
+	EXPECT_EQ(ref120, msgs.at(3).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, MuxWindowReleasesOnDisable)
+{
+	QByteArray audio0 = makePayload(20, 0x10);
+	QByteArray key10 = makePayload(60, 0x20);
+	QByteArray ref43 = makePayload(60, 0x30);
+	RTMPPublisher *publisher = createPublisher();
+	publisher->setMuxWindow(100);
+	ASSERT_TRUE(muxMediaMessage(AUDIO_MSG_TYPE, 0, audio0));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 10, key10,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 43, ref43,
+		RTMPClient::RefVideoFrame));
+	EXPECT_EQ(1, getOutQueueSize());
+
+	// Disabling the window writes everything that was held in order
+	publisher->setMuxWindow(0);
+	EXPECT_EQ(3, getOutQueueSize());
+	drain();
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(3, msgs.size());
+	EXPECT_EQ(0, msgs.at(0).timestamp);
+	EXPECT_EQ(10, msgs.at(1).timestamp);
+	EXPECT_EQ(key10, msgs.at(1).payload);
+	EXPECT_EQ(43, msgs.at(2).timestamp);
+	EXPECT_EQ(ref43, msgs.at(2).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, ReplayKeepsCachedTimestamps)
+{
+	QByteArray key1000 = makePayload(200, 0x10);
+	QByteArray audio1010 = makePayload(20, 0x20);
+	QByteArray ref1033 = makePayload(100, 0x30);
+	QByteArray nonRef1066 = makePayload(50, 0x40);
+	createPublisher();
+	m_client->setGopCacheLimit(64 * 1024);
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 1000, key1000,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(AUDIO_MSG_TYPE, 1010, audio1010));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 1033, ref1033,
+		RTMPClient::RefVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 1066, nonRef1066,
+		RTMPClient::NonRefVideoFrame));
+	drain();
+	loseConnection();
+
+	// The GOP is replayed with its original timestamps even though the
+	// output clock has already advanced past them
+	replayStreamCache();
+	drain();
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(4, msgs.size());
+	EXPECT_EQ(1000, msgs.at(0).timestamp);
+	EXPECT_EQ(key1000, msgs.at(0).payload);
+	EXPECT_EQ(1010, msgs.at(1).timestamp);
+	EXPECT_EQ(audio1010, msgs.at(1).payload);
+	EXPECT_EQ(1033, msgs.at(2).timestamp);
+	EXPECT_EQ(ref1033, msgs.at(2).payload);
+	EXPECT_EQ(1066, msgs.at(3).timestamp);
+	EXPECT_EQ(nonRef1066, msgs.at(3).payload);
+
+	// Media continues from the replayed frames
+	QByteArray ref1100 = makePayload(80, 0x50);
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 1100, ref1100,
+		RTMPClient::RefVideoFrame));
+	drain();
+	msgs = decodeWire();
+	ASSERT_EQ(5, msgs.size());
+	EXPECT_EQ(1100, msgs.at(4).timestamp);
+	EXPECT_EQ(ref1100, msgs.at(4).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, ReplayMetadataAndLatestGop)
+{
+	QByteArray seqHeader = makePayload(30, 0x10);
+	QByteArray key0 = makePayload(200, 0x20);
+	QByteArray ref33 = makePayload(100, 0x30);
+	QByteArray key66 = makePayload(200, 0x40);
+	QByteArray nonRef100 = makePayload(50, 0x50);
+	RTMPPublisher *publisher = createPublisher();
+	m_client->setGopCacheLimit(64 * 1024);
+	AMFObject *obj = new AMFObject();
+	(*obj)["width"] = new AMFNumber(64.0);
+	QByteArray dataFrame = AMFString("@setDataFrame").serialized();
+	dataFrame.append(AMFString("onMetaData").serialized());
+	dataFrame.append(obj->serialized());
+	ASSERT_TRUE(writeSetDataFrameMsg(obj));
+	EXPECT_EQ(obj, publisher->getDataFrame());
+	ASSERT_TRUE(writeVideoData(0, seqHeader));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 0, key0,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 33, ref33,
+		RTMPClient::RefVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 66, key66,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 100, nonRef100,
+		RTMPClient::NonRefVideoFrame));
+	drain();
+	loseConnection();
+
+	// Only the GOP that begins at the latest keyframe is replayed
+	replayStreamCache();
+	drain();
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(4, msgs.size());
+	EXPECT_EQ(18, msgs.at(0).msgType); // AMF 0 data
+	EXPECT_EQ(dataFrame, msgs.at(0).payload);
+	EXPECT_EQ(VIDEO_MSG_TYPE, msgs.at(1).msgType);
+	EXPECT_EQ(0, msgs.at(1).timestamp);
+	EXPECT_EQ(seqHeader, msgs.at(1).payload);
+	EXPECT_EQ(66, msgs.at(2).timestamp);
+	EXPECT_EQ(key66, msgs.at(2).payload);
+	EXPECT_EQ(100, msgs.at(3).timestamp);
+	EXPECT_EQ(nonRef100, msgs.at(3).payload);
+	EXPECT_EQ(obj, publisher->getDataFrame());
+}
+
+TEST_F(RTMPClientOutQueueTest, GopCacheLimitInvalidatesGop)
+{
+	QByteArray key0 = makePayload(100, 0x10);
+	QByteArray ref33 = makePayload(100, 0x20);
+	QByteArray ref66 = makePayload(20, 0x30);
+	QByteArray key100 = makePayload(100, 0x40);
+	createPublisher();
+	m_client->setGopCacheLimit(150);
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 0, key0,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 33, ref33,
+		RTMPClient::RefVideoFrame));
+
+	// A partial GOP cannot be decoded so nothing is cached until the next
+	// keyframe even if it would fit
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 66, ref66,
+		RTMPClient::RefVideoFrame));
+	drain();
+	loseConnection();
+	replayStreamCache();
+	EXPECT_EQ(0, drain());
+
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 100, key100,
+		RTMPClient::KeyVideoFrame));
+	drain();
+	loseConnection();
+	replayStreamCache();
+	drain();
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(1, msgs.size());
+	EXPECT_EQ(100, msgs.at(0).timestamp);
+	EXPECT_EQ(key100, msgs.at(0).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, ReplayHeldMediaWithoutGopCache)
+{
+	QByteArray key0 = makePayload(60, 0x10);
+	QByteArray audio10 = makePayload(20, 0x20);
+	QByteArray ref33 = makePayload(60, 0x30);
+	createPublisher();
+	ASSERT_EQ(0, m_client->getGopCacheLimit()); // Disabled by default
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 0, key0,
+		RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(muxMediaMessage(AUDIO_MSG_TYPE, 10, audio10));
+	ASSERT_TRUE(muxMediaMessage(VIDEO_MSG_TYPE, 33, ref33,
+		RTMPClient::RefVideoFrame));
+
+	// Media that was still queued is resent, media that was partially
+	// transmitted is lost with the connection
+	drain(12 + 10);
+	loseConnection();
+	replayStreamCache();
+	drain();
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(2, msgs.size());
+	EXPECT_EQ(AUDIO_MSG_TYPE, msgs.at(0).msgType);
+	EXPECT_EQ(10, msgs.at(0).timestamp);
+	EXPECT_EQ(audio10, msgs.at(0).payload);
+	EXPECT_EQ(VIDEO_MSG_TYPE, msgs.at(1).msgType);
+	EXPECT_EQ(33, msgs.at(1).timestamp);
+	EXPECT_EQ(ref33, msgs.at(1).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, AbortAtChunkBoundary)
+{
+	QByteArray ref10 = makePayload(300, 0x10);
+	QByteArray key30 = makePayload(200, 0x30);
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 10, ref10, VIDEO_CS_ID,
+		RTMPClient::RefVideoFrame));
+
+	// Transmit exactly the first chunk so nothing of the frame remains to be
+	// completed before the "Abort Message"
+	ASSERT_EQ(12 + 128, drain(12 + 128));
+	ASSERT_TRUE(abortPartialOutMessage());
+	EXPECT_EQ(1, getDroppedFrames());
+	EXPECT_EQ(1, getOutQueueSize());
+	EXPECT_EQ(4, getOutQueueBytes()); // Ungenerated "Abort Message"
+
+	ASSERT_TRUE(writeMessage(VIDEO_MSG_TYPE, 30, key30, VIDEO_CS_ID,
+		RTMPClient::KeyVideoFrame));
+	drain();
+	EXPECT_EQ(0, getOutQueueSize());
+	EXPECT_EQ(0, getOutQueueBytes());
+	EXPECT_EQ(0x02, m_wire.at(12 + 128)); // fmt 0, csid 2
+
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(2, msgs.size());
+	EXPECT_EQ(ABORT_MSG_TYPE, msgs.at(0).msgType);
+	ASSERT_EQ(4, msgs.at(0).payload.size());
+	EXPECT_EQ(VIDEO_CS_ID, decodeBEUInt32(msgs.at(0).payload.constData()));
+	EXPECT_EQ(VIDEO_CS_ID, msgs.at(1).csId);
+	EXPECT_EQ(30, msgs.at(1).timestamp);
+	EXPECT_EQ(key30, msgs.at(1).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, ProgressiveFrameSpansChunks)
+{
+	QByteArray part1 = makePayload(100, 0x10);
+	QByteArray part2 = makePayload(150, 0x20);
+	QByteArray part3 = makePayload(50, 0x30);
+	QByteArray audio50 = makePayload(30, 0x40);
+	ASSERT_TRUE(beginProgressiveMessage(VIDEO_MSG_TYPE, 40, 300,
+		VIDEO_CS_ID, RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(writeMessage(AUDIO_MSG_TYPE, 50, audio50, AUDIO_CS_ID));
+
+	// Nothing can be transmitted until the first byte is available
+	EXPECT_EQ(0, drain());
+
+	// Only complete data is transmitted and the audio waits for the frame
+	ASSERT_TRUE(appendProgressiveMessage(part1));
+	drain();
+	EXPECT_EQ(12 + 100, m_wire.size());
+	ASSERT_TRUE(appendProgressiveMessage(part2));
+	drain();
+	EXPECT_EQ(12 + 128 + 1 + 122, m_wire.size());
+	EXPECT_EQ(2, getOutQueueSize());
+	ASSERT_TRUE(appendProgressiveMessage(part3));
+	drain();
+	EXPECT_EQ(0, getOutQueueSize());
+	EXPECT_EQ(0, getOutQueueBytes());
+
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(2, msgs.size());
+	EXPECT_EQ(VIDEO_CS_ID, msgs.at(0).csId);
+	EXPECT_EQ(VIDEO_MSG_TYPE, msgs.at(0).msgType);
+	EXPECT_EQ(40, msgs.at(0).timestamp);
+	EXPECT_EQ(part1 + part2 + part3, msgs.at(0).payload);
+	EXPECT_EQ(AUDIO_CS_ID, msgs.at(1).csId);
+	EXPECT_EQ(50, msgs.at(1).timestamp);
+	EXPECT_EQ(audio50, msgs.at(1).payload);
+}
+
+TEST_F(RTMPClientOutQueueTest, AbortProgressiveAtChunkBoundary)
+{
+	QByteArray part1 = makePayload(128, 0x10);
+	QByteArray audio50 = makePayload(30, 0x40);
+	ASSERT_TRUE(beginProgressiveMessage(VIDEO_MSG_TYPE, 40, 300,
+		VIDEO_CS_ID, RTMPClient::KeyVideoFrame));
+	ASSERT_TRUE(appendProgressiveMessage(part1));
+	ASSERT_TRUE(writeMessage(AUDIO_MSG_TYPE, 50, audio50, AUDIO_CS_ID));
+
+	// The frame is aborted after a complete chunk so no padding is required
+	EXPECT_EQ(12 + 128, drain());
+	abortProgressiveMessage();
+	EXPECT_EQ(1, getDroppedFrames());
+	EXPECT_EQ(2, getOutQueueSize());
+	drain();
+	EXPECT_EQ(0, getOutQueueSize());
+	EXPECT_EQ(0, getOutQueueBytes());
+
+	QList<DecodedMessage> msgs = decodeWire();
+	ASSERT_EQ(2, msgs.size());
+	EXPECT_EQ(ABORT_MSG_TYPE, msgs.at(0).msgType);
+	ASSERT_EQ(4, msgs.at(0).payload.size());
+	EXPECT_EQ(VIDEO_CS_ID, decodeBEUInt32(msgs.at(0).payload.constData()));
+	EXPECT_EQ(AUDIO_CS_ID, msgs.at(1).csId);
+	EXPECT_EQ(50, msgs.at(1).timestamp);
+	EXPECT_EQ(audio50, msgs.at(1).payload);
+}
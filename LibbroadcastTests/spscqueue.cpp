@@ -0,0 +1,123 @@
+//*****************************************************************************
+// Libbroadcast: A library for broadcasting video over RTMP
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include <gtest/gtest.h>
+#include <Libbroadcast/spscqueue.h>
+#include <thread>
+
+#define DO_THREADED_TESTS 1
+
+//=============================================================================
+// Single-threaded tests
+
+TEST(SPSCQueueTest, CapacityRoundsUp)
+{
+	SPSCQueue<int> a(1);
+	EXPECT_EQ(1, a.getCapacity());
+	SPSCQueue<int> b(3);
+	EXPECT_EQ(3, b.getCapacity());
+	SPSCQueue<int> c(4);
+	EXPECT_EQ(7, c.getCapacity());
+}
+
+TEST(SPSCQueueTest, Fifo)
+{
+	SPSCQueue<int> queue(4);
+	EXPECT_TRUE(queue.isEmpty());
+	EXPECT_EQ(NULL, queue.peek());
+	EXPECT_FALSE(queue.pop());
+
+	// Wrap around the end of the slot array several times
+	int next = 0;
+	for(int round = 0; round < 10; round++) {
+		for(int i = 0; i < 3; i++)
+			EXPECT_TRUE(queue.push(round * 3 + i));
+		EXPECT_EQ(3, queue.getCount());
+		for(int i = 0; i < 3; i++) {
+			ASSERT_NE((int *)NULL, queue.peek());
+			EXPECT_EQ(next, *queue.peek());
+			int val = -1;
+			EXPECT_TRUE(queue.pop(&val));
+			EXPECT_EQ(next, val);
+			next++;
+		}
+		EXPECT_TRUE(queue.isEmpty());
+	}
+}
+
+TEST(SPSCQueueTest, PushFailsWhenFull)
+{
+	SPSCQueue<int> queue(7);
+	for(int i = 0; i < queue.getCapacity(); i++)
+		EXPECT_TRUE(queue.push(i));
+	EXPECT_FALSE(queue.push(100));
+	EXPECT_EQ(queue.getCapacity(), queue.getCount());
+
+	// Freeing a single slot allows a single push
+	EXPECT_TRUE(queue.pop());
+	EXPECT_TRUE(queue.push(100));
+	EXPECT_FALSE(queue.push(101));
+}
+
+TEST(SPSCQueueTest, PopReleasesSlot)
+{
+	SPSCQueue<QByteArray> queue(2);
+	QByteArray data("0123456789");
+	EXPECT_TRUE(queue.push(data));
+	EXPECT_TRUE(queue.pop());
+
+	// The queue must no longer reference our data
+	EXPECT_TRUE(data.isDetached());
+}
+
+//=============================================================================
+// Threaded tests
+
+#if DO_THREADED_TESTS
+
+static void produceSequence(SPSCQueue<int> *queue, int count)
+{
+	for(int i = 0; i < count; i++) {
+		while(!queue->push(i))
+			std::this_thread::yield();
+	}
+}
+
+TEST(SPSCQueueTest, ThreadedOrdering)
+{
+	const int COUNT = 1000000;
+	SPSCQueue<int> queue(64);
+	std::thread producer(produceSequence, &queue, COUNT);
+
+	int next = 0;
+	while(next < COUNT) {
+		int val;
+		if(!queue.pop(&val)) {
+			std::this_thread::yield();
+			continue;
+		}
+		if(val != next) {
+			ADD_FAILURE() << "Expected " << next << " but got " << val;
+			break;
+		}
+		next++;
+	}
+	producer.join();
+	EXPECT_EQ(COUNT, next);
+}
+
+#endif // DO_THREADED_TESTS